@@ -0,0 +1,161 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Arena allocator
+ *
+ * A loaded configuration consists of thousands of small nodes and strings
+ * which all live exactly as long as the configuration. They are taken from
+ * an arena: chunks mapped from the system and handed out front to back,
+ * never freed one by one. Dropping a configuration unmaps its chunks.
+ *
+ * Once the configuration is complete the arena is sealed, its pages become
+ * read only. A forked child then never copies them, and a stray write into
+ * the configuration crashes right away instead of going unnoticed.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+#include "common.h"
+
+// Alignment of the blocks, enough for every type of the configuration
+#define ARENA_ALIGN 16
+
+typedef struct chunk *chunkPtr;
+
+typedef struct chunk {
+    size_t size;
+    size_t used;
+    chunkPtr next;
+} Chunk;
+
+struct arena {
+    chunkPtr chunks;
+    size_t size;
+};
+
+#define CHUNK_HEADER ((sizeof(Chunk) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+static chunkPtr newChunk(size_t size)
+{
+    chunkPtr cPtr;
+
+    cPtr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (cPtr == MAP_FAILED) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    cPtr->size = size;
+    cPtr->used = CHUNK_HEADER;
+    cPtr->next = NULL;
+    return cPtr;
+}
+
+arenaPtr newArena()
+{
+    arenaPtr aPtr;
+
+    if (! (aPtr = calloc(1, sizeof(*aPtr)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    return aPtr;
+}
+
+// Returns size zeroed bytes
+void *arenaAlloc(arenaPtr aPtr, size_t size)
+{
+    chunkPtr cPtr = aPtr->chunks;
+    chunkPtr nPtr;
+    void *ptr;
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (! cPtr || cPtr->used + size > cPtr->size) {
+        if (CHUNK_HEADER + size > ARENA_CHUNK) {
+            // Gets a chunk of its own behind the current one, which
+            // stays open for the small blocks
+            nPtr = newChunk((CHUNK_HEADER + size + 4095) & ~(size_t)4095);
+            if (cPtr) {
+                nPtr->next = cPtr->next;
+                cPtr->next = nPtr;
+            } else {
+                aPtr->chunks = nPtr;
+            }
+            aPtr->size += nPtr->size;
+            nPtr->used += size;
+            return (char *)nPtr + CHUNK_HEADER;
+        }
+        nPtr = newChunk(ARENA_CHUNK);
+        nPtr->next = cPtr;
+        aPtr->chunks = cPtr = nPtr;
+        aPtr->size += nPtr->size;
+    }
+    // Fresh mappings are zeroed and no block is handed out twice
+    ptr = (char *)cPtr + cPtr->used;
+    cPtr->used += size;
+    return ptr;
+}
+
+char *arenaStrdup(arenaPtr aPtr, const char *str)
+{
+    return arenaMemdup(aPtr, str, strlen(str) + 1);
+}
+
+void *arenaMemdup(arenaPtr aPtr, const void *data, size_t len)
+{
+    void *ptr = arenaAlloc(aPtr, len);
+
+    memcpy(ptr, data, len);
+    return ptr;
+}
+
+// Makes the arena read only, it must not be allocated from afterwards
+void arenaSeal(arenaPtr aPtr)
+{
+    chunkPtr cPtr;
+
+    for (cPtr = aPtr->chunks; cPtr; cPtr = cPtr->next) {
+        if (mprotect(cPtr, cPtr->size, PROT_READ) < 0) {
+            logIT1(LOG_WARNING, "Arena: could not seal chunk");
+        }
+    }
+}
+
+// Bytes mapped for the arena
+size_t arenaSize(arenaPtr aPtr)
+{
+    return aPtr->size;
+}
+
+void freeArena(arenaPtr aPtr)
+{
+    chunkPtr cPtr;
+    chunkPtr nPtr;
+
+    if (! aPtr) {
+        return;
+    }
+    for (cPtr = aPtr->chunks; cPtr; cPtr = nPtr) {
+        nPtr = cPtr->next;
+        munmap(cPtr, cPtr->size);
+    }
+    free(aPtr);
+}
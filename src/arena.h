@@ -0,0 +1,37 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Bump allocator for the configuration image, freed and sealed as a whole
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Size of the chunks taken from the system, larger blocks get their own
+#define ARENA_CHUNK 65536
+
+typedef struct arena *arenaPtr;
+
+arenaPtr newArena();
+void *arenaAlloc(arenaPtr aPtr, size_t size);
+char *arenaStrdup(arenaPtr aPtr, const char *str);
+void *arenaMemdup(arenaPtr aPtr, const void *data, size_t len);
+void arenaSeal(arenaPtr aPtr);
+size_t arenaSize(arenaPtr aPtr);
+void freeArena(arenaPtr aPtr);
+
+#endif // ARENA_H
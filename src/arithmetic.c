@@ -20,6 +20,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include <syslog.h>
+
+#include "common.h"
+#include "arithmetic.h"
 
 #define HEX 8
 #define HEXDIGIT 10
@@ -65,14 +69,12 @@
 
 int nextToken(char **str, char **c, int *count);
 void  pushBack(char **str, int n);
-float execExpression(char **str, unsigned char *bPtr, float floatV, char *err);
 float execTerm(char **str, unsigned char *bPtr, float floatV, char *err);
 float execFactor(char **str, unsigned  char *bPtr, float floatV, char *err);
-int execIExpression(char **str, unsigned char *bPtr, char bitpos, char *pPtr, char *err);
 int execITerm(char **str, unsigned char *bPtr, char bitpos, char *pPtr, char *err);
 int execIFactor(char **str, unsigned char *bPtr, char bitpos, char *pPtr, char *err);
 
-float execExpression(char **str, unsigned char *bInPtr, float floatV, char *err)
+float execExpression(char **str, char *bInPtr, float floatV, char *err)
 {
     int f = 1;
     float term1, term2;
@@ -88,7 +90,7 @@ float execExpression(char **str, unsigned char *bInPtr, float floatV, char *err)
     // We did not receive characters
     for (n = 0; n <= 9; n++) {
         //bPtr[n]=*bInPtr++ & 255;
-        bPtr[n] = *bInPtr++;
+        bPtr[n] = (unsigned char)*bInPtr++;
     }
 
     switch (nextToken(str, &item, &n)) {
@@ -243,7 +245,7 @@ float execFactor(char **str, unsigned char *bPtr, float floatV, char *err)
         //printf("  Zahl: %s (f:%f)\n",nstring,factor);
         return factor;
     case KAUF:
-        expression = execExpression(str, bPtr, floatV, err);
+        expression = execExpression(str, (char *)bPtr, floatV, err);
         if (*err) {
             return 0;
         }
@@ -258,7 +260,7 @@ float execFactor(char **str, unsigned char *bPtr, float floatV, char *err)
     }
 }
 
-int execIExpression(char **str, unsigned char *bInPtr, char bitpos, char *pPtr, char *err)
+int execIExpression(char **str, char *bInPtr, char bitpos, char *pPtr, char *err)
 {
     int f = 1;
     int term1, term2;
@@ -274,7 +276,7 @@ int execIExpression(char **str, unsigned char *bInPtr, char bitpos, char *pPtr,
     // We have received characters
     for (n = 0; n <= 9; n++) {
         //bPtr[n]=*bInPtr++ & 255;
-        bPtr[n] = *bInPtr++;
+        bPtr[n] = (unsigned char)*bInPtr++;
     }
 
     op = ERROR;
@@ -498,7 +500,7 @@ int execIFactor(char **str, unsigned char *bPtr, char bitpos, char *pPtr, char *
         factor = atof(nstring);
         return factor;
     case KAUF:
-        expression = execIExpression(str, bPtr, bitpos, pPtr, err);
+        expression = execIExpression(str, (char *)bPtr, bitpos, pPtr, err);
         if (*err) {
             return 0;
         }
@@ -656,3 +658,495 @@ void  pushBack(char **str, int count)
     (*str) -= count;
     //printf("\t<<::%s\n",*str);
 }
+
+/* Compiled expressions
+ *
+ * The calc strings of the units are compiled once into a program for a
+ * small stack machine, following the same grammar and float or int
+ * arithmetic as execExpression() and execIExpression() above. Constant
+ * parts are folded, and the most common shapes of float calcs get a fast
+ * path without running the program at all.
+ */
+
+#define CALC_STACK 32
+
+// Ops of a program
+#define OP_CONST  1
+#define OP_BYTE   2
+#define OP_PBYTE  3
+#define OP_BITPOS 4
+#define OP_VALUE  5
+#define OP_NEG    6
+#define OP_NOT    7
+#define OP_ADD    8
+#define OP_SUB    9
+#define OP_MUL    10
+#define OP_DIV    11
+#define OP_MOD    12
+#define OP_AND    13
+#define OP_OR     14
+#define OP_XOR    15
+#define OP_SHL    16
+#define OP_SHR    17
+
+// Fast paths
+#define SHAPE_NONE   0
+#define SHAPE_VDIV   1   // V/k
+#define SHAPE_VMUL   2   // V*k
+#define SHAPE_B16DIV 3   // (B1*256+B0)/k
+
+static void emit(calcPtr cPtr, int op, int arg, float f, int i)
+{
+    CalcOp *ops;
+    CalcOp *aPtr;
+    CalcOp *bPtr;
+
+    // Constant folding: an op on constants becomes a constant
+    if ((op == OP_NEG || op == OP_NOT) && cPtr->len >= 1 && cPtr->ops[cPtr->len - 1].op == OP_CONST) {
+        aPtr = &cPtr->ops[cPtr->len - 1];
+        if (op == OP_NEG) {
+            aPtr->f = -aPtr->f;
+            aPtr->i = -aPtr->i;
+        } else {
+            aPtr->i = ~aPtr->i;
+        }
+        return;
+    }
+    if (op >= OP_ADD && cPtr->len >= 2 && cPtr->ops[cPtr->len - 1].op == OP_CONST
+            && cPtr->ops[cPtr->len - 2].op == OP_CONST
+            && ! (cPtr->integer && (op == OP_DIV || op == OP_MOD) && ! cPtr->ops[cPtr->len - 1].i)) {
+        aPtr = &cPtr->ops[cPtr->len - 2];
+        bPtr = &cPtr->ops[cPtr->len - 1];
+        switch (op) {
+        case OP_ADD:
+            aPtr->f += bPtr->f;
+            aPtr->i += bPtr->i;
+            break;
+        case OP_SUB:
+            aPtr->f -= bPtr->f;
+            aPtr->i -= bPtr->i;
+            break;
+        case OP_MUL:
+            aPtr->f *= bPtr->f;
+            aPtr->i *= bPtr->i;
+            break;
+        case OP_DIV:
+            aPtr->f /= bPtr->f;
+            if (cPtr->integer) {
+                aPtr->i /= bPtr->i;
+            }
+            break;
+        case OP_MOD:
+            aPtr->i %= bPtr->i;
+            break;
+        case OP_AND:
+            aPtr->i &= bPtr->i;
+            break;
+        case OP_OR:
+            aPtr->i |= bPtr->i;
+            break;
+        case OP_XOR:
+            aPtr->i ^= bPtr->i;
+            break;
+        case OP_SHL:
+            aPtr->i <<= bPtr->i;
+            break;
+        case OP_SHR:
+            aPtr->i >>= bPtr->i;
+            break;
+        }
+        cPtr->len--;
+        return;
+    }
+
+    if (cPtr->len == cPtr->size) {
+        cPtr->size = cPtr->size ? cPtr->size * 2 : 8;
+        if (! (ops = realloc(cPtr->ops, cPtr->size * sizeof(CalcOp)))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        cPtr->ops = ops;
+    }
+    aPtr = &cPtr->ops[cPtr->len++];
+    aPtr->op = op;
+    aPtr->arg = arg;
+    aPtr->f = f;
+    aPtr->i = i;
+}
+
+// A number as read by execFactor() and execIFactor()
+static void compileNumber(calcPtr cPtr, char **str, int token, char *item, int n)
+{
+    char nstring[100];
+    char *nPtr = nstring;
+    float factor;
+    int iFactor;
+
+    memset(nstring, 0, sizeof(nstring));
+    if (token == HEX) {
+        strcpy(nstring, "0x");
+        nPtr += 2;
+        token = nextToken(str, &item, &n);
+        while (((token == DIGIT) || (token == HEXDIGIT)) && nPtr < nstring + sizeof(nstring) - 1) {
+            *nPtr++ = *item;
+            token = nextToken(str, &item, &n);
+        }
+        pushBack(str, n);
+        if (cPtr->integer) {
+            sscanf(nstring, "%i", &iFactor);
+            emit(cPtr, OP_CONST, 0, iFactor, iFactor);
+        } else {
+            sscanf(nstring, "%f", &factor);
+            emit(cPtr, OP_CONST, 0, factor, factor);
+        }
+        return;
+    }
+    do {
+        *nPtr++ = *item;
+    } while ((token = nextToken(str, &item, &n)) == DIGIT && nPtr < nstring + sizeof(nstring) - 2);
+    // If a . follows, we have a decimal number
+    if (token == PUNKT) {
+        do {
+            *nPtr++ = *item;
+        } while ((token = nextToken(str, &item, &n)) == DIGIT && nPtr < nstring + sizeof(nstring) - 1);
+    }
+    pushBack(str, n);
+    *nPtr = '\0';
+    factor = atof(nstring);
+    iFactor = atof(nstring);
+    emit(cPtr, OP_CONST, 0, factor, iFactor);
+}
+
+static void compileExpr(calcPtr cPtr, char **str, char *err);
+
+static void compileFactor(calcPtr cPtr, char **str, char *err)
+{
+    char *item;
+    int token;
+    int n;
+
+    token = nextToken(str, &item, &n);
+    if (token >= BYTE0 && token <= BYTE9) {
+        emit(cPtr, OP_BYTE, token - BYTE0, 0, 0);
+    } else if (token == VALUE && ! cPtr->integer) {
+        emit(cPtr, OP_VALUE, 0, 0, 0);
+    } else if (token >= PBYTE0 && token <= PBYTE9 && cPtr->integer) {
+        emit(cPtr, OP_PBYTE, token - PBYTE0, 0, 0);
+    } else if (token == BITPOS && cPtr->integer) {
+        emit(cPtr, OP_BITPOS, 0, 0, 0);
+    } else if (token == HEX || token == DIGIT) {
+        compileNumber(cPtr, str, token, item, n);
+    } else if (token == KAUF) {
+        compileExpr(cPtr, str, err);
+        if (*err) {
+            return;
+        }
+        if (nextToken(str, &item, &n) != KZU) {
+            sprintf(err, "expected factor:) [%c]\n", *item);
+        }
+    } else if (token == NICHT && cPtr->integer) {
+        compileFactor(cPtr, str, err);
+        emit(cPtr, OP_NOT, 0, 0, 0);
+    } else if (cPtr->integer) {
+        sprintf(err, "expected factor: B0..B9 P0..P9 BP number ( ) [%c]\n", *item);
+    } else {
+        sprintf(err, "expected factor: B0..B9 number ( ) [%c]\n", *item);
+    }
+}
+
+static void compileTerm(calcPtr cPtr, char **str, char *err)
+{
+    char *item;
+    int op;
+    int n;
+
+    compileFactor(cPtr, str, err);
+    while (! *err) {
+        switch (nextToken(str, &item, &n)) {
+        case MAL:
+            op = OP_MUL;
+            break;
+        case GETEILT:
+            op = OP_DIV;
+            break;
+        case MODULO:
+            op = OP_MOD;
+            break;
+        case UND:
+            op = OP_AND;
+            break;
+        case ODER:
+            op = OP_OR;
+            break;
+        case XOR:
+            op = OP_XOR;
+            break;
+        case SHL:
+            op = OP_SHL;
+            break;
+        case SHR:
+            op = OP_SHR;
+            break;
+        default:
+            op = 0;
+            break;
+        }
+        // The float grammar only knows * and /
+        if (! op || (! cPtr->integer && op != OP_MUL && op != OP_DIV)) {
+            pushBack(str, n);
+            return;
+        }
+        compileFactor(cPtr, str, err);
+        emit(cPtr, op, 0, 0, 0);
+    }
+}
+
+static void compileExpr(calcPtr cPtr, char **str, char *err)
+{
+    char *item;
+    int token;
+    int n;
+
+    token = nextToken(str, &item, &n);
+    if (token != PLUS && token != MINUS && (token != NICHT || ! cPtr->integer)) {
+        pushBack(str, n);
+    }
+    compileTerm(cPtr, str, err);
+    if (token == MINUS) {
+        emit(cPtr, OP_NEG, 0, 0, 0);
+    } else if (token == NICHT && cPtr->integer) {
+        emit(cPtr, OP_NOT, 0, 0, 0);
+    }
+
+    while (! *err) {
+        token = nextToken(str, &item, &n);
+        // END is left to the caller as well
+        if (token != PLUS && token != MINUS && (token != NICHT || ! cPtr->integer)) {
+            pushBack(str, n);
+            return;
+        }
+        compileTerm(cPtr, str, err);
+        if (token == MINUS) {
+            emit(cPtr, OP_SUB, 0, 0, 0);
+        } else if (token == NICHT) {
+            // a ~ b is a + ~b, as in execIExpression()
+            emit(cPtr, OP_NOT, 0, 0, 0);
+            emit(cPtr, OP_ADD, 0, 0, 0);
+        } else {
+            emit(cPtr, OP_ADD, 0, 0, 0);
+        }
+    }
+}
+
+static int isOp(calcPtr cPtr, int n, int op, int arg)
+{
+    return cPtr->ops[n].op == op && cPtr->ops[n].arg == arg;
+}
+
+static void findShape(calcPtr cPtr)
+{
+    if (cPtr->integer) {
+        return;
+    }
+    if (cPtr->len == 3 && isOp(cPtr, 0, OP_VALUE, 0) && isOp(cPtr, 1, OP_CONST, 0)) {
+        cPtr->k = cPtr->ops[1].f;
+        if (isOp(cPtr, 2, OP_DIV, 0)) {
+            cPtr->shape = SHAPE_VDIV;
+        } else if (isOp(cPtr, 2, OP_MUL, 0)) {
+            cPtr->shape = SHAPE_VMUL;
+        }
+    } else if (cPtr->len == 7 && isOp(cPtr, 0, OP_BYTE, 1) && isOp(cPtr, 1, OP_CONST, 0)
+               && cPtr->ops[1].f == 256 && isOp(cPtr, 2, OP_MUL, 0) && isOp(cPtr, 3, OP_BYTE, 0)
+               && isOp(cPtr, 4, OP_ADD, 0) && isOp(cPtr, 5, OP_CONST, 0) && isOp(cPtr, 6, OP_DIV, 0)) {
+        cPtr->k = cPtr->ops[5].f;
+        cPtr->shape = SHAPE_B16DIV;
+    }
+}
+
+/* Compiles a calc (integer 0) or icalc (integer 1) expression. Returns
+ * NULL with a message in err if it has a syntax error. With aPtr the
+ * program is moved to the arena, otherwise removeExpression() frees it.
+ */
+calcPtr compileExpression(const char *expr, short integer, char *err, arenaPtr aPtr)
+{
+    calcPtr cPtr;
+    calcPtr nPtr;
+    char *str = (char *)expr;
+    char *item;
+    int depth = 0;
+    int maxDepth = 0;
+    int n;
+
+    *err = '\0';
+    if (! (cPtr = calloc(1, sizeof(*cPtr)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    cPtr->integer = integer;
+
+    compileExpr(cPtr, &str, err);
+    if (! *err && nextToken(&str, &item, &n) != END) {
+        sprintf(err, "unexpected [%c]\n", *item);
+    }
+    for (n = 0; ! *err && n < cPtr->len; n++) {
+        depth += (cPtr->ops[n].op <= OP_VALUE) ? 1 : (cPtr->ops[n].op <= OP_NOT) ? 0 : -1;
+        maxDepth = (depth > maxDepth) ? depth : maxDepth;
+    }
+    if (! *err && maxDepth > CALC_STACK) {
+        sprintf(err, "expression too complex\n");
+    }
+    if (*err) {
+        removeExpression(cPtr);
+        return NULL;
+    }
+    findShape(cPtr);
+    if (aPtr) {
+        nPtr = arenaMemdup(aPtr, cPtr, sizeof(*cPtr));
+        nPtr->ops = arenaMemdup(aPtr, cPtr->ops, cPtr->len * sizeof(CalcOp));
+        nPtr->size = cPtr->len;
+        removeExpression(cPtr);
+        return nPtr;
+    }
+    return cPtr;
+}
+
+void removeExpression(calcPtr cPtr)
+{
+    if (cPtr) {
+        free(cPtr->ops);
+        free(cPtr);
+    }
+}
+
+// Runs a program compiled from a calc, like execExpression()
+float execCalc(calcPtr cPtr, char *bInPtr, float floatV, char *err)
+{
+    unsigned char *bPtr = (unsigned char *)bInPtr;
+    float stack[CALC_STACK];
+    CalcOp *oPtr;
+    CalcOp *endPtr;
+    int top = -1;
+
+    switch (cPtr->shape) {
+    case SHAPE_VDIV:
+        return floatV / cPtr->k;
+    case SHAPE_VMUL:
+        return floatV * cPtr->k;
+    case SHAPE_B16DIV:
+        return ((float)bPtr[1] * 256 + bPtr[0]) / cPtr->k;
+    }
+
+    for (oPtr = cPtr->ops, endPtr = oPtr + cPtr->len; oPtr < endPtr; oPtr++) {
+        switch (oPtr->op) {
+        case OP_CONST:
+            stack[++top] = oPtr->f;
+            break;
+        case OP_BYTE:
+            stack[++top] = bPtr[oPtr->arg];
+            break;
+        case OP_VALUE:
+            stack[++top] = floatV;
+            break;
+        case OP_NEG:
+            stack[top] = -stack[top];
+            break;
+        case OP_ADD:
+            top--;
+            stack[top] += stack[top + 1];
+            break;
+        case OP_SUB:
+            top--;
+            stack[top] -= stack[top + 1];
+            break;
+        case OP_MUL:
+            top--;
+            stack[top] *= stack[top + 1];
+            break;
+        case OP_DIV:
+            top--;
+            stack[top] /= stack[top + 1];
+            break;
+        default:
+            sprintf(err, "Error exec calc: Unknown op %d", oPtr->op);
+            return 0;
+        }
+    }
+    return stack[0];
+}
+
+// Runs a program compiled from an icalc, like execIExpression()
+int execICalc(calcPtr cPtr, char *bInPtr, char bitpos, char *pPtr, char *err)
+{
+    unsigned char *bPtr = (unsigned char *)bInPtr;
+    int stack[CALC_STACK];
+    CalcOp *oPtr;
+    CalcOp *endPtr;
+    int top = -1;
+
+    for (oPtr = cPtr->ops, endPtr = oPtr + cPtr->len; oPtr < endPtr; oPtr++) {
+        switch (oPtr->op) {
+        case OP_CONST:
+            stack[++top] = oPtr->i;
+            break;
+        case OP_BYTE:
+            stack[++top] = bPtr[oPtr->arg];
+            break;
+        case OP_PBYTE:
+            stack[++top] = ((int)pPtr[oPtr->arg]) & 0xff;
+            break;
+        case OP_BITPOS:
+            stack[++top] = ((int)bitpos) & 0xff;
+            break;
+        case OP_NEG:
+            stack[top] = -stack[top];
+            break;
+        case OP_NOT:
+            stack[top] = ~stack[top];
+            break;
+        default:
+            top--;
+            switch (oPtr->op) {
+            case OP_ADD:
+                stack[top] += stack[top + 1];
+                break;
+            case OP_SUB:
+                stack[top] -= stack[top + 1];
+                break;
+            case OP_MUL:
+                stack[top] *= stack[top + 1];
+                break;
+            case OP_DIV:
+            case OP_MOD:
+                if (! stack[top + 1]) {
+                    sprintf(err, "Division by zero");
+                    return 0;
+                }
+                if (oPtr->op == OP_DIV) {
+                    stack[top] /= stack[top + 1];
+                } else {
+                    stack[top] %= stack[top + 1];
+                }
+                break;
+            case OP_AND:
+                stack[top] &= stack[top + 1];
+                break;
+            case OP_OR:
+                stack[top] |= stack[top + 1];
+                break;
+            case OP_XOR:
+                stack[top] ^= stack[top + 1];
+                break;
+            case OP_SHL:
+                stack[top] <<= stack[top + 1];
+                break;
+            case OP_SHR:
+                stack[top] >>= stack[top + 1];
+                break;
+            default:
+                sprintf(err, "Error exec ICalc: Unknown op %d", oPtr->op);
+                return 0;
+            }
+        }
+    }
+    return stack[0];
+}
@@ -19,7 +19,33 @@
 #ifndef ARITHMETIC_H
 #define ARITHMETIC_H
 
+#include "xmlconfig.h"
+#include "arena.h"
+
 float execExpression(char **str, char *bPtr, float floatV, char *err);
 int execIExpression(char **str, char *bPtr, char bitpos, char *pPtr, char *err);
 
+// Calc strings compiled once, see compileExpression(). The layout is
+// public for the tables generated by vgen
+typedef struct calcOp {
+    unsigned char op;
+    unsigned char arg;
+    float f;
+    int i;
+} CalcOp;
+
+struct calc {
+    short integer;
+    short shape;
+    float k;
+    int len;
+    int size;
+    CalcOp *ops;
+};
+
+calcPtr compileExpression(const char *expr, short integer, char *err, arenaPtr aPtr);
+void removeExpression(calcPtr cPtr);
+float execCalc(calcPtr cPtr, char *bPtr, float floatV, char *err);
+int execICalc(calcPtr cPtr, char *bPtr, char bitpos, char *pPtr, char *err);
+
 #endif // ARITHMETIC_H
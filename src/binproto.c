@@ -0,0 +1,108 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Frame building for the binary protocol, see binproto.h
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "binproto.h"
+#include "common.h"
+
+static void binReserve(BinBuf *bPtr, size_t len)
+{
+    unsigned char *ptr;
+
+    if (bPtr->len + len <= bPtr->size) {
+        return;
+    }
+    while (bPtr->len + len > bPtr->size) {
+        bPtr->size = bPtr->size ? bPtr->size * 2 : 256;
+    }
+    if (! (ptr = realloc(bPtr->data, bPtr->size))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    bPtr->data = ptr;
+}
+
+// Starts a frame, the length is filled in by binFinish()
+void binInit(BinBuf *bPtr)
+{
+    memset(bPtr, 0, sizeof(*bPtr));
+    binPut32(bPtr, 0);
+}
+
+void binFree(BinBuf *bPtr)
+{
+    free(bPtr->data);
+    memset(bPtr, 0, sizeof(*bPtr));
+}
+
+void binPut8(BinBuf *bPtr, unsigned int value)
+{
+    binReserve(bPtr, 1);
+    bPtr->data[bPtr->len++] = value & 0xff;
+}
+
+void binPut16(BinBuf *bPtr, unsigned int value)
+{
+    binPut8(bPtr, value >> 8);
+    binPut8(bPtr, value);
+}
+
+void binPut32(BinBuf *bPtr, uint32_t value)
+{
+    binPut16(bPtr, value >> 16);
+    binPut16(bPtr, value);
+}
+
+void binPut64(BinBuf *bPtr, uint64_t value)
+{
+    binPut32(bPtr, value >> 32);
+    binPut32(bPtr, value);
+}
+
+void binPutDouble(BinBuf *bPtr, double value)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    binPut64(bPtr, bits);
+}
+
+void binPutBytes(BinBuf *bPtr, const void *data, size_t len)
+{
+    binReserve(bPtr, len);
+    memcpy(bPtr->data + bPtr->len, data, len);
+    bPtr->len += len;
+}
+
+void binFinish(BinBuf *bPtr)
+{
+    uint32_t len = bPtr->len - BIN_HEADER;
+
+    bPtr->data[0] = len >> 24;
+    bPtr->data[1] = len >> 16;
+    bPtr->data[2] = len >> 8;
+    bPtr->data[3] = len;
+}
+
+unsigned int binGet16(const char *ptr)
+{
+    return ((unsigned char)ptr[0] << 8) | (unsigned char)ptr[1];
+}
@@ -0,0 +1,84 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Binary protocol on <binport>
+ *
+ * Every frame starts with its length as u32, not counting the length
+ * itself. All numbers are in network byte order, doubles as IEEE 754
+ * bit pattern in an u64.
+ *
+ * Request:  u32 len | u8 version | u8 type | u16 count | count items
+ *   BIN_EXEC item: u16 id | u16 paraLen | para
+ *     para are the raw bytes to write, empty for a read
+ *   BIN_LIST: no items
+ *
+ * Reply:    u32 len | u8 version | u8 type | u16 count | u32 generation
+ *           | count items
+ *   BIN_EXEC item: u16 id | u8 status | u8 flags | u64 value
+ *     | u64 read time (ms since the epoch) | u32 duration (us)
+ *     | u16 rawLen | raw | u16 textLen | text
+ *     text is the unit converted value, or the error message
+ *   BIN_LIST item: u16 id | u8 len | u8 flags | u8 nameLen | name
+ *     len is the number of bytes read, or to write with BIN_WRITE set
+ *
+ * The ids number the commands of the device, they change when the
+ * configuration is reloaded, which increments the generation.
+ */
+
+#ifndef BINPROTO_H
+#define BINPROTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BIN_VERSION 1
+
+// Frame types
+#define BIN_EXEC 1
+#define BIN_LIST 2
+
+// Item status
+#define BIN_OK       0
+#define BIN_EUNKNOWN 1
+#define BIN_EPARA    2
+#define BIN_EDEVICE  3
+#define BIN_EBUSY    4
+
+// Item flags
+#define BIN_VALUE 0x01
+#define BIN_WRITE 0x02
+
+#define BIN_HEADER 4
+#define BIN_REPLY_HEADER 8
+
+typedef struct binBuf {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} BinBuf;
+
+void binInit(BinBuf *bPtr);
+void binFree(BinBuf *bPtr);
+void binPut8(BinBuf *bPtr, unsigned int value);
+void binPut16(BinBuf *bPtr, unsigned int value);
+void binPut32(BinBuf *bPtr, uint32_t value);
+void binPut64(BinBuf *bPtr, uint64_t value);
+void binPutDouble(BinBuf *bPtr, double value);
+void binPutBytes(BinBuf *bPtr, const void *data, size_t len);
+void binFinish(BinBuf *bPtr);
+unsigned int binGet16(const char *ptr);
+
+#endif // BINPROTO_H
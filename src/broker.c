@@ -0,0 +1,282 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Device broker
+ *
+ * One thread owns the device link and executes the requests in the order
+ * they were queued. Client handlers only enqueue a request and get it back
+ * through a pipe once it is done, so the event loop can wait for it with
+ * epoll. Requests queued while the link is busy are taken as one batch,
+ * so neighbouring reads can be merged, and executed before the link is
+ * released again.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "broker.h"
+#include "common.h"
+#include "metrics.h"
+
+static pthread_t brokerThread;
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond;
+// Held while the broker works on the device link
+static pthread_mutex_t execLock = PTHREAD_MUTEX_INITIALIZER;
+
+static requestPtr queueHead = NULL;
+static requestPtr queueTail = NULL;
+static unsigned long lastId = 0;
+static BrokerStats stats;
+static int donePipe[2] = { -1, -1 };
+// Submitted and not yet taken back by brokerFinished(), see BROKER_QUEUE
+static int inFlight = 0;
+
+static requestHandler execRequest = NULL;
+static batchHandler execBatch = NULL;
+static brokerIdleHandler execIdle = NULL;
+
+static double msSince(struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+requestPtr newRequest(short type, void *owner)
+{
+    requestPtr rPtr;
+
+    if (! (rPtr = calloc(1, sizeof(Request)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    rPtr->type = type;
+    rPtr->owner = owner;
+    rPtr->debugFD = -1;
+    rPtr->done = 0;
+    rPtr->waiters = NULL;
+    rPtr->nextInFlight = NULL;
+    rPtr->next = NULL;
+
+    return rPtr;
+}
+
+static void *brokerMain(void *arg)
+{
+    requestPtr rPtr;
+    requestPtr batch;
+    requestPtr nextPtr;
+    char errText[2000];
+    int served;
+    int busy = 0;
+    int next = 0;
+    double wait;
+    uint64_t since;
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&queueLock);
+    while (1) {
+        if (! queueHead) {
+            if (busy) {
+                // Queue has run empty, the link may be given free
+                busy = 0;
+                pthread_mutex_unlock(&queueLock);
+                pthread_mutex_lock(&execLock);
+                next = execIdle ? execIdle() : 0;
+                pthread_mutex_unlock(&execLock);
+                pthread_mutex_lock(&queueLock);
+                if (next > 0) {
+                    clock_gettime(CLOCK_MONOTONIC, &deadline);
+                    deadline.tv_sec += next;
+                }
+                continue;
+            }
+            if (next > 0) {
+                if (pthread_cond_timedwait(&queueCond, &queueLock, &deadline) == ETIMEDOUT) {
+                    // Time for the idle handler again
+                    busy = 1;
+                }
+            } else {
+                pthread_cond_wait(&queueCond, &queueLock);
+            }
+            continue;
+        }
+
+        // Take everything queued so far
+        batch = queueHead;
+        queueHead = queueTail = NULL;
+        for (rPtr = batch; rPtr; rPtr = rPtr->next) {
+            stats.depth--;
+            wait = msSince(&rPtr->enqueued);
+            metricsLockWait((uint64_t)(wait * 1000000));
+            rPtr->span.ns[SPAN_QUEUE] = (uint64_t)(wait * 1000000);
+            stats.waitSum += wait;
+            if (wait > stats.waitMax) {
+                stats.waitMax = wait;
+            }
+            logIT(LOG_INFO, "Broker: request %lu (%s) waited %.1f ms", rPtr->id, rPtr->name, wait);
+        }
+        pthread_mutex_unlock(&queueLock);
+
+        served = 0;
+        for (rPtr = batch; rPtr; rPtr = nextPtr) {
+            nextPtr = rPtr->next;
+            served++;
+            spanAttach(&rPtr->span);
+            since = spanNow();
+            pthread_mutex_lock(&execLock);
+            spanAdd(SPAN_LOCK, since);
+            if (! rPtr->done && execBatch && nextPtr) {
+                execBatch(rPtr);
+                // Failures have been logged, the single requests report their own
+                takeErrMsg(errText, sizeof(errText));
+            }
+            if (! rPtr->done) {
+                setDebugFD(rPtr->debugFD);
+                execRequest(rPtr);
+                takeErrMsg(rPtr->errText, sizeof(rPtr->errText));
+                setDebugFD(-1);
+            }
+            pthread_mutex_unlock(&execLock);
+            spanDetach();
+
+            rPtr->next = NULL;
+            // The pointer is smaller than PIPE_BUF, so this is atomic, and
+            // the pipe has room for all requests in flight
+            if (write(donePipe[1], &rPtr, sizeof(rPtr)) != sizeof(rPtr)) {
+                logIT(LOG_ERR, "Broker: could not hand back request %lu: %s", rPtr->id, strerror(errno));
+            }
+        }
+
+        pthread_mutex_lock(&queueLock);
+        stats.served += served;
+        busy = 1;
+    }
+
+    return NULL;
+}
+
+int brokerStart(requestHandler onRequest, batchHandler onBatch, brokerIdleHandler onIdle)
+{
+    sigset_t set;
+    sigset_t oldSet;
+    pthread_condattr_t attr;
+    int ret;
+
+    execRequest = onRequest;
+    execBatch = onBatch;
+    execIdle = onIdle;
+    memset(&stats, 0, sizeof(stats));
+
+    // Idle timeouts must not jump with the wall clock
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queueCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pipe(donePipe) < 0) {
+        logIT(LOG_ERR, "Broker: pipe failed: %s", strerror(errno));
+        return 0;
+    }
+    fcntl(donePipe[0], F_SETFL, fcntl(donePipe[0], F_GETFL, 0) | O_NONBLOCK);
+
+    // The broker thread must not handle the signals of the main loop
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGPIPE);
+    sigaddset(&set, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &set, &oldSet);
+    ret = pthread_create(&brokerThread, NULL, brokerMain, NULL);
+    pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+    if (ret != 0) {
+        logIT(LOG_ERR, "Broker: could not create thread: %s", strerror(ret));
+        return 0;
+    }
+
+    logIT1(LOG_INFO, "Broker thread started");
+    return 1;
+}
+
+// Queues the request, returns 0 if the queue is full
+int brokerSubmit(requestPtr rPtr)
+{
+    pthread_mutex_lock(&queueLock);
+    if (inFlight >= BROKER_QUEUE) {
+        stats.rejected++;
+        pthread_mutex_unlock(&queueLock);
+        logIT(LOG_WARNING, "Broker: queue full, request %s rejected", rPtr->name);
+        return 0;
+    }
+
+    rPtr->id = ++lastId;
+    spanInit(&rPtr->span, rPtr->id);
+    rPtr->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &rPtr->enqueued);
+    if (queueTail) {
+        queueTail->next = rPtr;
+    } else {
+        queueHead = rPtr;
+    }
+    queueTail = rPtr;
+    inFlight++;
+    if (++stats.depth > stats.maxDepth) {
+        stats.maxDepth = stats.depth;
+    }
+    pthread_cond_signal(&queueCond);
+    pthread_mutex_unlock(&queueLock);
+
+    return 1;
+}
+
+// Returns the next finished request or NULL
+requestPtr brokerFinished()
+{
+    requestPtr rPtr;
+
+    if (read(donePipe[0], &rPtr, sizeof(rPtr)) != sizeof(rPtr)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&queueLock);
+    inFlight--;
+    pthread_mutex_unlock(&queueLock);
+    return rPtr;
+}
+
+// The event loop waits on this descriptor for finished requests
+int brokerFD()
+{
+    return donePipe[0];
+}
+
+void brokerGetStats(BrokerStats *sPtr)
+{
+    pthread_mutex_lock(&queueLock);
+    *sPtr = stats;
+    pthread_mutex_unlock(&queueLock);
+}
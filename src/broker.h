@@ -0,0 +1,103 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Device broker: a single thread owning the device link
+
+#ifndef BROKER_H
+#define BROKER_H
+
+#include <time.h>
+
+#include "common.h"
+#include "span.h"
+
+// Requests queued, running or waiting in the done pipe at most. Their
+// pointers fit into PIPE_BUF (4096 at least), so handing one back never
+// blocks the broker, however late the event loop reads them.
+#define BROKER_QUEUE 64
+
+// Request types
+#define REQ_COMMAND 1
+#define REQ_RAW     2
+#define REQ_CLOSE   3
+#define REQ_POLL    4
+#define REQ_BINARY  5
+
+typedef struct request *requestPtr;
+typedef struct waiter *waiterPtr;
+
+// Further owners getting the result of the same request
+typedef struct waiter {
+    void *owner;
+    waiterPtr next;
+} Waiter;
+
+typedef struct request {
+    unsigned long id;
+    short type;
+    char name[100];
+    char para[MAXBUF];
+    short noUnit;
+    int debugFD;
+    void *owner;
+    waiterPtr waiters;
+    requestPtr nextInFlight;
+    short done;
+    int status;
+    char result[MAXBUF];
+    char errText[2000];
+    struct timespec enqueued;
+    Span span;
+    // Binary protocol: status is one of BIN_ (binproto.h), para holds
+    // paraLen raw bytes, the value read goes to raw and, converted, to
+    // value and result
+    unsigned short cmdId;
+    short paraLen;
+    short rawLen;
+    unsigned char raw[256];
+    double value;
+    short hasValue;
+    struct timespec readTime;
+    unsigned long duration;
+    requestPtr next;
+} Request;
+
+typedef struct brokerStats {
+    int depth;
+    int maxDepth;
+    unsigned long served;
+    unsigned long rejected;
+    double waitSum;
+    double waitMax;
+} BrokerStats;
+
+// Runs a request in the broker thread, fills status and result
+typedef void (*requestHandler)(requestPtr rPtr);
+// Gets the requests taken from the queue together (linked by next), may
+// execute some of them at once and mark them done
+typedef void (*batchHandler)(requestPtr rPtr);
+// Called by the broker thread when the queue has run empty, returns the
+// number of seconds after which it wants to be called again (0: not at all)
+typedef int (*brokerIdleHandler)(void);
+
+requestPtr newRequest(short type, void *owner);
+int brokerStart(requestHandler onRequest, batchHandler onBatch, brokerIdleHandler onIdle);
+int brokerSubmit(requestPtr rPtr);
+requestPtr brokerFinished();
+int brokerFD();
+void brokerGetStats(BrokerStats *stats);
+
+#endif // BROKER_H
@@ -0,0 +1,164 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Value cache
+ *
+ * The formatted answers of read commands are kept for <cache ttl="..."/>
+ * seconds, keyed by command name, parameters and unit mode. Each entry
+ * remembers the address range it was read from, so a write command can
+ * drop everything it touches. The cache is only used by the event loop
+ * thread, so there is no locking.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "cache.h"
+#include "common.h"
+
+static cacheEntryPtr buckets[CACHE_BUCKETS];
+static int entries = 0;
+
+static unsigned int hashKey(const char *key)
+{
+    unsigned int hash = 5381;
+
+    while (*key) {
+        hash = hash * 33 + (unsigned char)*key++;
+    }
+    return hash;
+}
+
+static cacheEntryPtr findEntry(const char *key, unsigned int hash)
+{
+    cacheEntryPtr ePtr;
+
+    for (ePtr = buckets[hash % CACHE_BUCKETS]; ePtr; ePtr = ePtr->next) {
+        if (ePtr->hash == hash && strcmp(ePtr->key, key) == 0) {
+            return ePtr;
+        }
+    }
+    return NULL;
+}
+
+static void freeEntry(cacheEntryPtr ePtr)
+{
+    free(ePtr->key);
+    free(ePtr->value);
+    free(ePtr);
+    entries--;
+}
+
+void cacheKey(char *key, size_t keyLen, const char *name, const char *para, short noUnit)
+{
+    snprintf(key, keyLen, "%s\t%d\t%s", name, noUnit ? 1 : 0, para);
+}
+
+// Returns CACHE_FRESH or CACHE_EXPIRED with *ePtr set, or CACHE_MISS
+int cacheLookup(const char *key, cacheEntryPtr *ePtr)
+{
+    if (! (*ePtr = findEntry(key, hashKey(key)))) {
+        return CACHE_MISS;
+    }
+    if ((*ePtr)->failed || monotonicTime() - (*ePtr)->stored >= (*ePtr)->ttl) {
+        return CACHE_EXPIRED;
+    }
+    return CACHE_FRESH;
+}
+
+void cacheStore(const char *key, int ttl, int addr, int len, const char *value)
+{
+    cacheEntryPtr ePtr;
+    unsigned int hash = hashKey(key);
+
+    if (! (ePtr = findEntry(key, hash))) {
+        if (entries >= CACHE_MAX) {
+            logIT(LOG_WARNING, "Cache full, not caching %s", key);
+            return;
+        }
+        if (! (ePtr = calloc(1, sizeof(CacheEntry)))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        if (! (ePtr->key = strdup(key))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        ePtr->hash = hash;
+        ePtr->next = buckets[hash % CACHE_BUCKETS];
+        buckets[hash % CACHE_BUCKETS] = ePtr;
+        entries++;
+    }
+
+    free(ePtr->value);
+    if (! (ePtr->value = strdup(value))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    ePtr->addr = addr;
+    ePtr->len = len;
+    ePtr->ttl = ttl;
+    ePtr->stored = monotonicTime();
+    ePtr->refreshing = 0;
+    ePtr->failed = 0;
+}
+
+// The device could not be asked, the old value stays as last known good one
+void cacheFailed(const char *key)
+{
+    cacheEntryPtr ePtr;
+
+    if ((ePtr = findEntry(key, hashKey(key)))) {
+        ePtr->refreshing = 0;
+        ePtr->failed = 1;
+    }
+}
+
+// Drops all entries read from an address range overlapping [addr, addr+len)
+void cacheInvalidate(int addr, int len)
+{
+    cacheEntryPtr *pPtr;
+    cacheEntryPtr ePtr;
+    int n;
+
+    for (n = 0; n < CACHE_BUCKETS; n++) {
+        pPtr = &buckets[n];
+        while ((ePtr = *pPtr)) {
+            if (ePtr->addr < addr + (len > 0 ? len : 1) && addr < ePtr->addr + (ePtr->len > 0 ? ePtr->len : 1)) {
+                logIT(LOG_INFO, "Cache: dropping %s", ePtr->key);
+                *pPtr = ePtr->next;
+                freeEntry(ePtr);
+            } else {
+                pPtr = &ePtr->next;
+            }
+        }
+    }
+}
+
+void cacheClear()
+{
+    cacheEntryPtr ePtr;
+    int n;
+
+    for (n = 0; n < CACHE_BUCKETS; n++) {
+        while ((ePtr = buckets[n])) {
+            buckets[n] = ePtr->next;
+            freeEntry(ePtr);
+        }
+    }
+}
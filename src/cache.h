@@ -0,0 +1,54 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Value cache for the results of read commands
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <time.h>
+
+#define CACHE_BUCKETS 256
+#define CACHE_MAX     1024
+
+// Results of cacheLookup()
+#define CACHE_MISS    0
+#define CACHE_FRESH   1
+#define CACHE_EXPIRED 2
+
+typedef struct cacheEntry *cacheEntryPtr;
+
+typedef struct cacheEntry {
+    char *key;
+    unsigned int hash;
+    int addr;
+    int len;
+    int ttl;
+    time_t stored;
+    short refreshing;
+    short failed;
+    char *value;
+    cacheEntryPtr next;
+} CacheEntry;
+
+void cacheKey(char *key, size_t keyLen, const char *name, const char *para, short noUnit);
+int cacheLookup(const char *key, cacheEntryPtr *ePtr);
+void cacheStore(const char *key, int ttl, int addr, int len, const char *value);
+void cacheFailed(const char *key);
+void cacheInvalidate(int addr, int len);
+void cacheClear();
+
+#endif // CACHE_H
@@ -26,6 +26,7 @@
 #include <signal.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 
 #include "client.h"
 #include "prompt.h"
@@ -35,6 +36,12 @@
 static void sig_alrm(int);
 static jmp_buf  env_alrm;
 
+// Received bytes not yet consumed. The replies to pipelined commands follow
+// each other on the stream, so we may have read into the next one.
+static char recvBuf[ALLOCSIZE];
+static ssize_t recvLen = 0;
+static ssize_t recvPos = 0;
+
 int sendTrList(int sockfd, trPtr ptr);
 
 trPtr newTrNode(trPtr ptr)
@@ -58,6 +65,23 @@ trPtr newTrNode(trPtr ptr)
     return nptr;
 }
 
+static ssize_t recvByte(int fd, char *c)
+{
+    if (recvPos >= recvLen) {
+        recvPos = 0;
+        if ((recvLen = read(fd, recvBuf, sizeof(recvBuf))) <= 0) {
+            if (recvLen < 0 && errno == EINTR) {
+                recvLen = 0;
+                return -1;
+            }
+            recvLen = 0;
+            return 0;
+        }
+    }
+    *c = recvBuf[recvPos++];
+    return 1;
+}
+
 ssize_t recvSync(int fd, char *wait, char **recv)
 {
     char *rptr;
@@ -65,6 +89,7 @@ ssize_t recvSync(int fd, char *wait, char **recv)
     char c;
     ssize_t count;
     int rcount = 1;
+    size_t waitLen = strlen(wait);
 
     if (signal(SIGALRM, sig_alrm) == SIG_ERR) {
         logIT1(LOG_ERR, "SIGALRM error");
@@ -84,7 +109,7 @@ ssize_t recvSync(int fd, char *wait, char **recv)
 
     rptr = *recv;
     size_t i = 0;
-    while ((count = readn(fd, &c, 1))) {
+    while ((count = recvByte(fd, &c))) {
         alarm(0);
         if (count < 0) {
             continue;
@@ -104,7 +129,9 @@ ssize_t recvSync(int fd, char *wait, char **recv)
             }
         }
 
-        if ((pptr = strstr(*recv, wait))) {
+        // The reply ends with wait, we only need to look at the tail
+        if (i >= waitLen && memcmp(rptr - waitLen, wait, waitLen) == 0) {
+            pptr = rptr - waitLen;
             *pptr = '\0';
             logIT(LOG_INFO, "recv:%s", *recv);
             break;
@@ -170,6 +197,7 @@ size_t sendServer(int fd, char *s_buf, size_t len)
     fcntl(fd, F_SETFL, O_NONBLOCK);
     while (readn(fd, string, sizeof(string)) > 0) { }
     fcntl(fd, F_SETFL, ! O_NONBLOCK);
+    recvLen = recvPos = 0;
     return Writen(fd, s_buf, len);
 }
 
@@ -229,36 +257,52 @@ trPtr sendCmds(int sockfd, char *commands)
     return startPtr;
 }
 
+/* All commands are sent at once, the server answers them in order. Each
+ * reply is terminated by the prompt, so we read them one by one from the
+ * stream without waiting a round trip per command.
+ */
 int sendTrList(int sockfd, trPtr ptr)
 {
-    char string[1000 + 1];
     char prompt[] = PROMPT;
     char errTXT[] = ERR;
     char *sptr;
     char *dumPtr;
+    char *sendBuf;
+    size_t sendLen = 0;
+    trPtr tPtr;
 
     if (recvSync(sockfd, prompt, &sptr) <= 0) {
         free(sptr);
         return 0;
     }
+    free(sptr);
 
-    while (ptr) {
-        //memset(string, 0,sizeof(string));
-        snprintf(string, sizeof(string), "%s\n", ptr->cmd);
-
-        if (sendServer(sockfd, string, strlen(string)) <= 0) {
-            return 0;
-        }
+    for (tPtr = ptr; tPtr; tPtr = tPtr->next) {
+        sendLen += strlen(tPtr->cmd) + 1;
+    }
+    if (! (sendBuf = calloc(sendLen + 1, sizeof(char)))) {
+        logIT1(LOG_ERR, "calloc error");
+        exit(1);
+    }
+    for (tPtr = ptr; tPtr; tPtr = tPtr->next) {
+        strcat(sendBuf, tPtr->cmd);
+        strcat(sendBuf, "\n");
+        logIT(LOG_INFO, "SEND:%s", tPtr->cmd);
+    }
+    if (sendServer(sockfd, sendBuf, sendLen) <= 0) {
+        free(sendBuf);
+        return 0;
+    }
+    free(sendBuf);
 
-        //memset(string, 0,sizeof(string));
-        logIT(LOG_INFO, "SEND:%s", ptr->cmd);
+    while (ptr) {
         if (recvSync(sockfd, prompt, &sptr) <= 0) {
             free(sptr);
             return 0;
         }
 
         ptr->raw = sptr;
-        if (iscntrl(*(ptr->raw + strlen(ptr->raw) - 1))) {
+        if (*ptr->raw && iscntrl(*(ptr->raw + strlen(ptr->raw) - 1))) {
             *(ptr->raw + strlen(ptr->raw) - 1) = '\0';
         }
 
@@ -29,13 +29,16 @@
 #include <stdarg.h>
 
 #include "common.h"
+#include "socket.h"
+#include "logbuf.h"
 
 int syslogger = 0;
 int debug = 0;
 FILE *logFD;
-char errMsg[2000];
-int errClass = 99;
-int dbgFD = -1;
+// Each thread collects its own errors and may have its own debug client
+__thread char errMsg[2000];
+__thread int errClass = 99;
+__thread int dbgFD = -1;
 
 int initLog(int useSyslog, char *logfile, int debugSwitch)
 {
@@ -65,26 +68,45 @@ int initLog(int useSyslog, char *logfile, int debugSwitch)
     return 1;
 }
 
+// Lines collected for the log file and stderr, see logOutputFlush()
+static char logBatch[8192];
+static size_t logBatchLen = 0;
+
+/* Messages not wanted anywhere return before anything is formatted. Errors
+ * are collected for the client and the debug client gets everything right
+ * away, so these are formatted here. Everything else is queued as it is,
+ * the writer of logbuf.c formats and writes it.
+ */
 void logIT (int class, char *string, ...)
 {
     va_list arguments;
     time_t t;
-    char *tPtr;
+    char tBuf[32];
     char *cPtr;
-    time(&t);
-    tPtr = ctime(&t);
-    char *print_buffer;
-    int pid;
+    char text[MAXBUF];
     long avail;
 
+    errClass = class;
+    if (! logWanted(class)) {
+        return;
+    }
+    time(&t);
+
+    if (logBufRunning() && class > LOG_ERR && dbgFD < 0) {
+        va_start(arguments, string);
+        logBufPut(class, t, string, arguments);
+        va_end(arguments);
+        return;
+    }
+
     va_start(arguments, string);
-    vasprintf(&print_buffer, string, arguments);
+    vsnprintf(text, sizeof(text), string, arguments);
     va_end(arguments);
 
     if (class <= LOG_ERR)  {
         avail = sizeof(errMsg) - strlen(errMsg) - 2;
         if ( avail > 0 ) {
-            strncat(errMsg, print_buffer, avail);
+            strncat(errMsg, text, avail);
             strcat(errMsg, "\n");
         } else {
             strcpy(&errMsg[sizeof(errMsg) - 12], "OVERFLOW\n");
@@ -92,52 +114,134 @@ void logIT (int class, char *string, ...)
         }
     }
 
-    errClass = class;
-    // Remove control characters
-    cPtr = tPtr;
-    while (*cPtr) {
-        if (iscntrl(*cPtr)) {
-            *cPtr = ' ';
-        }
-        cPtr++;
-    }
-
     if (dbgFD >= 0) {
         // The debug FD is set and we firstly send the info there
-        dprintf(dbgFD, "DEBUG:%s: %s\n", tPtr, print_buffer);
+        ctime_r(&t, tBuf);
+        // Remove control characters
+        for (cPtr = tBuf; *cPtr; cPtr++) {
+            if (iscntrl(*cPtr)) {
+                *cPtr = ' ';
+            }
+        }
+        dprintf(dbgFD, "DEBUG:%s: %s\n", tBuf, text);
     }
 
     if (! debug && (class  > LOG_NOTICE)) {
-        free(print_buffer);
         return;
     }
 
-    pid = getpid();
+    if (logBufRunning()) {
+        logBufText(class, t, text);
+    } else {
+        logOutput(class, t, text);
+        logOutputFlush();
+    }
+}
+
+// Passes a message to syslog and adds its line for the log file and stderr
+void logOutput(int class, time_t t, const char *text)
+{
+    char tBuf[32];
+    char *cPtr;
+    char line[MAXBUF + 64];
+    int len;
 
     if (syslogger) {
-        syslog(class, "%s", print_buffer);
+        syslog(class, "%s", text);
+    }
+    if (! logFD && ! isatty(2)) {
+        return;
+    }
+    ctime_r(&t, tBuf);
+    // Remove control characters
+    for (cPtr = tBuf; *cPtr; cPtr++) {
+        if (iscntrl(*cPtr)) {
+            *cPtr = ' ';
+        }
     }
+    len = snprintf(line, sizeof(line), "[%d] %s: %s\n", getpid(), tBuf, text);
+    if (len >= (int)sizeof(line)) {
+        len = sizeof(line) - 1;
+    }
+    if (logBatchLen + len > sizeof(logBatch)) {
+        logOutputFlush();
+    }
+    memcpy(logBatch + logBatchLen, line, len);
+    logBatchLen += len;
+}
 
+// Writes the lines collected by logOutput()
+void logOutputFlush()
+{
+    if (! logBatchLen) {
+        return;
+    }
     if (logFD) {
-        fprintf(logFD, "[%d] %s: %s\n", pid, tPtr, print_buffer);
-        fflush(logFD);
+        write(fileno(logFD), logBatch, logBatchLen);
     }
-
     // Output only if 2 is open as STDERR
     if (isatty(2)) {
-        fprintf(stderr, "[%d] %s: %s\n", pid, tPtr, print_buffer);
+        write(2, logBatch, logBatchLen);
     }
+    logBatchLen = 0;
+}
 
-    free(print_buffer);
+/* For signal handlers: writes text to the log file and stderr right away,
+ * bypassing the log buffer, its writer thread and syslog. Only
+ * async-signal-safe calls, hence no time stamp.
+ */
+void logSignal(const char *text)
+{
+    char line[128];
+    char digits[16];
+    size_t len = 0;
+    int nDigits = 0;
+    pid_t pid = getpid();
+
+    line[len++] = '[';
+    do {
+        digits[nDigits++] = '0' + pid % 10;
+        pid /= 10;
+    } while (pid > 0);
+    while (nDigits > 0) {
+        line[len++] = digits[--nDigits];
+    }
+    line[len++] = ']';
+    line[len++] = ' ';
+    while (*text && len < sizeof(line) - 1) {
+        line[len++] = *text++;
+    }
+    line[len++] = '\n';
+
+    if (logFD) {
+        write(fileno(logFD), line, len);
+    }
+    if (isatty(2)) {
+        write(2, line, len);
+    }
+}
+
+// Whether logIT() writes a message of class anywhere, to skip building it
+int logWanted(int class)
+{
+    return dbgFD >= 0 || debug || class <= LOG_NOTICE;
 }
 
 void sendErrMsg(int fd)
 {
     char string[256];
 
-    if ((fd >= 0) && (errClass <= 3)) {
-        snprintf(string, sizeof(string), "ERR: %s", errMsg);
-        write(fd, string, strlen(string));
+    if (fd >= 0 && takeErrMsg(string, sizeof(string))) {
+        Writen(fd, string, strlen(string));
+    }
+}
+
+// Moves the collected error message of this thread to buf, returns its length
+int takeErrMsg(char *buf, size_t len)
+{
+    *buf = '\0';
+    if (errClass <= 3) {
+        snprintf(buf, len, "ERR: %s", errMsg);
         errClass = 99; // Thus it's only displayed once
         memset(errMsg, 0, sizeof(errMsg));
     }
@@ -145,6 +249,7 @@ void sendErrMsg(int fd)
     *errMsg = '\0';
     // Back to start, no matter if we actually output
     // Can be commented out for debugging, then we get the errors in errMsg
+    return strlen(buf);
 }
 
 void setDebugFD(int fd)
@@ -152,6 +257,15 @@ void setDebugFD(int fd)
     dbgFD = fd;
 }
 
+// Seconds of a clock not jumping with the wall clock
+time_t monotonicTime()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
 char hex2chr(char *hex)
 {
     char buffer[16];
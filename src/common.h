@@ -17,13 +17,21 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+#include <time.h>
+
 int initLog(int useSyslog, char *logfile, int debugSwitch);
 void logIT (int class, char *string, ...);
+void logOutput(int class, time_t t, const char *text);
+void logOutputFlush();
+void logSignal(const char *text);
+int logWanted(int class);
 char hex2chr(char *hex);
 int char2hex(char *outString, const char *charPtr, int len);
 short string2chr(char *line, char *buf, short bufsize);
 void sendErrMsg(int fd);
+int takeErrMsg(char *buf, size_t len);
 void setDebugFD(int fd);
+time_t monotonicTime();
 ssize_t readn(int fd, void *vptr, size_t n);
 
 #ifndef MAXBUF
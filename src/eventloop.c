@@ -0,0 +1,575 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Single process event loop
+ *
+ * Instead of forking a child for each client, all client sockets are
+ * multiplexed with epoll. Each connection only keeps a small session
+ * struct with its line buffer and settings, the bus work is done by the
+ * one process owning the device.
+ *
+ * The client sockets are nonblocking. What a client does not take at once
+ * is kept in the output buffer of its session and written when the socket
+ * gets writable again, so a slow reader never stalls the others.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "eventloop.h"
+#include "socket.h"
+#include "common.h"
+#include "prompt.h"
+
+#define MAX_EVENTS 32
+// A client letting more answers pile up than this is dropped
+#define MAX_OUTPUT (4 * 1024 * 1024)
+
+static sessionPtr sessions = NULL;
+static watchPtr watches = NULL;
+static int epfd = -1;
+static lineHandler lineCallback = NULL;
+static frameHandler frameCallback = NULL;
+
+void initSession(sessionPtr sPtr, int fd)
+{
+    memset(sPtr, 0, sizeof(Session));
+    sPtr->kind = WATCH_SESSION;
+    sPtr->fd = fd;
+    sPtr->rawFD = NULL;
+}
+
+void closeSession(sessionPtr sPtr)
+{
+    if (sPtr->rawFD) {
+        fclose(sPtr->rawFD);
+        remove(sPtr->rawFile);
+        sPtr->rawFD = NULL;
+    }
+}
+
+#ifdef __linux__
+
+static sessionPtr newSession(int fd)
+{
+    sessionPtr sPtr;
+
+    if (! (sPtr = calloc(1, sizeof(Session)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    initSession(sPtr, fd);
+    sPtr->next = sessions;
+    sessions = sPtr;
+
+    return sPtr;
+}
+
+/* Frees the sessions removed since the last call, except those a request
+ * still runs for. Only called between batches of events, since later
+ * events of a batch may still point to a session removed by an earlier one.
+ */
+static void reapSessions()
+{
+    sessionPtr *pPtr = &sessions;
+    sessionPtr sPtr;
+
+    while ((sPtr = *pPtr)) {
+        if (sPtr->closing && ! sPtr->pending) {
+            *pPtr = sPtr->next;
+            free(sPtr->outBuf);
+            free(sPtr);
+        } else {
+            pPtr = &sPtr->next;
+        }
+    }
+}
+
+static sessionPtr findSession(int fd)
+{
+    sessionPtr sPtr;
+
+    for (sPtr = sessions; sPtr; sPtr = sPtr->next) {
+        if (sPtr->fd == fd) {
+            return sPtr;
+        }
+    }
+    return NULL;
+}
+
+// Reading stops while the session waits for the device or is ending,
+// writing is watched while output is queued
+static void watchSession(sessionPtr sPtr)
+{
+    struct epoll_event ev;
+    int events;
+
+    events = (sPtr->pending || sPtr->draining) ? 0 : EPOLLIN;
+    if (sPtr->outLen) {
+        events |= EPOLLOUT;
+    }
+    if (events == sPtr->events) {
+        return;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = sPtr;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, sPtr->fd, &ev);
+    sPtr->events = events;
+}
+
+// Writes as much of the queued output as the client takes, returns 0 on errors
+static int flushSession(sessionPtr sPtr)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < sPtr->outLen) {
+        n = write(sPtr->fd, sPtr->outBuf + done, sPtr->outLen - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (n <= 0) {
+            logIT(LOG_ERR, "Error writing to socket (fd:%d): %s", sPtr->fd, strerror(errno));
+            sPtr->outLen = 0;
+            return 0;
+        }
+        done += n;
+    }
+    sPtr->outLen -= done;
+    memmove(sPtr->outBuf, sPtr->outBuf + done, sPtr->outLen);
+
+    return 1;
+}
+
+// Gives up on a client, the loop removes the session on the hangup this causes
+static void dropSession(sessionPtr sPtr)
+{
+    sPtr->outLen = 0;
+    sPtr->inLen = 0;
+    sPtr->dropped = 1;
+    shutdown(sPtr->fd, SHUT_RDWR);
+}
+
+// Writen() of the sessions, queues what the client does not take at once
+static ssize_t sessionOutput(int fd, void *ptr, size_t nbytes)
+{
+    sessionPtr sPtr;
+    char *bufPtr;
+    size_t size;
+
+    if (fd < 0 || ! (sPtr = findSession(fd))) {
+        return -1;
+    }
+    if (sPtr->dropped) {
+        return 0;
+    }
+    if (sPtr->outLen + nbytes > MAX_OUTPUT) {
+        logIT(LOG_ERR, "Client (fd:%d) does not take its answers, closing", fd);
+        dropSession(sPtr);
+        return 0;
+    }
+    if (sPtr->outLen + nbytes > sPtr->outSize) {
+        size = sPtr->outSize ? sPtr->outSize : MAXLINE;
+        while (size < sPtr->outLen + nbytes) {
+            size *= 2;
+        }
+        if (! (bufPtr = realloc(sPtr->outBuf, size))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        sPtr->outBuf = bufPtr;
+        sPtr->outSize = size;
+    }
+    memcpy(sPtr->outBuf + sPtr->outLen, ptr, nbytes);
+    sPtr->outLen += nbytes;
+
+    if (! flushSession(sPtr)) {
+        dropSession(sPtr);
+        return 0;
+    }
+    watchSession(sPtr);
+
+    return nbytes;
+}
+
+static void removeSession(sessionPtr sPtr)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, sPtr->fd, NULL);
+    closeSession(sPtr);
+    closeSocket(sPtr->fd);
+    sPtr->fd = -1;
+    sPtr->outLen = 0;
+    // Freed by reapSessions(), once a running request has returned
+    sPtr->closing = 1;
+}
+
+// The last words of a closing session, binary clients would not understand them
+static void sessionError(sessionPtr sPtr)
+{
+    char string[256];
+
+    if (sPtr->binary) {
+        takeErrMsg(string, sizeof(string));
+    } else {
+        sendErrMsg(sPtr->fd);
+    }
+}
+
+// Ends a session once the client has taken its last answers
+static void endSession(sessionPtr sPtr)
+{
+    if (sPtr->outLen && flushSession(sPtr) && sPtr->outLen) {
+        sPtr->draining = 1;
+        watchSession(sPtr);
+        return;
+    }
+    removeSession(sPtr);
+}
+
+// Handles the buffered frames of a binary session, returns 0 if it has ended
+static int processFrames(sessionPtr sPtr)
+{
+    char frame[MAXLINE];
+    unsigned char *ptr;
+    int len;
+    int ret;
+
+    while (sPtr->inLen >= 4 && ! sPtr->pending) {
+        ptr = (unsigned char *)sPtr->inBuf;
+        len = (ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+        if (len < 0 || len > (int)sizeof(sPtr->inBuf) - 5) {
+            logIT(LOG_ERR, "Binary frame of %d bytes too long, closing", len);
+            return 0;
+        }
+        if (sPtr->inLen < len + 4) {
+            break;
+        }
+        memcpy(frame, sPtr->inBuf + 4, len);
+        sPtr->inLen -= len + 4;
+        memmove(sPtr->inBuf, sPtr->inBuf + len + 4, sPtr->inLen);
+
+        ret = frameCallback(sPtr, frame, len);
+        if (ret == SESSION_CLOSE) {
+            return 0;
+        }
+        if (ret == SESSION_PENDING) {
+            sPtr->pending = 1;
+            watchSession(sPtr);
+        }
+    }
+
+    return 1;
+}
+
+// Handles the buffered lines, returns 0 if the session has ended
+static int processLines(sessionPtr sPtr)
+{
+    char line[MAXLINE];
+    char *nlPtr;
+    char *ptr;
+    int len;
+    int ret;
+
+    if (sPtr->binary) {
+        return processFrames(sPtr);
+    }
+    while (sPtr->inLen && ! sPtr->pending) {
+        if ((nlPtr = memchr(sPtr->inBuf, '\n', sPtr->inLen))) {
+            len = nlPtr - sPtr->inBuf + 1;
+        } else if (sPtr->inLen == sizeof(sPtr->inBuf) - 1) {
+            // Line too long, handle it in pieces like Readline() does
+            len = sPtr->inLen;
+        } else {
+            break;
+        }
+        memcpy(line, sPtr->inBuf, len);
+        line[len] = '\0';
+        sPtr->inLen -= len;
+        memmove(sPtr->inBuf, sPtr->inBuf + len, sPtr->inLen);
+
+        // Remove control characters
+        ptr = line + len;
+        while (ptr >= line && iscntrl(*ptr)) {
+            *ptr-- = '\0';
+        }
+        ret = lineCallback(sPtr, line);
+        if (ret == SESSION_CLOSE) {
+            return 0;
+        }
+        if (ret == SESSION_PENDING) {
+            sPtr->pending = 1;
+            watchSession(sPtr);
+        }
+    }
+
+    return 1;
+}
+
+// Reads from the client, returns 0 if the session has ended
+static int readSession(sessionPtr sPtr)
+{
+    ssize_t n;
+
+    n = read(sPtr->fd, sPtr->inBuf + sPtr->inLen, sizeof(sPtr->inBuf) - sPtr->inLen - 1);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 1;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    sPtr->inLen += n;
+    sPtr->inBuf[sPtr->inLen] = '\0';
+
+    return processLines(sPtr);
+}
+
+// The request of a pending session has been answered
+void sessionResume(sessionPtr sPtr)
+{
+    sPtr->pending = 0;
+    if (sPtr->closing) {
+        return;
+    }
+    if (! processLines(sPtr)) {
+        sessionError(sPtr);
+        endSession(sPtr);
+        return;
+    }
+    watchSession(sPtr);
+}
+
+int eventLoopInit()
+{
+    if (epfd >= 0) {
+        return 1;
+    }
+    if ((epfd = epoll_create1(0)) < 0) {
+        logIT(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        return 0;
+    }
+    setWriteHook(sessionOutput);
+    return 1;
+}
+
+// Calls onReady whenever fd gets readable
+int eventLoopWatch(int fd, watchHandler onReady)
+{
+    struct epoll_event ev;
+    watchPtr wPtr;
+
+    if (! eventLoopInit()) {
+        return 0;
+    }
+    if (! (wPtr = calloc(1, sizeof(Watch)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    wPtr->kind = WATCH_FD;
+    wPtr->fd = fd;
+    wPtr->onReady = onReady;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = wPtr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        logIT(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        free(wPtr);
+        return 0;
+    }
+    wPtr->next = watches;
+    watches = wPtr;
+
+    return 1;
+}
+
+// Accepts a nonblocking connection and watches it, returns NULL if there is none
+static sessionPtr acceptClient(int listenfd)
+{
+    struct epoll_event ev;
+    struct sockaddr_storage cliaddr;
+    socklen_t cliaddrlen = sizeof(cliaddr);
+    char clienthost[NI_MAXHOST];
+    char clientservice[NI_MAXSERV];
+    sessionPtr sPtr;
+    int connfd;
+
+    if ((connfd = accept4(listenfd, (struct sockaddr *) &cliaddr, &cliaddrlen, SOCK_NONBLOCK)) < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            logIT(LOG_NOTICE, "accept failed: %s", strerror(errno));
+        }
+        return NULL;
+    }
+    getnameinfo((struct sockaddr *) &cliaddr, cliaddrlen, clienthost, sizeof(clienthost),
+                clientservice, sizeof(clientservice), NI_NUMERICHOST);
+    logIT(LOG_NOTICE, "Client connected %s:%s (FD:%d)", clienthost, clientservice, connfd);
+
+    sPtr = newSession(connfd);
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = sPtr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+        logIT(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+        removeSession(sPtr);
+        return NULL;
+    }
+    sPtr->events = EPOLLIN;
+
+    return sPtr;
+}
+
+static void acceptSession(int listenfd)
+{
+    sessionPtr sPtr;
+
+    if ((sPtr = acceptClient(listenfd)) && ! Writen(sPtr->fd, PROMPT, strlen(PROMPT))) {
+        removeSession(sPtr);
+    }
+}
+
+// Binary sessions get no prompt
+static void acceptBinary(int listenfd)
+{
+    sessionPtr sPtr;
+
+    if ((sPtr = acceptClient(listenfd))) {
+        sPtr->binary = 1;
+    }
+}
+
+// Accepts binary protocol sessions on listenfd
+int eventLoopBinary(int listenfd, frameHandler onFrame)
+{
+    frameCallback = onFrame;
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    return eventLoopWatch(listenfd, acceptBinary);
+}
+
+int eventLoop(int listenfd, lineHandler onLine, idleHandler onIdle)
+{
+    struct epoll_event events[MAX_EVENTS];
+    sessionPtr sPtr;
+    watchPtr wPtr;
+    int nfds;
+    int n;
+    int timeout;
+
+    lineCallback = onLine;
+    // A client gone between the wakeup and accept() must not block the loop
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    if (! eventLoopWatch(listenfd, acceptSession)) {
+        return 0;
+    }
+
+    logIT1(LOG_NOTICE, "Event loop started");
+
+    while (1) {
+        timeout = onIdle ? onIdle() : -1;
+        nfds = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+        if (nfds < 0) {
+            if (errno != EINTR) {
+                logIT(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+                break;
+            }
+            nfds = 0;
+        }
+
+        for (n = 0; n < nfds; n++) {
+            wPtr = events[n].data.ptr;
+            if (wPtr->kind == WATCH_FD) {
+                wPtr->onReady(wPtr->fd);
+                continue;
+            }
+
+            sPtr = events[n].data.ptr;
+            if (sPtr->fd < 0) {
+                continue;
+            }
+            if (events[n].events & EPOLLOUT) {
+                if (! flushSession(sPtr) || (sPtr->draining && ! sPtr->outLen)) {
+                    removeSession(sPtr);
+                    continue;
+                }
+                watchSession(sPtr);
+            }
+            if ((events[n].events & (EPOLLHUP | EPOLLERR)) && ! (events[n].events & EPOLLIN)) {
+                removeSession(sPtr);
+            } else if ((events[n].events & EPOLLIN) && ! sPtr->draining && ! readSession(sPtr)) {
+                sessionError(sPtr);
+                endSession(sPtr);
+            }
+        }
+        reapSessions();
+    }
+
+    for (sPtr = sessions; sPtr; sPtr = sPtr->next) {
+        sPtr->pending = 0;
+        if (sPtr->fd >= 0) {
+            removeSession(sPtr);
+        }
+    }
+    reapSessions();
+    close(epfd);
+    epfd = -1;
+
+    return 0;
+}
+
+#else
+
+void sessionResume(sessionPtr sPtr)
+{
+}
+
+int eventLoopInit()
+{
+    return 0;
+}
+
+int eventLoopWatch(int fd, watchHandler onReady)
+{
+    return 0;
+}
+
+int eventLoopBinary(int listenfd, frameHandler onFrame)
+{
+    return 0;
+}
+
+int eventLoop(int listenfd, lineHandler onLine, idleHandler onIdle)
+{
+    logIT1(LOG_ERR, "Event loop mode needs epoll, which is not available on this system");
+    return 0;
+}
+
+#endif
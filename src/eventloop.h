@@ -0,0 +1,95 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Single process event loop serving all client connections
+
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <stdio.h>
+
+#include "socket.h"
+
+// Return values of a line handler
+#define SESSION_CLOSE   0
+#define SESSION_OK      1
+#define SESSION_PENDING 2
+
+// Kinds of descriptors watched by the event loop
+#define WATCH_SESSION 1
+#define WATCH_FD      2
+
+// Per connection state, used by the event loop and the forking server alike
+typedef struct session *sessionPtr;
+
+typedef struct session {
+    short kind;
+    int fd;
+    char inBuf[MAXLINE];
+    int inLen;
+    short noUnit;
+    short debug;
+    // Timing breakdown after each answer, see span.c
+    short trace;
+    short pending;
+    short closing;
+    // Output the client has not taken yet, event loop only
+    char *outBuf;
+    size_t outLen;
+    size_t outSize;
+    int events;
+    // Ended, but still handing out its last answers
+    short draining;
+    // Given up on, further output is discarded
+    short dropped;
+    // Binary protocol session, see binproto.h
+    short binary;
+    void *batch;
+    FILE *rawFD;
+    char rawFile[32];
+    sessionPtr next;
+} Session;
+
+typedef void (*watchHandler)(int fd);
+
+typedef struct watch *watchPtr;
+
+typedef struct watch {
+    short kind;
+    int fd;
+    watchHandler onReady;
+    watchPtr next;
+} Watch;
+
+// Called for each complete line, returns one of the SESSION_ values.
+// With SESSION_PENDING the session waits for sessionResume().
+typedef int (*lineHandler)(sessionPtr sPtr, char *line);
+// Called for each complete frame of a binary session (without its length
+// prefix), returns one of the SESSION_ values like a line handler
+typedef int (*frameHandler)(sessionPtr sPtr, char *frame, int len);
+// Called before waiting for events, returns the milliseconds after which
+// it wants to be called again (-1: only when something happens)
+typedef int (*idleHandler)(void);
+
+void initSession(sessionPtr sPtr, int fd);
+void closeSession(sessionPtr sPtr);
+void sessionResume(sessionPtr sPtr);
+int eventLoopInit();
+int eventLoopWatch(int fd, watchHandler onReady);
+int eventLoopBinary(int listenfd, frameHandler onFrame);
+int eventLoop(int listenfd, lineHandler onLine, idleHandler onIdle);
+
+#endif // EVENTLOOP_H
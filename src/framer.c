@@ -43,6 +43,7 @@
 #include "common.h"
 #include "io.h"
 #include "framer.h"
+#include "metrics.h"
 
 typedef unsigned short int uint16;
 
@@ -181,6 +182,8 @@ static int framer_close_p300(int fd)
     int rlen;
 
     for (i = 0; i < P300X_ATTEMPTS; i++) {
+        // Sync bytes of the device may be waiting, the ack has to be fresh
+        flushInput(fd);
         if (! my_send(fd, &wbuf, 1)) {
             framer_set_result(P300_ERROR);
             snprintf(string, sizeof(string), ">FRAMER: reset not send");
@@ -234,6 +237,7 @@ static int framer_open_p300(int fd)
             return FRAMER_ERROR;
         }
 
+        flushInput(fd);
         if (! my_send(fd, enable, sizeof(enable))) {
             framer_set_result(P300_ERROR);
             snprintf(string, sizeof(string), ">FRAMER: enable not send");
@@ -258,6 +262,7 @@ static int framer_open_p300(int fd)
             // by framer_reset_actaddr() to avoid error log
             // >FRAMER: addr was still active FE06
             framer_reset_actaddr();
+            metricsCount(METRIC_P300_OPENS);
             snprintf(string, sizeof(string), ">FRAMER: opened");
             logIT(LOG_INFO, string);
             return FRAMER_SUCCESS;
@@ -272,6 +277,38 @@ static int framer_open_p300(int fd)
     return FRAMER_ERROR;
 }
 
+// Repeats the sync on an open P300 session, re-opens it if the device has dropped back
+static int framer_keepalive_p300(int fd)
+{
+    char string[100];
+    char rbuf = 0;
+    char enable[] = P300_ENABLE;
+    unsigned long etime;
+    int rlen;
+
+    if (! my_send(fd, enable, sizeof(enable))) {
+        snprintf(string, sizeof(string), ">FRAMER: keepalive not send");
+        logIT(LOG_ERR, string);
+        return FRAMER_ERROR;
+    }
+
+    etime = 0;
+    rlen = receive_nb(fd, &rbuf, 1, &etime);
+    if (rlen <= 0) {
+        snprintf(string, sizeof(string), ">FRAMER: keepalive read failure for ack");
+        logIT(LOG_ERR, string);
+        return FRAMER_ERROR;
+    } else if (rbuf == P300_INIT_OK) {
+        snprintf(string, sizeof(string), ">FRAMER: keepalive ok");
+        logIT(LOG_INFO, string);
+        return FRAMER_SUCCESS;
+    }
+
+    snprintf(string, sizeof(string), ">FRAMER: keepalive unexpected data 0x%02X, re-sync", rbuf);
+    logIT(LOG_WARNING, string);
+    return framer_open_p300(fd);
+}
+
 // calculation check sum for P300, assuming buffer is frame and starts by P300_LEADIN
 static char framer_chksum(char *buf, int len)
 {
@@ -586,10 +623,20 @@ int framer_openDevice(char *device, char pid)
     return fd;
 }
 
+// Keeps an open link in sync, only P300 has a session to maintain
+int framer_keepalive(int fd)
+{
+    if (framer_pid == P300_LEADIN) {
+        return framer_keepalive_p300(fd);
+    }
+    return FRAMER_SUCCESS;
+}
+
 void framer_closeDevice(int fd)
 {
     if (framer_pid == P300_LEADIN) {
         framer_close_p300(fd);
+        metricsCount(METRIC_P300_CLOSES);
     }
 
     framer_pid = 0;
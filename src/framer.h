@@ -38,6 +38,7 @@ int framer_send(int fd, char *s_buf, int len);
 int framer_waitfor(int fd, char *w_buf, int w_len);
 int framer_receive(int fd, char *r_buf, int r_len, unsigned long *petime);
 int framer_openDevice(char *device, char pid);
+int framer_keepalive(int fd);
 void framer_closeDevice(int fd);
 
 #endif // FRAMER_H
@@ -0,0 +1,387 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Value history
+ *
+ * Every numeric value read for a command is appended to its series. The
+ * series are compressed like in Facebook's Gorilla paper: timestamps as
+ * delta of delta, values XORed with the previous one, storing only the
+ * meaningful bits. Slowly changing heating values mostly need one or two
+ * bits per timestamp and a handful per value.
+ *
+ * The points are kept in fixed size blocks. The number of blocks is given
+ * by the memory budget in <history>; when it is used up, the oldest block
+ * of all series is dropped. Only the event loop thread uses the history,
+ * so there is no locking.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "history.h"
+#include "common.h"
+
+// The largest point: 4 + 32 bits timestamp, 2 + 5 + 6 + 64 bits value
+#define HIST_POINT_BITS 113
+
+static histSeriesPtr series = NULL;
+static int blocks = 0;
+static int maxBlocks = 0;
+
+static void writeBits(histBlockPtr bPtr, uint64_t value, int count)
+{
+    while (count--) {
+        if ((value >> count) & 1) {
+            bPtr->data[bPtr->bits >> 3] |= 0x80 >> (bPtr->bits & 7);
+        }
+        bPtr->bits++;
+    }
+}
+
+static uint64_t readBits(histBlockPtr bPtr, int *pos, int count)
+{
+    uint64_t value = 0;
+
+    while (count--) {
+        value = (value << 1) | ((bPtr->data[*pos >> 3] >> (7 - (*pos & 7))) & 1);
+        (*pos)++;
+    }
+    return value;
+}
+
+static long readSigned(histBlockPtr bPtr, int *pos, int count)
+{
+    long value = (long)readBits(bPtr, pos, count);
+
+    if (value & (1L << (count - 1))) {
+        value -= 1L << count;
+    }
+    return value;
+}
+
+static histSeriesPtr getSeries(const char *name)
+{
+    histSeriesPtr sPtr;
+
+    for (sPtr = series; sPtr; sPtr = sPtr->next) {
+        if (strcmp(sPtr->name, name) == 0) {
+            return sPtr;
+        }
+    }
+    return NULL;
+}
+
+// Drops the block with the oldest data of all series
+static int dropOldest()
+{
+    histSeriesPtr sPtr;
+    histSeriesPtr oldest = NULL;
+    histBlockPtr bPtr;
+
+    for (sPtr = series; sPtr; sPtr = sPtr->next) {
+        if (sPtr->head && (! oldest || sPtr->head->first < oldest->head->first)) {
+            oldest = sPtr;
+        }
+    }
+    if (! oldest) {
+        return 0;
+    }
+    bPtr = oldest->head;
+    if (! (oldest->head = bPtr->next)) {
+        oldest->tail = NULL;
+    }
+    free(bPtr);
+    blocks--;
+    return 1;
+}
+
+void historyBudget(int kBytes)
+{
+    maxBlocks = (kBytes > 0) ? (int)((long)kBytes * 1024 / sizeof(HistBlock)) : 0;
+    while (blocks > maxBlocks && dropOldest()) {
+        ;
+    }
+    logIT(LOG_INFO, "History: %d blocks of %d", blocks, maxBlocks);
+}
+
+static histBlockPtr newBlock(histSeriesPtr sPtr, time_t t, double value)
+{
+    histBlockPtr bPtr;
+
+    while (blocks >= maxBlocks) {
+        if (! dropOldest()) {
+            return NULL;
+        }
+    }
+    if (! (bPtr = calloc(1, sizeof(HistBlock)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    bPtr->first = t;
+    bPtr->firstValue = value;
+    bPtr->count = 1;
+    bPtr->last = t;
+    memcpy(&bPtr->value, &value, sizeof(bPtr->value));
+    bPtr->leading = -1;
+    blocks++;
+
+    if (sPtr->tail) {
+        sPtr->tail->next = bPtr;
+    } else {
+        sPtr->head = bPtr;
+    }
+    sPtr->tail = bPtr;
+    return bPtr;
+}
+
+static void encodePoint(histBlockPtr bPtr, time_t t, double value)
+{
+    long delta = t - bPtr->last;
+    long dod = delta - bPtr->delta;
+    uint64_t bits;
+    uint64_t xor;
+    int leading;
+    int trailing;
+    int meaningful;
+
+    if (dod == 0) {
+        writeBits(bPtr, 0x0, 1);
+    } else if (dod >= -64 && dod <= 63) {
+        writeBits(bPtr, 0x2, 2);
+        writeBits(bPtr, dod, 7);
+    } else if (dod >= -256 && dod <= 255) {
+        writeBits(bPtr, 0x6, 3);
+        writeBits(bPtr, dod, 9);
+    } else if (dod >= -2048 && dod <= 2047) {
+        writeBits(bPtr, 0xe, 4);
+        writeBits(bPtr, dod, 12);
+    } else {
+        writeBits(bPtr, 0xf, 4);
+        writeBits(bPtr, dod, 32);
+    }
+
+    memcpy(&bits, &value, sizeof(bits));
+    if (! (xor = bits ^ bPtr->value)) {
+        writeBits(bPtr, 0x0, 1);
+    } else {
+        leading = __builtin_clzll(xor);
+        trailing = __builtin_ctzll(xor);
+        if (leading > 31) {
+            leading = 31;
+        }
+        if (bPtr->leading >= 0 && leading >= bPtr->leading && trailing >= bPtr->trailing) {
+            // Fits into the window of the previous value
+            writeBits(bPtr, 0x2, 2);
+            writeBits(bPtr, xor >> bPtr->trailing, 64 - bPtr->leading - bPtr->trailing);
+        } else {
+            meaningful = 64 - leading - trailing;
+            writeBits(bPtr, 0x3, 2);
+            writeBits(bPtr, leading, 5);
+            // 64 does not fit into 6 bits, it is stored as 0
+            writeBits(bPtr, meaningful & 0x3f, 6);
+            writeBits(bPtr, xor >> trailing, meaningful);
+            bPtr->leading = leading;
+            bPtr->trailing = trailing;
+        }
+    }
+
+    bPtr->last = t;
+    bPtr->delta = delta;
+    bPtr->value = bits;
+    bPtr->count++;
+}
+
+void historyAdd(const char *name, time_t t, double value)
+{
+    histSeriesPtr sPtr;
+    histBlockPtr bPtr;
+    long dod;
+
+    if (maxBlocks <= 0) {
+        return;
+    }
+    if (! (sPtr = getSeries(name))) {
+        if (! (sPtr = calloc(1, sizeof(HistSeries)))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        if (! (sPtr->name = strdup(name))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        sPtr->next = series;
+        series = sPtr;
+    }
+
+    if ((bPtr = sPtr->tail)) {
+        if (t <= bPtr->last) {
+            // One point per second, the clock must not go back
+            return;
+        }
+        dod = (t - bPtr->last) - bPtr->delta;
+        if (bPtr->bits + HIST_POINT_BITS <= HIST_BLOCK * 8
+                && dod >= -0x7fffffffL && dod <= 0x7fffffffL) {
+            encodePoint(bPtr, t, value);
+            return;
+        }
+    }
+    newBlock(sPtr, t, value);
+}
+
+struct aggregate {
+    time_t from;
+    int step;
+    int mode;
+    time_t bucket;
+    double value;
+    int count;
+    historyFn fn;
+    void *data;
+    int points;
+};
+
+static void aggregateFlush(struct aggregate *aPtr)
+{
+    if (aPtr->count) {
+        aPtr->fn(aPtr->bucket, aPtr->mode == HIST_AVG ? aPtr->value / aPtr->count : aPtr->value,
+                 aPtr->data);
+        aPtr->points++;
+        aPtr->count = 0;
+    }
+}
+
+static void aggregatePoint(struct aggregate *aPtr, time_t t, double value)
+{
+    time_t bucket;
+
+    if (aPtr->step <= 0) {
+        aPtr->fn(t, value, aPtr->data);
+        aPtr->points++;
+        return;
+    }
+    bucket = aPtr->from + (t - aPtr->from) / aPtr->step * aPtr->step;
+    if (aPtr->count && bucket != aPtr->bucket) {
+        aggregateFlush(aPtr);
+    }
+    if (! aPtr->count) {
+        aPtr->bucket = bucket;
+        aPtr->value = value;
+    } else if (aPtr->mode == HIST_MIN) {
+        aPtr->value = (value < aPtr->value) ? value : aPtr->value;
+    } else if (aPtr->mode == HIST_MAX) {
+        aPtr->value = (value > aPtr->value) ? value : aPtr->value;
+    } else {
+        aPtr->value += value;
+    }
+    aPtr->count++;
+}
+
+static void decodeBlock(histBlockPtr bPtr, time_t to, struct aggregate *aPtr)
+{
+    time_t t = bPtr->first;
+    long delta = 0;
+    uint64_t bits;
+    double value = bPtr->firstValue;
+    int leading = 0;
+    int trailing = 0;
+    int meaningful;
+    int pos = 0;
+    int n;
+
+    memcpy(&bits, &value, sizeof(bits));
+    for (n = 0; n < bPtr->count; n++) {
+        if (n) {
+            if (! readBits(bPtr, &pos, 1)) {
+                ;
+            } else if (! readBits(bPtr, &pos, 1)) {
+                delta += readSigned(bPtr, &pos, 7);
+            } else if (! readBits(bPtr, &pos, 1)) {
+                delta += readSigned(bPtr, &pos, 9);
+            } else if (! readBits(bPtr, &pos, 1)) {
+                delta += readSigned(bPtr, &pos, 12);
+            } else {
+                delta += readSigned(bPtr, &pos, 32);
+            }
+            t += delta;
+
+            if (readBits(bPtr, &pos, 1)) {
+                if (readBits(bPtr, &pos, 1)) {
+                    leading = readBits(bPtr, &pos, 5);
+                    if (! (meaningful = readBits(bPtr, &pos, 6))) {
+                        meaningful = 64;
+                    }
+                    trailing = 64 - leading - meaningful;
+                }
+                bits ^= readBits(bPtr, &pos, 64 - leading - trailing) << trailing;
+                memcpy(&value, &bits, sizeof(value));
+            }
+        }
+        if (t > to) {
+            return;
+        }
+        if (t >= aPtr->from) {
+            aggregatePoint(aPtr, t, value);
+        }
+    }
+}
+
+/* Hands the points of a series between from and to to fn, if step is given
+ * aggregated into buckets of step seconds starting at from. Returns the
+ * number of points, -1 if nothing has been recorded for the command.
+ */
+int historyQuery(const char *name, time_t from, time_t to, int step, int mode,
+                 historyFn fn, void *data)
+{
+    histSeriesPtr sPtr;
+    histBlockPtr bPtr;
+    struct aggregate agg;
+
+    if (! (sPtr = getSeries(name))) {
+        return -1;
+    }
+    memset(&agg, 0, sizeof(agg));
+    agg.from = from;
+    agg.step = step;
+    agg.mode = mode;
+    agg.fn = fn;
+    agg.data = data;
+
+    for (bPtr = sPtr->head; bPtr && bPtr->first <= to; bPtr = bPtr->next) {
+        if (bPtr->last >= from) {
+            decodeBlock(bPtr, to, &agg);
+        }
+    }
+    aggregateFlush(&agg);
+
+    return agg.points;
+}
+
+// Returns HIST_AVG, HIST_MIN or HIST_MAX, -1 if mode is none of them
+int historyMode(const char *mode)
+{
+    if (strcmp(mode, "avg") == 0) {
+        return HIST_AVG;
+    }
+    if (strcmp(mode, "min") == 0) {
+        return HIST_MIN;
+    }
+    if (strcmp(mode, "max") == 0) {
+        return HIST_MAX;
+    }
+    return -1;
+}
@@ -0,0 +1,66 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Compressed in-memory history of the values read per command
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Compressed bytes per block, a block is dropped as a whole
+#define HIST_BLOCK 240
+
+// Aggregation of historyQuery()
+#define HIST_AVG 0
+#define HIST_MIN 1
+#define HIST_MAX 2
+
+typedef struct histBlock *histBlockPtr;
+typedef struct histSeries *histSeriesPtr;
+
+typedef struct histBlock {
+    time_t first;
+    double firstValue;
+    int count;
+    int bits;
+    // Encoder state after the last point
+    time_t last;
+    long delta;
+    uint64_t value;
+    int leading;
+    int trailing;
+    unsigned char data[HIST_BLOCK];
+    histBlockPtr next;
+} HistBlock;
+
+typedef struct histSeries {
+    char *name;
+    histBlockPtr head;
+    histBlockPtr tail;
+    histSeriesPtr next;
+} HistSeries;
+
+typedef void (*historyFn)(time_t t, double value, void *data);
+
+void historyBudget(int kBytes);
+void historyAdd(const char *name, time_t t, double value);
+int historyQuery(const char *name, time_t from, time_t to, int step, int mode,
+                 historyFn fn, void *data);
+int historyMode(const char *mode);
+
+#endif // HISTORY_H
@@ -19,21 +19,23 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
-#include <signal.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <termios.h>
 #include <string.h>
 #include <time.h>
-#include <setjmp.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/times.h>
 #include <fcntl.h>
-#include <sys/time.h>
+#include <sys/poll.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "io.h"
+#include "trace.h"
 #include "socket.h"
 #include "common.h"
 
@@ -42,11 +44,181 @@
 #define NCC NCCS
 #endif
 
-static void sig_alrm(int);
-static jmp_buf    env_alrm;
+/* Device links
+ *
+ * The fd of a link stays nonblocking as long as it is open and is read
+ * through a read-ahead buffer: a read takes whatever the driver has, up
+ * to the size of the buffer, and the following receives are served from
+ * it. Each operation gets a deadline on the monotonic clock and waits
+ * for the fd with poll() until then, no signals are involved.
+ *
+ * Input is only thrown away where nothing can belong to a request any
+ * more: when the link is opened, before the next send after a receive
+ * failed, since a late answer may still come in, after the sync bytes of
+ * waitfor() and where the framer resynchronizes (flushInput()).
+ */
+
+#define IO_BUFSIZE 512
+
+// Results of fillLink() besides the number of bytes read
+#define IO_TIMEOUT 0
+#define IO_ERROR  -1
+#define IO_EOF    -2
+
+typedef struct ioLink *ioLinkPtr;
+
+typedef struct ioLink {
+    int fd;
+    short tty;
+    // A receive failed, what is pending now belongs to no request
+    short stale;
+    // The last read filled the buffer, the driver may hold more
+    short more;
+    // Settings of the tty, VMIN changes in frame mode
+    struct termios tio;
+    int head;
+    int len;
+    char buf[IO_BUFSIZE];
+    ioLinkPtr next;
+} IoLink;
+
+static ioLinkPtr links = NULL;
+static pthread_mutex_t linksLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Line parameters for the next opentty(), see setSerial()
+static int serialBaud = 4800;
+static char serialParity = 'E';
+static int serialStopBits = 2;
+static int serialLowLatency = 0;
+static int serialFrameMode = 0;
+
+// Receive timeout of this thread in ms, 0 for TIMEOUT, see ioTimeout()
+static __thread int recvTimeout = 0;
+
+static const struct {
+    int baud;
+    speed_t speed;
+} speeds[] = {
+    { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+    { 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 }, { 115200, B115200 }
+};
+
+static int setnonblock(int fd)
+{
+    int flags;
+
+    // If they have O_NONBLOCK, use the Posix way to do it
+#if defined(O_NONBLOCK)
+    if (-1 == (flags = fcntl(fd, F_GETFL, 0))) {
+        flags = 0;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+#else
+    // Otherwise, use the old way of doing it
+    flags = 1;
+    return ioctl(fd, FIONBIO, &flags);
+#endif
+}
+
+// The link of fd, set up the first time the fd is used
+static ioLinkPtr getLink(int fd)
+{
+    ioLinkPtr lPtr;
+
+    pthread_mutex_lock(&linksLock);
+    for (lPtr = links; lPtr && lPtr->fd != fd; lPtr = lPtr->next) {
+        ;
+    }
+    if (! lPtr) {
+        if (! (lPtr = calloc(1, sizeof(IoLink)))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        lPtr->fd = fd;
+        lPtr->tty = isatty(fd);
+        if (lPtr->tty) {
+            tcgetattr(fd, &lPtr->tio);
+        }
+        setnonblock(fd);
+        lPtr->next = links;
+        links = lPtr;
+    }
+    pthread_mutex_unlock(&linksLock);
+
+    return lPtr;
+}
+
+static void dropLink(int fd)
+{
+    ioLinkPtr *pPtr;
+    ioLinkPtr lPtr;
+
+    pthread_mutex_lock(&linksLock);
+    for (pPtr = &links; *pPtr; pPtr = &(*pPtr)->next) {
+        if ((*pPtr)->fd == fd) {
+            lPtr = *pPtr;
+            *pPtr = lPtr->next;
+            free(lPtr);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&linksLock);
+}
+
+// Throws away the buffered input and whatever the driver holds
+static void discardLink(ioLinkPtr lPtr)
+{
+    char buf[IO_BUFSIZE];
+    ssize_t n;
+    int count = lPtr->len;
+
+    lPtr->head = lPtr->len = 0;
+    lPtr->stale = 0;
+    lPtr->more = 0;
+    if (lPtr->tty) {
+        tcflush(lPtr->fd, TCIFLUSH);
+    }
+    // A socket has no flush, it is read empty
+    while ((n = read(lPtr->fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR)) {
+        count += (n > 0) ? n : 0;
+    }
+    if (count) {
+        logIT(LOG_INFO, "Discarded %d bytes of input", count);
+    }
+}
+
+void flushInput(int fd)
+{
+    discardLink(getLink(fd));
+}
+
+/* Sets the line parameters of the ttys opened from now on: parity is
+ * 'N', 'E' or 'O'. lowLatency asks the driver not to hold back received
+ * bytes, frameMode lets the tty wake the reader only when the whole
+ * frame is there instead of on every byte.
+ */
+void setSerial(int baud, char parity, int stopBits, int lowLatency, int frameMode)
+{
+    serialBaud = baud;
+    serialParity = parity;
+    serialStopBits = stopBits;
+    serialLowLatency = lowLatency;
+    serialFrameMode = frameMode;
+}
+
+// The receives of this thread wait at most ms for their bytes, 0 restores
+// TIMEOUT. Returns the timeout set before.
+int ioTimeout(int ms)
+{
+    int prev = recvTimeout;
+
+    recvTimeout = ms;
+    return prev;
+}
 
 void closeDevice(int fd)
 {
+    dropLink(fd);
     close(fd);
 }
 
@@ -74,18 +246,42 @@ int openDevice(char *device)
         // Here goes some error stuff
         return -1;
     }
+    // Nothing that came in before belongs to us
+    discardLink(getLink(fd));
 
     return fd;
 }
 
+static void setLowLatency(int fd, char *device)
+{
+#if defined(TIOCSSERIAL) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serial;
+
+    if (ioctl(fd, TIOCGSERIAL, &serial) < 0) {
+        logIT(LOG_WARNING, "Low latency mode not supported by %s:%m", device);
+        return;
+    }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    if (ioctl(fd, TIOCSSERIAL, &serial) < 0) {
+        logIT(LOG_WARNING, "Could not set low latency mode on %s:%m", device);
+    }
+#else
+    logIT(LOG_WARNING, "Low latency mode not supported on this system");
+#endif
+}
+
+// Returns the fd of the configured tty or -1
 int opentty(char *device)
 {
     int fd;
+    size_t n;
+    speed_t speed = B4800;
+    tcflag_t cflag = CLOCAL | CS8 | CREAD;
 
     logIT(LOG_LOCAL0, "Configuring serial interface %s", device);
     if ((fd = open(device, O_RDWR)) < 0) {
         logIT(LOG_ERR, "cannot open %s:%m", device);
-        exit(1);
+        return -1;
     }
 
     int s;
@@ -93,7 +289,8 @@ int opentty(char *device)
     s = tcgetattr(fd, &oldsb);
     if (s < 0) {
         logIT(LOG_ERR, "error tcgetattr %s:%m", device);
-        exit(1);
+        close(fd);
+        return -1;
     }
 
     newsb = oldsb;
@@ -107,225 +304,294 @@ int opentty(char *device)
     memset(&newsb, 0, sizeof(newsb));
 #endif
 
+    for (n = 0; n < sizeof(speeds) / sizeof(speeds[0]) && speeds[n].baud != serialBaud; n++) {
+        ;
+    }
+    if (n < sizeof(speeds) / sizeof(speeds[0])) {
+        speed = speeds[n].speed;
+    } else {
+        logIT(LOG_WARNING, "Unsupported baud rate %d, using 4800", serialBaud);
+    }
+    if (serialParity == 'E') {
+        cflag |= PARENB;
+    } else if (serialParity == 'O') {
+        cflag |= PARENB | PARODD;
+    }
+    if (serialStopBits == 2) {
+        cflag |= CSTOPB;
+    }
+
     newsb.c_iflag     = IGNBRK | IGNPAR;
     newsb.c_oflag     = 0;
     newsb.c_lflag     = 0; // removed ISIG for susp=control-z problem;
-    newsb.c_cflag     = (CLOCAL | B4800 | CS8 | CREAD | PARENB | CSTOPB);
+    newsb.c_cflag     = cflag;
     newsb.c_cc[VMIN]  = 1;
     newsb.c_cc[VTIME] = 0;
+    cfsetispeed(&newsb, speed);
+    cfsetospeed(&newsb, speed);
 
     tcsetattr(fd, TCSADRAIN, &newsb);
+    if (serialLowLatency) {
+        setLowLatency(fd, device);
+    }
 
     // DTR High for voltage supply
     int modemctl = 0;
     ioctl(fd, TIOCMGET, &modemctl);
     modemctl |= TIOCM_DTR;
     s = ioctl(fd, TIOCMSET, &modemctl);
-    if (s < 0) {
+    if (s < 0 && (errno == ENOTTY || errno == EINVAL)) {
+        // A pseudo terminal has no modem lines
+        logIT(LOG_WARNING, "No modem lines on %s, DTR not set", device);
+    } else if (s < 0) {
         logIT(LOG_ERR, "error ioctl TIOCMSET %s:%m", device);
-        exit(1);
+        close(fd);
+        return -1;
     }
 
     return fd;
 }
 
-int my_send(int fd, char *s_buf, int len)
+// Milliseconds on the monotonic clock since start
+static double msSince(struct timespec *start)
 {
-    int i;
-    int wr;
-    // Empty buffer
-    tcflush(fd, TCIOFLUSH);
-    // We use the socket fixed variant from socket.c
-    wr = writen(fd, s_buf, len);
-    for (i = 0; i < len; i++) {
-        unsigned char byte = s_buf[i] & 255;
-        logIT(LOG_INFO, ">SENT: %02X", (int)byte);
-    }
+    struct timespec now;
 
-    if (wr == len) {
-        return wr;
-    } else {
-        logIT(LOG_ERR, ">ERROR: sent %d of %d bytes", wr, len);
-        return 0;
-    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
 }
 
-int receive(int fd, char *r_buf, int r_len, unsigned long *etime)
+static void deadlineIn(struct timespec *deadline, int seconds)
 {
-    int i;
-    struct tms tms_t;
-    clock_t start, end, mid, mid1;
-    unsigned long clktck;
-
-    clktck = sysconf(_SC_CLK_TCK);
-    start = times(&tms_t);
-    mid1 = start;
-    for (i = 0; i < r_len; i++) {
-        if (signal(SIGALRM, sig_alrm) == SIG_ERR) {
-            logIT1(LOG_ERR, "SIGALRM error");
-        }
-        if (setjmp(env_alrm) != 0) {
-            logIT1(LOG_ERR, "read timeout");
-            return -1;
-        }
-        alarm(TIMEOUT);
-        // We use the socket fixed variant from socket.c
-        if (readn(fd, &r_buf[i], 1) <= 0) {
-            logIT1(LOG_ERR, "error read tty");;
-            alarm(0);
-            return -1;
-        }
-
-        alarm(0);
-        unsigned char byte = r_buf[i] & 255;
-        mid = times(&tms_t);
-        logIT(LOG_INFO, "<RECV: %02X (%0.1f ms)", byte, ((float)(mid - mid1) / clktck) * 1000);
-        mid1 = mid;
-    }
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += seconds;
+}
 
-    end = times(&tms_t);
-    *etime = ((float)(end - start) / clktck) * 1000;
+// Milliseconds left until the deadline, rounded up, 0 if it has passed
+static int msLeft(struct timespec *deadline)
+{
+    struct timespec now;
+    long ms;
 
-    return i;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+    return (ms > 0) ? ms : 0;
 }
 
-static int setnonblock(int fd)
+// Waits until fd is ready for events or the deadline has passed
+static int waitLink(int fd, short events, struct timespec *deadline)
 {
-    int flags;
+    struct pollfd pfd;
+    int ret;
 
-    // If they have O_NONBLOCK, use the Posix way to do it
-#if defined(O_NONBLOCK)
-    if (-1 == (flags = fcntl(fd, F_GETFL, 0))) {
-        flags = 0;
+    pfd.fd = fd;
+    pfd.events = events;
+    while ((ret = poll(&pfd, 1, msLeft(deadline))) < 0 && errno == EINTR) {
+        ;
     }
-    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-#else
-    // Otherwise, use the old way of doing it
-    flags = 1;
-    return ioctl(fd, FIOBIO, &flags);
-#endif
+    return ret;
 }
 
-static int setblock(int fd)
+/* In frame mode the tty wakes poll() only once want bytes are there. The
+ * tty is only set when VMIN changes, i.e. when the size of the awaited
+ * frame does.
+ */
+static void frameLink(ioLinkPtr lPtr, int want)
 {
-    int flags;
+    cc_t vmin = lPtr->tio.c_cc[VMIN];
 
-    // If they have O_BLOCK, use the Posix way to do it
-#if defined(O_NONBLOCK)
-    if (-1 == (flags = fcntl(fd, F_GETFL, 0))) {
-        flags = 0;
+    want = (want > 255) ? 255 : (want < 1) ? 1 : want;
+    if (want == vmin) {
+        return;
+    }
+    lPtr->tio.c_cc[VMIN] = want;
+    lPtr->tio.c_cc[VTIME] = 0;
+    if (tcsetattr(lPtr->fd, TCSANOW, &lPtr->tio) < 0) {
+        lPtr->tio.c_cc[VMIN] = vmin;
     }
-    return fcntl(fd, F_SETFL, flags & (~O_NONBLOCK));
-#else
-    // Otherwise, use the old way of doing it
-    flags = 0;
-    return ioctl(fd, FIOBIO, &flags);
-#endif
 }
 
-static char *dump( char *dest, char *title, char *buf, int len)
+// Reads what the driver has into the buffer, waits for want bytes until the
+// deadline. Returns the number of bytes read, IO_TIMEOUT, IO_ERROR or IO_EOF.
+static int fillLink(ioLinkPtr lPtr, int want, struct timespec *deadline)
 {
-    int pos = 0;
+    ssize_t n;
+    int space;
+    int ret;
+
+    if (! lPtr->len) {
+        lPtr->head = 0;
+    } else if (lPtr->head + lPtr->len == IO_BUFSIZE) {
+        memmove(lPtr->buf, lPtr->buf + lPtr->head, lPtr->len);
+        lPtr->head = 0;
+    }
+    space = IO_BUFSIZE - lPtr->head - lPtr->len;
+    while (1) {
+        // After a short read the driver is empty, reading again before
+        // poll() would only cost a call on a slow line
+        if (! lPtr->more) {
+            if (lPtr->tty && serialFrameMode) {
+                frameLink(lPtr, want);
+            }
+            if ((ret = waitLink(lPtr->fd, POLLIN, deadline)) == 0) {
+                return IO_TIMEOUT;
+            } else if (ret < 0) {
+                return IO_ERROR;
+            }
+        }
+        n = read(lPtr->fd, lPtr->buf + lPtr->head + lPtr->len, space);
+        if (n > 0) {
+            lPtr->more = (n == space);
+            lPtr->len += n;
+            return n;
+        } else if (n == 0) {
+            return IO_EOF;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return IO_ERROR;
+        }
+        lPtr->more = 0;
+    }
+}
+
+// Writes title and the bytes in hex to dest, cut off at size
+static char *dump( char *dest, size_t size, char *title, char *buf, int len)
+{
+    size_t pos = 0;
     int i;
 
-    pos = sprintf(dest, "%s", title);
-    for ( i = 0; i < len; i++) {
-        pos += sprintf(dest + pos, " %02X",  buf[i] & 0xff);
+    // Nobody reads it, logIT() drops the empty message right away
+    if (! logWanted(LOG_INFO)) {
+        *dest = '\0';
+        return dest;
+    }
+    pos = snprintf(dest, size, "%s", title);
+    for ( i = 0; i < len && pos < size; i++) {
+        pos += snprintf(dest + pos, size - pos, " %02X",  buf[i] & 0xff);
     }
 
     return dest;
 }
 
-int receive_nb(int fd, char *r_buf, int r_len, unsigned long *etime)
+int my_send(int fd, char *s_buf, int len)
 {
+    ioLinkPtr lPtr = getLink(fd);
+    struct timespec deadline;
+    ssize_t n;
     int i;
-    ssize_t len;
-    char string[100];
+    int wr = 0;
 
-    fd_set rfds;
-    struct timeval tv;
-    int retval;
+    if (lPtr->stale) {
+        // The answer of the failed request may still have come in
+        discardLink(lPtr);
+    }
+    deadlineIn(&deadline, TIMEOUT);
+    // In one write, unless the driver cannot take it all at once
+    while (wr < len) {
+        if ((n = write(fd, s_buf + wr, len - wr)) > 0) {
+            wr += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            break;
+        } else if (! msLeft(&deadline) || waitLink(fd, POLLOUT, &deadline) <= 0) {
+            // Nothing taken, not even after waiting until the deadline
+            break;
+        }
+    }
+    traceFrame(TRACE_SEND, s_buf, len, wr);
+    for (i = 0; i < len && logWanted(LOG_INFO); i++) {
+        unsigned char byte = s_buf[i] & 255;
+        logIT(LOG_INFO, ">SENT: %02X", (int)byte);
+    }
 
-    struct tms tms_t;
-    clock_t start, end, mid, mid1;
-    unsigned long clktck;
-    clktck = sysconf(_SC_CLK_TCK);
-    start = times(&tms_t);
-    mid1 = start;
+    if (wr == len) {
+        return wr;
+    } else {
+        logIT(LOG_ERR, ">ERROR: sent %d of %d bytes", wr, len);
+        return 0;
+    }
+}
 
-    i = 0;
-    while ( i < r_len ) {
-        setnonblock(fd);
-        FD_ZERO(&rfds);
-        FD_SET(fd, &rfds);
-        tv.tv_sec = TIMEOUT;
-        tv.tv_usec = 0;
-        retval = select(fd + 1, &rfds, NULL, NULL, &tv);
-        if (retval == 0) {
-            logIT(LOG_ERR, "<RECV: read timeout");
-            setblock(fd);
-            logIT(LOG_INFO, dump(string, "<RECV: received", r_buf, i));
-            return -1;
-        } else if (retval < 0) {
-            if (errno == EINTR) {
-                logIT(LOG_INFO, "<RECV: select interrupted - redo");
-                continue;
-            } else {
-                logIT(LOG_ERR, "<RECV: select error %d", retval);
-                setblock(fd);
-                logIT(LOG_INFO, dump(string, "<RECV: received", r_buf, i));
-                return -1;
-            }
-        } else if ( FD_ISSET(fd, &rfds)) {
-            len = read(fd, &r_buf[i], r_len - i);
-            if (len == 0) {
-                logIT(LOG_ERR, "<RECV: read eof");
-                setblock(fd);
-                logIT(LOG_INFO, dump(string, "<RECV: received", r_buf, i));
-                return -1;
-            } else if (len < 0) {
-                if (errno == EINTR) {
-                    logIT(LOG_INFO, "<RECV: read interrupted - redo");
-                    continue;
-                } else {
-                    logIT(LOG_ERR, "<RECV: read error %d", errno);
-                    setblock(fd);
-                    logIT(LOG_INFO, dump(string, "<RECV: received", r_buf, i));
-                    return -1;
-                }
-            } else {
-                unsigned char byte = r_buf[i] & 255;
-                mid = times(&tms_t);
-                logIT(LOG_INFO, "<RECV: len=%zd %02X (%0.1f ms)", len, byte, ((float)(mid - mid1) / clktck) * 1000);
-                mid1 = mid;
-                i += len;
-            }
+/* Reads r_len bytes, waiting at most TIMEOUT seconds or the timeout of
+ * ioTimeout() for all of them. Returns r_len or -1, etime is set to the
+ * ms it took.
+ */
+int receive_nb(int fd, char *r_buf, int r_len, unsigned long *etime)
+{
+    ioLinkPtr lPtr = getLink(fd);
+    struct timespec start;
+    struct timespec deadline;
+    // Room for the dump of a merged read of the planner
+    char string[16 + 3 * MAXBUF];
+    int ret = 0;
+    int i = 0;
+    int n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    if (recvTimeout > 0) {
+        deadline.tv_sec += recvTimeout / 1000;
+        deadline.tv_nsec += (recvTimeout % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    } else {
+        deadline.tv_sec += TIMEOUT;
+    }
+
+    while (i < r_len) {
+        if (! lPtr->len && (ret = fillLink(lPtr, r_len - i, &deadline)) <= 0) {
+            break;
+        }
+        if (ret > 0) {
+            logIT(LOG_INFO, "<RECV: len=%d %02X (%0.1f ms)", ret,
+                  lPtr->buf[lPtr->head] & 255, msSince(&start));
+            ret = 0;
+        }
+        n = (lPtr->len < r_len - i) ? lPtr->len : r_len - i;
+        memcpy(r_buf + i, lPtr->buf + lPtr->head, n);
+        lPtr->head += n;
+        lPtr->len -= n;
+        i += n;
+    }
+
+    if (i < r_len) {
+        if (ret == IO_TIMEOUT) {
+            logIT1(LOG_ERR, "<RECV: read timeout");
+        } else if (ret == IO_EOF) {
+            logIT1(LOG_ERR, "<RECV: read eof");
         } else {
-            continue;
+            logIT(LOG_ERR, "<RECV: read error %d", errno);
         }
+        lPtr->stale = 1;
+        traceFrame(TRACE_RECV, r_buf, i, (ret == IO_TIMEOUT) ? TRACE_TIMEOUT : TRACE_ERROR);
+        logIT(LOG_INFO, dump(string, sizeof(string), "<RECV: received", r_buf, i));
+        return -1;
     }
 
-    end = times(&tms_t);
-    *etime = ((float)(end - start) / clktck) * 1000;
-    setblock(fd);
-    logIT(LOG_INFO, dump(string, "<RECV: received", r_buf, i));
+    *etime = msSince(&start);
+    traceFrame(TRACE_RECV, r_buf, i, i);
+    logIT(LOG_INFO, dump(string, sizeof(string), "<RECV: received", r_buf, i));
 
     return i;
 }
 
-static void sig_alrm(int signo)
+// The same as receive_nb(), both read through the buffer of the link
+int receive(int fd, char *r_buf, int r_len, unsigned long *etime)
 {
-    longjmp(env_alrm, 1);
+    return receive_nb(fd, r_buf, r_len, etime);
 }
 
 int waitfor(int fd, char *w_buf, int w_len)
 {
+    ioLinkPtr lPtr = getLink(fd);
+    struct timespec deadline;
     int i;
-    time_t start;
-    char r_buf[MAXBUF];
     char hexString[128] = "\0";
     char dummy[3];
-    unsigned long etime;
+    char byte;
+    int ret;
 
     for (i = 0; i < w_len; i++) {
         sprintf(dummy, "%02X", w_buf[i]);
@@ -333,34 +599,37 @@ int waitfor(int fd, char *w_buf, int w_len)
     }
 
     logIT(LOG_INFO, "Waiting for %s", hexString);
-    start = time(NULL);
+    deadlineIn(&deadline, TIMEOUT);
 
     // We wait for the first character, then everything has to apply
-    do {
-        etime = 0;
-        if (receive(fd, r_buf, 1, &etime) < 0) {
-            return 0;
-        }
-        if (time(NULL) - start > TIMEOUT) {
-            logIT1(LOG_WARNING, "Timeout wait");
-            return 0;
-        }
-    } while (r_buf[0] != w_buf[0]);
-
-    for (i = 1; i < w_len; i++) {
-        etime = 0;
-        if (receive(fd, r_buf, 1, &etime) < 0) {
-            return 0;
-        }
-        if (time(NULL) - start > TIMEOUT) {
-            logIT1(LOG_WARNING, "Timeout wait");
+    i = 0;
+    while (i < w_len) {
+        if (! lPtr->len && (ret = fillLink(lPtr, w_len - i, &deadline)) <= 0) {
+            if (ret == IO_TIMEOUT) {
+                logIT1(LOG_WARNING, "Timeout wait");
+            } else {
+                logIT1(LOG_ERR, "error read tty");
+            }
+            lPtr->stale = 1;
             return 0;
         }
-        if ( r_buf[0] != w_buf[i]) {
+        byte = lPtr->buf[lPtr->head++];
+        lPtr->len--;
+        traceFrame(TRACE_RECV, &byte, 1, 1);
+        if (byte == w_buf[i]) {
+            i++;
+        } else if (i) {
+            // The request fails, the next send starts on an empty link
             logIT1(LOG_ERR, "Lost synchronization");
-            exit(1);
+            lPtr->stale = 1;
+            return 0;
         }
     }
+    // What came with the sync is no answer, it is thrown away like the
+    // rest of the input before a send always was
+    if (lPtr->len) {
+        discardLink(lPtr);
+    }
 
     // logIT1(LOG_INFO,"Recognized string");
     return 1;
@@ -21,6 +21,9 @@ int my_send(int fd, char *s_buf, int len);
 int receive(int fd, char *r_buf, int r_len, unsigned long *etime);
 int receive_nb(int fd, char *r_buf, int r_len, unsigned long *etime);
 int waitfor(int fd, char *w_buf, int w_len);
+void flushInput(int fd);
+void setSerial(int baud, char parity, int stopBits, int lowLatency, int frameMode);
+int ioTimeout(int ms);
 int opentty(char *device);
 int openDevice(char *device);
 void closeDevice(int fd);
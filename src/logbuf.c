@@ -0,0 +1,678 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Asynchronous log buffer
+ *
+ * Formatting a message, stamping it and writing it with a flush of its own
+ * took longer than the request it was logged for, on an SD card even more
+ * so. logIT() now hands messages to logBufPut(), which copies the format
+ * and its arguments as they are, binary, into a slot of a ring and
+ * returns. A writer thread formats the entries and writes them in batches.
+ *
+ * The ring is a bounded queue of fixed slots, each with a sequence number
+ * telling whether it is free or filled in the current lap. Producers claim
+ * a slot by a compare and swap on the enqueue position and never wait: if
+ * the ring is full, the message is dropped and counted, the writer logs
+ * the count once it catches up. Producers only wake the writer through a
+ * pipe when it sleeps, which is safe in a signal handler as well.
+ *
+ * A forked child starts with an empty ring and starts a writer of its own
+ * with its first message, the parent writes what it queued before.
+ * logBufFlush() waits until everything queued has been written, it runs
+ * at exit.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/poll.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "logbuf.h"
+#include "common.h"
+
+// How long logBufFlush() waits for the writer, in ms
+#define LOG_FLUSH_MS 2000
+
+typedef struct logSlot {
+    unsigned long seq;
+    int class;
+    // errno at the call, for %m
+    int err;
+    time_t t;
+    // data holds the formatted message instead of format and arguments
+    int text;
+    char data[LOG_DATA];
+} LogSlot;
+
+static LogSlot ring[LOG_SLOTS];
+static unsigned long enqueuePos = 0;
+static unsigned long dequeuePos = 0;
+// Everything before has been written
+static unsigned long writtenPos = 0;
+static unsigned long dropped = 0;
+static int sleeping = 0;
+static int flushing = 0;
+static int running = 0;
+static int started = 0;
+static int wakeFD[2] = { -1, -1 };
+// Dropped messages the writer has logged
+static unsigned long reported = 0;
+
+// Argument types of a conversion
+enum { ARG_NONE, ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE, ARG_INTMAX, ARG_PTRDIFF,
+       ARG_DOUBLE, ARG_LDOUBLE, ARG_STRING, ARG_POINTER, ARG_ERRNO, ARG_BAD
+     };
+
+/* Parses the conversion following a '%' in format. Returns its length,
+ * the type of its argument, the number of '*' taking an int and the
+ * precision given as digits, -1 if none or -2 if it is a '*'.
+ */
+static int parseSpec(const char *format, int *type, int *stars, int *prec)
+{
+    const char *ptr = format;
+    char mod = 0;
+
+    *stars = 0;
+    *prec = -1;
+    while (*ptr && strchr("-+ #0'", *ptr)) {
+        ptr++;
+    }
+    if (*ptr == '*') {
+        (*stars)++;
+        ptr++;
+    } else {
+        while (isdigit((unsigned char)*ptr)) {
+            ptr++;
+        }
+    }
+    if (*ptr == '.') {
+        ptr++;
+        if (*ptr == '*') {
+            (*stars)++;
+            *prec = -2;
+            ptr++;
+        } else {
+            *prec = atoi(ptr);
+            while (isdigit((unsigned char)*ptr)) {
+                ptr++;
+            }
+        }
+    }
+    if (*ptr == 'h') {
+        mod = *ptr++;
+        if (*ptr == 'h') {
+            ptr++;
+        }
+    } else if (*ptr == 'l') {
+        mod = *ptr++;
+        if (*ptr == 'l') {
+            mod = 'q';
+            ptr++;
+        }
+    } else if (*ptr && strchr("qLzjt", *ptr)) {
+        mod = *ptr++;
+    }
+
+    switch (*ptr) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        *type = (mod == 'l') ? ARG_LONG : (mod == 'q' || mod == 'L') ? ARG_LLONG
+                : (mod == 'z') ? ARG_SIZE : (mod == 'j') ? ARG_INTMAX
+                : (mod == 't') ? ARG_PTRDIFF : ARG_INT;
+        break;
+    case 'c':
+        *type = mod ? ARG_BAD : ARG_INT;
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        *type = (mod == 'L') ? ARG_LDOUBLE : ARG_DOUBLE;
+        break;
+    case 's':
+        *type = mod ? ARG_BAD : ARG_STRING;
+        break;
+    case 'p':
+        *type = ARG_POINTER;
+        break;
+    case 'm':
+        *type = ARG_ERRNO;
+        break;
+    case '%':
+        *type = ARG_NONE;
+        break;
+    default:
+        // %n, positional arguments and what else we don't know
+        *type = ARG_BAD;
+        return ptr - format;
+    }
+    return ptr - format + 1;
+}
+
+static int packBytes(char **dest, char *end, const void *src, size_t len)
+{
+    if (*dest + len > end) {
+        return 0;
+    }
+    memcpy(*dest, src, len);
+    *dest += len;
+    return 1;
+}
+
+/* Copies format and its arguments to buf: the format with its 0, then the
+ * arguments as they are, strings with their 0. Returns 0 if they don't fit
+ * or format has a conversion we can't copy.
+ */
+static int packArgs(char *buf, size_t size, const char *format, va_list args)
+{
+    char *dest = buf;
+    char *end = buf + size;
+    const char *ptr;
+    int type, stars, prec, star;
+    int i;
+    union {
+        int i;
+        long l;
+        long long ll;
+        size_t z;
+        intmax_t j;
+        ptrdiff_t t;
+        double d;
+        long double ld;
+        void *p;
+    } arg;
+    char *str;
+    size_t len;
+
+    if (! packBytes(&dest, end, format, strlen(format) + 1)) {
+        return 0;
+    }
+    for (ptr = format; *ptr; ptr++) {
+        if (*ptr != '%') {
+            continue;
+        }
+        ptr += parseSpec(ptr + 1, &type, &stars, &prec);
+        if (type == ARG_BAD) {
+            return 0;
+        }
+        for (i = 0; i < stars; i++) {
+            star = va_arg(args, int);
+            if (! packBytes(&dest, end, &star, sizeof(star))) {
+                return 0;
+            }
+        }
+        if (prec == -2) {
+            // The last '*' is the precision
+            prec = star;
+        }
+        switch (type) {
+        case ARG_INT:
+            arg.i = va_arg(args, int);
+            len = sizeof(arg.i);
+            break;
+        case ARG_LONG:
+            arg.l = va_arg(args, long);
+            len = sizeof(arg.l);
+            break;
+        case ARG_LLONG:
+            arg.ll = va_arg(args, long long);
+            len = sizeof(arg.ll);
+            break;
+        case ARG_SIZE:
+            arg.z = va_arg(args, size_t);
+            len = sizeof(arg.z);
+            break;
+        case ARG_INTMAX:
+            arg.j = va_arg(args, intmax_t);
+            len = sizeof(arg.j);
+            break;
+        case ARG_PTRDIFF:
+            arg.t = va_arg(args, ptrdiff_t);
+            len = sizeof(arg.t);
+            break;
+        case ARG_DOUBLE:
+            arg.d = va_arg(args, double);
+            len = sizeof(arg.d);
+            break;
+        case ARG_LDOUBLE:
+            arg.ld = va_arg(args, long double);
+            len = sizeof(arg.ld);
+            break;
+        case ARG_POINTER:
+            arg.p = va_arg(args, void *);
+            len = sizeof(arg.p);
+            break;
+        case ARG_STRING:
+            // A NULL string is stored as a lone 1, printf shows it as (null)
+            if (! (str = va_arg(args, char *))) {
+                if (! packBytes(&dest, end, "\001", 1)) {
+                    return 0;
+                }
+                continue;
+            }
+            // With a precision, the string need not end with a 0
+            len = (prec >= 0) ? strnlen(str, prec) : strlen(str);
+            if (! packBytes(&dest, end, "", 1) || ! packBytes(&dest, end, str, len)
+                    || ! packBytes(&dest, end, "", 1)) {
+                return 0;
+            }
+            continue;
+        default:
+            continue;
+        }
+        if (! packBytes(&dest, end, &arg, len)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void unpackBytes(const char **src, void *dest, size_t len)
+{
+    memcpy(dest, *src, len);
+    *src += len;
+}
+
+// Formats a slot packed by packArgs() into text
+static void unpackArgs(const LogSlot *sPtr, char *text, size_t size)
+{
+    const char *format = sPtr->data;
+    const char *src = format + strlen(format) + 1;
+    const char *ptr;
+    const char *specPtr;
+    char spec[64];
+    char *out = text;
+    size_t left = size;
+    int type, stars, prec, star;
+    int n, len, i;
+    union {
+        int i;
+        long l;
+        long long ll;
+        size_t z;
+        intmax_t j;
+        ptrdiff_t t;
+        double d;
+        long double ld;
+        void *p;
+    } arg;
+    const char *str;
+
+    *text = '\0';
+    for (ptr = format; *ptr && left > 1; ptr++) {
+        if (*ptr != '%') {
+            *out++ = *ptr;
+            *out = '\0';
+            left--;
+            continue;
+        }
+        specPtr = ptr;
+        len = parseSpec(ptr + 1, &type, &stars, &prec) + 1;
+        ptr += len - 1;
+
+        // The spec with the '*' replaced by their values
+        n = 0;
+        for (i = 0; i < len && n < (int)sizeof(spec) - 16; i++) {
+            if (specPtr[i] != '*') {
+                spec[n++] = specPtr[i];
+                continue;
+            }
+            unpackBytes(&src, &star, sizeof(star));
+            if (specPtr[i - 1] == '.' && star < 0) {
+                // A negative precision is taken as if omitted
+                n--;
+                continue;
+            }
+            n += snprintf(spec + n, sizeof(spec) - n, "%d", star);
+        }
+        spec[n] = '\0';
+
+        switch (type) {
+        case ARG_INT:
+            unpackBytes(&src, &arg.i, sizeof(arg.i));
+            n = snprintf(out, left, spec, arg.i);
+            break;
+        case ARG_LONG:
+            unpackBytes(&src, &arg.l, sizeof(arg.l));
+            n = snprintf(out, left, spec, arg.l);
+            break;
+        case ARG_LLONG:
+            unpackBytes(&src, &arg.ll, sizeof(arg.ll));
+            n = snprintf(out, left, spec, arg.ll);
+            break;
+        case ARG_SIZE:
+            unpackBytes(&src, &arg.z, sizeof(arg.z));
+            n = snprintf(out, left, spec, arg.z);
+            break;
+        case ARG_INTMAX:
+            unpackBytes(&src, &arg.j, sizeof(arg.j));
+            n = snprintf(out, left, spec, arg.j);
+            break;
+        case ARG_PTRDIFF:
+            unpackBytes(&src, &arg.t, sizeof(arg.t));
+            n = snprintf(out, left, spec, arg.t);
+            break;
+        case ARG_DOUBLE:
+            unpackBytes(&src, &arg.d, sizeof(arg.d));
+            n = snprintf(out, left, spec, arg.d);
+            break;
+        case ARG_LDOUBLE:
+            unpackBytes(&src, &arg.ld, sizeof(arg.ld));
+            n = snprintf(out, left, spec, arg.ld);
+            break;
+        case ARG_POINTER:
+            unpackBytes(&src, &arg.p, sizeof(arg.p));
+            n = snprintf(out, left, spec, arg.p);
+            break;
+        case ARG_STRING:
+            if (*src++) {
+                n = snprintf(out, left, spec, (char *)NULL);
+            } else {
+                str = src;
+                src += strlen(str) + 1;
+                n = snprintf(out, left, spec, str);
+            }
+            break;
+        case ARG_ERRNO:
+            n = snprintf(out, left, "%s", strerror(sPtr->err));
+            break;
+        default:
+            n = snprintf(out, left, "%%");
+        }
+        if (n < 0) {
+            n = 0;
+        }
+        if ((size_t)n >= left) {
+            // Truncated
+            break;
+        }
+        out += n;
+        left -= n;
+    }
+}
+
+// Takes the next filled slot and formats it, returns 0 if there is none
+static int takeSlot(char *text, size_t size, int *class, time_t *t)
+{
+    LogSlot *sPtr = &ring[dequeuePos % LOG_SLOTS];
+
+    if (__atomic_load_n(&sPtr->seq, __ATOMIC_ACQUIRE) != dequeuePos + 1) {
+        return 0;
+    }
+    if (sPtr->text) {
+        snprintf(text, size, "%s", sPtr->data);
+    } else {
+        unpackArgs(sPtr, text, size);
+    }
+    *class = sPtr->class;
+    *t = sPtr->t;
+    // Free for the next lap
+    __atomic_store_n(&sPtr->seq, dequeuePos + LOG_SLOTS, __ATOMIC_RELEASE);
+    dequeuePos++;
+    return 1;
+}
+
+// Writes everything queued so far
+static void drain()
+{
+    char text[MAXBUF];
+    char string[100];
+    unsigned long count;
+    int class;
+    time_t t;
+
+    while (takeSlot(text, sizeof(text), &class, &t)) {
+        logOutput(class, t, text);
+    }
+    count = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    if (count != reported) {
+        snprintf(string, sizeof(string), "Log buffer full, %lu messages dropped", count - reported);
+        logOutput(LOG_WARNING, time(NULL), string);
+        reported = count;
+    }
+    logOutputFlush();
+    __atomic_store_n(&writtenPos, dequeuePos, __ATOMIC_RELEASE);
+}
+
+static void *logWriter(void *arg)
+{
+    struct pollfd pfd;
+    struct timespec batch = { 0, LOG_BATCH_MS * 1000000L };
+    char buf[64];
+
+    (void)arg;
+    pfd.fd = wakeFD[0];
+    pfd.events = POLLIN;
+    while (1) {
+        drain();
+        __atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring[dequeuePos % LOG_SLOTS].seq, __ATOMIC_SEQ_CST) != dequeuePos + 1) {
+            // Nothing queued, wait for the next message
+            poll(&pfd, 1, -1);
+        }
+        __atomic_store_n(&sleeping, 0, __ATOMIC_SEQ_CST);
+        while (read(wakeFD[0], buf, sizeof(buf)) > 0) {
+            ;
+        }
+        // Let the rest of a burst come in
+        if (! __atomic_load_n(&flushing, __ATOMIC_ACQUIRE)) {
+            nanosleep(&batch, NULL);
+        }
+    }
+    return NULL;
+}
+
+// In a forked child, the writer of the parent is gone
+static void forkChild()
+{
+    int n;
+
+    for (n = 0; n < LOG_SLOTS; n++) {
+        ring[n].seq = n;
+    }
+    enqueuePos = dequeuePos = writtenPos = 0;
+    dropped = reported = 0;
+    sleeping = flushing = 0;
+    running = 0;
+    if (wakeFD[0] >= 0) {
+        close(wakeFD[0]);
+        close(wakeFD[1]);
+        wakeFD[0] = wakeFD[1] = -1;
+    }
+}
+
+static int startWriter()
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int ret;
+
+    if (pipe2(wakeFD, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return 0;
+    }
+    // The writer takes no signals, they go to the threads doing the work
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, logWriter, NULL);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        close(wakeFD[0]);
+        close(wakeFD[1]);
+        wakeFD[0] = wakeFD[1] = -1;
+        return 0;
+    }
+    running = 1;
+    return 1;
+}
+
+// From now on messages go through the buffer
+void logBufStart()
+{
+    int n;
+
+    if (started) {
+        return;
+    }
+    for (n = 0; n < LOG_SLOTS; n++) {
+        ring[n].seq = n;
+    }
+    pthread_atfork(NULL, NULL, forkChild);
+    atexit(logBufFlush);
+    started = 1;
+    if (! startWriter()) {
+        started = 0;
+        logIT1(LOG_WARNING, "Could not start the log writer, logging synchronously");
+    }
+}
+
+// Whether logIT() should queue its messages
+int logBufRunning()
+{
+    return started;
+}
+
+// Claims a free slot and fills in the header, NULL if the ring is full
+static LogSlot *claimSlot(int class, time_t t, int err, unsigned long *seq)
+{
+    LogSlot *sPtr;
+    unsigned long pos;
+    long diff;
+
+    if (! running && ! startWriter()) {
+        return NULL;
+    }
+    pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+    while (1) {
+        sPtr = &ring[pos % LOG_SLOTS];
+        diff = (long)(__atomic_load_n(&sPtr->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+        }
+    }
+    sPtr->class = class;
+    sPtr->t = t;
+    sPtr->err = err;
+    *seq = pos + 1;
+    return sPtr;
+}
+
+// Hands the filled slot to the writer
+static void publishSlot(LogSlot *sPtr, unsigned long seq)
+{
+    __atomic_store_n(&sPtr->seq, seq, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST)) {
+        write(wakeFD[1], "", 1);
+    }
+}
+
+/* Queues a message as format and arguments, formatted later by the writer.
+ * Returns 0 if the ring is full and the message has been dropped.
+ */
+int logBufPut(int class, time_t t, const char *format, va_list args)
+{
+    LogSlot *sPtr;
+    unsigned long seq;
+    va_list copy;
+    int err = errno;
+
+    if (! (sPtr = claimSlot(class, t, err, &seq))) {
+        return 0;
+    }
+    va_copy(copy, args);
+    sPtr->text = 0;
+    if (! packArgs(sPtr->data, sizeof(sPtr->data), format, copy)) {
+        // Too long or a conversion we can't copy, formatted right away
+        errno = err;
+        vsnprintf(sPtr->data, sizeof(sPtr->data), format, args);
+        sPtr->text = 1;
+    }
+    va_end(copy);
+    publishSlot(sPtr, seq);
+    errno = err;
+    return 1;
+}
+
+// Queues a message already formatted, returns 0 if it has been dropped
+int logBufText(int class, time_t t, const char *text)
+{
+    LogSlot *sPtr;
+    unsigned long seq;
+
+    if (! (sPtr = claimSlot(class, t, 0, &seq))) {
+        return 0;
+    }
+    snprintf(sPtr->data, sizeof(sPtr->data), "%s", text);
+    sPtr->text = 1;
+    publishSlot(sPtr, seq);
+    return 1;
+}
+
+// Waits until the writer has written all messages queued, called at exit
+void logBufFlush()
+{
+    struct timespec tick = { 0, 1000000L };
+    unsigned long pos = __atomic_load_n(&enqueuePos, __ATOMIC_ACQUIRE);
+    int n;
+
+    if (! running) {
+        return;
+    }
+    __atomic_store_n(&flushing, 1, __ATOMIC_RELEASE);
+    if (__atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST)) {
+        write(wakeFD[1], "", 1);
+    }
+    for (n = 0; n < LOG_FLUSH_MS && __atomic_load_n(&writtenPos, __ATOMIC_ACQUIRE) < pos; n++) {
+        nanosleep(&tick, NULL);
+    }
+    __atomic_store_n(&flushing, 0, __ATOMIC_RELEASE);
+}
+
+// Messages dropped since the start, as the ring was full
+unsigned long logBufDropped()
+{
+    return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
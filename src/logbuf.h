@@ -0,0 +1,38 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Asynchronous log buffer written by a thread of its own, see logbuf.c
+
+#ifndef LOGBUF_H
+#define LOGBUF_H
+
+#include <stdarg.h>
+#include <time.h>
+
+// Number of slots and the bytes a slot holds for format and arguments
+#define LOG_SLOTS 512
+#define LOG_DATA 480
+// Time the writer lets a burst of messages collect into one write
+#define LOG_BATCH_MS 10
+
+void logBufStart();
+int logBufRunning();
+int logBufPut(int class, time_t t, const char *format, va_list args);
+int logBufText(int class, time_t t, const char *text);
+void logBufFlush();
+unsigned long logBufDropped();
+
+#endif // LOGBUF_H
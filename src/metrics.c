@@ -0,0 +1,684 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Metrics
+ *
+ * Per command the executions, errors and retries are counted and the
+ * durations, measured with the monotonic clock, are kept in a histogram
+ * like HdrHistogram: each power of two of microseconds is split into 8
+ * linear sub-buckets, so every value is known to 12.5 %, from 1 us to
+ * 134 s in 200 buckets. The same goes for the time waited for the
+ * device: the semaphore of the forking server or the queue of the event
+ * loop. The P300 session opens and closes and the time the bus was busy
+ * are counted as well.
+ *
+ * The time the device took to answer is kept per command and for the
+ * protocol as a whole. With adaptive timeouts the receive of a command
+ * waits its 99th percentile times a factor, within a floor and a ceiling,
+ * so a lost frame is retried after a few hundred ms instead of seconds.
+ * Until a command has been answered METRIC_MIN_ANSWERS times the
+ * percentile of the protocol is used.
+ *
+ * Everything lives in memory mapped shared before any child is forked,
+ * so the children of the forking server count into the same place. The
+ * counters are only changed with atomic adds, the commands claim their
+ * slot of a hash table by name the first time they are run.
+ *
+ * "stats" prints a summary. With <metricsport> a thread serves them in
+ * the text format of Prometheus to every connection on that port. It
+ * waits for the requests of several clients at once, so one not sending
+ * its request holds up nobody else.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "metrics.h"
+#include "common.h"
+#include "socket.h"
+
+// Clients the metrics server waits on for their request at once
+#define METRIC_CLIENTS 16
+// Time a client has to send its request, it gets the answer anyway then
+#define METRIC_REQUEST_MS 2000
+
+// Slot states
+#define SLOT_FREE  0
+#define SLOT_CLAIM 1
+#define SLOT_USED  2
+
+typedef struct metricHist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint32_t buckets[METRIC_BUCKETS];
+} MetricHist;
+
+typedef struct metricCmd {
+    int state;
+    char name[METRIC_NAME];
+    uint64_t errors;
+    uint64_t retries;
+    MetricHist latency;
+    MetricHist answer;
+} MetricCmd;
+
+typedef struct metrics {
+    uint64_t started;
+    uint64_t busy;
+    uint64_t counters[METRIC_COUNTERS];
+    MetricHist lockWait;
+    MetricHist answer;
+    MetricCmd cmds[METRIC_CMDS];
+} Metrics;
+
+// Bounds of the Prometheus buckets in us
+static const uint64_t promBounds[] = {
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000
+};
+
+static Metrics *metrics = NULL;
+// The command running in this thread, see metricsBegin()
+static __thread int current = -1;
+static __thread uint64_t began;
+static __thread uint64_t waited;
+
+// Adaptive timeouts, off with a factor of 0
+static float timeoutFactor = 0;
+static int timeoutMin = 0;
+static int timeoutMax = 0;
+
+uint64_t metricsNow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metricsInit()
+{
+    void *ptr;
+
+    if (metrics) {
+        return;
+    }
+    ptr = mmap(NULL, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        logIT1(LOG_WARNING, "Could not map the metrics, they are off");
+        return;
+    }
+    metrics = ptr;
+    metrics->started = metricsNow();
+}
+
+static int bucketOf(uint64_t us)
+{
+    int exp;
+    int idx;
+
+    if (us < (1 << METRIC_SUB_BITS)) {
+        return us;
+    }
+    exp = 63 - __builtin_clzll(us);
+    idx = ((exp - METRIC_SUB_BITS + 1) << METRIC_SUB_BITS)
+          + ((us >> (exp - METRIC_SUB_BITS)) & ((1 << METRIC_SUB_BITS) - 1));
+    return (idx < METRIC_BUCKETS) ? idx : METRIC_BUCKETS - 1;
+}
+
+// The smallest value in us of bucket idx
+static uint64_t bucketLow(int idx)
+{
+    int exp;
+
+    if (idx < (1 << METRIC_SUB_BITS)) {
+        return idx;
+    }
+    exp = (idx >> METRIC_SUB_BITS) + METRIC_SUB_BITS - 1;
+    return (uint64_t)((1 << METRIC_SUB_BITS) + (idx & ((1 << METRIC_SUB_BITS) - 1)))
+           << (exp - METRIC_SUB_BITS);
+}
+
+static void histAdd(MetricHist *hPtr, uint64_t ns)
+{
+    uint64_t max;
+
+    __atomic_fetch_add(&hPtr->buckets[bucketOf(ns / 1000)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hPtr->sum, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&hPtr->count, 1, __ATOMIC_RELAXED);
+    max = __atomic_load_n(&hPtr->max, __ATOMIC_RELAXED);
+    while (ns > max
+           && ! __atomic_compare_exchange_n(&hPtr->max, &max, ns, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+}
+
+// The slot of the command name, claimed on first use. -1 if the table is full.
+static int getSlot(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    const char *ptr;
+    MetricCmd *mPtr;
+    int expected;
+    int state;
+    int n;
+    int idx;
+
+    for (ptr = name; *ptr; ptr++) {
+        hash = (hash ^ (unsigned char)*ptr) * 16777619u;
+    }
+    for (n = 0; n < METRIC_CMDS; n++) {
+        idx = (hash + n) & (METRIC_CMDS - 1);
+        mPtr = &metrics->cmds[idx];
+        state = __atomic_load_n(&mPtr->state, __ATOMIC_ACQUIRE);
+        if (state == SLOT_FREE) {
+            expected = SLOT_FREE;
+            if (__atomic_compare_exchange_n(&mPtr->state, &expected, SLOT_CLAIM, 0,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+                strncpy(mPtr->name, name, METRIC_NAME - 1);
+                __atomic_store_n(&mPtr->state, SLOT_USED, __ATOMIC_RELEASE);
+                return idx;
+            }
+            state = expected;
+        }
+        // Another process is just writing the name
+        while (state == SLOT_CLAIM) {
+            sched_yield();
+            state = __atomic_load_n(&mPtr->state, __ATOMIC_ACQUIRE);
+        }
+        if (strncmp(mPtr->name, name, METRIC_NAME - 1) == 0) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+// Starts to measure the command name in this thread
+void metricsBegin(const char *name)
+{
+    if (! metrics) {
+        return;
+    }
+    // Without a name only the bus time is counted
+    current = name ? getSlot(name) : -1;
+    waited = 0;
+    began = metricsNow();
+}
+
+void metricsRetry()
+{
+    if (metrics && current >= 0) {
+        __atomic_fetch_add(&metrics->cmds[current].retries, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Ends the command of metricsBegin(), result < 0 is an error
+void metricsEnd(int result)
+{
+    uint64_t took;
+
+    if (! metrics) {
+        return;
+    }
+    took = metricsNow() - began;
+    // The bus was busy, apart from waiting for it
+    __atomic_fetch_add(&metrics->busy, (took > waited) ? took - waited : 0, __ATOMIC_RELAXED);
+    if (current >= 0) {
+        histAdd(&metrics->cmds[current].latency, took);
+        if (result < 0) {
+            __atomic_fetch_add(&metrics->cmds[current].errors, 1, __ATOMIC_RELAXED);
+        }
+    }
+    current = -1;
+}
+
+/* A command served by a frame it shared with others, took and answer are
+ * the times of that frame. The bus time of the frame is counted once, by
+ * metricsBegin(NULL) and metricsEnd() around it.
+ */
+void metricsShared(const char *name, uint64_t took, uint64_t answer)
+{
+    int slot;
+
+    if (! metrics || (slot = getSlot(name)) < 0) {
+        return;
+    }
+    histAdd(&metrics->cmds[slot].latency, took);
+    histAdd(&metrics->cmds[slot].answer, answer);
+}
+
+void metricsLockWait(uint64_t ns)
+{
+    if (metrics) {
+        histAdd(&metrics->lockWait, ns);
+        waited += ns;
+    }
+}
+
+// The device answered the command running in this thread after ns
+void metricsAnswer(uint64_t ns)
+{
+    if (metrics) {
+        histAdd(&metrics->answer, ns);
+        if (current >= 0) {
+            histAdd(&metrics->cmds[current].answer, ns);
+        }
+    }
+}
+
+void metricsAdaptive(float factor, int minMs, int maxMs)
+{
+    timeoutFactor = factor;
+    timeoutMin = minMs;
+    timeoutMax = maxMs;
+}
+
+void metricsCount(int counter)
+{
+    if (metrics) {
+        __atomic_fetch_add(&metrics->counters[counter], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Copies a histogram, its count is the sum of the copied buckets
+static void histCopy(MetricHist *dest, MetricHist *src)
+{
+    int n;
+
+    dest->count = 0;
+    for (n = 0; n < METRIC_BUCKETS; n++) {
+        dest->buckets[n] = __atomic_load_n(&src->buckets[n], __ATOMIC_RELAXED);
+        dest->count += dest->buckets[n];
+    }
+    dest->sum = __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+    dest->max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+}
+
+// The value in ms below which the fraction p of the values lies
+static double percentile(MetricHist *hPtr, double p)
+{
+    uint64_t rank;
+    uint64_t seen = 0;
+    uint64_t high;
+    int n;
+
+    if (! hPtr->count) {
+        return 0;
+    }
+    rank = p * hPtr->count + 0.5;
+    rank = rank ? rank : 1;
+    for (n = 0; n < METRIC_BUCKETS - 1; n++) {
+        seen += hPtr->buckets[n];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    // The highest value of the bucket, but not above the maximum seen
+    high = bucketLow(n + 1) * 1000;
+    return ((high < hPtr->max) ? high : hPtr->max) / 1e6;
+}
+
+// The timeout in ms for answers with the distribution hPtr, 0 if too few are known
+static int timeoutOf(MetricHist *hPtr)
+{
+    double ms;
+
+    if (hPtr->count < METRIC_MIN_ANSWERS) {
+        return 0;
+    }
+    ms = percentile(hPtr, 0.99) * timeoutFactor;
+    ms = (ms < timeoutMin) ? timeoutMin : ms;
+    return (timeoutMax > 0 && ms > timeoutMax) ? timeoutMax : (int)(ms + 0.5);
+}
+
+/* The receive timeout in ms for the command running in this thread, from
+ * its answers or those of the protocol. 0 if adaptive timeouts are off or
+ * nothing is known yet, the fixed timeout applies then.
+ */
+int metricsTimeout()
+{
+    MetricHist hist;
+    int ms = 0;
+
+    if (! metrics || timeoutFactor <= 0) {
+        return 0;
+    }
+    if (current >= 0) {
+        histCopy(&hist, &metrics->cmds[current].answer);
+        ms = timeoutOf(&hist);
+    }
+    if (! ms) {
+        histCopy(&hist, &metrics->answer);
+        ms = timeoutOf(&hist);
+    }
+    return ms;
+}
+
+static void printHist(FILE *out, const char *name, MetricHist *hPtr)
+{
+    fprintf(out, "%-24s %8llu %8.1f %8.1f %8.1f %8.1f %8.1f\n", name,
+            (unsigned long long)hPtr->count,
+            hPtr->count ? hPtr->sum / 1e6 / hPtr->count : 0.0,
+            percentile(hPtr, 0.5), percentile(hPtr, 0.9), percentile(hPtr, 0.99),
+            hPtr->max / 1e6);
+}
+
+// Writes the text of "stats" to fd
+void metricsText(int fd)
+{
+    MetricHist hist;
+    MetricCmd *mPtr;
+    uint64_t uptime;
+    uint64_t busy;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *out;
+    int n;
+
+    if (! metrics) {
+        Writen(fd, "Metrics are off\n", 16);
+        return;
+    }
+    if (! (out = open_memstream(&text, &len))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    uptime = metricsNow() - metrics->started;
+    busy = __atomic_load_n(&metrics->busy, __ATOMIC_RELAXED);
+    fprintf(out, "Uptime %.0f s, bus busy %.1f s (%.2f %%), P300 opens %llu, closes %llu\n",
+            uptime / 1e9, busy / 1e9, uptime ? 100.0 * busy / uptime : 0.0,
+            (unsigned long long)__atomic_load_n(&metrics->counters[METRIC_P300_OPENS], __ATOMIC_RELAXED),
+            (unsigned long long)__atomic_load_n(&metrics->counters[METRIC_P300_CLOSES], __ATOMIC_RELAXED));
+    fprintf(out, "%-24s %8s %8s %8s %8s %8s %8s\n", "ms", "count", "avg", "p50", "p90", "p99", "max");
+    histCopy(&hist, &metrics->lockWait);
+    printHist(out, "(device wait)", &hist);
+    histCopy(&hist, &metrics->answer);
+    printHist(out, "(answer)", &hist);
+
+    fprintf(out, "\n%-24s %8s %8s %8s %8s %8s %8s %8s %8s\n", "command", "count", "errors",
+            "retries", "avg ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (n = 0; n < METRIC_CMDS; n++) {
+        mPtr = &metrics->cmds[n];
+        if (__atomic_load_n(&mPtr->state, __ATOMIC_ACQUIRE) != SLOT_USED) {
+            continue;
+        }
+        histCopy(&hist, &mPtr->latency);
+        fprintf(out, "%-24s %8llu %8llu %8llu %8.1f %8.1f %8.1f %8.1f %8.1f\n", mPtr->name,
+                (unsigned long long)hist.count,
+                (unsigned long long)__atomic_load_n(&mPtr->errors, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&mPtr->retries, __ATOMIC_RELAXED),
+                hist.count ? hist.sum / 1e6 / hist.count : 0.0,
+                percentile(&hist, 0.5), percentile(&hist, 0.9), percentile(&hist, 0.99),
+                hist.max / 1e6);
+    }
+
+    if (timeoutFactor > 0) {
+        fprintf(out, "\nAdaptive timeouts: p99 x %g, %d to %d ms\n", timeoutFactor, timeoutMin, timeoutMax);
+        fprintf(out, "%-24s %8s %8s %8s\n", "command", "answers", "p99 ms", "timeout");
+        for (n = 0; n < METRIC_CMDS; n++) {
+            mPtr = &metrics->cmds[n];
+            if (__atomic_load_n(&mPtr->state, __ATOMIC_ACQUIRE) != SLOT_USED) {
+                continue;
+            }
+            histCopy(&hist, &mPtr->answer);
+            if (hist.count) {
+                fprintf(out, "%-24s %8llu %8.1f %8d\n", mPtr->name, (unsigned long long)hist.count,
+                        percentile(&hist, 0.99), timeoutOf(&hist));
+            }
+        }
+    }
+    fclose(out);
+    Writen(fd, text, len);
+    free(text);
+}
+
+// A histogram in Prometheus format, the buckets end on the edges of ours
+static void promHist(FILE *out, const char *metric, const char *labels, MetricHist *hPtr)
+{
+    uint64_t below = 0;
+    size_t b;
+    int n = 0;
+
+    for (b = 0; b < sizeof(promBounds) / sizeof(*promBounds); b++) {
+        for (; n < METRIC_BUCKETS - 1 && bucketLow(n + 1) <= promBounds[b]; n++) {
+            below += hPtr->buckets[n];
+        }
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", metric, labels, *labels ? "," : "",
+                promBounds[b] / 1e6, (unsigned long long)below);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", metric, labels, *labels ? "," : "",
+            (unsigned long long)hPtr->count);
+    fprintf(out, "%s_sum%s%s%s %.6f\n", metric, *labels ? "{" : "", labels, *labels ? "}" : "",
+            hPtr->sum / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", metric, *labels ? "{" : "", labels, *labels ? "}" : "",
+            (unsigned long long)hPtr->count);
+}
+
+static void promCounter(FILE *out, const char *metric, const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", metric, help, metric);
+}
+
+static void promText(FILE *out)
+{
+    MetricHist hist;
+    MetricCmd *mPtr;
+    char labels[METRIC_NAME + 16];
+    int n;
+
+    fprintf(out, "# HELP vcontrold_uptime_seconds Time since vcontrold started\n"
+            "# TYPE vcontrold_uptime_seconds gauge\n"
+            "vcontrold_uptime_seconds %.3f\n", (metricsNow() - metrics->started) / 1e9);
+    promCounter(out, "vcontrold_bus_busy_seconds_total", "Time commands used the device");
+    fprintf(out, "vcontrold_bus_busy_seconds_total %.6f\n",
+            __atomic_load_n(&metrics->busy, __ATOMIC_RELAXED) / 1e9);
+    promCounter(out, "vcontrold_p300_opens_total", "P300 sessions opened");
+    fprintf(out, "vcontrold_p300_opens_total %llu\n",
+            (unsigned long long)__atomic_load_n(&metrics->counters[METRIC_P300_OPENS], __ATOMIC_RELAXED));
+    promCounter(out, "vcontrold_p300_closes_total", "P300 sessions closed");
+    fprintf(out, "vcontrold_p300_closes_total %llu\n",
+            (unsigned long long)__atomic_load_n(&metrics->counters[METRIC_P300_CLOSES], __ATOMIC_RELAXED));
+
+    fprintf(out, "# HELP vcontrold_device_wait_seconds Time waited for the device\n"
+            "# TYPE vcontrold_device_wait_seconds histogram\n");
+    histCopy(&hist, &metrics->lockWait);
+    promHist(out, "vcontrold_device_wait_seconds", "", &hist);
+
+    fprintf(out, "# HELP vcontrold_command_duration_seconds Duration of the commands\n"
+            "# TYPE vcontrold_command_duration_seconds histogram\n");
+    for (n = 0; n < METRIC_CMDS; n++) {
+        mPtr = &metrics->cmds[n];
+        if (__atomic_load_n(&mPtr->state, __ATOMIC_ACQUIRE) == SLOT_USED) {
+            snprintf(labels, sizeof(labels), "command=\"%s\"", mPtr->name);
+            histCopy(&hist, &mPtr->latency);
+            promHist(out, "vcontrold_command_duration_seconds", labels, &hist);
+        }
+    }
+    promCounter(out, "vcontrold_command_errors_total", "Commands failed");
+    for (n = 0; n < METRIC_CMDS; n++) {
+        mPtr = &metrics->cmds[n];
+        if (__atomic_load_n(&mPtr->state, __ATOMIC_ACQUIRE) == SLOT_USED) {
+            fprintf(out, "vcontrold_command_errors_total{command=\"%s\"} %llu\n", mPtr->name,
+                    (unsigned long long)__atomic_load_n(&mPtr->errors, __ATOMIC_RELAXED));
+        }
+    }
+    promCounter(out, "vcontrold_command_retries_total", "Commands repeated after a timeout or wrong answer");
+    for (n = 0; n < METRIC_CMDS; n++) {
+        mPtr = &metrics->cmds[n];
+        if (__atomic_load_n(&mPtr->state, __ATOMIC_ACQUIRE) == SLOT_USED) {
+            fprintf(out, "vcontrold_command_retries_total{command=\"%s\"} %llu\n", mPtr->name,
+                    (unsigned long long)__atomic_load_n(&mPtr->retries, __ATOMIC_RELAXED));
+        }
+    }
+}
+
+typedef struct metricClient {
+    int fd;
+    uint64_t since;
+    size_t len;
+    char request[1024];
+} MetricClient;
+
+// Answers a client with the metrics and closes the connection
+static void promReply(int fd)
+{
+    char header[128];
+    char *text = NULL;
+    size_t len;
+    FILE *out;
+
+    if (! (out = open_memstream(&text, &len))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    promText(out);
+    fclose(out);
+    // Written blocking, but not for longer than the send timeout
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n\r\n", len);
+    if (writen(fd, header, strlen(header)) > 0) {
+        writen(fd, text, len);
+    }
+    free(text);
+    close(fd);
+}
+
+// Reads what the client sent, returns 1 once its request is complete
+static int promRequest(MetricClient *cPtr)
+{
+    ssize_t n;
+
+    n = read(cPtr->fd, cPtr->request + cPtr->len, sizeof(cPtr->request) - cPtr->len - 1);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n <= 0) {
+        // The client is done sending, it gets the answer anyway
+        return 1;
+    }
+    cPtr->len += n;
+    cPtr->request[cPtr->len] = '\0';
+    return cPtr->len == sizeof(cPtr->request) - 1 || strstr(cPtr->request, "\r\n\r\n")
+           || strstr(cPtr->request, "\n\n");
+}
+
+// Answers every connection with the metrics, whatever was asked
+static void *metricsServer(void *arg)
+{
+    int listenfd = (int)(intptr_t)arg;
+    struct timeval tv = { 2, 0 };
+    MetricClient clients[METRIC_CLIENTS];
+    struct pollfd pfds[METRIC_CLIENTS + 1];
+    MetricClient *cPtr;
+    uint64_t now;
+    int count = 0;
+    int timeout;
+    int left;
+    int fd;
+    int n;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    while (1) {
+        // Only takes new clients while there is room for them
+        pfds[0].fd = (count < METRIC_CLIENTS) ? listenfd : -1;
+        pfds[0].events = POLLIN;
+        timeout = -1;
+        now = metricsNow();
+        for (n = 0; n < count; n++) {
+            pfds[n + 1].fd = clients[n].fd;
+            pfds[n + 1].events = POLLIN;
+            left = METRIC_REQUEST_MS - (int)((now - clients[n].since) / 1000000);
+            left = (left > 0) ? left : 0;
+            if (timeout < 0 || left < timeout) {
+                timeout = left;
+            }
+        }
+        if (poll(pfds, count + 1, timeout) < 0 && errno != EINTR) {
+            logIT(LOG_ERR, "Metrics: poll failed: %s", strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        now = metricsNow();
+        for (n = count - 1; n >= 0; n--) {
+            cPtr = &clients[n];
+            if ((pfds[n + 1].revents && promRequest(cPtr))
+                    || now - cPtr->since >= (uint64_t)METRIC_REQUEST_MS * 1000000) {
+                promReply(cPtr->fd);
+                clients[n] = clients[--count];
+            }
+        }
+
+        if (! (pfds[0].revents & POLLIN)) {
+            continue;
+        }
+        if ((fd = accept(listenfd, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                logIT(LOG_ERR, "Metrics: accept failed: %s", strerror(errno));
+                sleep(1);
+            }
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        cPtr = &clients[count++];
+        cPtr->fd = fd;
+        cPtr->since = now;
+        cPtr->len = 0;
+    }
+    return NULL;
+}
+
+// Serves the metrics on listenfd from a thread of its own
+void metricsServe(int listenfd)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+    sigset_t all, old;
+    int ret;
+
+    if (! metrics) {
+        return;
+    }
+    // The server takes no signals, they go to the threads doing the work
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_create(&thread, &attr, metricsServer, (void *)(intptr_t)listenfd);
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (ret != 0) {
+        logIT1(LOG_ERR, "Could not start the metrics server");
+    }
+}
@@ -0,0 +1,54 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Counters and latency histograms in shared memory, see metrics.c
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// Commands with counters of their own, a power of two
+#define METRIC_CMDS 256
+#define METRIC_NAME 48
+// Histogram: 8 linear sub-buckets per power of two of microseconds,
+// values are kept with 12.5 % precision up to 134 s
+#define METRIC_SUB_BITS 3
+#define METRIC_BUCKETS 200
+
+// Answers seen of a command before its own timeout is used
+#define METRIC_MIN_ANSWERS 20
+
+// Counters of metricsCount()
+#define METRIC_P300_OPENS  0
+#define METRIC_P300_CLOSES 1
+#define METRIC_COUNTERS    2
+
+void metricsInit();
+uint64_t metricsNow();
+void metricsBegin(const char *name);
+void metricsRetry();
+void metricsEnd(int result);
+void metricsShared(const char *name, uint64_t took, uint64_t answer);
+void metricsLockWait(uint64_t ns);
+void metricsAnswer(uint64_t ns);
+void metricsAdaptive(float factor, int minMs, int maxMs);
+int metricsTimeout();
+void metricsCount(int counter);
+void metricsText(int fd);
+void metricsServe(int listenfd);
+
+#endif // METRICS_H
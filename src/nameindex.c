@@ -0,0 +1,147 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Hash indexes
+ *
+ * The configuration keeps commands, units, macros, protocol commands and
+ * polls in linked lists, which the get...Node() functions walk. Once a
+ * configuration is loaded, an index per list maps the names to the nodes.
+ * It answers like the walk: the first node of a name wins, a node without
+ * a name matches every name and hides the nodes behind it, a lookup
+ * without a name returns the first node.
+ *
+ * The names are not copied, they belong to the nodes. The index of a
+ * configuration lives in its arena, like the nodes.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "nameindex.h"
+#include "common.h"
+
+static unsigned int hashName(const char *name)
+{
+    unsigned int hash = 5381;
+
+    while (*name) {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash;
+}
+
+// Linear probing, size is a power of two
+static NameSlot *findSlot(nameIndexPtr iPtr, const char *name, unsigned int hash)
+{
+    NameSlot *sPtr;
+    unsigned int n = hash & (iPtr->size - 1);
+
+    for (;;) {
+        sPtr = &iPtr->slots[n];
+        if (! sPtr->name || (sPtr->hash == hash && strcmp(sPtr->name, name) == 0)) {
+            return sPtr;
+        }
+        n = (n + 1) & (iPtr->size - 1);
+    }
+}
+
+static void growIndex(nameIndexPtr iPtr)
+{
+    NameSlot *old = iPtr->slots;
+    unsigned int oldSize = iPtr->size;
+    unsigned int n;
+
+    iPtr->size = oldSize ? oldSize * 2 : 64;
+    if (iPtr->aPtr) {
+        // The old slots stay in the arena unused
+        iPtr->slots = arenaAlloc(iPtr->aPtr, iPtr->size * sizeof(NameSlot));
+    } else if (! (iPtr->slots = calloc(iPtr->size, sizeof(NameSlot)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    for (n = 0; n < oldSize; n++) {
+        if (old[n].name) {
+            *findSlot(iPtr, old[n].name, old[n].hash) = old[n];
+        }
+    }
+    if (! iPtr->aPtr) {
+        free(old);
+    }
+}
+
+nameIndexPtr newNameIndex(arenaPtr aPtr)
+{
+    nameIndexPtr iPtr;
+
+    if (aPtr) {
+        iPtr = arenaAlloc(aPtr, sizeof(*iPtr));
+    } else if (! (iPtr = calloc(1, sizeof(*iPtr)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    iPtr->aPtr = aPtr;
+    growIndex(iPtr);
+    return iPtr;
+}
+
+// The nodes have to be added in list order
+void addNameIndex(nameIndexPtr iPtr, const char *name, void *ptr)
+{
+    NameSlot *sPtr;
+    unsigned int hash;
+
+    if (iPtr->wildcard) {
+        // Never reached by the walk
+        return;
+    }
+    if (! iPtr->first) {
+        iPtr->first = ptr;
+    }
+    if (! name) {
+        iPtr->wildcard = ptr;
+        return;
+    }
+    if ((iPtr->used + 1) * 2 > iPtr->size) {
+        growIndex(iPtr);
+    }
+    hash = hashName(name);
+    if (! (sPtr = findSlot(iPtr, name, hash))->name) {
+        sPtr->name = name;
+        sPtr->hash = hash;
+        sPtr->ptr = ptr;
+        iPtr->used++;
+    }
+}
+
+void *getNameIndex(nameIndexPtr iPtr, const char *name)
+{
+    NameSlot *sPtr;
+
+    if (! name) {
+        return iPtr->first;
+    }
+    sPtr = findSlot(iPtr, name, hashName(name));
+    return sPtr->name ? sPtr->ptr : iPtr->wildcard;
+}
+
+void removeNameIndex(nameIndexPtr iPtr)
+{
+    if (iPtr && ! iPtr->aPtr) {
+        free(iPtr->slots);
+        free(iPtr);
+    }
+}
@@ -0,0 +1,48 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Hash indexes over the names of the configuration lists
+
+#ifndef NAMEINDEX_H
+#define NAMEINDEX_H
+
+#include "arena.h"
+
+typedef struct nameIndex *nameIndexPtr;
+
+// The layout is public for the tables generated by vgen
+typedef struct nameSlot {
+    const char *name;
+    unsigned int hash;
+    void *ptr;
+} NameSlot;
+
+struct nameIndex {
+    NameSlot *slots;
+    unsigned int size;
+    unsigned int used;
+    void *first;
+    void *wildcard;
+    // NULL: allocated from the heap, or static
+    arenaPtr aPtr;
+};
+
+nameIndexPtr newNameIndex(arenaPtr aPtr);
+void addNameIndex(nameIndexPtr iPtr, const char *name, void *ptr);
+void *getNameIndex(nameIndexPtr iPtr, const char *name);
+void removeNameIndex(nameIndexPtr iPtr);
+
+#endif // NAMEINDEX_H
@@ -31,9 +31,12 @@
 #include "xmlconfig.h"
 #include "parser.h"
 #include "unit.h"
+#include "arithmetic.h"
 #include "common.h"
 #include "io.h"
 #include "framer.h"
+#include "metrics.h"
+#include "span.h"
 
 extern FILE *iniFD; // For creation of the Sim. INI Files
 
@@ -144,11 +147,22 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
     unsigned long etime;
     char out_buff[1024];
     int out_len;
+    // The bytes for the BYTES token, the compiled commands are never written
+    char unitBuf[MAXBUF];
+    short unitLen = -1;
+    char *bytesPtr;
+    short bytesLen;
+    short rLen;
+    uint64_t since;
+    int ret;
+    // Adaptive receive timeout of this round, and whether it ran out
+    int timeout;
+    int lost;
 
     memset(simIn, 0, sizeof(simIn));
     memset(simOut, 0, sizeof(simOut));
 
-    // First copy or convert the bytes of sendBuf to the BYTES token of cmpPtr
+    // First copy or convert the bytes of sendBuf for the BYTES token of cmpPtr
     // to be sure not to abort right in the middle of it
     cPtr = cmpPtr; // do not change cmpPtr, use local cPtr
     while (cPtr) {
@@ -164,35 +178,36 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
                       "Error in length of the hex string (%d) != send length of the command (%d), terminating", sendLen, cPtr->len);
                 return -1;
             }
-            if (cPtr->send) {
-                free(cPtr->send);
-            }
-            cPtr->send = calloc(cPtr->len, sizeof(char));
+            unitLen = cPtr->len;
             sendLen = 0; // We don't send the converted sendBuf
-            memcpy(cPtr->send, sendBuf, cPtr->len);
+            memcpy(unitBuf, sendBuf, unitLen);
         } else if (cPtr->uPtr) {
             len = sendLen; // we need this in procSetUnit() to clear sendBuf
-            if (procSetUnit(cPtr->uPtr, sendBuf, &len, bitpos, pRecvPtr) <= 0) {
+            since = spanNow();
+            ret = procSetUnit(cPtr->uPtr, sendBuf, &len, bitpos, pRecvPtr);
+            spanAdd(SPAN_CONVERT, since);
+            if (ret <= 0) {
                 logIT(LOG_ERR, "Error in unit conversion: %s, terminating", sendBuf);
                 return -1;
             }
-            if (cPtr->send) {
-                free(cPtr->send);
-            }
-            cPtr->send = calloc(len, sizeof(char));
-            cPtr->len = len;
+            unitLen = len;
             sendLen = 0; // We don't send the converted sendBuf
-            memcpy(cPtr->send, sendBuf, len);
+            memcpy(unitBuf, sendBuf, len);
         }
         cPtr = cPtr->next;
     }
 
     do {
         cPtr = cmpPtr; // We need the starting point for the next round
+        timeout = metricsTimeout();
+        lost = 0;
         while (cmpPtr) {
             switch (cmpPtr->token) {
             case WAIT:
-                if (! framer_waitfor(fd, cmpPtr->send, cmpPtr->len)) {
+                since = spanNow();
+                ret = framer_waitfor(fd, cmpPtr->send, cmpPtr->len);
+                spanAdd(SPAN_RECV, since);
+                if (! ret) {
                     logIT1(LOG_ERR, "Error in wait, terminating");
                     return -1;
                 }
@@ -204,7 +219,13 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
             case SEND:
                 out_len = 0;
                 while (1) {
-                    if (out_len + cmpPtr->len > sizeof(out_buff)) {
+                    bytesPtr = cmpPtr->send;
+                    bytesLen = cmpPtr->len;
+                    if (cmpPtr->token == BYTES && unitLen >= 0) {
+                        bytesPtr = unitBuf;
+                        bytesLen = unitLen;
+                    }
+                    if (out_len + bytesLen > (int)sizeof(out_buff)) {
                         // Hopefully, we never end up here
                         logIT1(LOG_ERR, "Error out_buff buffer overflow, terminating");
                         return -1;
@@ -212,8 +233,8 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
 
                     // Copy all SEND data and BYTES data to out_buff, that CRC calculation
                     // works in framer_send()
-                    memcpy(out_buff + out_len, cmpPtr->send, cmpPtr->len);
-                    out_len += cmpPtr->len;
+                    memcpy(out_buff + out_len, bytesPtr, bytesLen);
+                    out_len += bytesLen;
 
                     if (! (cmpPtr->next && cmpPtr->next->token == BYTES)) {
                         break;
@@ -221,7 +242,18 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
                     cmpPtr = cmpPtr->next;
                 }
 
-                if (! framer_send(fd, out_buff, out_len)) {
+                since = spanNow();
+                ioTimeout(timeout);
+                ret = framer_send(fd, out_buff, out_len);
+                ioTimeout(0);
+                spanAdd(SPAN_SEND, since);
+                if (! ret && timeout && retry > 1) {
+                    // The ack may have been lost, no need to wait any longer
+                    logIT(LOG_NOTICE, "Send failed within %d ms (Retry: %d)", timeout, retry - 1);
+                    metricsRetry();
+                    lost = 1;
+                    goto RETRY;
+                } else if (! ret) {
                     logIT1(LOG_ERR, "Error in send, terminating");
                     return -1;
                 }
@@ -239,18 +271,30 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
                 strcat(simOut, " ");
                 break;
             case RECV:
-                if (cmpPtr->len > recvLen) {
+                rLen = cmpPtr->len;
+                if (rLen > recvLen) {
                     // Hopefully, we don't end up here
                     logIT(LOG_ERR, "Recv buffer too small. Is: %d, should be %d",
-                          recvLen, cmpPtr->len);
-                    cmpPtr->len = recvLen;
+                          recvLen, rLen);
+                    rLen = recvLen;
                 }
                 etime = 0;
                 memset(recvBuf, 0, recvLen);
-                if (framer_receive(fd, recvBuf, cmpPtr->len, &etime) <= 0) {
+                since = spanNow();
+                ioTimeout(timeout);
+                ret = framer_receive(fd, recvBuf, rLen, &etime);
+                ioTimeout(0);
+                spanAdd(SPAN_RECV, since);
+                if (ret <= 0 && timeout && retry > 1) {
+                    logIT(LOG_NOTICE, "No answer within %d ms (Retry: %d)", timeout, retry - 1);
+                    metricsRetry();
+                    lost = 1;
+                    goto RETRY;
+                } else if (ret <= 0) {
                     logIT1(LOG_ERR, "Error in recv, terminating");
                     return -1;
                 }
+                metricsAnswer(spanNow() - since);
                 // If receiving took longer than the timeout, we start the next round
                 if (recvTimeout && (etime > recvTimeout)) {
                     logIT(LOG_NOTICE, "Recv Timeout: %ld ms > %d ms (Retry: %d)",
@@ -259,24 +303,26 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
                         logIT1(LOG_ERR, "Recv timeout, terminating");
                         return -1;
                     }
+                    metricsRetry();
                     goto RETRY;
                 }
 
                 // If some errStr is defined, we check if the result is correct
                 if (cmpPtr->errStr && *cmpPtr->errStr) {
-                    if (memcmp(recvBuf, cmpPtr->errStr, cmpPtr->len) == 0) {
+                    if (memcmp(recvBuf, cmpPtr->errStr, rLen) == 0) {
                         // Wrong answer
                         logIT(LOG_NOTICE, "Errstr matched, wrong result (Retry: %d)", retry - 1);
                         if (retry <= 1) {
                             logIT1(LOG_ERR, "Wrong result, terminating");
                             return -1;
                         }
+                        metricsRetry();
                         goto RETRY;
                     }
                 }
 
                 memset(string, 0, sizeof(string));
-                char2hex(string, recvBuf, cmpPtr->len);
+                char2hex(string, recvBuf, rLen);
                 strcat(simIn, string);
                 strcat(simIn, " ");
 
@@ -284,8 +330,10 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
                 // return the converted value to uPtr
                 memset(result, 0, sizeof(result));
                 if (! supressUnit && cmpPtr->uPtr) {
-                    if (procGetUnit(cmpPtr->uPtr, recvBuf, cmpPtr->len, result, bitpos, pRecvPtr)
-                        <= 0) {
+                    since = spanNow();
+                    ret = procGetUnit(cmpPtr->uPtr, recvBuf, rLen, result, bitpos, pRecvPtr);
+                    spanAdd(SPAN_CONVERT, since);
+                    if (ret <= 0) {
                         logIT(LOG_ERR, "Error in unit conversion: %s, terminating", result);
                         return -1;
                     }
@@ -303,7 +351,7 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
                     // We already sent and received, now we output it.
                     fprintf(iniFD, "%s= %s \n", simOut, simIn);
                 }
-                return cmpPtr->len;
+                return rLen;
                 break;
             case PAUSE:
                 logIT(LOG_INFO, "Waiting %i ms", cmpPtr->len);
@@ -315,24 +363,29 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
             case BYTES:
                 // We send the forwarded sendBuffer. No converting has been done.
                 if (sendLen) {
-                    if (!my_send(fd, sendBuf, sendLen)) {
+                    since = spanNow();
+                    ret = my_send(fd, sendBuf, sendLen);
+                    spanAdd(SPAN_SEND, since);
+                    if (! ret) {
                         logIT1(LOG_ERR, "Error in send, terminating");
                         return -1;
                     }
                     char2hex(string, sendBuf, sendLen);
                     strcat(simOut, string);
                     strcat(simOut, " ");
-                } else if (cmpPtr->len) {
+                } else if ((unitLen >= 0) ? unitLen : cmpPtr->len) {
                     // A unit to use is already defined, and we already converted it
-                    if (! my_send(fd, cmpPtr->send, cmpPtr->len)) {
+                    bytesPtr = (unitLen >= 0) ? unitBuf : cmpPtr->send;
+                    bytesLen = (unitLen >= 0) ? unitLen : cmpPtr->len;
+                    since = spanNow();
+                    ret = my_send(fd, bytesPtr, bytesLen);
+                    spanAdd(SPAN_SEND, since);
+                    if (! ret) {
                         logIT1(LOG_ERR, "Error in send unit bytes, terminating");
-                        free(cmpPtr->send);
-                        cmpPtr->send = NULL;
-                        cmpPtr->len = 0;
                         return -1;
                     }
                     memset(string, 0, sizeof(string));
-                    char2hex(string, cmpPtr->send, cmpPtr->len);
+                    char2hex(string, bytesPtr, bytesLen);
                     strcat(simOut, string);
                     strcat(simOut, " ");
                 }
@@ -346,7 +399,7 @@ int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen,
 RETRY:
         retry--;
         cmpPtr = cPtr; // One more time, please
-    } while ((cmpPtr->errStr || recvTimeout) && (retry > 0));
+    } while ((cmpPtr->errStr || recvTimeout || lost) && (retry > 0));
 
     return 0;
 }
@@ -376,7 +429,7 @@ int execCmd(char *cmd, int fd, char *recvBuf, int recvLen)
     case SEND:
         if (! my_send(fd, hex, hexlen)) {
             logIT1(LOG_ERR, "Error send, terminating");
-            exit(1);
+            return -1;
         }
         break;
     case RECV:
@@ -387,7 +440,7 @@ int execCmd(char *cmd, int fd, char *recvBuf, int recvLen)
         etime = 0;
         if (receive(fd, recvBuf, hexlen, &etime) <= 0) {
             logIT1(LOG_ERR, "Error recv, terminating");
-            exit(1);
+            return -1;
         }
         logIT(LOG_INFO, "Recv: %ld ms", etime);
         // If we have a unit (== uPtr), we convert the received value and also return it to uPtr
@@ -406,19 +459,15 @@ int execCmd(char *cmd, int fd, char *recvBuf, int recvLen)
     return 0;
 }
 
-compilePtr newCompileNode(compilePtr ptr)
+compilePtr newCompileNode(compilePtr ptr, arenaPtr aPtr)
 {
     compilePtr nptr;
 
     if (ptr && ptr->next) {
-        return newCompileNode(ptr->next);
+        return newCompileNode(ptr->next, aPtr);
     }
 
-    nptr = calloc(1, sizeof(Compile));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(aPtr, sizeof(Compile));
 
     if (ptr) {
         ptr->next = nptr;
@@ -432,35 +481,9 @@ compilePtr newCompileNode(compilePtr ptr)
     return nptr;
 }
 
-void removeCompileList(compilePtr ptr)
+// Replaces the variables and macros of the protocol command, returns 0 on errors
+static int expand(commandPtr cPtr, protocolPtr pPtr, arenaPtr aPtr)
 {
-    if (ptr && ptr->next) {
-        removeCompileList(ptr->next);
-    }
-
-    if (ptr) {
-        free(ptr->send);
-        ptr->send = NULL;
-        free(ptr);
-        ptr = NULL;
-    }
-}
-
-int expand(commandPtr cPtr, protocolPtr pPtr)
-{
-    // Recursion
-    if (! cPtr) {
-        return 0;
-    }
-    if (cPtr->next) {
-        expand(cPtr->next, pPtr);
-    }
-
-    // If no address has been set, we do nothing
-    if (! cPtr->addr) {
-        return 0;
-    }
-
     char eString[2000];
     char *ePtr = eString;;
     char var[100];
@@ -476,16 +499,16 @@ int expand(commandPtr cPtr, protocolPtr pPtr)
     // The command pointer's send has to be assembled
 
     // 1. Search command pcmd at the protocol's command
-    if (! (iPtr = (icmdPtr) getIcmdNode( pPtr->icPtr, cPtr->pcmd))) {
+    if (! (iPtr = (icmdPtr) lookupIcmd(pPtr, cPtr->pcmd))) {
         logIT(LOG_ERR, "Protocol command %s (at %s) not defined", cPtr->pcmd, cPtr->name);
-        exit(3);
+        return 0;
     }
 
     // 2. Parse the line and replace the variables with values from cPtr
     sendPtr = iPtr->send;
     sendStartPtr = iPtr->send;
     if (! sendPtr) {
-        return 0;
+        return 1;
     }
 
     logIT(LOG_INFO, "protocmd line: %s", sendPtr);
@@ -538,8 +561,8 @@ int expand(commandPtr cPtr, protocolPtr pPtr)
                     ePtr += strlen(cPtr->unit);
                 }
             } else {
-                logIT(LOG_ERR, "Variable %s Unknown", var);
-                exit(3);
+                logIT(LOG_ERR, "Variable %s Unknown (at %s)", var, cPtr->name);
+                return 0;
             }
         }
         sendPtr = bptr;
@@ -558,14 +581,16 @@ int expand(commandPtr cPtr, protocolPtr pPtr)
     ePtr = eString;
     do {
         ptr = sendPtr;
-        while (*ptr++) {
-            if ((*ptr == ' ') || (*ptr == ';') || (*ptr == '\0')) {
-                break;
-            }
+        // The first character always belongs to the word, an empty line has none
+        if (*ptr) {
+            ptr++;
+        }
+        while (*ptr && (*ptr != ' ') && (*ptr != ';')) {
+            ptr++;
         }
         memset(name, 0, sizeof(name));
         strncpy(name, sendPtr, ptr - sendPtr);
-        if ((mFPtr = getMacroNode(pPtr->mPtr, name))) {
+        if ((mFPtr = lookupMacro(pPtr, name))) {
             strncpy(ePtr, mFPtr->command, strlen(mFPtr->command));
             ePtr += strlen(mFPtr->command);
             *ePtr++ = *ptr;
@@ -573,35 +598,19 @@ int expand(commandPtr cPtr, protocolPtr pPtr)
             strncpy(ePtr, sendPtr, ptr - sendPtr + 1);
             ePtr += ptr - sendPtr + 1;
         }
-        sendPtr = ptr + 1;
+        // Do not step over the end of the line
+        sendPtr = *ptr ? ptr + 1 : ptr;
     } while (*sendPtr);
 
     free(tmpPtr);
     logIT(LOG_INFO, "   after EXPAND:%s", eString);
-    if (! (cPtr->send = calloc(strlen(eString) + 1, sizeof(char)))) {
-        logIT1(LOG_ERR, "calloc failed");
-        exit(1);
-    }
-
-    strcpy(cPtr->send, eString);
+    cPtr->send = arenaStrdup(aPtr, eString);
     return 1;
 }
 
-compilePtr buildByteCode(commandPtr cPtr, unitPtr uPtr)
+// Converts the expanded send string to bytecode, returns 0 on errors
+static int buildByteCode(commandPtr cPtr, unitPtr uPtr, arenaPtr aPtr)
 {
-    // Recursion
-    if (!cPtr) {
-        return 0;
-    }
-    if (cPtr->next) {
-        buildByteCode(cPtr->next, uPtr);
-    }
-
-    // If no address has been given, we do nothing
-    if (! cPtr->addr) {
-        return 0;
-    }
-
     char eString[2000];
     char cmd[200];
     char *ptr;
@@ -621,7 +630,7 @@ compilePtr buildByteCode(commandPtr cPtr, unitPtr uPtr)
 
     if (! sendPtr) {
         // Nothing to do here
-        return 0;
+        return 1;
     }
 
     logIT(LOG_INFO, "BuildByteCode: %s", sendPtr);
@@ -639,7 +648,7 @@ compilePtr buildByteCode(commandPtr cPtr, unitPtr uPtr)
         memset(uSPtr, 0, sizeof(uString));
         token = parseLine(cmd, hex, &hexlen, uString, sizeof(uString));
         logIT(LOG_INFO, "        Token: %d Hexlen: %d, Unit: %s", token, hexlen, uSPtr);
-        cmpPtr = newCompileNode(cmpStartPtr);
+        cmpPtr = newCompileNode(cmpStartPtr, aPtr);
 
         if (!cmpStartPtr) {
             cmpStartPtr = cmpPtr;
@@ -647,31 +656,73 @@ compilePtr buildByteCode(commandPtr cPtr, unitPtr uPtr)
         cmpPtr->token = token;
         cmpPtr->len = hexlen;
         cmpPtr->errStr = cPtr->errStr;
-        cmpPtr->send = calloc(hexlen, sizeof(char));
-        memcpy(cmpPtr->send, hex, hexlen);
+        cmpPtr->send = arenaMemdup(aPtr, hex, hexlen);
 
-        if (*uSPtr && !(cmpPtr->uPtr = getUnitNode(uPtr, uSPtr))) {
-            logIT(LOG_ERR, "Unit %s not defined", uSPtr);
-            exit(3);
+        if (*uSPtr && !(cmpPtr->uPtr = lookupUnit(uPtr, uSPtr))) {
+            logIT(LOG_ERR, "Unit %s (at %s) not defined", uSPtr, cPtr->name);
+            return 0;
         }
 
         sendPtr += strlen(cmd) + 1;
     } while (*sendPtr);
 
     cPtr->cmpPtr = cmpStartPtr;
-    return cmpStartPtr;
+    return 1;
 }
 
-void compileCommand(devicePtr dPtr, unitPtr uPtr)
+// Compiles the calc strings and enums of the units, calc syntax errors
+// show up at load time
+void compileUnits(unitPtr uPtr, arenaPtr aPtr)
 {
-    if (! dPtr) {
-        return;
-    }
-    if (dPtr->next) {
-        compileCommand(dPtr->next, uPtr);
+    char err[1000];
+    struct {
+        char *expr;
+        short integer;
+        calcPtr *prog;
+    } calcs[4];
+    int n;
+
+    for (; uPtr; uPtr = uPtr->next) {
+        if (uPtr->compiled) {
+            continue;
+        }
+        uPtr->compiled = 1;
+        compileEnums(uPtr, aPtr);
+        calcs[0].expr = uPtr->gCalc;
+        calcs[0].integer = 0;
+        calcs[0].prog = &uPtr->gProg;
+        calcs[1].expr = uPtr->sCalc;
+        calcs[1].integer = 0;
+        calcs[1].prog = &uPtr->sProg;
+        calcs[2].expr = uPtr->gICalc;
+        calcs[2].integer = 1;
+        calcs[2].prog = &uPtr->gIProg;
+        calcs[3].expr = uPtr->sICalc;
+        calcs[3].integer = 1;
+        calcs[3].prog = &uPtr->sIProg;
+        for (n = 0; n < 4; n++) {
+            if (! calcs[n].expr || ! *calcs[n].expr) {
+                continue;
+            }
+            if (! (*calcs[n].prog = compileExpression(calcs[n].expr, calcs[n].integer, err, aPtr))) {
+                // The unit still works as before, the error shows up on each conversion
+                logIT(LOG_ERR, "Unit %s: error in calc %s: %s", uPtr->name, calcs[n].expr, err);
+            }
+        }
     }
+}
 
-    logIT(LOG_INFO, "Expanding command for device %s", dPtr->id);
-    expand(dPtr->cmdPtr, dPtr->protoPtr);
-    buildByteCode(dPtr->cmdPtr, uPtr);
+/* Compiles a single command of a device using the protocol pPtr: the macros
+ * are replaced and the string to send is converted to bytecode. Everything
+ * compiled is allocated from aPtr, cPtr must be writable. Returns 0 if the
+ * command refers to an undefined protocol command, variable or unit.
+ */
+int compileCommand(commandPtr cPtr, protocolPtr pPtr, unitPtr uPtr, arenaPtr aPtr)
+{
+    // If no address has been set, we do nothing
+    if (! cPtr->addr) {
+        return 1;
+    }
+    logIT(LOG_INFO, "Compiling command %s", cPtr->name);
+    return expand(cPtr, pPtr, aPtr) && buildByteCode(cPtr, uPtr, aPtr);
 }
@@ -17,13 +17,15 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include "arena.h"
+
 int parseLine(char *lineo, char *hex, int *hexlen, char *uSPtr, ssize_t uSPtrLen);
 int execCmd(char *cmd, int fd, char *result, int resultLen);
-void removeCompileList(compilePtr ptr);
 int execByteCode(compilePtr cmpPtr, int fd, char *recvBuf, short recvLen, char *sendBuf,
                  short sendLen, short supressUnit, char bitpos, int retry, char *pRecvPtr,
                  unsigned short recvTimeout);
-void compileCommand(devicePtr dPtr, unitPtr uPtr);
+void compileUnits(unitPtr uPtr, arenaPtr aPtr);
+int compileCommand(commandPtr cPtr, protocolPtr pPtr, unitPtr uPtr, arenaPtr aPtr);
 
 // Token Definition
 #define WAIT    1
@@ -0,0 +1,217 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Address range planner
+ *
+ * The P300 READ_DATA request carries a length byte, so the values of
+ * several commands reading neighbouring addresses can be fetched with one
+ * frame. The planner sorts the commands by address, merges runs whose
+ * gaps and total length stay within the configured limits and slices the
+ * answer back into the single values.
+ *
+ * Only plain getaddr commands take part: SEND 00 01 <addr> <len> followed
+ * by RECV <len>, without pre command or error string.
+ *
+ * The frames of a group are traced under its first command, the others
+ * get an empty trace span with their result. Each command served counts
+ * the time of the whole frame in its metrics.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "planner.h"
+#include "xmlconfig.h"
+#include "parser.h"
+#include "unit.h"
+#include "common.h"
+#include "framer.h"
+#include "span.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define PLAN_P300      0x41
+#define PLAN_READ_LEN  5
+
+// Returns 1 if the command is a plain P300 read
+int planMergeable(commandPtr cPtr, char pid)
+{
+    compilePtr sPtr = cPtr->cmpPtr;
+    compilePtr rPtr;
+
+    if (pid != PLAN_P300 || cPtr->precmd || cPtr->errStr || ! sPtr) {
+        return 0;
+    }
+    if (sPtr->token != SEND || sPtr->len != PLAN_READ_LEN
+            || sPtr->send[0] != 0x00 || sPtr->send[1] != 0x01) {
+        return 0;
+    }
+    rPtr = sPtr->next;
+    if (! rPtr || rPtr->token != RECV || rPtr->next
+            || rPtr->len != (unsigned char)sPtr->send[4] || rPtr->len < 1) {
+        return 0;
+    }
+    return 1;
+}
+
+static int planAddr(commandPtr cPtr)
+{
+    return ((unsigned char)cPtr->cmpPtr->send[2] << 8) | (unsigned char)cPtr->cmpPtr->send[3];
+}
+
+static int planLen(commandPtr cPtr)
+{
+    return cPtr->cmpPtr->next->len;
+}
+
+static int compareAddr(const void *a, const void *b)
+{
+    return (*(planItemPtr *)a)->addr - (*(planItemPtr *)b)->addr;
+}
+
+// Reads [start, start+len) with one frame and hands the parts to the items
+static int execGroup(planItemPtr *items, int count, int fd, int start, int len)
+{
+    char sendBuf[PLAN_READ_LEN];
+    char recvBuf[PLAN_MAXLEN];
+    char pRecvBuf[MAXBUF];
+    unsigned long etime = 0;
+    compilePtr rPtr;
+    planItemPtr iPtr;
+    uint64_t began;
+    uint64_t answer;
+    uint64_t since;
+    int done = 0;
+    int ret;
+    int n;
+
+    logIT(LOG_INFO, "Planner: reading %04X-%04X for %d commands", start, start + len - 1, count);
+
+    sendBuf[0] = 0x00;
+    sendBuf[1] = 0x01;
+    sendBuf[2] = (start >> 8) & 0xff;
+    sendBuf[3] = start & 0xff;
+    sendBuf[4] = len;
+
+    // Failed frames are not counted for the commands, they are tried singly
+    traceBegin(items[0]->cPtr->seq);
+    metricsBegin(NULL);
+    began = metricsNow();
+    since = spanNow();
+    ret = framer_send(fd, sendBuf, sizeof(sendBuf));
+    spanAdd(SPAN_SEND, since);
+    if (! ret) {
+        logIT1(LOG_ERR, "Planner: error in send");
+        traceEnd(-1);
+        metricsEnd(-1);
+        return -1;
+    }
+    memset(recvBuf, 0, sizeof(recvBuf));
+    since = spanNow();
+    ret = framer_receive(fd, recvBuf, len, &etime);
+    spanAdd(SPAN_RECV, since);
+    if (ret <= 0) {
+        logIT1(LOG_ERR, "Planner: error in recv");
+        traceEnd(-1);
+        metricsEnd(-1);
+        return -1;
+    }
+    answer = spanNow() - since;
+    metricsAnswer(answer);
+    traceEnd(ret);
+    metricsEnd(ret);
+
+    memset(pRecvBuf, 0, sizeof(pRecvBuf));
+    for (n = 0; n < count; n++) {
+        iPtr = items[n];
+        rPtr = iPtr->cPtr->cmpPtr->next;
+        memset(iPtr->recvBuf, 0, sizeof(iPtr->recvBuf));
+        if (! iPtr->noUnit && rPtr->uPtr) {
+            since = spanNow();
+            ret = procGetUnit(rPtr->uPtr, recvBuf + iPtr->addr - start, rPtr->len,
+                              iPtr->recvBuf, iPtr->cPtr->bit, pRecvBuf);
+            spanAdd(SPAN_CONVERT, since);
+            if (ret <= 0) {
+                // Left to the single command, which reports the error
+                logIT(LOG_ERR, "Planner: error in unit conversion of %s", iPtr->cPtr->name);
+                continue;
+            }
+            iPtr->count = 0;
+        } else {
+            memcpy(iPtr->recvBuf, recvBuf + iPtr->addr - start, rPtr->len);
+            iPtr->count = rPtr->len;
+        }
+        if (n) {
+            traceBegin(iPtr->cPtr->seq);
+            traceEnd(rPtr->len);
+        }
+        metricsShared(iPtr->cPtr->name, metricsNow() - began, answer);
+        iPtr->done = 1;
+        done++;
+    }
+
+    return done;
+}
+
+/* Executes the mergeable items (see planMergeable()) in as few frames as
+ * possible. Items not sharing a frame with another one are left alone.
+ * Returns the number of items done, or -1 if a frame failed.
+ */
+int execPlan(planItemPtr *items, int count, int fd, int gap, int maxLen)
+{
+    int first;
+    int n;
+    int start;
+    int end;
+    int itemEnd;
+    int done = 0;
+    int ret;
+
+    if (maxLen > PLAN_MAXLEN) {
+        maxLen = PLAN_MAXLEN;
+    }
+    for (n = 0; n < count; n++) {
+        items[n]->addr = planAddr(items[n]->cPtr);
+        items[n]->done = 0;
+    }
+    qsort(items, count, sizeof(planItemPtr), compareAddr);
+
+    first = 0;
+    while (first < count) {
+        start = items[first]->addr;
+        end = start + planLen(items[first]->cPtr);
+        for (n = first + 1; n < count; n++) {
+            itemEnd = items[n]->addr + planLen(items[n]->cPtr);
+            if (items[n]->addr > end + gap || (itemEnd > end ? itemEnd : end) - start > maxLen) {
+                break;
+            }
+            if (itemEnd > end) {
+                end = itemEnd;
+            }
+        }
+        if (n - first > 1) {
+            if ((ret = execGroup(items + first, n - first, fd, start, end - start)) < 0) {
+                return -1;
+            }
+            done += ret;
+        }
+        first = n;
+    }
+
+    return done;
+}
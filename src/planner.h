@@ -0,0 +1,44 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Address range planner: merges neighbouring P300 reads into one frame
+
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include "xmlconfig.h"
+#include "parser.h"
+
+// Largest read we ask the device for in one frame
+#define PLAN_MAXLEN 128
+
+typedef struct planItem *planItemPtr;
+
+typedef struct planItem {
+    commandPtr cPtr;
+    short noUnit;
+    void *data;
+    int addr;
+    short done;
+    // Like execByteCode(): 0 for a unit converted string, n for raw bytes
+    int count;
+    char recvBuf[MAXBUF];
+} PlanItem;
+
+int planMergeable(commandPtr cPtr, char pid);
+int execPlan(planItemPtr *items, int count, int fd, int gap, int maxLen);
+
+#endif // PLANNER_H
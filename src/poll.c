@@ -0,0 +1,120 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Poll schedule
+ *
+ * Each <command> in <poll> is read every <interval> seconds, shifted by a
+ * random offset of up to <jitter> seconds. The interval adapts to the
+ * value: after POLL_STABLE unchanged results it is doubled up to <max>,
+ * a changed result halves it down to <min>. The daemon only asks for the
+ * next due entry when the device has nothing else to do.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "poll.h"
+#include "common.h"
+
+static void schedule(pollPtr ptr, time_t now)
+{
+    int offset = 0;
+
+    if (ptr->jitter > 0) {
+        offset = random() % (2 * ptr->jitter + 1) - ptr->jitter;
+    }
+    ptr->due = now + ptr->current + offset;
+    if (ptr->due <= now) {
+        ptr->due = now + 1;
+    }
+}
+
+/* Returns the most overdue entry or NULL if none is due. *wait gets the
+ * seconds until the next one is due, -1 if there is nothing to poll.
+ */
+pollPtr pollNext(pollPtr ptr, int *wait)
+{
+    pollPtr nextPtr = NULL;
+    time_t now = monotonicTime();
+
+    *wait = -1;
+    for (; ptr; ptr = ptr->next) {
+        if (ptr->current < 0) {
+            continue;
+        }
+        if (ptr->current == 0) {
+            // New schedule, the first round is spread over the jitter
+            ptr->current = ptr->interval;
+            ptr->due = now + (ptr->jitter > 0 ? random() % (ptr->jitter + 1) : 0);
+        }
+        if (! nextPtr || ptr->due < nextPtr->due) {
+            nextPtr = ptr;
+        }
+    }
+    if (! nextPtr) {
+        return NULL;
+    }
+    if (nextPtr->due > now) {
+        *wait = nextPtr->due - now;
+        return NULL;
+    }
+    return nextPtr;
+}
+
+// The value has been read (NULL: failed), the next round is planned
+void pollDone(pollPtr ptr, const char *value)
+{
+    if (ptr->current < 0) {
+        return;
+    }
+    if (value) {
+        if (ptr->last && strcmp(ptr->last, value) == 0) {
+            if (++ptr->stable >= POLL_STABLE && ptr->current < ptr->max) {
+                ptr->current = (ptr->current * 2 < ptr->max) ? ptr->current * 2 : ptr->max;
+                ptr->stable = 0;
+                logIT(LOG_INFO, "Poll %s: stable, interval %d s", ptr->name, ptr->current);
+            }
+        } else {
+            if (ptr->last && ptr->current > ptr->min) {
+                ptr->current = (ptr->current / 2 > ptr->min) ? ptr->current / 2 : ptr->min;
+                logIT(LOG_INFO, "Poll %s: changed, interval %d s", ptr->name, ptr->current);
+            }
+            ptr->stable = 0;
+            free(ptr->last);
+            if (! (ptr->last = strdup(value))) {
+                logIT1(LOG_ERR, "malloc failed");
+                exit(1);
+            }
+        }
+    }
+    schedule(ptr, monotonicTime());
+}
+
+void pollDisable(pollPtr ptr)
+{
+    ptr->current = -1;
+}
+
+// How long a polled value may be served from the cache
+int pollTTL(pollPtr ptr)
+{
+    if (! ptr || ptr->current <= 0) {
+        return 0;
+    }
+    return 2 * ptr->current + ptr->jitter;
+}
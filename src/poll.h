@@ -0,0 +1,32 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Schedule of the background reads configured in <poll>
+
+#ifndef POLL_H
+#define POLL_H
+
+#include "xmlconfig.h"
+
+// Unchanged results before the interval is stretched
+#define POLL_STABLE 3
+
+pollPtr pollNext(pollPtr ptr, int *wait);
+void pollDone(pollPtr ptr, const char *value);
+void pollDisable(pollPtr ptr);
+int pollTTL(pollPtr ptr);
+
+#endif // POLL_H
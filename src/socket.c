@@ -136,6 +136,10 @@ int listenToSocket(int listenfd, int makeChild)
         getnameinfo((struct sockaddr *) &cliaddr, cliaddrlen, clienthost, sizeof(clienthost),
                     clientservice, sizeof(clientservice), NI_NUMERICHOST);
 
+        if (connfd < 0 && errno == EINTR) {
+            // Interrupted by a signal the caller has to look at
+            return -1;
+        }
         if (connfd < 0) {
             logIT(LOG_NOTICE, "accept on host %s: port %s", clienthost, clientservice);
             close(connfd);
@@ -246,8 +250,21 @@ ssize_t writen(int fd, const void *vptr, size_t n)
 
 // end writen
 
+// The event loop queues the output of its nonblocking sessions
+static writeHook outputHook = NULL;
+
+void setWriteHook(writeHook hook)
+{
+    outputHook = hook;
+}
+
 ssize_t Writen(int fd, void *ptr, size_t nbytes)
 {
+    ssize_t n;
+
+    if (outputHook && (n = outputHook(fd, ptr, nbytes)) >= 0) {
+        return n;
+    }
     if (writen(fd, ptr, nbytes) != nbytes) {
         logIT1(LOG_ERR, "Error writing to socket");
         return 0;
@@ -27,6 +27,10 @@ void closeSocket(int sockfd);
 ssize_t writen(int fd, const void *vptr, size_t n);
 ssize_t Writen(int fd, void *ptr, size_t nbytes);
 
+// Takes over Writen() for the descriptors it knows, returns -1 for all others
+typedef ssize_t (*writeHook)(int fd, void *ptr, size_t nbytes);
+void setWriteHook(writeHook hook);
+
 ssize_t readn(int fd, void *vptr, size_t n);
 ssize_t Readn(int fd, void *ptr, size_t nbytes);
 
@@ -0,0 +1,118 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Request spans
+ *
+ * A span follows one request from the moment it is read from the client
+ * until its answer is written and sums up the time spent in each phase:
+ * waiting in the queue of the event loop, waiting for the device lock,
+ * opening the link, sending, receiving, converting units and writing the
+ * answer. Whatever is not in a phase is the work in between.
+ *
+ * The span of the request being worked on is attached to the thread, so
+ * the layers below only call spanAdd() and need not know which request
+ * it is. In the event loop the span travels with the request from the
+ * loop to the broker thread and back.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include "span.h"
+#include "common.h"
+
+static const char *phaseNames[SPAN_PHASES] = {
+    "queue", "lock", "open", "send", "recv", "convert", "write"
+};
+
+static __thread Span *current = NULL;
+
+uint64_t spanNow()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Starts the span of a request, it begins now
+void spanInit(Span *spPtr, unsigned long id)
+{
+    memset(spPtr, 0, sizeof(*spPtr));
+    spPtr->id = id;
+    spPtr->start = spanNow();
+}
+
+// The time of this thread goes to spPtr until spanDetach(), returns the
+// span attached before
+Span *spanAttach(Span *spPtr)
+{
+    Span *prevPtr = current;
+
+    current = spPtr;
+    return prevPtr;
+}
+
+void spanDetach()
+{
+    current = NULL;
+}
+
+// Adds the time since the given spanNow() to a phase of the attached span
+void spanAdd(int phase, uint64_t since)
+{
+    if (current) {
+        current->ns[phase] += spanNow() - since;
+    }
+}
+
+// Adds the phases of src to dest, for work done for several requests at once
+void spanMerge(Span *dest, Span *src)
+{
+    int n;
+
+    for (n = 0; n < SPAN_PHASES; n++) {
+        dest->ns[n] += src->ns[n];
+    }
+}
+
+// "<id>: <total> ms, queue <ms> lock <ms> ...", the total is up to now
+int spanFormat(Span *spPtr, char *buf, size_t size)
+{
+    size_t len;
+    int n;
+
+    len = snprintf(buf, size, "%lu: %.1f ms,", spPtr->id, (spanNow() - spPtr->start) / 1000000.0);
+    for (n = 0; n < SPAN_PHASES && len < size; n++) {
+        len += snprintf(buf + len, size - len, " %s %.1f", phaseNames[n], spPtr->ns[n] / 1000000.0);
+    }
+    return (len < size) ? len : size - 1;
+}
+
+// Logs the breakdown of a request that took at least slowMs (0: never)
+void spanSlow(Span *spPtr, const char *name, int slowMs)
+{
+    char text[256];
+
+    if (slowMs <= 0 || spanNow() - spPtr->start < (uint64_t)slowMs * 1000000) {
+        return;
+    }
+    spanFormat(spPtr, text, sizeof(text));
+    logIT(LOG_WARNING, "Slow %s, request %s", name, text);
+}
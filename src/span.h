@@ -0,0 +1,50 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Where the time of a request went, see span.c
+
+#ifndef SPAN_H
+#define SPAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Phases of a request
+#define SPAN_QUEUE   0
+#define SPAN_LOCK    1
+#define SPAN_OPEN    2
+#define SPAN_SEND    3
+#define SPAN_RECV    4
+#define SPAN_CONVERT 5
+#define SPAN_WRITE   6
+#define SPAN_PHASES  7
+
+typedef struct span {
+    unsigned long id;
+    uint64_t start;
+    uint64_t ns[SPAN_PHASES];
+} Span;
+
+uint64_t spanNow();
+void spanInit(Span *spPtr, unsigned long id);
+Span *spanAttach(Span *spPtr);
+void spanDetach();
+void spanAdd(int phase, uint64_t since);
+void spanMerge(Span *dest, Span *src);
+int spanFormat(Span *spPtr, char *buf, size_t size);
+void spanSlow(Span *spPtr, const char *name, int slowMs);
+
+#endif // SPAN_H
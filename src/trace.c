@@ -0,0 +1,236 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Flight recorder
+ *
+ * Every frame sent to or received from the device, and the begin and end
+ * of every command, is recorded into a ring of fixed size entries. It is
+ * always on: recording takes a clock read, one atomic add and a copy of
+ * at most TRACE_DATA bytes, nothing is formatted. The ring is mapped
+ * shared before any child is forked, so the children of the forking
+ * server record into the same ring and any session can dump all of it.
+ *
+ * A writer claims a position with the atomic add and marks the entry
+ * invalid while it fills it, then stores position + 1 as its seq. The
+ * dump copies an entry and takes it only if its seq was the expected one
+ * before and after the copy, entries overwritten meanwhile are skipped.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "trace.h"
+#include "common.h"
+#include "socket.h"
+
+typedef struct traceRing {
+    uint64_t head;
+    // Keeps head on a cache line of its own
+    char pad[56];
+    TraceEntry entries[TRACE_SLOTS];
+} TraceRing;
+
+static TraceRing *ring = NULL;
+static __thread int traceCmd = TRACE_NOCMD;
+// getpid() is a system call, it is only asked after a fork
+static pid_t pid = 0;
+
+static void forkChild()
+{
+    pid = getpid();
+}
+
+void traceInit()
+{
+    void *ptr;
+
+    if (ring) {
+        return;
+    }
+    ptr = mmap(NULL, sizeof(TraceRing), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        logIT1(LOG_WARNING, "Could not map the flight recorder, it is off");
+        return;
+    }
+    ring = ptr;
+    pid = getpid();
+    pthread_atfork(NULL, NULL, forkChild);
+}
+
+static void record(int kind, int cmd, const char *buf, int size, int result)
+{
+    struct timespec ts;
+    TraceEntry *ePtr;
+    uint64_t pos;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    ePtr = &ring->entries[pos & (TRACE_SLOTS - 1)];
+
+    __atomic_store_n(&ePtr->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ePtr->ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    ePtr->pid = pid;
+    ePtr->cmd = cmd;
+    ePtr->result = (result < INT16_MIN) ? INT16_MIN : (result > INT16_MAX) ? INT16_MAX : result;
+    ePtr->kind = kind;
+    ePtr->size = (size < 0) ? 0 : (size > UINT16_MAX) ? UINT16_MAX : size;
+    ePtr->len = (ePtr->size > TRACE_DATA) ? TRACE_DATA : ePtr->size;
+    if (ePtr->len) {
+        memcpy(ePtr->data, buf, ePtr->len);
+    }
+    __atomic_store_n(&ePtr->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Starts a command, the frames until traceEnd() are recorded with its id
+void traceBegin(int cmd)
+{
+    traceCmd = cmd;
+    if (ring) {
+        record(TRACE_BEGIN, cmd, NULL, 0, 0);
+    }
+}
+
+void traceEnd(int result)
+{
+    if (ring) {
+        record(TRACE_END, traceCmd, NULL, 0, result);
+    }
+    traceCmd = TRACE_NOCMD;
+}
+
+void traceFrame(int kind, const char *buf, int size, int result)
+{
+    if (ring) {
+        record(kind, traceCmd, buf, size, result);
+    }
+}
+
+static unsigned char *put16(unsigned char *ptr, uint16_t value)
+{
+    value = htons(value);
+    memcpy(ptr, &value, 2);
+    return ptr + 2;
+}
+
+static unsigned char *put32(unsigned char *ptr, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(ptr, &value, 4);
+    return ptr + 4;
+}
+
+static unsigned char *put64(unsigned char *ptr, uint64_t value)
+{
+    ptr = put32(ptr, value >> 32);
+    return put32(ptr, value & 0xffffffff);
+}
+
+/* Writes the recorded entries, oldest first, in the format of trace.h.
+ * names are the command names by id. Returns 0 if the recorder is off or
+ * the client went away.
+ */
+int traceDump(int fd, const char **names, int count)
+{
+    unsigned char *buf;
+    unsigned char *ptr;
+    TraceEntry entry;
+    TraceEntry *ePtr;
+    struct timespec mono;
+    struct timespec wall;
+    uint64_t head;
+    uint64_t pos;
+    uint64_t seq;
+    uint32_t entries = 0;
+    size_t len;
+    size_t size;
+    int n;
+
+    if (! ring) {
+        return 0;
+    }
+    size = TRACE_HEADER_LEN + TRACE_SLOTS * (TRACE_ENTRY_LEN + TRACE_DATA);
+    for (n = 0; n < count; n++) {
+        size += 1 + (names[n] ? strlen(names[n]) : 0);
+    }
+    if (! (buf = malloc(size))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &wall);
+    ptr = buf + TRACE_HEADER_LEN;
+    for (n = 0; n < count; n++) {
+        len = names[n] ? strlen(names[n]) : 0;
+        len = (len > 255) ? 255 : len;
+        *ptr++ = len;
+        if (len) {
+            memcpy(ptr, names[n], len);
+            ptr += len;
+        }
+    }
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (pos = (head > TRACE_SLOTS) ? head - TRACE_SLOTS : 0; pos < head; pos++) {
+        ePtr = &ring->entries[pos & (TRACE_SLOTS - 1)];
+        seq = __atomic_load_n(&ePtr->seq, __ATOMIC_ACQUIRE);
+        if (seq != pos + 1) {
+            // Still being written or already overwritten
+            continue;
+        }
+        memcpy(&entry, ePtr, sizeof(entry));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ePtr->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        ptr = put64(ptr, seq);
+        ptr = put64(ptr, entry.ns);
+        ptr = put32(ptr, entry.pid);
+        ptr = put16(ptr, entry.cmd);
+        ptr = put16(ptr, (uint16_t)entry.result);
+        *ptr++ = entry.kind;
+        *ptr++ = entry.len;
+        ptr = put16(ptr, entry.size);
+        memcpy(ptr, entry.data, entry.len);
+        ptr += entry.len;
+        entries++;
+    }
+    len = ptr - buf;
+
+    ptr = buf;
+    memcpy(ptr, TRACE_MAGIC, 4);
+    ptr += 4;
+    *ptr++ = TRACE_VERSION;
+    *ptr++ = 0;
+    ptr = put16(ptr, count);
+    ptr = put32(ptr, entries);
+    ptr = put64(ptr, (uint64_t)mono.tv_sec * 1000000000 + mono.tv_nsec);
+    ptr = put64(ptr, (uint64_t)wall.tv_sec * 1000000000 + wall.tv_nsec);
+
+    n = (Writen(fd, buf, len) == (ssize_t)len);
+    free(buf);
+    return n;
+}
@@ -0,0 +1,83 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Flight recorder of the bus traffic, written by "trace dump"
+ *
+ * All numbers are in network byte order.
+ *
+ * Dump:   4 "VTRC" | u8 version | u8 reserved | u16 nameCount
+ *         | u32 entryCount | u64 now | u64 wallclock
+ *         | nameCount names | entryCount entries
+ *   now is the monotonic clock in ns at the dump, wallclock the ns
+ *   since the epoch at the same moment
+ *   name:  u8 len | name, the command id is its position
+ *   entry: u64 seq | u64 time (monotonic ns) | u32 pid | u16 cmd
+ *          | i16 result | u8 kind | u8 len | u16 size | len bytes
+ *     size is the number of bytes on the bus, only the first len of
+ *     them are recorded
+ *
+ * The ids number the commands of the device like in binproto.h, they
+ * change when the configuration is reloaded.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "VTRC"
+#define TRACE_VERSION 1
+
+// Entries kept, a power of two
+#define TRACE_SLOTS 4096
+// Bytes of a frame kept per entry
+#define TRACE_DATA 36
+
+// Entry kinds
+#define TRACE_BEGIN 1
+#define TRACE_END   2
+#define TRACE_SEND  3
+#define TRACE_RECV  4
+
+// Command id of traffic outside of a command, e.g. of raw mode
+#define TRACE_NOCMD 0xffff
+
+// Results of TRACE_RECV besides the number of bytes
+#define TRACE_ERROR   -1
+#define TRACE_TIMEOUT -2
+
+#define TRACE_HEADER_LEN 28
+#define TRACE_ENTRY_LEN 28
+
+typedef struct traceEntry {
+    uint64_t seq;
+    uint64_t ns;
+    uint32_t pid;
+    uint16_t cmd;
+    int16_t result;
+    uint8_t kind;
+    uint8_t len;
+    uint16_t size;
+    uint8_t data[TRACE_DATA];
+} TraceEntry;
+
+void traceInit();
+void traceBegin(int cmd);
+void traceEnd(int result);
+void traceFrame(int kind, const char *buf, int size, int result);
+int traceDump(int fd, const char **names, int count);
+
+#endif // TRACE_H
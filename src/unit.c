@@ -45,6 +45,7 @@
 #include "xmlconfig.h"
 #include "common.h"
 #include "arithmetic.h"
+#include "unit.h"
 
 // We need this at procSet ...
 #define FLOAT 1
@@ -73,9 +74,9 @@
 
 int getCycleTime(char *recv, int len, char *result);
 int setCycleTime(char *string, char *sendBuf);
-short bytes2Enum(enumPtr ptr, char *bytes, char **text, short len);
-short text2Enum(enumPtr ptr, char *text, char **bytes, short *len);
-int getErrState(enumPtr ePtr, char *recv, int len, char *result);
+short bytes2Enum(unitPtr uPtr, char *bytes, char **text, short len);
+short text2Enum(unitPtr uPtr, char *text, char **bytes, short *len);
+int getErrState(unitPtr uPtr, char *recv, int len, char *result);
 int getSysTime(char *recv, int len, char *result);
 int setSysTime(char *input, char *sendBuf);
 
@@ -250,7 +251,7 @@ int setSysTime(char *input, char *sendBuf)
     return string2chr(systime, sendBuf, 8);
 }
 
-int getErrState(enumPtr ePtr, char *recv, int len, char *result)
+int getErrState(unitPtr uPtr, char *recv, int len, char *result)
 {
     int i;
     char *errtext;
@@ -268,7 +269,7 @@ int getErrState(enumPtr ePtr, char *recv, int len, char *result)
         memset(string, 0, sizeof(string));
         memset(systime, 0, sizeof(systime));
         // Error code: Byte 0
-        if (bytes2Enum(ePtr, ptr, &errtext, 1))
+        if (bytes2Enum(uPtr, ptr, &errtext, 1))
             // Rest SysTime
             if (getSysTime(ptr + 1, 8, systime)) {
                 snprintf(string, sizeof(string),
@@ -285,7 +286,146 @@ int getErrState(enumPtr ePtr, char *recv, int len, char *result)
     return 1;
 }
 
-short bytes2Enum(enumPtr ptr, char *bytes, char **text, short len)
+/* Enum tables
+ *
+ * compileEnums() turns the enum list of a unit into tables. They answer
+ * like getEnumNode() walking the list: the first entry in list order
+ * whose bytes start with the searched ones wins, entries shorter than
+ * the search count as padded with zeros. The entry without bytes is the
+ * default. The tables live in the arena of the configuration.
+ */
+
+static int enumByteAt(enumPtr ePtr, int n)
+{
+    return (n < ePtr->len) ? (unsigned char)ePtr->bytes[n] : 0;
+}
+
+// Compares the first len bytes of the padded entry with bytes
+static int enumCompare(enumPtr ePtr, const char *bytes, int len)
+{
+    int n;
+    int diff;
+
+    for (n = 0; n < len; n++) {
+        if ((diff = enumByteAt(ePtr, n) - (unsigned char)bytes[n])) {
+            return diff;
+        }
+    }
+    return 0;
+}
+
+// Key length for compareKeys(), the tables are built while loading only
+static int sortLen;
+
+static int compareKeys(const void *a, const void *b)
+{
+    const EnumKey *aPtr = a;
+    const EnumKey *bPtr = b;
+    int n;
+    int diff;
+
+    for (n = 0; n < sortLen; n++) {
+        if ((diff = enumByteAt(aPtr->ePtr, n) - enumByteAt(bPtr->ePtr, n))) {
+            return diff;
+        }
+    }
+    return aPtr->order - bPtr->order;
+}
+
+void compileEnums(unitPtr uPtr, arenaPtr aPtr)
+{
+    enumTablePtr tPtr;
+    enumPtr ePtr;
+    int order;
+
+    if (! uPtr->ePtr || uPtr->eTab) {
+        return;
+    }
+    tPtr = arenaAlloc(aPtr, sizeof(*tPtr));
+    tPtr->byText = newNameIndex(aPtr);
+    for (ePtr = uPtr->ePtr; ePtr; ePtr = ePtr->next) {
+        if (ePtr->text) {
+            addNameIndex(tPtr->byText, ePtr->text, ePtr);
+        }
+        if (! ePtr->bytes) {
+            if (! tPtr->dflt) {
+                tPtr->dflt = ePtr;
+            }
+            continue;
+        }
+        if (! tPtr->byByte[enumByteAt(ePtr, 0)]) {
+            tPtr->byByte[enumByteAt(ePtr, 0)] = ePtr;
+        }
+        tPtr->count++;
+        tPtr->maxLen = (ePtr->len > tPtr->maxLen) ? ePtr->len : tPtr->maxLen;
+    }
+    tPtr->keys = arenaAlloc(aPtr, (tPtr->count ? tPtr->count : 1) * sizeof(EnumKey));
+    order = 0;
+    tPtr->count = 0;
+    for (ePtr = uPtr->ePtr; ePtr; ePtr = ePtr->next, order++) {
+        if (ePtr->bytes) {
+            tPtr->keys[tPtr->count].ePtr = ePtr;
+            tPtr->keys[tPtr->count++].order = order;
+        }
+    }
+    sortLen = tPtr->maxLen;
+    qsort(tPtr->keys, tPtr->count, sizeof(EnumKey), compareKeys);
+    uPtr->eTab = tPtr;
+}
+
+static enumPtr searchEnumKeys(enumTablePtr tPtr, const char *bytes, int len)
+{
+    int low = 0;
+    int high = tPtr->count;
+    int mid;
+    int n;
+    enumPtr ePtr = NULL;
+    int order = 0;
+
+    if (len > tPtr->maxLen) {
+        // The entries are padded with zeros
+        for (n = tPtr->maxLen; n < len; n++) {
+            if (bytes[n]) {
+                return NULL;
+            }
+        }
+        len = tPtr->maxLen;
+    }
+    // The first key not below the bytes, then the earliest of the equal ones
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (enumCompare(tPtr->keys[mid].ePtr, bytes, len) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (n = low; n < tPtr->count && enumCompare(tPtr->keys[n].ePtr, bytes, len) == 0; n++) {
+        if (! ePtr || tPtr->keys[n].order < order) {
+            ePtr = tPtr->keys[n].ePtr;
+            order = tPtr->keys[n].order;
+        }
+    }
+    return ePtr;
+}
+
+static enumPtr findEnumBytes(unitPtr uPtr, char *bytes, short len)
+{
+    enumTablePtr tPtr = uPtr->eTab;
+    enumPtr ePtr;
+
+    if (! tPtr) {
+        if (! (ePtr = getEnumNode(uPtr->ePtr, bytes, len))) {
+            // We search for the default
+            ePtr = getEnumNode(uPtr->ePtr, bytes, -1);
+        }
+        return ePtr;
+    }
+    ePtr = (len == 1) ? tPtr->byByte[(unsigned char)*bytes] : searchEnumKeys(tPtr, bytes, len);
+    return ePtr ? ePtr : tPtr->dflt;
+}
+
+short bytes2Enum(unitPtr uPtr, char *bytes, char **text, short len)
 {
     enumPtr ePtr = NULL;
     char string[200];
@@ -295,150 +435,246 @@ short bytes2Enum(enumPtr ptr, char *bytes, char **text, short len)
     }
 
     // Search for the appropriate enum and return the value
-    if (! (ePtr = getEnumNode(ptr, bytes, len))) {
-        // We search for the default
-        ePtr = getEnumNode(ptr, bytes, -1);
+    if (! (ePtr = findEnumBytes(uPtr, bytes, len))) {
+        return 0;
     }
-    if (ePtr) {
-        *text = ePtr->text;
+    *text = ePtr->text;
+    if (logWanted(LOG_INFO)) {
         memset(string, 0, sizeof(string));
         char2hex(string, bytes, len);
         strcat(string, " -> ");
         strcat(string, ePtr->text);
         logIT1(LOG_INFO, string);
-        return 1;
-    } else {
-        return 0;
     }
+    return 1;
 }
 
-short text2Enum(enumPtr ptr, char *text, char **bytes, short *len)
+short text2Enum(unitPtr uPtr, char *text, char **bytes, short *len)
 {
     enumPtr ePtr = NULL;
     char string[200];
     char string2[1000];
 
     // Search for the appropriate enum and return the value
-    if (! (ePtr = getEnumNode(ptr, text, 0))) {
+    if (uPtr->eTab) {
+        ePtr = getNameIndex(uPtr->eTab->byText, text);
+    } else {
+        ePtr = getEnumNode(uPtr->ePtr, text, 0);
+    }
+    if (! ePtr) {
         return 0;
     }
 
     *bytes = ePtr->bytes;
     *len = ePtr->len;
-    memset(string, 0, sizeof(string));
-    strncpy(string, text, sizeof(string));
-    strcat(string, " -> ");
-    memset(string2, 0, sizeof(string2));
-    char2hex(string2, ePtr->bytes, ePtr->len);
-    strcat(string, string2);
-    logIT1(LOG_INFO, string);
+    if (logWanted(LOG_INFO)) {
+        memset(string, 0, sizeof(string));
+        strncpy(string, text, sizeof(string));
+        strcat(string, " -> ");
+        memset(string2, 0, sizeof(string2));
+        char2hex(string2, ePtr->bytes, ePtr->len);
+        strcat(string, string2);
+        logIT1(LOG_INFO, string);
+    }
 
     return *len;
 }
 
+// Adapters of the types with their own conversion to the unit type table
+static int getCycleTimeUnit(unitPtr uPtr, char *recv, int len, char *result)
+{
+    (void)uPtr;
+    return getCycleTime(recv, len, result);
+}
+
+static int getSysTimeUnit(unitPtr uPtr, char *recv, int len, char *result)
+{
+    (void)uPtr;
+    return getSysTime(recv, len, result);
+}
+
+static int getErrStateUnit(unitPtr uPtr, char *recv, int len, char *result)
+{
+    return getErrState(uPtr, recv, len, result);
+}
+
+static int getEnumUnit(unitPtr uPtr, char *recv, int len, char *result)
+{
+    char *tPtr;
+
+    if (! bytes2Enum(uPtr, recv, &tPtr, len)) {
+        sprintf(result, "Didn't find an appropriate enum");
+        return 0;
+    }
+    strcpy(result, tPtr);
+    return 1;
+}
+
+static int setCycleTimeUnit(unitPtr uPtr, char *input, char *sendBuf, short *sendLen)
+{
+    (void)uPtr;
+    if (! *input) {
+        return 0;
+    }
+    return (*sendLen = setCycleTime(input, sendBuf)) != 0;
+}
+
+static int setSysTimeUnit(unitPtr uPtr, char *input, char *sendBuf, short *sendLen)
+{
+    (void)uPtr;
+    return (*sendLen = setSysTime(input, sendBuf)) != 0;
+}
+
+static int setEnumUnit(unitPtr uPtr, char *input, char *sendBuf, short *sendLen)
+{
+    char *ptr;
+    short count;
+
+    if (! *input) {
+        return 0;
+    }
+    if (! (count = text2Enum(uPtr, input, &ptr, sendLen))) {
+        sprintf(sendBuf, "Did not find an appropriate enum");
+        return 0;
+    }
+    memcpy(sendBuf, ptr, count);
+    return 1;
+}
+
+// The numeric types, the device uses little endian
+static float decodeChar(const char *buf)
+{
+    return (int8_t)buf[0];
+}
+
+static float decodeUChar(const char *buf)
+{
+    return (uint8_t)buf[0];
+}
+
+static float decodeShort(const char *buf)
+{
+    int16_t value;
+
+    memcpy(&value, buf, 2);
+    return (int16_t)__le16_to_cpu(value);
+}
+
+static float decodeUShort(const char *buf)
+{
+    uint16_t value;
+
+    memcpy(&value, buf, 2);
+    return (uint16_t)__le16_to_cpu(value);
+}
+
+static float decodeInt(const char *buf)
+{
+    int32_t value;
+
+    memcpy(&value, buf, 4);
+    return (int32_t)__le32_to_cpu(value);
+}
+
+static float decodeUInt(const char *buf)
+{
+    uint32_t value;
+
+    memcpy(&value, buf, 4);
+    return (uint32_t)__le32_to_cpu(value);
+}
+
+static void encode8(char *buf, int64_t value)
+{
+    buf[0] = value & 0xff;
+}
+
+static void encode16(char *buf, int64_t value)
+{
+    uint16_t le = __cpu_to_le16((uint16_t)value);
+
+    memcpy(buf, &le, 2);
+}
+
+static void encode32(char *buf, int64_t value)
+{
+    uint32_t le = __cpu_to_le32((uint32_t)value);
+
+    memcpy(buf, &le, 4);
+}
+
+typedef struct unitType {
+    const char *name;
+    // Types with their own conversion
+    int (*get)(unitPtr uPtr, char *recv, int len, char *result);
+    int (*set)(unitPtr uPtr, char *input, char *sendBuf, short *sendLen);
+    // Numeric types, the value is run through the calc of the unit
+    float (*decode)(const char *buf);
+    void (*encode)(char *buf, int64_t value);
+    short width;
+    const char *format;
+} UnitType;
+
+// Indexed by the UNIT_* codes
+static const UnitType unitTypes[] = {
+    { NULL, NULL, NULL, NULL, NULL, 0, NULL },
+    { "cycletime", getCycleTimeUnit, setCycleTimeUnit, NULL, NULL, 0, NULL },
+    { "systime", getSysTimeUnit, setSysTimeUnit, NULL, NULL, 0, NULL },
+    { "errstate", getErrStateUnit, NULL, NULL, NULL, 0, NULL },
+    { "enum", getEnumUnit, setEnumUnit, NULL, NULL, 0, NULL },
+    { "char", NULL, NULL, decodeChar, encode8, 1, "%02X %s" },
+    { "uchar", NULL, NULL, decodeUChar, encode8, 1, "%02X %s" },
+    { "short", NULL, NULL, decodeShort, encode16, 2, "%04X %s" },
+    { "ushort", NULL, NULL, decodeUShort, encode16, 2, "%04X %s" },
+    { "int", NULL, NULL, decodeInt, encode32, 4, "%08X %s" },
+    { "uint", NULL, NULL, decodeUInt, encode32, 4, "%08X %s" },
+    { NULL, NULL, NULL, NULL, NULL, 0, NULL }
+};
+
+/* Returns the UNIT_* code of a <type>. The type only has to start with
+ * the name, the first match in table order wins.
+ */
+int getUnitType(const char *type)
+{
+    int n;
+
+    if (! type) {
+        return UNIT_NONE;
+    }
+    for (n = UNIT_CYCLETIME; n < UNIT_UNKNOWN; n++) {
+        if (strncmp(type, unitTypes[n].name, strlen(unitTypes[n].name)) == 0) {
+            return n;
+        }
+    }
+    return UNIT_UNKNOWN;
+}
+
 int procGetUnit(unitPtr uPtr, char *recvBuf, int recvLen, char *result, char bitpos, char *pRecvPtr)
 {
     char string[256];
     char error[1000];
     char buffer[MAXBUF];
     char *errPtr = error;
-    //short t;
     float erg;
     int ergI;
-    char formatI[20];
     float floatV = 0;
     char *inPtr;
     char *tPtr;
-    // Here the types for the conversion in <type> tags
-    int8_t charV;
-    uint8_t ucharV;
-    int16_t shortV;
-    int16_t tmpS;
-    uint16_t ushortV;
-    uint16_t tmpUS;
-    int32_t intV;
-    int32_t tmpI;
-    uint32_t tmpUI;
-    uint32_t uintV;
+    const UnitType *typePtr = &unitTypes[uPtr->typeCode];
 
     memset(errPtr, 0, sizeof(error));
 
-    // We tread the different <type> entries
-    if (strstr(uPtr->type, "cycletime") == uPtr->type) {
-        // Cycle time
-        if (getCycleTime(recvBuf, recvLen, result)) {
-            return 1;
-        } else {
-            return -1;
-        }
-    } else if (strstr(uPtr->type, "systime") == uPtr->type) {
-        // System time
-        if (getSysTime(recvBuf, recvLen, result)) {
-            return 1;
-        } else {
-            return -1;
-        }
-    } else if (strstr(uPtr->type, "errstate") == uPtr->type) {
-        // Error code + System time
-        if (getErrState(uPtr->ePtr, recvBuf, recvLen, result)) {
-            return 1;
-        } else {
-            return -1;
-        }
-    } else if (strstr(uPtr->type, "enum") == uPtr->type) {
-        // enum
-        if (bytes2Enum(uPtr->ePtr, recvBuf, &tPtr, recvLen)) {
-            strcpy(result, tPtr);
-            return 1;
-        } else {
-            sprintf(result, "Didn't find an appropriate enum");
-            return -1;
-        }
+    // cycletime, systime, errstate and enum
+    if (typePtr->get) {
+        return typePtr->get(uPtr, recvBuf, recvLen, result) ? 1 : -1;
     }
 
     // Here are all the numeric types
-    if (strstr(uPtr->type, "char") == uPtr->type) {
-        // Conversion to Char 1Byte
-        memcpy(&charV, recvBuf, 1);
-        floatV = charV; // Implicit type conversion to float for our arithmetic
-        sprintf(formatI, "%%02X %%s");
-    } else if (strstr(uPtr->type, "uchar") == uPtr->type) {
-        // Conversion to Unsigned Char 1Byte
-        memcpy(&ucharV, recvBuf, 1);
-        floatV = ucharV; // Implicit type conversion to float for our arithmetic
-        sprintf(formatI, "%%02X %%s");
-    } else if (strstr(uPtr->type, "short") == uPtr->type) {
-        // Conversion to Short 2Byte
-        memcpy(&tmpS, recvBuf, 2);
-        // According to the CPU, the conversion is done here
-        shortV = __le16_to_cpu(tmpS);
-        floatV = shortV; // Implicit type conversion to float for our arithmetic
-        sprintf(formatI, "%%04X %%s");
-    } else if (strstr(uPtr->type, "ushort") == uPtr->type) {
-        // Conversion to  Short 2Byte
-        memcpy(&tmpUS, recvBuf, 2);
-        // According to the CPU, the conversion is done here
-        ushortV = __le16_to_cpu(tmpUS);
-        floatV = ushortV; // Implicit type conversion to float for our arithmetic
-        sprintf(formatI, "%%04X %%s");
-    } else if (strstr(uPtr->type, "int") == uPtr->type) {
-        // Conversion to Int 4Byte
-        memcpy(&tmpI, recvBuf, 4);
-        // According to the CPU, the conversion is done here
-        intV = __le32_to_cpu(tmpI);
-        floatV = intV; // Implicit type conversion to float for our arithmetic
-        sprintf(formatI, "%%08X %%s");
-    } else if (strstr(uPtr->type, "uint") == uPtr->type) {
-        // Conversion to Unsigned Int 4Byte
-        memcpy(&tmpUI, recvBuf, 4);
-        // According to the CPU, the conversion is done here
-        uintV = __le32_to_cpu(tmpUI);
-        floatV = uintV; // Implicit type conversion to float for our arithmetic
-        sprintf(formatI, "%%08X %%s");
-    } else if (uPtr->type) {
+    if (! typePtr->decode) {
         logIT(LOG_ERR, "Unknown type %s in unit %s", uPtr->type, uPtr->name);
         return -1;
     }
+    floatV = typePtr->decode(recvBuf); // Implicit type conversion to float for our arithmetic
 
     // Some logging
     int n;
@@ -457,13 +693,13 @@ int procGetUnit(unitPtr uPtr, char *recvBuf, int recvLen, char *result, char bit
             break;
         }
     }
-
     if (uPtr->gCalc && *uPtr->gCalc) {
         // calc in XML and get defined within
         logIT(LOG_INFO, "Typ: %s (in float: %f)", uPtr->type, floatV);
         inPtr = uPtr->gCalc;
         logIT(LOG_INFO, "(FLOAT) Exp: %s [%s]", inPtr, buffer);
-        erg = execExpression(&inPtr, recvBuf, floatV, errPtr);
+        erg = uPtr->gProg ? execCalc(uPtr->gProg, recvBuf, floatV, errPtr)
+                          : execExpression(&inPtr, recvBuf, floatV, errPtr);
         if (*errPtr) {
             logIT(LOG_ERR, "Exec %s: %s", uPtr->gCalc, error);
             strcpy(result, string);
@@ -474,7 +710,8 @@ int procGetUnit(unitPtr uPtr, char *recvBuf, int recvLen, char *result, char bit
         // icalc in XML and get defined within
         inPtr = uPtr->gICalc;
         logIT(LOG_INFO, "(INT) Exp: %s [BP:%d] [%s]", inPtr, bitpos, buffer);
-        ergI = execIExpression(&inPtr, recvBuf, bitpos, pRecvPtr, errPtr);
+        ergI = uPtr->gIProg ? execICalc(uPtr->gIProg, recvBuf, bitpos, pRecvPtr, errPtr)
+                            : execIExpression(&inPtr, recvBuf, bitpos, pRecvPtr, errPtr);
         if (*errPtr) {
             logIT(LOG_ERR, "Exec %s: %s", uPtr->gCalc, error);
             strcpy(result, string);
@@ -482,11 +719,12 @@ int procGetUnit(unitPtr uPtr, char *recvBuf, int recvLen, char *result, char bit
         }
         logIT(LOG_INFO, "Res: (Hex max. 4 bytes) %08x", ergI);
         res = ergI;
-        if ( uPtr->ePtr && bytes2Enum(uPtr->ePtr, &res, &tPtr, recvLen)) {
+        // res is a single byte
+        if (uPtr->ePtr && bytes2Enum(uPtr, &res, &tPtr, 1)) {
             strcpy(result, tPtr);
             return 1;
         } else {
-            sprintf(result, formatI, ergI, uPtr->entity);
+            sprintf(result, typePtr->format, ergI, uPtr->entity);
             return 1;
         }
         // Probably do the enum search here
@@ -501,26 +739,16 @@ int procSetUnit(unitPtr uPtr, char *sendBuf, short *sendLen, char bitpos, char *
     char buffer[MAXBUF];
     char input[MAXBUF];
     char *errPtr = error;
-    // short t;
     float erg = 0.0;
     int ergI = 0;
     short count;
-    char ergType;
+    char ergType = INT;
     float floatV;
     char *inPtr;
-    // Here the types for the <type> tag conversion
-    int8_t charV;
-    uint8_t ucharV;
-    int16_t shortV;
-    int16_t tmpS;
-    uint16_t ushortV;
-    uint16_t tmpUS;
-    int32_t intV;
-    int32_t tmpI;
-    uint32_t tmpUI;
-    uint32_t uintV;
+    const UnitType *typePtr = &unitTypes[uPtr->typeCode];
 
     memset(errPtr, 0, sizeof(error));
+    memset(string, 0, sizeof(string));
     // Some logging
     int n = 0;
     char *ptr;
@@ -531,48 +759,28 @@ int procSetUnit(unitPtr uPtr, char *sendBuf, short *sendLen, char bitpos, char *
     strncpy(input, sendBuf, sizeof(input));
     memset(sendBuf, 0, *sendLen);
 
-    if (strstr(uPtr->type, "cycletime") == uPtr->type) {
-        // Cycle time
-        if (! *input) {
-            return -1;
-        }
-        if (! (*sendLen = setCycleTime(input, sendBuf))) {
-            return -1;
-        } else  {
-            return 1;
-        }
-    }
-    if (strstr(uPtr->type, "systime") == uPtr->type) {
-        // System time
-        if (! (*sendLen = setSysTime(input, sendBuf))) {
-            return -1;
-        } else  {
-            return 1;
-        }
-    } else if (strstr(uPtr->type, "enum") == uPtr->type) {
-        // enum
-        if (! *input)
-        { return -1; }
-        if (!(count = text2Enum(uPtr->ePtr, input, &ptr, sendLen))) {
-            sprintf(sendBuf, "Did not find an appropriate enum");
-            return -1;
-        } else {
-            memcpy(sendBuf, ptr, count);
-            return 1;
-        }
+    // cycletime, systime and enum
+    if (typePtr->set) {
+        return typePtr->set(uPtr, input, sendBuf, sendLen) ? 1 : -1;
     }
 
     if (! *input) {
         return -1;
     }
 
+    if (! typePtr->encode) {
+        logIT(LOG_ERR, "Unknown type %s in unit %s", uPtr->type, uPtr->name);
+        return -1;
+    }
+
     // Here the forwarded value
     if (uPtr->sCalc && *uPtr->sCalc) {
         // calc in XML and get defined within
         floatV = atof(input);
         inPtr = uPtr->sCalc;
         logIT(LOG_INFO, "Send Exp: %s [V=%f]", inPtr, floatV);
-        erg = execExpression(&inPtr, dumBuf, floatV, errPtr);
+        erg = uPtr->sProg ? execCalc(uPtr->sProg, dumBuf, floatV, errPtr)
+                          : execExpression(&inPtr, dumBuf, floatV, errPtr);
         if (*errPtr) {
             logIT(LOG_ERR, "Exec %s: %s", uPtr->sCalc, error);
             strcpy(sendBuf, string);
@@ -590,14 +798,15 @@ int procSetUnit(unitPtr uPtr, char *sendBuf, short *sendLen, char bitpos, char *
                 sprintf(sendBuf, "Input missing");
                 return -1;
             }
-            if (! (count = text2Enum(uPtr->ePtr, input, &ptr, sendLen))) {
+            if (! (count = text2Enum(uPtr, input, &ptr, sendLen))) {
                 sprintf(sendBuf, "Did not find an appropriate enum");
                 return -1;
             } else {
                 memset(dumBuf, 0, sizeof(dumBuf));
                 memcpy(dumBuf, ptr, count);
                 logIT(LOG_INFO, "(INT) Exp: %s [BP:%d]", inPtr, bitpos);
-                ergI = execIExpression(&inPtr, dumBuf, bitpos, pRecvPtr, errPtr);
+                ergI = uPtr->sIProg ? execICalc(uPtr->sIProg, dumBuf, bitpos, pRecvPtr, errPtr)
+                                    : execIExpression(&inPtr, dumBuf, bitpos, pRecvPtr, errPtr);
                 if (*errPtr) {
                     logIT(LOG_ERR, "Exec %s: %s", uPtr->sICalc, error);
                     strcpy(sendBuf, string);
@@ -609,66 +818,16 @@ int procSetUnit(unitPtr uPtr, char *sendBuf, short *sendLen, char bitpos, char *
         }
     }
 
-    // The result is in erg and has to be converted according to the type
-    if (uPtr->type) {
-        if (strstr(uPtr->type, "char") == uPtr->type) {
-            // Conversion to Short 2Byte
-            // According to the CPU, the conversion is done here
-            (ergType == FLOAT) ? (charV = erg) : (charV = ergI);
-            memcpy(sendBuf, &charV, 1);
-            *sendLen = 1;
-        } else if (strstr(uPtr->type, "uchar") == uPtr->type) {
-            // According to the CPU, the conversion is done here
-            (ergType == FLOAT) ? (ucharV = erg) : (ucharV = ergI);
-            memcpy(sendBuf, &ucharV, 1);
-            *sendLen = 1;
-        } else if (strstr(uPtr->type, "short") == uPtr->type) {
-            // According to the CPU, the conversion is done here
-            (ergType == FLOAT) ? (tmpS = erg) : (tmpS = ergI);
-            shortV = __cpu_to_le16(tmpS);
-            memcpy(sendBuf, &shortV, 2);
-            *sendLen = 2;
-        } else if (strstr(uPtr->type, "ushort") == uPtr->type) {
-            // According to the CPU, the conversion is done here
-            (ergType == FLOAT) ? (tmpUS = erg) : (tmpUS = ergI);
-            ushortV = __cpu_to_le16(tmpUS);
-            memcpy(sendBuf, &ushortV, 2);
-            *sendLen = 2;
-        } else if (strstr(uPtr->type, "int") == uPtr->type) {
-            // According to the CPU, the conversion is done here
-            (ergType == FLOAT) ? (tmpI = erg) : (tmpI = ergI);
-            intV = __cpu_to_le32(tmpI);
-            memcpy(sendBuf, &intV, 2);
-            *sendLen = 4;
-        } else if (strstr(uPtr->type, "uint") == uPtr->type) {
-            // According to the CPU, the conversion is done here
-            (ergType == FLOAT) ? (tmpUI = erg) : (tmpUI = ergI);
-            uintV = __cpu_to_le32(tmpUI);
-            memcpy(sendBuf, &uintV, 2);
-        } else if (uPtr->type) {
-            memset(string, 0, sizeof(string));
-            logIT(LOG_ERR, "Unknown type %s in unit %s", uPtr->type, uPtr->name);
-            return -1;
-        }
-
-        memset(buffer, 0, sizeof(buffer));
-        ptr = sendBuf;
-        while (*ptr) {
-            memset(string, 0, sizeof(string));
-            unsigned char byte = *ptr++ & 255;
-            snprintf(string, sizeof(string), "%02X ", byte);
-            strcat(buffer, string);
-            if (n >= MAXBUF - 3) {
-                // FN: Where is 'n' initialized?!
-                break;
-            }
-        }
+    // The result is in erg or ergI and is converted according to the type
+    typePtr->encode(sendBuf, (ergType == FLOAT) ? (int64_t)erg : ergI);
+    *sendLen = typePtr->width;
 
-        logIT(LOG_INFO, "Type: %s (bytes: %s)  ", uPtr->type, buffer);
-
-        return 1;
+    for (n = 0; n < *sendLen; n++) {
+        snprintf(string, sizeof(string), "%02X ", (unsigned char)sendBuf[n]);
+        strcat(buffer, string);
     }
 
-    // We should never reach here. But we want to keep the compiler happy.
-    return 0;
+    logIT(LOG_INFO, "Type: %s (bytes: %s)  ", uPtr->type, buffer);
+
+    return 1;
 }
@@ -17,6 +17,41 @@
 #ifndef UNIT_H
 #define UNIT_H
 
+#include "arena.h"
+
+// Unit types, resolved from <type> by getUnitType()
+#define UNIT_NONE      0
+#define UNIT_CYCLETIME 1
+#define UNIT_SYSTIME   2
+#define UNIT_ERRSTATE  3
+#define UNIT_ENUM      4
+#define UNIT_CHAR      5
+#define UNIT_UCHAR     6
+#define UNIT_SHORT     7
+#define UNIT_USHORT    8
+#define UNIT_INT       9
+#define UNIT_UINT      10
+#define UNIT_UNKNOWN   11
+
+// Enum tables, see compileEnums(). The layout is public for vgen
+typedef struct enumKey {
+    enumPtr ePtr;
+    int order;
+} EnumKey;
+
+struct enumTable {
+    // Searches for one byte
+    enumPtr byByte[256];
+    // Entries with bytes, by their bytes padded to maxLen, then list order
+    EnumKey *keys;
+    int count;
+    int maxLen;
+    enumPtr dflt;
+    nameIndexPtr byText;
+};
+
+int getUnitType(const char *type);
+void compileEnums(unitPtr uPtr, arenaPtr aPtr);
 int procGetUnit(unitPtr uPtr, char *recvBuf, int len, char *result, char bitpos, char *pRecvPtr);
 int procSetUnit(unitPtr uPtr, char *sendBuf, short *sendLen, char bitpos, char *pRecvPtr);
 
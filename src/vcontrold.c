@@ -42,12 +42,24 @@
 
 #include "io.h"
 #include "common.h"
+#include "logbuf.h"
+#include "trace.h"
+#include "metrics.h"
+#include "span.h"
 #include "xmlconfig.h"
 #include "parser.h"
+#include "unit.h"
 #include "socket.h"
 #include "prompt.h"
 #include "semaphore.h"
 #include "framer.h"
+#include "eventloop.h"
+#include "broker.h"
+#include "cache.h"
+#include "planner.h"
+#include "poll.h"
+#include "history.h"
+#include "binproto.h"
 
 #ifdef __CYGWIN__
 #define XMLFILE "vcontrold.xml"
@@ -64,18 +76,33 @@ char *xmlfile = XMLFILE;
 FILE *iniFD = NULL;
 int makeDaemon = 1;
 int inetversion = 0;
-
-// Defined in xmlconfig.c
-extern protocolPtr protoPtr;
-extern unitPtr uPtr;
-extern devicePtr devPtr;
-extern configPtr cfgPtr;
+int eventLoopMode = 0;
+// Given with -d, NULL for the tty of the configuration
+char *linkDevice = NULL;
+static int linkFD = -1;
+static time_t linkUsed = 0;
+static time_t linkSynced = 0;
+static volatile sig_atomic_t reloadPending = 0;
+// Event loop: read requests queued or running, identical reads join them
+static requestPtr inFlight = NULL;
+static unsigned long joinedRequests = 0;
+// Event loop: requests handed to the broker and not yet back
+static int outstanding = 0;
+// Forking server: the commands run by this process, numbering their spans
+static unsigned long requestCount = 0;
+
+// Defined in xmlconfig.c, the configuration pinned by this thread
+extern __thread protocolPtr protoPtr;
+extern __thread unitPtr uPtr;
+extern __thread devicePtr devPtr;
+extern __thread configPtr cfgPtr;
 
 // Declarations
-int readCmdFile(char *filename, char *result, int *resultLen, char *device);
-int interactive(int socketfd, char *device);
+int readCmdFile(char *filename, char *result, int *resultLen);
+int interactive(int socketfd);
+int handleLine(sessionPtr sPtr, char *readBuf);
 void printHelp(int socketfd);
-int rawModus (int socketfd, char *device);
+int rawModus(sessionPtr sPtr);
 static void sigPipeHandler(int signo);
 static void sigHupHandler(int signo);
 int reloadConfig();
@@ -89,504 +116,1783 @@ void usage()
     printf("                 [-n|--nodaemon] [-v|--verbose] [-V|--Version]\n");
     printf("                 [-c|--commandfile <command-file>] [-P|--pidfile <pid-file>]");
     printf("                 [-U|--username <username>] [-G|--groupname <groupname>]\n");
-    printf("                 [-?|--help] [-i|--vsim] [-g|--debug]\n");
+    printf("                 [-?|--help] [-i|--vsim] [-g|--debug] [-e|--eventloop]\n");
     printf("                 [-4|--inet4] [-6|--inet6]\n\n");
 
-    exit(1);
+    exit(1);
+}
+
+// Requests already handed to the broker finish on the old configuration
+int reloadConfig()
+{
+    if (parseXMLFile(xmlfile)) {
+        // Commands and addresses may have changed
+        cacheClear();
+        metricsAdaptive(cfgPtr->timeoutFactor, cfgPtr->timeoutMin, cfgPtr->timeoutMax);
+        // Used the next time the link is opened
+        setSerial(cfgPtr->baud, cfgPtr->parity, cfgPtr->stopBits,
+                  cfgPtr->lowLatency, cfgPtr->frameMode);
+        if (eventLoopMode) {
+            historyBudget(cfgPtr->historyMem);
+        }
+        logIT(LOG_NOTICE, "XML file %s reloaded", xmlfile);
+        return 1;
+    } else {
+        logIT(LOG_ERR, "Loading of XML file %s failed", xmlfile);
+        return 0;
+    }
+}
+
+static char *linkName()
+{
+    return linkDevice ? linkDevice : cfgPtr->tty;
+}
+
+// In the forking server the device link lives as long as the session and the
+// semaphore serializes the children. In the event loop there is only one
+// process owning the device, the link is shared by all sessions and closed
+// as soon as no more work is pending.
+static int linkOpen()
+{
+    uint64_t since;
+
+    linkUsed = monotonicTime();
+    if (linkFD >= 0) {
+        return linkFD;
+    }
+
+    if (! eventLoopMode) {
+        since = spanNow();
+        vcontrol_semget();
+        metricsLockWait(spanNow() - since);
+        spanAdd(SPAN_LOCK, since);
+    }
+    since = spanNow();
+    linkFD = framer_openDevice(linkName(), cfgPtr->devPtr->protoPtr->id);
+    spanAdd(SPAN_OPEN, since);
+    if (linkFD == -1) {
+        logIT(LOG_ERR, "Error opening %s", linkName());
+        if (! eventLoopMode) {
+            vcontrol_semrelease();
+        }
+    }
+    linkSynced = linkUsed;
+
+    return linkFD;
+}
+
+static void linkClose()
+{
+    if (linkFD < 0) {
+        return;
+    }
+
+    framer_closeDevice(linkFD);
+    linkFD = -1;
+    if (! eventLoopMode) {
+        vcontrol_semrelease();
+    }
+}
+
+/* Broker thread: the queue has run empty.
+ * Without a persistent link we give the device free right away. Otherwise
+ * the link stays open until it has not been used for <idle> seconds, and
+ * the P300 session is kept in sync every <keepalive> seconds meanwhile.
+ */
+static int linkIdle()
+{
+    time_t now;
+    int next = 0;
+
+    pinImage();
+
+    if (! cfgPtr->persistent) {
+        linkClose();
+        return 0;
+    }
+    if (linkFD < 0) {
+        return 0;
+    }
+
+    now = monotonicTime();
+    if (cfgPtr->idle > 0) {
+        if (now - linkUsed >= cfgPtr->idle) {
+            logIT(LOG_INFO, "Link idle for %d s, closing", (int)(now - linkUsed));
+            linkClose();
+            return 0;
+        }
+        next = cfgPtr->idle - (now - linkUsed);
+    }
+    if (cfgPtr->keepalive > 0) {
+        if (now - linkSynced >= cfgPtr->keepalive) {
+            if (! framer_keepalive(linkFD)) {
+                logIT1(LOG_WARNING, "Keepalive failed, closing link");
+                linkClose();
+                return 0;
+            }
+            linkSynced = now;
+        }
+        if (next == 0 || cfgPtr->keepalive - (now - linkSynced) < next) {
+            next = cfgPtr->keepalive - (now - linkSynced);
+        }
+    }
+
+    return next;
+}
+
+int readCmdFile(char *filename, char *result, int *resultLen)
+{
+    FILE *cmdPtr;
+    char line[MAXBUF];
+    char string[256];
+    char recvBuf[MAXBUF];
+    char *resultPtr = result;
+    int fd;
+    int count = 0;
+    *resultLen = 0; // nothing received yet :-)
+
+    // Open the device only if we have something to do
+    if ((fd = linkOpen()) == -1) {
+        result = "\0";
+        *resultLen = 0;
+        return 0;
+    }
+
+    cmdPtr = fopen(filename, "r");
+    if (! cmdPtr) {
+        logIT(LOG_ERR, "Could not open cmd file %s", filename);
+        result = "\0";
+        *resultLen = 0;
+        linkClose();
+        return 0;
+    }
+    logIT(LOG_INFO, "Reading cmd file %s", filename);
+    // Empty queue
+    flushInput(fd);
+    while (fgets(line, MAXBUF - 1, cmdPtr)) {
+        // Remove \n
+        line[strlen(line) - 1] = '\0';
+        memset(recvBuf, 0, sizeof(recvBuf));
+        count = execCmd(line, fd, recvBuf, sizeof(recvBuf));
+        int n;
+        char *ptr;
+        ptr = recvBuf;
+        char buffer[MAXBUF];
+        memset(buffer, 0, sizeof(buffer));
+        for (n = 0; n < count; n++) {
+            // We received characters
+            *resultPtr++ = *ptr;
+            (*resultLen)++;
+            memset(string, 0, sizeof(string));
+            unsigned char byte = *ptr++ & 255;
+            snprintf(string, sizeof(string), "%02X ", byte);
+            strcat(buffer, string);
+            if (n >= MAXBUF - 3) {
+                break;
+            }
+        }
+        if (count - 1) {
+            // timeout
+        }
+        if (count) {
+            logIT(LOG_INFO, "Received: %s", buffer);
+        }
+
+    }
+    // The raw commands leave the link in an unknown state
+    linkClose();
+    fclose(cmdPtr);
+    return 1;
+}
+
+void printHelp(int socketfd)
+{
+//      10        20        30        40        50        60        70        80
+    char string[] = " \
+close              Close connection to device\n \
+commands           List all commands for the protocol listed in the XML file\n \
+debug on|off       Toggle debug information\n \
+detail <command>   Show detailed information about <command>\n \
+device             The device set in the XML file\n \
+history <command> <from> <to> [step] [avg|min|max]\n \
+                   Recorded values of <command> (event loop mode)\n \
+protocol           Active protocol\n \
+queue              Device queue statistics (event loop mode)\n \
+raw                Raw mode, commands WAIT,SEND,RECV,PAUSE terminated with END\n \
+reload             Reload XML configuration\n \
+stats              Command counters and timings\n \
+trace on|off       Toggle the timing breakdown of each command\n \
+trace dump         Binary dump of the flight recorder, see vtrace\n \
+unit on|off        Toggle conversion to given unit\n \
+version            Show the version number\n \
+quit               Close the session\n";
+    Writen(socketfd, string, strlen(string));
+}
+
+int rawModus(sessionPtr sPtr)
+{
+    // Here, we write all incoming commands in a temporary file, which is forwarded to readCmdFile
+    int fd;
+
+#ifdef __CYGWIN__
+    strcpy(sPtr->rawFile, "vitotmp-XXXXXX");
+#else
+    strcpy(sPtr->rawFile, "/tmp/vitotmp-XXXXXX");
+#endif
+
+    if ((fd = mkstemp(sPtr->rawFile)) < 0) {
+        logIT1(LOG_ERR, "Error creating mkstemp");
+        return 0;
+    }
+
+    sPtr->rawFD = fdopen(fd, "w+");
+    if (! sPtr->rawFD) {
+        logIT(LOG_ERR, "Could not create temp file %s", sPtr->rawFile);
+        close(fd);
+        remove(sPtr->rawFile);
+        return 0;
+    }
+
+    logIT(LOG_INFO, "Raw mode: Temp file: %s", sPtr->rawFile);
+    return 1;
+}
+
+// Executes the collected raw commands, the answer is written to out
+static void execRaw(char *filename, char *out, size_t outLen)
+{
+    char result[MAXBUF];
+    int resultLen;
+
+    *out = '\0';
+    resultLen = sizeof(result);
+    readCmdFile(filename, result, &resultLen);
+    if (resultLen) {
+        // Re received characters
+        char buffer[MAXBUF];
+        memset(buffer, 0, sizeof(buffer));
+        char2hex(buffer, result, resultLen);
+        snprintf(out, outLen, "Result: %s\n", buffer);
+    }
+    remove(filename);
+}
+
+static requestPtr findInFlight(char *name, char *para, short noUnit)
+{
+    requestPtr rPtr;
+
+    for (rPtr = inFlight; rPtr; rPtr = rPtr->nextInFlight) {
+        if (rPtr->noUnit == noUnit && strcmp(rPtr->name, name) == 0 && strcmp(rPtr->para, para) == 0) {
+            return rPtr;
+        }
+    }
+    return NULL;
+}
+
+static void removeInFlight(requestPtr rPtr)
+{
+    requestPtr *pPtr;
+
+    for (pPtr = &inFlight; *pPtr; pPtr = &(*pPtr)->nextInFlight) {
+        if (*pPtr == rPtr) {
+            *pPtr = rPtr->nextInFlight;
+            break;
+        }
+    }
+    rPtr->nextInFlight = NULL;
+}
+
+// After a write the reads queued before it must not be joined any more
+static void clearInFlight()
+{
+    requestPtr rPtr;
+
+    while ((rPtr = inFlight)) {
+        inFlight = rPtr->nextInFlight;
+        rPtr->nextInFlight = NULL;
+    }
+}
+
+// Hands a request over to the device broker (event loop mode).
+// A shared request can be joined by identical reads until it is done.
+static int submitRequest(sessionPtr sPtr, short type, char *name, char *para, short shared)
+{
+    requestPtr rPtr;
+
+    rPtr = newRequest(type, sPtr);
+    strncpy(rPtr->name, name, sizeof(rPtr->name) - 1);
+    strncpy(rPtr->para, para, sizeof(rPtr->para) - 1);
+    rPtr->noUnit = sPtr ? sPtr->noUnit : 0;
+    rPtr->debugFD = (sPtr && sPtr->debug) ? sPtr->fd : -1;
+
+    if (! brokerSubmit(rPtr)) {
+        free(rPtr);
+        return SESSION_OK;
+    }
+    outstanding++;
+    if (shared) {
+        rPtr->nextInFlight = inFlight;
+        inFlight = rPtr;
+    }
+    return SESSION_PENDING;
+}
+
+// Attaches the session to an identical read already on its way, returns 0 if there is none
+static int joinRequest(sessionPtr sPtr, char *name, char *para)
+{
+    requestPtr rPtr;
+    waiterPtr wPtr;
+
+    if (! (rPtr = findInFlight(name, para, sPtr->noUnit))) {
+        return 0;
+    }
+    if (! (wPtr = calloc(1, sizeof(Waiter)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    wPtr->owner = sPtr;
+    wPtr->next = rPtr->waiters;
+    rPtr->waiters = wPtr;
+    joinedRequests++;
+    logIT(LOG_INFO, "Joining request %lu (%s)", rPtr->id, name);
+
+    return 1;
+}
+
+// Seconds the result of a command may be served from the cache, 0: not cached
+static int commandTTL(commandPtr cPtr)
+{
+    compilePtr cmpPtr;
+
+    if (cPtr->ttl >= 0) {
+        return cPtr->ttl;
+    }
+    // Otherwise the unit decides
+    for (cmpPtr = cPtr->cmpPtr; cmpPtr; cmpPtr = cmpPtr->next) {
+        if (cmpPtr->uPtr && cmpPtr->uPtr->ttl >= 0) {
+            return cmpPtr->uPtr->ttl;
+        }
+    }
+    return 0;
+}
+
+// Commands sending data to the device (setters) are never cached
+static int commandWrites(commandPtr cPtr)
+{
+    compilePtr cmpPtr;
+
+    for (cmpPtr = cPtr->cmpPtr; cmpPtr; cmpPtr = cmpPtr->next) {
+        if (cmpPtr->token == BYTES) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Polled commands are cached as long as the next poll may take
+static int cacheTTL(commandPtr cPtr)
+{
+    int ttl;
+
+    if ((ttl = commandTTL(cPtr)) > 0) {
+        return ttl;
+    }
+    return pollTTL(lookupPoll(cfgPtr, cPtr->name));
+}
+
+static int commandAddr(commandPtr cPtr)
+{
+    return cPtr->addr ? (int)strtol(cPtr->addr, NULL, 16) : 0;
+}
+
+// Sends a cached answer, marked if the device could not confirm it lately
+static void writeCached(int socketfd, cacheEntryPtr ePtr)
+{
+    char string[MAXBUF];
+    size_t len;
+
+    if (! ePtr->failed) {
+        Writen(socketfd, ePtr->value, strlen(ePtr->value));
+        return;
+    }
+    len = strlen(ePtr->value);
+    if (len && ePtr->value[len - 1] == '\n') {
+        len--;
+    }
+    snprintf(string, sizeof(string), "%.*s (stale)\n", (int)len, ePtr->value);
+    Writen(socketfd, string, strlen(string));
+}
+
+// After "trace on" the answer to a command is followed by where its time went
+static void writeSpan(sessionPtr sPtr, Span *spPtr)
+{
+    char string[256];
+    int len;
+
+    if (! sPtr->trace) {
+        return;
+    }
+    len = snprintf(string, sizeof(string), "Span ");
+    len += spanFormat(spPtr, string + len, sizeof(string) - len - 1);
+    string[len++] = '\n';
+    Writen(sPtr->fd, string, len);
+}
+
+// Queues a request without a client, its result only goes to the cache
+static int submitRefresh(char *name, char *para, short noUnit)
+{
+    requestPtr rPtr;
+
+    if (findInFlight(name, para, noUnit)) {
+        // The read is on its way anyway
+        return 1;
+    }
+    rPtr = newRequest(REQ_COMMAND, NULL);
+    strncpy(rPtr->name, name, sizeof(rPtr->name) - 1);
+    strncpy(rPtr->para, para, sizeof(rPtr->para) - 1);
+    rPtr->noUnit = noUnit;
+
+    if (! brokerSubmit(rPtr)) {
+        free(rPtr);
+        return 0;
+    }
+    outstanding++;
+    rPtr->nextInFlight = inFlight;
+    inFlight = rPtr;
+    return 1;
+}
+
+// Event loop: answers a command from the cache if possible, queues it otherwise
+static int dispatchCommand(sessionPtr sPtr, commandPtr cPtr, char *cmd, char *para)
+{
+    char key[MAXBUF + 128];
+    cacheEntryPtr ePtr;
+
+    if (commandWrites(cPtr)) {
+        // Whatever has been read from this range is outdated now
+        cacheInvalidate(commandAddr(cPtr), cPtr->len);
+        clearInFlight();
+        return submitRequest(sPtr, REQ_COMMAND, cmd, para, 0);
+    }
+    if (cacheTTL(cPtr) > 0) {
+        cacheKey(key, sizeof(key), cmd, para, sPtr->noUnit);
+        switch (cacheLookup(key, &ePtr)) {
+        case CACHE_FRESH:
+            logIT(LOG_INFO, "Cache hit: %s", cmd);
+            writeCached(sPtr->fd, ePtr);
+            return SESSION_OK;
+        case CACHE_EXPIRED:
+            // Serve the old value, the device is asked in the background
+            logIT(LOG_INFO, "Cache expired: %s", cmd);
+            if (! ePtr->refreshing) {
+                ePtr->refreshing = submitRefresh(cmd, para, sPtr->noUnit);
+            }
+            writeCached(sPtr->fd, ePtr);
+            return SESSION_OK;
+        }
+    }
+    if (joinRequest(sPtr, cmd, para)) {
+        return SESSION_PENDING;
+    }
+    return submitRequest(sPtr, REQ_COMMAND, cmd, para, 1);
+}
+
+static int rawLine(sessionPtr sPtr, char *line)
+{
+    char result[MAXBUF];
+
+    // Here, we parse the particular commands
+    if (strstr(line, "END") == line) {
+        fclose(sPtr->rawFD);
+        sPtr->rawFD = NULL;
+        if (eventLoopMode) {
+            // No idea what the raw commands do to the device
+            clearInFlight();
+            return submitRequest(sPtr, REQ_RAW, "raw", sPtr->rawFile, 0);
+        }
+        execRaw(sPtr->rawFile, result, sizeof(result));
+        if (*result) {
+            Writen(sPtr->fd, result, strlen(result));
+        }
+        return SESSION_OK;
+    }
+    logIT(LOG_INFO, "Raw: Read: %s", line);
+    if (fprintf(sPtr->rawFD, "%s\n", line) < 0) {
+        logIT1(LOG_ERR, "Error writing to temp file");
+    }
+    return SESSION_OK;
+}
+
+// Formats what execByteCode() received: a unit converted string (count 0)
+// or count raw bytes shown in hex
+static void formatResult(char *recvBuf, int count, char *result, size_t resultLen)
+{
+    char buffer[MAXBUF];
+    char string[256];
+
+    if (*recvBuf && (count == 0)) {
+        // Unit converted
+        logIT1(LOG_INFO, recvBuf);
+        snprintf(result, resultLen, "%s\n", recvBuf);
+    } else if (count) {
+        int n;
+        char *ptr;
+        ptr = recvBuf;
+        memset(buffer, 0, sizeof(buffer));
+        for (n = 0; n < count; n++) {
+            // We received a character
+            memset(string, 0, sizeof(string));
+            unsigned char byte = *ptr++ & 255;
+            snprintf(string, sizeof(string), "%02X ", byte);
+            strcat(buffer, string);
+            if (n >= MAXBUF - 3) {
+                break;
+            }
+        }
+        snprintf(result, resultLen, "%s\n", buffer);
+        logIT(LOG_INFO, "Received: %s", buffer);
+    }
+}
+
+/* Runs the bytecode of cPtr, and of its pre command, on the device link.
+ * Returns -1 on error, 0 if recvBuf holds the unit converted string or the
+ * number of raw bytes in recvBuf.
+ */
+static int execDevice(commandPtr cPtr, char *sendBuf, short sendLen, short noUnit,
+                      char *recvBuf, short recvLen, char *pRecvBuf)
+{
+    commandPtr pcPtr;
+    int fd;
+    int count;
+    char buffer[MAXBUF];
+
+    memset(recvBuf, 0, recvLen);
+    memset(pRecvBuf, 0, MAXBUF);
+
+    traceBegin(cPtr->seq);
+    metricsBegin(cPtr->name);
+    // We only open the device if we have something to do. But only if it's not open yet.
+    if ((fd = linkOpen()) == -1) {
+        traceEnd(-1);
+        metricsEnd(-1);
+        return -1;
+    }
+
+    // If there's a pre command, we execute this first
+    if (cPtr->precmd && (pcPtr = lookupCommand(cfgPtr->devPtr, cPtr->precmd))) {
+        logIT(LOG_INFO, "Executing pre command %s", cPtr->precmd);
+
+        if (execByteCode(pcPtr->cmpPtr, fd, pRecvBuf, MAXBUF, sendBuf, sendLen, 1, pcPtr->bit, pcPtr->retry, pRecvBuf, pcPtr->recvTimeout) == -1) {
+            logIT(LOG_ERR, "Error executing %s", cPtr->precmd);
+            if (eventLoopMode) {
+                linkClose();
+            }
+            traceEnd(-1);
+            metricsEnd(-1);
+            return -1;
+        } else {
+            memset(buffer, 0, sizeof(buffer));
+            char2hex(buffer, pRecvBuf, pcPtr->len);
+            logIT(LOG_INFO, "Result of pre command: %s", buffer);
+        }
+    }
+
+    // We execute the bytecode:
+    // -1: Error
+    //  0: Preformatted string
+    //  n: raw bytes
+    count = execByteCode(cPtr->cmpPtr, fd, recvBuf, recvLen, sendBuf, sendLen, noUnit, cPtr->bit, cPtr->retry, pRecvBuf, cPtr->recvTimeout);
+
+    if (count == -1) {
+        logIT(LOG_ERR, "Error executing %s", cPtr->name);
+        if (eventLoopMode) {
+            // The link is in an unknown state, the next command syncs again
+            linkClose();
+        }
+        traceEnd(-1);
+        metricsEnd(-1);
+        return -1;
+    }
+    traceEnd(count);
+    metricsEnd(count);
+    return count;
+}
+
+static int execCommand(commandPtr cPtr, char *para, short noUnit, char *result, size_t resultLen)
+{
+    short count = 0;
+    char recvBuf[MAXBUF];
+    char pRecvBuf[MAXBUF];
+    char sendBuf[MAXBUF];
+    short sendLen = 0;
+    uint64_t since;
+
+    memset(result, 0, resultLen);
+
+    // If unit off is set or no unit is defined, we pass the parameters in hex
+    memset(sendBuf, 0, sizeof(sendBuf));
+    if ((noUnit || !cPtr->unit) && *para) {
+        if ((sendLen = string2chr(para, sendBuf, sizeof(sendBuf))) == -1) {
+            logIT(LOG_ERR, "No hex string: %s", para);
+            return -1;
+        }
+        // If sendLen > len of the command, we use len
+        if (sendLen > cPtr->len) {
+            logIT(LOG_WARNING,
+                  "Length of the hex string > send length of the command, sending only %d bytes", cPtr->len);
+            sendLen = cPtr->len;
+        }
+    } else if (*para) {
+        // We copy the parameter, execByteCode itself takes care of it
+        strcpy(sendBuf, para);
+        sendLen = strlen(sendBuf);
+    }
+
+    if ((count = execDevice(cPtr, sendBuf, sendLen, noUnit, recvBuf, sizeof(recvBuf), pRecvBuf)) == -1) {
+        return -1;
+    }
+    since = spanNow();
+    formatResult(recvBuf, count, result, resultLen);
+    spanAdd(SPAN_CONVERT, since);
+
+    return strlen(result);
+}
+
+static void printDetail(int socketfd, char *readPtr)
+{
+    char string[256];
+    commandPtr cPtr;
+
+    // Is the command defined in the XML?
+    if (readPtr && (cPtr = lookupCommand(cfgPtr->devPtr, readPtr))) {
+        memset(string, 0, sizeof(string));
+        snprintf(string, sizeof(string), "%s: %s\n", cPtr->name, cPtr->send);
+        Writen(socketfd, string, strlen(string));
+        // Error String defined
+        char buf[MAXBUF];
+        memset(buf, 0, sizeof(buf));
+        if (cPtr->errStr && char2hex(buf, cPtr->errStr, cPtr->len)) {
+            snprintf(string, sizeof(string), "\tError at (Hex): %s", buf);
+            Writen(socketfd, string, strlen(string));
+        }
+        // recvTimeout?
+        if (cPtr->recvTimeout) {
+            snprintf(string, sizeof(string), "\tRECV Timeout: %d ms\n", cPtr->recvTimeout);
+            Writen(socketfd, string, strlen(string));
+        }
+        // Retry defined?
+        if (cPtr->retry) {
+            snprintf(string, sizeof(string), "\tRetry: %d\n", cPtr->retry);
+            Writen(socketfd, string, strlen(string));
+        }
+        // Is Bit defined?
+        if (cPtr->bit > 0) {
+            snprintf(string, sizeof(string), "\tBit (BP): %d\n", cPtr->bit);
+            Writen(socketfd, string, strlen(string));
+        }
+        // Cached?
+        if (! commandWrites(cPtr) && cacheTTL(cPtr) > 0) {
+            snprintf(string, sizeof(string), "\tCache TTL: %d s\n", cacheTTL(cPtr));
+            Writen(socketfd, string, strlen(string));
+        }
+        // Pre command defined?
+        if (cPtr->precmd) {
+            snprintf(string, sizeof(string), "\tPre command (P0-P9): %s\n", cPtr->precmd);
+            Writen(socketfd, string, strlen(string));
+        }
+
+        // If a unit has been given, we also output it
+        compilePtr cmpPtr;
+        cmpPtr = cPtr->cmpPtr;
+        while (cmpPtr) {
+            if (cmpPtr && cmpPtr->uPtr) {
+                // Unit gefunden
+                char *gcalc;
+                char *scalc;
+                // We differentiate the calculation by get and setaddr
+                if (cmpPtr->uPtr->gCalc && *cmpPtr->uPtr->gCalc) {
+                    gcalc = cmpPtr->uPtr->gCalc;
+                } else {
+                    gcalc = cmpPtr->uPtr->gICalc;
+                }
+                if (cmpPtr->uPtr->sCalc && *cmpPtr->uPtr->sCalc) {
+                    scalc = cmpPtr->uPtr->sCalc;
+                } else {
+                    scalc = cmpPtr->uPtr->sICalc;
+                }
+
+                snprintf(string, sizeof(string),
+                         "\tUnit: %s (%s)\n\t  Type: %s\n\t  Get-Calc: %s\n\t  \
+                          Set-Calc: %s\n\t Einheit: %s\n",
+                         cmpPtr->uPtr->name, cmpPtr->uPtr->abbrev,
+                         cmpPtr->uPtr->type,
+                         gcalc,
+                         scalc,
+                         cmpPtr->uPtr->entity);
+                Writen(socketfd, string, strlen(string));
+                // If it's an enum, is the more?
+                if (cmpPtr->uPtr->ePtr) {
+                    enumPtr ePtr;
+                    ePtr = cmpPtr->uPtr->ePtr;
+                    char dummy[20];
+                    while (ePtr) {
+                        memset(dummy, 0, sizeof(dummy));
+                        if (!ePtr->bytes) {
+                            strcpy(dummy, "<default>");
+                        } else {
+                            char2hex(dummy, ePtr->bytes, ePtr->len);
+                        }
+                        snprintf(string, sizeof(string), "\t  Enum Bytes: %s Text: %s\n",
+                                 dummy, ePtr->text);
+                        Writen(socketfd, string, strlen(string));
+                        ePtr = ePtr->next;
+                    }
+                }
+            }
+            cmpPtr = cmpPtr->next;
+        }
+    } else {
+        memset(string, 0, sizeof(string));
+        snprintf(string, sizeof(string), "ERR: command %s unknown\n", readPtr);
+        Writen(socketfd, string, strlen(string));
+    }
+}
+
+static void printQueue(int socketfd)
+{
+    char string[256];
+    BrokerStats stats;
+
+    if (! eventLoopMode) {
+        snprintf(string, sizeof(string), "ERR: no device queue without event loop\n");
+        Writen(socketfd, string, strlen(string));
+        return;
+    }
+    brokerGetStats(&stats);
+    snprintf(string, sizeof(string),
+             "Queue: depth %d (max %d), served %lu, joined %lu, rejected %lu, wait avg %.1f ms max %.1f ms\n",
+             stats.depth, stats.maxDepth, stats.served, joinedRequests, stats.rejected,
+             stats.served ? stats.waitSum / stats.served : 0.0, stats.waitMax);
+    Writen(socketfd, string, strlen(string));
+}
+
+static void writePoint(time_t t, double value, void *data)
+{
+    char string[64];
+
+    snprintf(string, sizeof(string), "%ld %f\n", (long)t, value);
+    Writen(*(int *)data, string, strlen(string));
+}
+
+// Absolute seconds since the epoch, "now" or seconds relative to now if negative
+static int parseTime(char *str, time_t now, time_t *t)
+{
+    char *endPtr;
+    long value;
+
+    if (strcmp(str, "now") == 0) {
+        *t = now;
+        return 1;
+    }
+    value = strtol(str, &endPtr, 10);
+    if (endPtr == str || *endPtr) {
+        return 0;
+    }
+    *t = (value < 0) ? now + value : value;
+    return 1;
+}
+
+static void printHistory(int socketfd, char *para)
+{
+    char string[256];
+    char name[100];
+    char from[32];
+    char to[32];
+    char opt1[16];
+    char opt2[16];
+    char extra[2];
+    char *mode = "avg";
+    int step = 0;
+    time_t now = time(NULL);
+    time_t fromTime;
+    time_t toTime;
+    int valid;
+    int n;
+
+    if (! eventLoopMode) {
+        snprintf(string, sizeof(string), "ERR: no history without event loop\n");
+        Writen(socketfd, string, strlen(string));
+        return;
+    }
+    // The step and the mode are optional, each on its own
+    n = sscanf(para, "%99s %31s %31s %15s %15s %1s", name, from, to, opt1, opt2, extra);
+    valid = (n >= 3 && n <= 5);
+    if (valid && n >= 4 && *opt1 && strspn(opt1, "0123456789") == strlen(opt1)) {
+        step = atoi(opt1);
+        if (n == 5) {
+            mode = opt2;
+        }
+    } else if (valid && n == 4) {
+        mode = opt1;
+    } else if (n == 5) {
+        valid = 0;
+    }
+    if (! valid || ! parseTime(from, now, &fromTime) || ! parseTime(to, now, &toTime)
+            || historyMode(mode) < 0) {
+        snprintf(string, sizeof(string),
+                 "ERR: usage: history <command> <from> <to> [step] [avg|min|max]\n");
+        Writen(socketfd, string, strlen(string));
+        return;
+    }
+    if (mode == opt1 && toTime >= fromTime) {
+        // A mode without a step combines the whole range into one value
+        step = toTime - fromTime + 1;
+    }
+    if (historyQuery(name, fromTime, toTime, step, historyMode(mode), writePoint, &socketfd) < 0) {
+        snprintf(string, sizeof(string), "ERR: no history for %s\n", name);
+        Writen(socketfd, string, strlen(string));
+    }
+}
+
+/* The built-in verbs. They return SESSION_CLOSE, SESSION_OK or
+ * SESSION_PENDING like handleLine() does, or VERB_PROMPT to have the
+ * prompt written.
+ */
+#define VERB_PROMPT 3
+
+static int verbHelp(sessionPtr sPtr, char *para)
+{
+    (void)para;
+    printHelp(sPtr->fd);
+    return VERB_PROMPT;
+}
+
+static int verbQuit(sessionPtr sPtr, char *para)
+{
+    (void)para;
+    Writen(sPtr->fd, BYE, strlen(BYE));
+    return SESSION_CLOSE;
+}
+
+static int verbDebug(sessionPtr sPtr, char *para)
+{
+    if (strstr(para, "on") == para) {
+        sPtr->debug = 1;
+        setDebugFD(sPtr->fd);
+    } else if (strstr(para, "off") == para) {
+        sPtr->debug = 0;
+        setDebugFD(-1);
+    } else {
+        Writen(sPtr->fd, UNKNOWN, strlen(UNKNOWN));
+    }
+    return VERB_PROMPT;
+}
+
+static int verbUnit(sessionPtr sPtr, char *para)
+{
+    if (strstr(para, "off") == para) {
+        sPtr->noUnit = 1;
+    } else if (strstr(para, "on") == para) {
+        sPtr->noUnit = 0;
+    } else {
+        Writen(sPtr->fd, UNKNOWN, strlen(UNKNOWN));
+    }
+    return VERB_PROMPT;
+}
+
+static int verbReload(sessionPtr sPtr, char *para)
+{
+    char string[256];
+    int ret;
+
+    (void)para;
+    ret = reloadConfig();
+    if (ret) {
+        snprintf(string, sizeof(string), "XML file %s reloaded\n", xmlfile);
+        Writen(sPtr->fd, string, strlen(string));
+        // If we have a parent (daemon mode), it reveives a SIGHUP
+        if (makeDaemon && ! eventLoopMode) {
+            kill(getppid(), SIGHUP);
+        }
+    } else {
+        snprintf(string, sizeof(string),
+                 "Loading of XML file %s failed, using old configuration\n", xmlfile);
+        Writen(sPtr->fd, string, strlen(string));
+    }
+    return VERB_PROMPT;
+}
+
+static int verbRaw(sessionPtr sPtr, char *para)
+{
+    (void)para;
+    // The prompt follows after END
+    return rawModus(sPtr) ? SESSION_OK : VERB_PROMPT;
+}
+
+static int verbClose(sessionPtr sPtr, char *para)
+{
+    char string[256];
+
+    (void)para;
+    if (eventLoopMode) {
+        return submitRequest(sPtr, REQ_CLOSE, "close", "", 0);
+    }
+    linkClose();
+    snprintf(string, sizeof(string), "%s closed\n", linkName());
+    Writen(sPtr->fd, string, strlen(string));
+    return VERB_PROMPT;
+}
+
+static int verbCommands(sessionPtr sPtr, char *para)
+{
+    char string[256];
+    commandPtr cPtr;
+
+    (void)para;
+    for (cPtr = cfgPtr->devPtr->cmdPtr; cPtr; cPtr = cPtr->next) {
+        if (cPtr->addr) {
+            snprintf(string, sizeof(string), "%s: %s\n", cPtr->name, cPtr->description);
+            Writen(sPtr->fd, string, strlen(string));
+        }
+    }
+    return VERB_PROMPT;
+}
+
+static int verbProtocol(sessionPtr sPtr, char *para)
+{
+    char string[256];
+
+    (void)para;
+    snprintf(string, sizeof(string), "%s\n", cfgPtr->devPtr->protoPtr->name);
+    Writen(sPtr->fd, string, strlen(string));
+    return VERB_PROMPT;
+}
+
+static int verbDevice(sessionPtr sPtr, char *para)
+{
+    char string[256];
+
+    (void)para;
+    snprintf(string, sizeof(string), "%s (ID=%s) (Protocol=%s)\n", cfgPtr->devPtr->name,
+             cfgPtr->devPtr->id,
+             cfgPtr->devPtr->protoPtr->name);
+    Writen(sPtr->fd, string, strlen(string));
+    return VERB_PROMPT;
+}
+
+static int verbVersion(sessionPtr sPtr, char *para)
+{
+    char string[256];
+
+    (void)para;
+    snprintf(string, sizeof(string), "Version: %s\n", VERSION);
+    Writen(sPtr->fd, string, strlen(string));
+    return VERB_PROMPT;
+}
+
+static int verbQueue(sessionPtr sPtr, char *para)
+{
+    (void)para;
+    printQueue(sPtr->fd);
+    return VERB_PROMPT;
+}
+
+static int verbHistory(sessionPtr sPtr, char *para)
+{
+    printHistory(sPtr->fd, para);
+    return VERB_PROMPT;
+}
+
+static int verbTrace(sessionPtr sPtr, char *para)
+{
+    const char **names;
+    commandPtr cPtr;
+    int count = 0;
+
+    while (isspace(*para)) {
+        para++;
+    }
+    if (strstr(para, "on") == para) {
+        sPtr->trace = 1;
+        return VERB_PROMPT;
+    } else if (strstr(para, "off") == para) {
+        sPtr->trace = 0;
+        return VERB_PROMPT;
+    } else if (strstr(para, "dump") != para) {
+        Writen(sPtr->fd, UNKNOWN, strlen(UNKNOWN));
+        return VERB_PROMPT;
+    }
+    // The recorded ids are the positions in the command list
+    for (cPtr = cfgPtr->devPtr->cmdPtr; cPtr; cPtr = cPtr->next) {
+        count = (cPtr->seq >= count) ? cPtr->seq + 1 : count;
+    }
+    if (! (names = calloc(count + 1, sizeof(*names)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    for (cPtr = cfgPtr->devPtr->cmdPtr; cPtr; cPtr = cPtr->next) {
+        names[cPtr->seq] = cPtr->name;
+    }
+    if (! traceDump(sPtr->fd, names, count)) {
+        logIT1(LOG_ERR, "Flight recorder not dumped");
+    }
+    free(names);
+    return VERB_PROMPT;
+}
+
+static int verbStats(sessionPtr sPtr, char *para)
+{
+    (void)para;
+    metricsText(sPtr->fd);
+    return VERB_PROMPT;
+}
+
+static int verbDetail(sessionPtr sPtr, char *para)
+{
+    while (isspace(*para)) {
+        para++;
+    }
+    printDetail(sPtr->fd, para);
+    return VERB_PROMPT;
+}
+
+typedef struct verb {
+    const char *name;
+    int (*fn)(sessionPtr sPtr, char *para);
+} Verb;
+
+static const Verb verbs[] = {
+    { "help", verbHelp },
+    { "quit", verbQuit },
+    { "debug", verbDebug },
+    { "unit", verbUnit },
+    { "reload", verbReload },
+    { "raw", verbRaw },
+    { "close", verbClose },
+    { "commands", verbCommands },
+    { "protocol", verbProtocol },
+    { "device", verbDevice },
+    { "version", verbVersion },
+    { "queue", verbQueue },
+    { "history", verbHistory },
+    { "detail", verbDetail },
+    { "trace", verbTrace },
+    { "stats", verbStats },
+    { NULL, NULL }
+};
+
+// The verb named by the first word of a line, NULL if it is none
+static const Verb *getVerb(const char *cmd)
+{
+    static nameIndexPtr verbIndex = NULL;
+    const Verb *vPtr;
+
+    if (! verbIndex) {
+        verbIndex = newNameIndex(NULL);
+        for (vPtr = verbs; vPtr->name; vPtr++) {
+            addNameIndex(verbIndex, vPtr->name, (void *)vPtr);
+        }
+    }
+    return getNameIndex(verbIndex, cmd);
+}
+
+// Handles one line of the text protocol, returns 0 if the session has to be closed
+int handleLine(sessionPtr sPtr, char *readBuf)
+{
+    int socketfd = sPtr->fd;
+    int ret;
+    char result[MAXBUF];
+    commandPtr cPtr;
+    const Verb *vPtr;
+    char cmd[MAXBUF];
+    char para[MAXBUF];
+    char *ptr;
+    Span span;
+    uint64_t since;
+
+    setDebugFD(sPtr->debug ? socketfd : -1);
+    sendErrMsg(socketfd);
+
+    if (sPtr->rawFD) {
+        if (rawLine(sPtr, readBuf) == SESSION_PENDING) {
+            return SESSION_PENDING;
+        }
+        if (sPtr->rawFD) {
+            // Still collecting raw commands, no prompt
+            return SESSION_OK;
+        }
+    } else {
+        logIT(LOG_INFO, "Command: %s", readBuf);
+
+        // We separate the command and possible options at the first blank
+        memset(cmd, 0, sizeof(cmd));
+        memset(para, 0, sizeof(para));
+        if ((ptr = strchr(readBuf, ' '))) {
+            strncpy(cmd, readBuf, ptr - readBuf);
+            strcpy(para, ptr + 1);
+        } else {
+            strcpy(cmd, readBuf);
+        }
+
+        // Here, the particular commands are parsed
+        if ((vPtr = getVerb(cmd))) {
+            if ((ret = vPtr->fn(sPtr, para)) != VERB_PROMPT) {
+                return ret;
+            }
+        } else if ((cPtr = lookupCommand(cfgPtr->devPtr, cmd)) && (cPtr->addr)) {
+            // The command is defined in XML, so we take care of it ...
+            if (iniFD) {
+                fprintf(iniFD, ";%s\n", readBuf);
+            }
+            if (eventLoopMode) {
+                if ((ret = dispatchCommand(sPtr, cPtr, cmd, para)) == SESSION_PENDING) {
+                    return ret;
+                }
+                sendErrMsg(socketfd);
+                if (! Writen(socketfd, PROMPT, strlen(PROMPT))) {
+                    return SESSION_CLOSE;
+                }
+                return SESSION_OK;
+            }
+            spanInit(&span, ++requestCount);
+            spanAttach(&span);
+            ret = execCommand(cPtr, para, sPtr->noUnit, result, sizeof(result));
+            since = spanNow();
+            if (ret == -1) {
+                sendErrMsg(socketfd);
+            } else if (*result) {
+                Writen(socketfd, result, strlen(result));
+            }
+            spanAdd(SPAN_WRITE, since);
+            spanDetach();
+            writeSpan(sPtr, &span);
+            spanSlow(&span, cmd, cfgPtr->slowLog);
+            if (iniFD) {
+                fflush(iniFD);
+            }
+        } else if (*readBuf) {
+            if (!Writen(socketfd, UNKNOWN, strlen(UNKNOWN))) {
+                sendErrMsg(socketfd);
+                return SESSION_CLOSE;
+            }
+        }
+    }
+
+    sendErrMsg(socketfd);
+    if (!Writen(socketfd, PROMPT, strlen(PROMPT))) {
+        sendErrMsg(socketfd);
+        return SESSION_CLOSE;
+    }
+
+    return SESSION_OK;
+}
+
+// Broker thread: binary results tell when the value was read and how long it took
+static void binaryStamp(requestPtr rPtr)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &rPtr->readTime);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rPtr->duration = (now.tv_sec - rPtr->enqueued.tv_sec) * 1000000L
+                     + (now.tv_nsec - rPtr->enqueued.tv_nsec) / 1000;
+}
+
+// Broker thread: a binary request gets the raw bytes and the value converted
+// by the unit of the command, without any text formatting
+static void binaryResult(requestPtr rPtr, commandPtr cPtr, char *recvBuf, int count, char *pRecvBuf)
+{
+    compilePtr cmpPtr;
+    char text[MAXBUF];
+    char *endPtr;
+
+    binaryStamp(rPtr);
+    rPtr->status = BIN_OK;
+    rPtr->rawLen = (count < (int)sizeof(rPtr->raw)) ? count : (int)sizeof(rPtr->raw);
+    memcpy(rPtr->raw, recvBuf, rPtr->rawLen);
+
+    for (cmpPtr = cPtr->cmpPtr; cmpPtr && cmpPtr->token != RECV; cmpPtr = cmpPtr->next) {
+        ;
+    }
+    if (! count || ! cmpPtr || ! cmpPtr->uPtr) {
+        return;
+    }
+    memset(text, 0, sizeof(text));
+    if (procGetUnit(cmpPtr->uPtr, recvBuf, count, text, cPtr->bit, pRecvBuf) <= 0) {
+        // The raw bytes are still good
+        logIT(LOG_ERR, "Error in unit conversion of %s", cPtr->name);
+        return;
+    }
+    strncpy(rPtr->result, text, sizeof(rPtr->result) - 1);
+    rPtr->value = strtod(text, &endPtr);
+    rPtr->hasValue = (endPtr != text);
+}
+
+static void execBinary(requestPtr rPtr, commandPtr cPtr)
+{
+    char recvBuf[MAXBUF];
+    char pRecvBuf[MAXBUF];
+    char sendBuf[MAXBUF];
+    int count;
+
+    memset(sendBuf, 0, sizeof(sendBuf));
+    memcpy(sendBuf, rPtr->para, rPtr->paraLen);
+    if ((count = execDevice(cPtr, sendBuf, rPtr->paraLen, 1, recvBuf, sizeof(recvBuf), pRecvBuf)) == -1) {
+        binaryStamp(rPtr);
+        rPtr->status = BIN_EDEVICE;
+        return;
+    }
+    binaryResult(rPtr, cPtr, recvBuf, count, pRecvBuf);
+}
+
+// Broker thread: executes a queued request
+static void execRequest(requestPtr rPtr)
+{
+    commandPtr cPtr;
+
+    // Picks up a reloaded configuration between requests
+    pinImage();
+
+    switch (rPtr->type) {
+    case REQ_COMMAND:
+    case REQ_POLL:
+        // The configuration may have been reloaded since the request was queued
+        if (! (cPtr = lookupCommand(cfgPtr->devPtr, rPtr->name)) || ! cPtr->addr) {
+            logIT(LOG_ERR, "Command %s unknown", rPtr->name);
+            rPtr->status = -1;
+            break;
+        }
+        rPtr->status = execCommand(cPtr, rPtr->para, rPtr->noUnit, rPtr->result, sizeof(rPtr->result));
+        break;
+    case REQ_BINARY:
+        if (! (cPtr = lookupCommand(cfgPtr->devPtr, rPtr->name)) || ! cPtr->addr) {
+            logIT(LOG_ERR, "Command %s unknown", rPtr->name);
+            rPtr->status = BIN_EUNKNOWN;
+            break;
+        }
+        execBinary(rPtr, cPtr);
+        break;
+    case REQ_RAW:
+        execRaw(rPtr->para, rPtr->result, sizeof(rPtr->result));
+        break;
+    case REQ_CLOSE:
+        linkClose();
+        snprintf(rPtr->result, sizeof(rPtr->result), "%s closed\n", linkName());
+        break;
+    }
+}
+
+/* Broker thread: the plain reads queued together with rPtr, up to the next
+ * request of another kind, are fetched through the address range planner.
+ * Whatever it cannot merge is left to execRequest().
+ */
+static void execBatch(requestPtr rPtr)
+{
+    planItemPtr items[BROKER_QUEUE];
+    planItemPtr iPtr;
+    commandPtr cPtr;
+    char pRecvBuf[MAXBUF];
+    Span shared;
+    Span *prevPtr;
+    int count = 0;
+    int n;
+
+    pinImage();
+    if (cfgPtr->batchMax <= 0) {
+        return;
+    }
+    for (; rPtr && count < BROKER_QUEUE; rPtr = rPtr->next) {
+        if (rPtr->done) {
+            continue;
+        }
+        if (rPtr->type != REQ_COMMAND && rPtr->type != REQ_POLL && rPtr->type != REQ_BINARY) {
+            break;
+        }
+        if (! (cPtr = lookupCommand(cfgPtr->devPtr, rPtr->name)) || ! cPtr->addr) {
+            continue;
+        }
+        if (commandWrites(cPtr)) {
+            // Reads must not pass a write
+            break;
+        }
+        if (! planMergeable(cPtr, cfgPtr->devPtr->protoPtr->id)) {
+            continue;
+        }
+        if (! (iPtr = calloc(1, sizeof(PlanItem)))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        iPtr->cPtr = cPtr;
+        iPtr->noUnit = (rPtr->type == REQ_BINARY) ? 1 : rPtr->noUnit;
+        iPtr->data = rPtr;
+        items[count++] = iPtr;
+    }
+
+    // The requests served by the same frames share their time
+    spanInit(&shared, 0);
+    prevPtr = spanAttach(&shared);
+    if (count > 1 && linkOpen() != -1) {
+        if (execPlan(items, count, linkFD, cfgPtr->batchGap, cfgPtr->batchMax) < 0) {
+            // The link is in an unknown state, the single commands sync again
+            linkClose();
+        }
+    }
+    spanAttach(prevPtr);
+
+    for (n = 0; n < count; n++) {
+        iPtr = items[n];
+        if (iPtr->done && ((requestPtr)iPtr->data)->type == REQ_BINARY) {
+            rPtr = iPtr->data;
+            memset(pRecvBuf, 0, sizeof(pRecvBuf));
+            binaryResult(rPtr, iPtr->cPtr, iPtr->recvBuf, iPtr->count, pRecvBuf);
+            spanMerge(&rPtr->span, &shared);
+            rPtr->done = 1;
+        } else if (iPtr->done) {
+            rPtr = iPtr->data;
+            formatResult(iPtr->recvBuf, iPtr->count, rPtr->result, sizeof(rPtr->result));
+            rPtr->status = strlen(rPtr->result);
+            spanMerge(&rPtr->span, &shared);
+            rPtr->done = 1;
+        }
+        free(iPtr);
+    }
+}
+
+// Event loop: keeps the cache in line with a finished request. Returns the
+// last good value if the device could not be asked, NULL otherwise.
+static cacheEntryPtr cacheUpdate(requestPtr rPtr)
+{
+    char key[MAXBUF + 128];
+    commandPtr cPtr;
+    cacheEntryPtr ePtr;
+
+    if (rPtr->type == REQ_RAW) {
+        // No idea what has been written
+        cacheClear();
+        return NULL;
+    }
+    if ((rPtr->type != REQ_COMMAND && rPtr->type != REQ_POLL && rPtr->type != REQ_BINARY)
+            || ! (cPtr = lookupCommand(cfgPtr->devPtr, rPtr->name))) {
+        return NULL;
+    }
+    if (commandWrites(cPtr)) {
+        // Reads queued before the write may have refilled the range
+        cacheInvalidate(commandAddr(cPtr), cPtr->len);
+        return NULL;
+    }
+    if (rPtr->type == REQ_BINARY) {
+        // Binary results are not cached
+        return NULL;
+    }
+    if (cacheTTL(cPtr) <= 0) {
+        return NULL;
+    }
+
+    cacheKey(key, sizeof(key), rPtr->name, rPtr->para, rPtr->noUnit);
+    if (rPtr->status >= 0 && *rPtr->result) {
+        cacheStore(key, cacheTTL(cPtr), commandAddr(cPtr), cPtr->len, rPtr->result);
+        return NULL;
+    }
+    cacheFailed(key);
+    if (cacheLookup(key, &ePtr) != CACHE_MISS) {
+        return ePtr;
+    }
+    return NULL;
+}
+
+static void answerSession(sessionPtr sPtr, requestPtr rPtr, cacheEntryPtr ePtr)
+{
+    uint64_t since;
+
+    if (! sPtr->closing) {
+        spanAttach(&rPtr->span);
+        since = spanNow();
+        if (ePtr) {
+            writeCached(sPtr->fd, ePtr);
+        } else if (*rPtr->result) {
+            Writen(sPtr->fd, rPtr->result, strlen(rPtr->result));
+        }
+        if (*rPtr->errText && ! ePtr) {
+            Writen(sPtr->fd, rPtr->errText, strlen(rPtr->errText));
+        }
+        spanAdd(SPAN_WRITE, since);
+        spanDetach();
+        writeSpan(sPtr, &rPtr->span);
+        Writen(sPtr->fd, PROMPT, strlen(PROMPT));
+    }
+    sessionResume(sPtr);
+}
+
+// Event loop: numeric values read with unit conversion go to the history
+static void historyRecord(requestPtr rPtr)
+{
+    commandPtr cPtr;
+    char *endPtr;
+    double value;
+
+    if ((rPtr->type != REQ_COMMAND && rPtr->type != REQ_POLL)
+            || rPtr->status < 0 || rPtr->noUnit || *rPtr->para) {
+        return;
+    }
+    if (! (cPtr = lookupCommand(cfgPtr->devPtr, rPtr->name)) || commandWrites(cPtr)) {
+        return;
+    }
+    value = strtod(rPtr->result, &endPtr);
+    if (endPtr != rPtr->result) {
+        historyAdd(rPtr->name, time(NULL), value);
+    }
+}
+
+// Event loop: a frame of the binary protocol, answered when all its
+// commands are done
+typedef struct binBatch {
+    int count;
+    int open;
+    requestPtr *items;
+} BinBatch;
+
+// The command with the given id, see writeList()
+static commandPtr binaryCommand(unsigned int id)
+{
+    commandPtr cPtr;
+
+    for (cPtr = cfgPtr->devPtr->cmdPtr; cPtr; cPtr = cPtr->next) {
+        if (cPtr->addr && id-- == 0) {
+            return compiledCommand(cfgPtr->devPtr, cPtr);
+        }
+    }
+    return NULL;
+}
+
+// Writes take the bytes of the BYTES token of the compiled command, as with unit off
+static int binaryParaLen(commandPtr cPtr)
+{
+    compilePtr cmpPtr;
+
+    for (cmpPtr = cPtr->cmpPtr; cmpPtr; cmpPtr = cmpPtr->next) {
+        if (cmpPtr->token == BYTES) {
+            return cmpPtr->len;
+        }
+    }
+    return 0;
+}
+
+static void binaryHeader(BinBuf *bPtr, int type, int count)
+{
+    binInit(bPtr);
+    binPut8(bPtr, BIN_VERSION);
+    binPut8(bPtr, type);
+    binPut16(bPtr, count);
+    binPut32(bPtr, imageGeneration());
+}
+
+static int writeList(int socketfd)
+{
+    BinBuf buf;
+    commandPtr cPtr;
+    commandPtr ccPtr;
+    int count = 0;
+    int id = 0;
+    int ret;
+
+    for (cPtr = cfgPtr->devPtr->cmdPtr; cPtr; cPtr = cPtr->next) {
+        count += cPtr->addr ? 1 : 0;
+    }
+    binaryHeader(&buf, BIN_LIST, count);
+    for (cPtr = cfgPtr->devPtr->cmdPtr; cPtr; cPtr = cPtr->next) {
+        if (! cPtr->addr) {
+            continue;
+        }
+        // The lengths need the bytecode, one which does not compile lists as a read
+        if (! (ccPtr = compiledCommand(cfgPtr->devPtr, cPtr))) {
+            ccPtr = cPtr;
+        }
+        binPut16(&buf, id++);
+        binPut8(&buf, commandWrites(ccPtr) ? binaryParaLen(ccPtr) : ccPtr->len);
+        binPut8(&buf, commandWrites(ccPtr) ? BIN_WRITE : 0);
+        binPut8(&buf, strlen(cPtr->name) > 255 ? 255 : strlen(cPtr->name));
+        binPutBytes(&buf, cPtr->name, strlen(cPtr->name) > 255 ? 255 : strlen(cPtr->name));
+    }
+    binFinish(&buf);
+    ret = Writen(socketfd, buf.data, buf.len);
+    binFree(&buf);
+    return ret;
 }
 
-int reloadConfig()
+static int writeBatch(int socketfd, BinBatch *bPtr)
 {
-    if (parseXMLFile(xmlfile)) {
-        compileCommand(devPtr, uPtr);
-        logIT(LOG_NOTICE, "XML file %s reloaded", xmlfile);
-        return 1;
-    } else {
-        logIT(LOG_ERR, "Loading of XML file %s failed", xmlfile);
-        return 0;
+    BinBuf buf;
+    requestPtr rPtr;
+    char *text;
+    int n;
+    int ret;
+
+    binaryHeader(&buf, BIN_EXEC, bPtr->count);
+    for (n = 0; n < bPtr->count; n++) {
+        rPtr = bPtr->items[n];
+        text = (rPtr->status == BIN_OK) ? rPtr->result : rPtr->errText;
+        binPut16(&buf, rPtr->cmdId);
+        binPut8(&buf, rPtr->status);
+        binPut8(&buf, rPtr->hasValue ? BIN_VALUE : 0);
+        binPutDouble(&buf, rPtr->value);
+        binPut64(&buf, (uint64_t)rPtr->readTime.tv_sec * 1000 + rPtr->readTime.tv_nsec / 1000000);
+        binPut32(&buf, rPtr->duration);
+        binPut16(&buf, rPtr->rawLen);
+        binPutBytes(&buf, rPtr->raw, rPtr->rawLen);
+        binPut16(&buf, strlen(text));
+        binPutBytes(&buf, text, strlen(text));
     }
+    binFinish(&buf);
+    ret = Writen(socketfd, buf.data, buf.len);
+    binFree(&buf);
+    return ret;
 }
 
-int readCmdFile(char *filename, char *result, int *resultLen, char *device)
+static void freeBatch(BinBatch *bPtr)
 {
-    FILE *cmdPtr;
-    char line[MAXBUF];
-    char string[256];
-    char recvBuf[MAXBUF];
-    char *resultPtr = result;
-    int fd;
-    int count = 0;
-    *resultLen = 0; // nothing received yet :-)
+    int n;
 
-    // Open the device only if we have something to do
-    vcontrol_semget();
-    if ((fd = framer_openDevice(device, cfgPtr->devPtr->protoPtr->id)) == -1) {
-        vcontrol_semrelease();
-        logIT(LOG_ERR, "Error opening %s", device);
-        result = "\0";
-        *resultLen = 0;
-        return 0;
+    for (n = 0; n < bPtr->count; n++) {
+        free(bPtr->items[n]);
     }
+    free(bPtr->items);
+    free(bPtr);
+}
 
-    cmdPtr = fopen(filename, "r");
-    if (! cmdPtr) {
-        logIT(LOG_ERR, "Could not open cmd file %s", filename);
-        result = "\0";
-        *resultLen = 0;
-        framer_closeDevice(fd);
-        vcontrol_semrelease();
-        return 0;
+// Event loop: handles a frame of the binary protocol
+static int handleFrame(sessionPtr sPtr, char *frame, int len)
+{
+    BinBatch *bPtr;
+    requestPtr rPtr;
+    commandPtr cPtr;
+    char *ptr = frame + BIN_HEADER;
+    char string[256];
+    unsigned int paraLen;
+    int count;
+    int n;
+    int ret;
+
+    if (len < BIN_HEADER || frame[0] != BIN_VERSION) {
+        logIT(LOG_ERR, "Binary: frame of version %d unknown, closing", len ? frame[0] : 0);
+        return SESSION_CLOSE;
     }
-    logIT(LOG_INFO, "Reading cmd file %s", filename);
-    // Empty queue
-    tcflush(fd, TCIOFLUSH);
-    while (fgets(line, MAXBUF - 1, cmdPtr)) {
-        // Remove \n
-        line[strlen(line) - 1] = '\0';
-        memset(recvBuf, 0, sizeof(recvBuf));
-        count = execCmd(line, fd, recvBuf, sizeof(recvBuf));
-        int n;
-        char *ptr;
-        ptr = recvBuf;
-        char buffer[MAXBUF];
-        memset(buffer, 0, sizeof(buffer));
-        for (n = 0; n < count; n++) {
-            // We received characters
-            *resultPtr++ = *ptr;
-            (*resultLen)++;
-            memset(string, 0, sizeof(string));
-            unsigned char byte = *ptr++ & 255;
-            snprintf(string, sizeof(string), "%02X ", byte);
-            strcat(buffer, string);
-            if (n >= MAXBUF - 3) {
-                break;
-            }
+    count = binGet16(frame + 2);
+
+    switch (frame[1]) {
+    case BIN_LIST:
+        return writeList(sPtr->fd) ? SESSION_OK : SESSION_CLOSE;
+    case BIN_EXEC:
+        break;
+    default:
+        logIT(LOG_ERR, "Binary: frame type %d unknown, closing", frame[1]);
+        return SESSION_CLOSE;
+    }
+
+    if (! (bPtr = calloc(1, sizeof(BinBatch))) || ! (bPtr->items = calloc(count + 1, sizeof(requestPtr)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    for (n = 0; n < count; n++) {
+        if (ptr + 4 > frame + len || ptr + 4 + (paraLen = binGet16(ptr + 2)) > frame + len
+                || paraLen > MAXBUF) {
+            logIT1(LOG_ERR, "Binary: frame truncated, closing");
+            freeBatch(bPtr);
+            return SESSION_CLOSE;
         }
-        if (count - 1) {
-            // timeout
+        rPtr = newRequest(REQ_BINARY, sPtr);
+        bPtr->items[bPtr->count++] = rPtr;
+        rPtr->cmdId = binGet16(ptr);
+        memcpy(rPtr->para, ptr + 4, paraLen);
+        rPtr->paraLen = paraLen;
+        ptr += 4 + paraLen;
+
+        if (! (cPtr = binaryCommand(rPtr->cmdId))) {
+            rPtr->status = BIN_EUNKNOWN;
+            continue;
         }
-        if (count) {
-            logIT(LOG_INFO, "Received: %s", buffer);
+        // Writes need exactly the bytes of the command, reads nothing
+        if ((int)paraLen != binaryParaLen(cPtr)) {
+            rPtr->status = BIN_EPARA;
+            snprintf(rPtr->errText, sizeof(rPtr->errText), "%s needs %d bytes", cPtr->name,
+                     binaryParaLen(cPtr));
+            continue;
+        }
+        strncpy(rPtr->name, cPtr->name, sizeof(rPtr->name) - 1);
+        if (commandWrites(cPtr)) {
+            clearInFlight();
         }
+        if (! brokerSubmit(rPtr)) {
+            rPtr->status = BIN_EBUSY;
+            takeErrMsg(string, sizeof(string));
+            continue;
+        }
+        outstanding++;
+        bPtr->open++;
+    }
+    logIT(LOG_INFO, "Binary: %d commands, %d queued", bPtr->count, bPtr->open);
 
+    if (bPtr->open) {
+        sPtr->batch = bPtr;
+        return SESSION_PENDING;
     }
-    framer_closeDevice(fd);
-    vcontrol_semrelease();
-    fclose(cmdPtr);
-    return 1;
+    ret = writeBatch(sPtr->fd, bPtr);
+    freeBatch(bPtr);
+    return ret ? SESSION_OK : SESSION_CLOSE;
 }
 
-void printHelp(int socketfd)
+// Event loop: a command of a binary frame is done
+static void binaryDone(requestPtr rPtr)
 {
-//      10        20        30        40        50        60        70        80
-    char string[] = " \
-close              Close connection to device\n \
-commands           List all commands for the protocol listed in the XML file\n \
-debug on|off       Toggle debug information\n \
-detail <command>   Show detailed information about <command>\n \
-device             The device set in the XML file\n \
-protocol           Active protocol\n \
-raw                Raw mode, commands WAIT,SEND,RECV,PAUSE terminated with END\n \
-reload             Reload XML configuration\n \
-unit on|off        Toggle conversion to given unit\n \
-version            Show the version number\n \
-quit               Close the session\n";
-    Writen(socketfd, string, strlen(string));
+    sessionPtr sPtr = rPtr->owner;
+    BinBatch *bPtr = sPtr->batch;
+
+    if (--bPtr->open > 0) {
+        return;
+    }
+    if (! sPtr->closing && ! writeBatch(sPtr->fd, bPtr)) {
+        logIT1(LOG_ERR, "Binary: could not send the answer");
+    }
+    freeBatch(bPtr);
+    sPtr->batch = NULL;
+    sessionResume(sPtr);
 }
 
-int rawModus(int socketfd, char *device)
+// Event loop: the broker has finished a request, the answer goes to the client
+// and to everyone who joined it
+static void requestDone(requestPtr rPtr)
 {
-    // Here, we write all incoming commands in a temporary file, which is forwarded to readCmdFile
-    char readBuf[MAXBUF];
-    char string[256];
+    cacheEntryPtr ePtr;
+    waiterPtr wPtr;
+    pollPtr pPtr;
+
+    outstanding--;
+    removeInFlight(rPtr);
+    ePtr = cacheUpdate(rPtr);
+    if (rPtr->type == REQ_BINARY) {
+        spanSlow(&rPtr->span, rPtr->name, cfgPtr->slowLog);
+        // Freed with its frame
+        binaryDone(rPtr);
+        return;
+    }
+    historyRecord(rPtr);
+    if (rPtr->type == REQ_POLL && (pPtr = lookupPoll(cfgPtr, rPtr->name))) {
+        pollDone(pPtr, (rPtr->status >= 0 && *rPtr->result) ? rPtr->result : NULL);
+    }
+    if (iniFD) {
+        fflush(iniFD);
+    }
 
-    // FIXME: I think we should be using some PID or such instead of "XXXXXX".
-#ifdef __CYGWIN__
-    char tmpfile[] = "vitotmp-XXXXXX";
-#else
-    char tmpfile[] = "/tmp/vitotmp-XXXXXX";
-#endif
+    // Owner is NULL for a cache refresh or a poll
+    if (rPtr->owner) {
+        answerSession(rPtr->owner, rPtr, ePtr);
+    }
+    while ((wPtr = rPtr->waiters)) {
+        rPtr->waiters = wPtr->next;
+        answerSession(wPtr->owner, rPtr, ePtr);
+        free(wPtr);
+    }
+    spanSlow(&rPtr->span, rPtr->name, cfgPtr->slowLog);
+    free(rPtr);
+}
 
-    FILE *filePtr;
-    char result[MAXBUF];
-    int resultLen;
+static void brokerReady(int fd)
+{
+    requestPtr rPtr;
 
-    if (! mkstemp(tmpfile)) {
-        // Another try
-        if (! mkstemp(tmpfile)) {
-            logIT1(LOG_ERR, "Error creating mkstemp");
-            return 0;
-        }
+    (void)fd;
+    while ((rPtr = brokerFinished())) {
+        requestDone(rPtr);
     }
+}
 
-    filePtr = fopen(tmpfile, "w+");
-    if (! filePtr) {
-        logIT(LOG_ERR, "Could not create temp file %s", tmpfile);
-        return 0;
-    }
+/* Event loop: starts the next due poll if the device has nothing else to
+ * do, so clients never wait for more than one poll. Returns the
+ * milliseconds until the next poll is due, -1 if there is none.
+ */
+static int pollRun()
+{
+    pollPtr pPtr;
+    commandPtr cPtr;
+    requestPtr rPtr;
+    int wait;
 
-    logIT(LOG_INFO, "Raw mode: Temp file: %s", tmpfile);
-
-    while (Readline(socketfd, readBuf, sizeof(readBuf))) {
-        // Here, we parse the particular commands
-        if (strstr(readBuf, "END") == readBuf) {
-            fclose(filePtr);
-            resultLen = sizeof(result);
-            readCmdFile(tmpfile, result, &resultLen, device);
-            if (resultLen) {
-                // Re received characters
-                char buffer[MAXBUF];
-                memset(buffer, 0, sizeof(buffer));
-                char2hex(buffer, result, resultLen);
-                snprintf(string, sizeof(string), "Result: %s\n", buffer);
-                Writen(socketfd, string, strlen(string));
-            }
-            remove(tmpfile);
-            return 1;
+    if (! cfgPtr->pollsPtr || outstanding > 0) {
+        // We come back when the broker is done
+        return -1;
+    }
+    while ((pPtr = pollNext(cfgPtr->pollsPtr, &wait))) {
+        if (! (cPtr = lookupCommand(cfgPtr->devPtr, pPtr->name)) || ! cPtr->addr
+                || commandWrites(cPtr)) {
+            logIT(LOG_ERR, "Poll: %s is no read command, ignored", pPtr->name);
+            pollDisable(pPtr);
+            continue;
         }
-        logIT(LOG_INFO, "Raw: Read: %s", readBuf);
-        if (fputs(readBuf, filePtr) == EOF) {
-            logIT1(LOG_ERR, "Error writing to temp file");
-        } else {
-            // debug stuff
+        if (findInFlight(pPtr->name, "", 0)) {
+            // Read anyway right now
+            pollDone(pPtr, NULL);
+            continue;
         }
+        logIT(LOG_INFO, "Poll: %s", pPtr->name);
+        rPtr = newRequest(REQ_POLL, NULL);
+        strncpy(rPtr->name, pPtr->name, sizeof(rPtr->name) - 1);
+        if (! brokerSubmit(rPtr)) {
+            free(rPtr);
+            pollDone(pPtr, NULL);
+            return -1;
+        }
+        outstanding++;
+        rPtr->nextInFlight = inFlight;
+        inFlight = rPtr;
+        return -1;
+    }
+
+    return (wait < 0) ? -1 : wait * 1000;
+}
+
+static int loopIdle()
+{
+    // All pending lines have been handled
+    setDebugFD(-1);
+    if (reloadPending) {
+        reloadPending = 0;
+        logIT1(LOG_NOTICE, "Received SIGHUP, reloading");
+        reloadConfig();
     }
-    return 0; // is this correct?
+    return pollRun();
 }
 
-int interactive(int socketfd, char *device)
+/* Clients may send several lines without waiting for the prompt, Readline()
+ * keeps what it has read ahead. The lines are answered in order and each
+ * answer ends with exactly one prompt, which is never part of an answer.
+ */
+int interactive(int socketfd)
 {
+    Session session;
     char readBuf[1000];
     char *readPtr;
-    char bye[] = BYE;
-    char string[256];
-    commandPtr cPtr;
-    commandPtr pcPtr;
-    int fd = -1;
-    short count = 0;
     short rcount = 0;
-    short noUnit = 0;
-    char recvBuf[MAXBUF];
-    char pRecvBuf[MAXBUF];
-    char sendBuf[MAXBUF];
-    char cmd[MAXBUF];
-    char para[MAXBUF];
-    char *ptr;
-    short sendLen;
-    char buffer[MAXBUF];
+    int ret = 0;
 
+    initSession(&session, socketfd);
     Writen(socketfd, PROMPT, strlen(PROMPT));
     memset(readBuf, 0, sizeof(readBuf));
 
     while ((rcount = Readline(socketfd, readBuf, sizeof(readBuf)))) {
-        sendErrMsg(socketfd);
         // Remove control characters
         readPtr = readBuf + rcount;
         while (iscntrl(*readPtr)) {
             *readPtr-- = '\0';
         }
-        logIT(LOG_INFO, "Command: %s", readBuf);
-
-        // We separate the command and possible options at the first blank
-        memset(cmd, 0, sizeof(cmd));
-        memset(para, 0, sizeof(para));
-        if ((ptr = strchr(readBuf, ' '))) {
-            strncpy(cmd, readBuf, ptr - readBuf);
-            strcpy(para, ptr + 1);
-        } else {
-            strcpy(cmd, readBuf);
-        }
-
-        // Here, the particular commands are parsed
-        if (strstr(readBuf, "help") == readBuf) {
-            printHelp(socketfd);
-        } else if (strstr(readBuf, "quit") == readBuf) {
-            Writen(socketfd, bye, strlen(bye));
-            framer_closeDevice(fd);
-            vcontrol_semrelease();
-            return 1;
-        } else if (strstr(readBuf, "debug on") == readBuf) {
-            setDebugFD(socketfd);
-        } else if (strstr(readBuf, "debug off") == readBuf) {
-            setDebugFD(-1);
-        } else if (strstr(readBuf, "unit off") == readBuf) {
-            noUnit = 1;
-        } else if (strstr(readBuf, "unit on") == readBuf) {
-            noUnit = 0;
-        } else if (strstr(readBuf, "reload") == readBuf) {
-            if (reloadConfig()) {
-                memset(string, 0, sizeof(string));
-                snprintf(string, sizeof(string), "XML file %s reloaded\n", xmlfile);
-                Writen(socketfd, string, strlen(string));
-                // If we have a parent (daemon mode), it reveives a SIGHUP
-                if (makeDaemon) {
-                    kill(getppid(), SIGHUP);
-                }
-            } else {
-                memset(string, 0, sizeof(string));
-                snprintf(string, sizeof(string),
-                         "Loading of XML file %s failed, using old configuration\n", xmlfile);
-                Writen(socketfd, string, strlen(string));
-            }
-        } else if (strstr(readBuf, "raw") == readBuf) {
-            rawModus(socketfd, device);
-        } else if (strstr(readBuf, "close") == readBuf) {
-            framer_closeDevice(fd);
-            vcontrol_semrelease();
-            snprintf(string, sizeof(string), "%s closed\n", device);
-            Writen(socketfd, string, strlen(string));
-            fd = -1;
-        } else if (strstr(readBuf, "commands") == readBuf) {
-            cPtr = cfgPtr->devPtr->cmdPtr;
-            while (cPtr) {
-                if (cPtr->addr) {
-                    memset(string, 0, sizeof(string));
-                    snprintf(string, sizeof(string), "%s: %s\n", cPtr->name, cPtr->description);
-                    Writen(socketfd, string, strlen(string));
-                }
-                cPtr = cPtr->next;
-            }
-        } else if (strstr(readBuf, "protocol") == readBuf) {
-            memset(string, 0, sizeof(string));
-            snprintf(string, sizeof(string), "%s\n", cfgPtr->devPtr->protoPtr->name);
-            Writen(socketfd, string, strlen(string));
-        } else if (strstr(readBuf, "device") == readBuf) {
-            memset(string, 0, sizeof(string));
-            snprintf(string, sizeof(string), "%s (ID=%s) (Protocol=%s)\n", cfgPtr->devPtr->name,
-                     cfgPtr->devPtr->id,
-                     cfgPtr->devPtr->protoPtr->name);
-            Writen(socketfd, string, strlen(string));
-        } else if (strstr(readBuf, "version") == readBuf) {
-            memset(string, 0, sizeof(string));
-            snprintf(string, sizeof(string), "Version: %s\n", VERSION);
-            Writen(socketfd, string, strlen(string));
-        } else if ((cPtr = getCommandNode(cfgPtr->devPtr->cmdPtr, cmd)) && (cPtr->addr)) {
-            // The command is defined in XML, so we take care of it ...
-            memset(string, 0, sizeof(string));
-            memset(recvBuf, 0, sizeof(recvBuf));
-            memset(sendBuf, 0, sizeof(sendBuf));
-            memset(pRecvBuf, 0, sizeof(pRecvBuf));
-
-            // If unit off is set or no unit is defined, we pass the parameters in hex
-            memset(sendBuf, 0, sizeof(sendBuf));
-            if ((noUnit || !cPtr->unit) && *para) {
-                if ((sendLen = string2chr(para, sendBuf, sizeof(sendBuf))) == -1) {
-                    logIT(LOG_ERR, "No hex string: %s", para);
-                    sendErrMsg(socketfd);
-                    if (! Writen(socketfd, PROMPT, strlen(PROMPT))) {
-                        sendErrMsg(socketfd);
-                        framer_closeDevice(fd);
-                        vcontrol_semrelease();
-                        return 0;
-                    }
-                    continue;
-                }
-                // If sendLen > len of the command, we use len
-                if (sendLen > cPtr->len) {
-                    logIT(LOG_WARNING,
-                          "Length of the hex string > send length of the command, sending only %d bytes", cPtr->len);
-                    sendLen = cPtr->len;
-                }
-            } else if (*para) {
-                // We copy the parameter, execByteCode itself takes care of it
-                strcpy(sendBuf, para);
-                sendLen = strlen(sendBuf);
-            }
-            if (iniFD) {
-                fprintf(iniFD, ";%s\n", readBuf);
-            }
-
-            // We only open the device if we have something to do. But only if it's not open yet.
-            if (fd < 0) {
-                /* As one vclient call opens the link once, all is seen a transaction
-                 * This may cause trouble for telnet sessions, as the whole session is
-                 * one link activity, even more commands are given within.
-                 * This is related to a accept/close on a server socket
-                 */
-                // everything on link is a transaction - all commands
-                vcontrol_semget();
-
-                if ((fd = framer_openDevice(device, cfgPtr->devPtr->protoPtr->id)) == -1) {
-                    logIT(LOG_ERR, "Error opening %s", device);
-                    sendErrMsg(socketfd);
-                    framer_closeDevice(fd);
-                    vcontrol_semrelease();
-                    if (!Writen(socketfd, PROMPT, strlen(PROMPT))) {
-                        sendErrMsg(socketfd);
-                        return 0;
-                    }
-                    continue;
-                }
-            }
-
-            // If there's a pre command, we execute this first
-            if (cPtr->precmd && (pcPtr = getCommandNode(cfgPtr->devPtr->cmdPtr, cPtr->precmd))) {
-                logIT(LOG_INFO, "Executing pre command %s", cPtr->precmd);
-
-                if (execByteCode(pcPtr->cmpPtr, fd, pRecvBuf, sizeof(pRecvBuf), sendBuf, sendLen, 1, pcPtr->bit, pcPtr->retry, pRecvBuf, pcPtr->recvTimeout) == -1) {
-                    logIT(LOG_ERR, "Error executing %s", readBuf);
-                    sendErrMsg(socketfd);
-                    break;
-                } else {
-                    memset(buffer, 0, sizeof(buffer));
-                    char2hex(buffer, pRecvBuf, pcPtr->len);
-                    logIT(LOG_INFO, "Result of pre command: %s", buffer);
-                }
-            }
-
-            // We execute the bytecode:
-            // -1: Error
-            //  0: Preformatted string
-            //  n: raw bytes
-            count = execByteCode(cPtr->cmpPtr, fd, recvBuf, sizeof(recvBuf), sendBuf, sendLen, noUnit, cPtr->bit, cPtr->retry, pRecvBuf, cPtr->recvTimeout);
-
-            if (count == -1) {
-                logIT(LOG_ERR, "Error executing %s", readBuf);
-                sendErrMsg(socketfd);
-            } else if (*recvBuf && (count == 0)) {
-                // Unit converted
-                logIT1(LOG_INFO, recvBuf);
-                snprintf(string, sizeof(string), "%s\n", recvBuf);
-                Writen(socketfd, string, strlen(string));
-            } else {
-                int n;
-                char *ptr;
-                ptr = recvBuf;
-                char buffer[MAXBUF];
-                memset(buffer, 0, sizeof(buffer));
-                for (n = 0; n < count; n++) {
-                    // We received a character
-                    memset(string, 0, sizeof(string));
-                    unsigned char byte = *ptr++ & 255;
-                    snprintf(string, sizeof(string), "%02X ", byte);
-                    strcat(buffer, string);
-                    if (n >= MAXBUF - 3) {
-                        break;
-                    }
-                }
-                if (count) {
-                    snprintf(string, sizeof(string), "%s\n", buffer);
-                    Writen(socketfd, string, strlen(string));
-                    logIT(LOG_INFO, "Received: %s", buffer);
-                }
-            }
-            if (iniFD) {
-                fflush(iniFD);
-            }
-        } else if (strstr(readBuf, "detail") == readBuf) {
-            readPtr = readBuf + strlen("detail");
-            while (isspace(*readPtr)) {
-                readPtr++;
-            }
-            // Is the command defined in the XML?
-            if (readPtr && (cPtr = getCommandNode(cfgPtr->devPtr->cmdPtr, readPtr))) {
-                memset(string, 0, sizeof(string));
-                snprintf(string, sizeof(string), "%s: %s\n", cPtr->name, cPtr->send);
-                Writen(socketfd, string, strlen(string));
-                // Error String defined
-                char buf[MAXBUF];
-                memset(buf, 0, sizeof(buf));
-                if (cPtr->errStr && char2hex(buf, cPtr->errStr, cPtr->len)) {
-                    snprintf(string, sizeof(string), "\tError at (Hex): %s", buf);
-                    Writen(socketfd, string, strlen(string));
-                }
-                // recvTimeout?
-                if (cPtr->recvTimeout) {
-                    snprintf(string, sizeof(string), "\tRECV Timeout: %d ms\n", cPtr->recvTimeout);
-                    Writen(socketfd, string, strlen(string));
-                }
-                // Retry defined?
-                if (cPtr->retry) {
-                    snprintf(string, sizeof(string), "\tRetry: %d\n", cPtr->retry);
-                    Writen(socketfd, string, strlen(string));
-                }
-                // Is Bit defined?
-                if (cPtr->bit > 0) {
-                    snprintf(string, sizeof(string), "\tBit (BP): %d\n", cPtr->bit);
-                    Writen(socketfd, string, strlen(string));
-                }
-                // Pre command defined?
-                if (cPtr->precmd) {
-                    snprintf(string, sizeof(string), "\tPre command (P0-P9): %s\n", cPtr->precmd);
-                    Writen(socketfd, string, strlen(string));
-                }
-
-                // If a unit has been given, we also output it
-                compilePtr cmpPtr;
-                cmpPtr = cPtr->cmpPtr;
-                while (cmpPtr) {
-                    if (cmpPtr && cmpPtr->uPtr) {
-                        // Unit gefunden
-                        char *gcalc;
-                        char *scalc;
-                        // We differentiate the calculation by get and setaddr
-                        if (cmpPtr->uPtr->gCalc && *cmpPtr->uPtr->gCalc) {
-                            gcalc = cmpPtr->uPtr->gCalc;
-                        } else {
-                            gcalc = cmpPtr->uPtr->gICalc;
-                        }
-                        if (cmpPtr->uPtr->sCalc && *cmpPtr->uPtr->sCalc) {
-                            scalc = cmpPtr->uPtr->sCalc;
-                        } else {
-                            scalc = cmpPtr->uPtr->sICalc;
-                        }
-
-                        snprintf(string, sizeof(string),
-                                 "\tUnit: %s (%s)\n\t  Type: %s\n\t  Get-Calc: %s\n\t  \
-                                  Set-Calc: %s\n\t Einheit: %s\n",
-                                 cmpPtr->uPtr->name, cmpPtr->uPtr->abbrev,
-                                 cmpPtr->uPtr->type,
-                                 gcalc,
-                                 scalc,
-                                 cmpPtr->uPtr->entity);
-                        Writen(socketfd, string, strlen(string));
-                        // If it's an enum, is the more?
-                        if (cmpPtr->uPtr->ePtr) {
-                            enumPtr ePtr;
-                            ePtr = cmpPtr->uPtr->ePtr;
-                            char dummy[20];
-                            while (ePtr) {
-                                memset(dummy, 0, sizeof(dummy));
-                                if (!ePtr->bytes) {
-                                    strcpy(dummy, "<default>");
-                                } else {
-                                    char2hex(dummy, ePtr->bytes, ePtr->len);
-                                }
-                                snprintf(string, sizeof(string), "\t  Enum Bytes: %s Text: %s\n",
-                                         dummy, ePtr->text);
-                                Writen(socketfd, string, strlen(string));
-                                ePtr = ePtr->next;
-                            }
-                        }
-                    }
-                    cmpPtr = cmpPtr->next;
-                }
-            } else {
-                memset(string, 0, sizeof(string));
-                snprintf(string, sizeof(string), "ERR: command %s unknown\n", readPtr);
-                Writen(socketfd, string, strlen(string));
-            }
-        } else if (*readBuf) {
-            if (!Writen(socketfd, UNKNOWN, strlen(UNKNOWN))) {
-                sendErrMsg(socketfd);
-                framer_closeDevice(fd);
-                vcontrol_semrelease();
-                return 0;
-            }
-        }
-        sendErrMsg(socketfd);
-        if (!Writen(socketfd, PROMPT, strlen(PROMPT))) {
-            sendErrMsg(socketfd);
-            framer_closeDevice(fd);
-            vcontrol_semrelease();
-            return 0;
+        if (! handleLine(&session, readBuf)) {
+            // quit has been sent or the client is gone
+            ret = (strstr(readBuf, "quit") == readBuf);
+            break;
         }
         memset(readBuf, 0, sizeof(readBuf));
     }
     sendErrMsg(socketfd);
-    framer_closeDevice(fd);
-    vcontrol_semrelease();
-    return 0;
+    closeSession(&session);
+    linkClose();
+    return ret;
 }
 
 static void sigPipeHandler(int signo)
@@ -595,26 +1901,30 @@ static void sigPipeHandler(int signo)
     // FIXME: And we do nothing here? Why do we handle it then?
 }
 
+// Loading takes a while and allocates, the main loop picks the flag up
 static void sigHupHandler(int signo)
 {
-    logIT1(LOG_NOTICE, "Received SIGHUP");
-    reloadConfig();
+    reloadPending = 1;
 }
 
 char *pidFile = NULL;
 
+// logIT() could start the log writer of a forked child in here, the
+// message is written directly instead
 static void sigTermHandler(int signo)
 {
     if (signo == SIGTERM) {
-        logIT1(LOG_NOTICE, "Received SIGTERM");
+        logSignal("Received SIGTERM");
     } else if (signo == SIGINT) {
-        logIT1(LOG_NOTICE, "Received SIGINT");
+        logSignal("Received SIGINT");
     } else if (signo == SIGQUIT) {
-        logIT1(LOG_NOTICE, "Received SIGQUIT");
+        logSignal("Received SIGQUIT");
     } else {
-        logIT(LOG_NOTICE, "Received signal %d", signo);
+        logSignal("Received a signal");
+    }
+    if (! eventLoopMode) {
+        vcontrol_semfree();
     }
-    vcontrol_semfree();
     if (pidFile) {
         unlink(pidFile);
     }
@@ -635,6 +1945,8 @@ int main(int argc, char *argv[])
     static int verbose = 0;
     int tcpport = 0;
     static int simuOut = 0;
+    int xmlGiven = 0;
+    imagePtr iPtr;
     int opt;
 
     while (1) {
@@ -642,6 +1954,7 @@ int main(int argc, char *argv[])
             {"commandfile", required_argument, 0,            'c'},
             {"device",      required_argument, 0,            'd'},
             {"debug",       no_argument,       &debug,       1  },
+            {"eventloop",   no_argument,       &eventLoopMode, 1 },
             {"vsim",        no_argument,       &simuOut,     1  },
             {"logfile",     required_argument, 0,            'l'},
             {"pidfile",     required_argument, 0,            'P'},
@@ -661,7 +1974,7 @@ int main(int argc, char *argv[])
 
         // getopt_long stores the option index here.
         int option_index = 0;
-        opt = getopt_long (argc, argv, "c:d:gil:P:U:G:np:sx:vV46",
+        opt = getopt_long (argc, argv, "c:d:egil:P:U:G:np:sx:vV46",
                            long_options, &option_index);
 
         // Detect the end of the options.
@@ -698,6 +2011,9 @@ int main(int argc, char *argv[])
         case 'd':
             device = optarg;
             break;
+        case 'e':
+            eventLoopMode = 1;
+            break;
         case 'g':
             debug = 1;
             break;
@@ -735,6 +2051,7 @@ int main(int argc, char *argv[])
             break;
         case 'x':
             xmlfile = optarg;
+            xmlGiven = 1;
             break;
         case '?':
             // getopt_long already printed an error message.
@@ -749,7 +2066,10 @@ int main(int argc, char *argv[])
 
     logIT(LOG_NOTICE, "started vcontrold version %s", VERSION);
 
-    if (!parseXMLFile(xmlfile)) {
+    // Tables compiled in at build time spare parsing, -x and reloads read the XML file
+    if (! xmlGiven && (iPtr = builtinImage())) {
+        publishImage(iPtr);
+    } else if (!parseXMLFile(xmlfile)) {
         fprintf(stderr, "Error loading %s, terminating\n", xmlfile);
         exit(1);
     }
@@ -759,14 +2079,15 @@ int main(int argc, char *argv[])
         if (! tcpport) {
             tcpport = cfgPtr->port;
         }
-        if (! device) {
-            device = cfgPtr->tty;
-        }
         if (! logfile) {
             logfile = cfgPtr->logfile;
         }
-        if (! pidFile) {
-            pidFile = cfgPtr->pidfile;
+        if (! pidFile && cfgPtr->pidfile) {
+            // Needed at exit, the configuration may have been reloaded by then
+            if (! (pidFile = strdup(cfgPtr->pidfile))) {
+                logIT1(LOG_ERR, "malloc failed");
+                exit(1);
+            }
         }
         if (! username) {
             username = cfgPtr->username;
@@ -780,13 +2101,24 @@ int main(int argc, char *argv[])
         if (! debug) {
             debug = cfgPtr->debug;
         }
+        setSerial(cfgPtr->baud, cfgPtr->parity, cfgPtr->stopBits,
+                  cfgPtr->lowLatency, cfgPtr->frameMode);
+        metricsAdaptive(cfgPtr->timeoutFactor, cfgPtr->timeoutMin, cfgPtr->timeoutMax);
     }
 
     if (!initLog(useSyslog, logfile, debug)) {
         exit(1);
     }
-
-    if (signal(SIGHUP, sigHupHandler) == SIG_ERR) {
+    logBufStart();
+    traceInit();
+    metricsInit();
+
+    // Without SA_RESTART, so a waiting accept() returns to pick up the reload
+    struct sigaction hupAction;
+    memset(&hupAction, 0, sizeof(hupAction));
+    hupAction.sa_handler = sigHupHandler;
+    sigemptyset(&hupAction.sa_mask);
+    if (sigaction(SIGHUP, &hupAction, NULL) < 0) {
         logIT1(LOG_ERR, "Error handling SIGHUP");
         exit(1);
     }
@@ -814,8 +2146,7 @@ int main(int argc, char *argv[])
         fprintf(iniFD, "[DATA]\n");
     }
 
-    // The macros are replaced and the strings to send are converted to bytecode
-    compileCommand(devPtr, uPtr);
+    linkDevice = device;
 
     int fd = 0;
     char result[MAXBUF];
@@ -877,6 +2208,8 @@ int main(int argc, char *argv[])
 
         int sockfd = -1;
         int listenfd = openSocket(tcpport);
+        int binfd = (eventLoopMode && cfgPtr->binPort) ? openSocket(cfgPtr->binPort) : -1;
+        int metricsfd = cfgPtr->metricsPort ? openSocket(cfgPtr->metricsPort) : -1;
 
         // Drop privileges after binding
         if (0 == getuid()) {
@@ -939,9 +2272,56 @@ int main(int argc, char *argv[])
             }
         }
 
+        if (metricsfd >= 0) {
+            metricsServe(metricsfd);
+        }
+
+        if (eventLoopMode) {
+            // One process serves all clients, the broker thread owns the device
+            if (signal(SIGPIPE, sigPipeHandler) == SIG_ERR) {
+                logIT1(LOG_ERR, "Signal error");
+                exit(1);
+            }
+            historyBudget(cfgPtr->historyMem);
+            if (! eventLoopInit() || ! brokerStart(execRequest, execBatch, linkIdle) ||
+                    ! eventLoopWatch(brokerFD(), brokerReady)) {
+                logIT1(LOG_ERR, "Could not start the event loop");
+                exit(1);
+            }
+            if (binfd >= 0 && ! eventLoopBinary(binfd, handleFrame)) {
+                logIT1(LOG_ERR, "Could not start the binary protocol");
+                exit(1);
+            }
+            eventLoop(listenfd, handleLine, loopIdle);
+            // We only get here on fatal errors
+            if (pidFile) {
+                unlink(pidFile);
+            }
+            exit(1);
+        }
+
+        if (cfgPtr->persistent) {
+            logIT1(LOG_WARNING, "A persistent link needs the event loop mode (-e), ignored");
+        }
+        if (cfgPtr->pollsPtr) {
+            logIT1(LOG_WARNING, "Polling needs the event loop mode (-e), ignored");
+        }
+        if (cfgPtr->binPort) {
+            logIT1(LOG_WARNING, "The binary protocol needs the event loop mode (-e), ignored");
+        }
+        if (cfgPtr->historyMem) {
+            logIT1(LOG_WARNING, "The history needs the event loop mode (-e), ignored");
+        }
+
         vcontrol_seminit();
 
         while (1) {
+            if (reloadPending) {
+                // Sessions running in children keep their configuration
+                reloadPending = 0;
+                logIT1(LOG_NOTICE, "Received SIGHUP, reloading");
+                reloadConfig();
+            }
             sockfd = listenToSocket(listenfd, makeDaemon);
             if (signal(SIGPIPE, sigPipeHandler) == SIG_ERR) {
                 logIT1(LOG_ERR, "Signal error");
@@ -949,14 +2329,14 @@ int main(int argc, char *argv[])
             }
             if (sockfd >= 0) {
                 // Socket returned fd, the rest is done interactively
-                interactive(sockfd, device);
+                interactive(sockfd);
                 closeSocket(sockfd);
                 setDebugFD(-1);
                 if (makeDaemon) {
                     logIT(LOG_INFO, "Child process with PID %d terminated", getpid());
                     exit(0); // The child bids boodbye
                 }
-            } else {
+            } else if (! reloadPending) {
                 logIT1(LOG_ERR, "Error connecting");
             }
         }
@@ -964,8 +2344,8 @@ int main(int argc, char *argv[])
         vcontrol_seminit();
     }
 
-    if (*cmdfile) {
-        readCmdFile(cmdfile, result, &resultLen, device);
+    if (cmdfile && *cmdfile) {
+        readCmdFile(cmdfile, result, &resultLen);
     }
 
     vcontrol_semfree();
@@ -0,0 +1,680 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Build time generator for the built-in configuration
+ *
+ * vgen loads a vcontrold.xml with its vito.xml like vcontrold does, then
+ * writes the resulting image as C source: every node, string, compiled
+ * bytecode, calc program, enum table and name index becomes a static
+ * const object. Linked into vcontrold with BUILTIN_CONFIG, the image is
+ * ready at startup without parsing any XML, and its tables sit in read
+ * only memory shared by all processes.
+ *
+ * The nodes are written depth first, everything a node points to comes
+ * before it. The configuration has no cycles, an index only points to
+ * nodes of its list, which is written first.
+ *
+ * vcontrold compiles commands on first use, the commands of the active
+ * device are written compiled here instead.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <math.h>
+#include <getopt.h>
+
+#include "xmlconfig.h"
+#include "nameindex.h"
+#include "arithmetic.h"
+#include "unit.h"
+#include "common.h"
+
+// Referenced by parser.c and socket.c, vgen never talks to a device
+FILE *iniFD = NULL;
+int inetversion = 0;
+
+// The pinned image, see xmlconfig.c
+extern __thread configPtr cfgPtr;
+
+static FILE *out;
+// The symbol of every node written, by its address
+static nameIndexPtr symbols;
+static int counter = 0;
+// The device whose commands are written compiled
+static devicePtr compileDev = NULL;
+
+static void usage()
+{
+    printf("usage: vgen [-o|--output <c-file>] <xml-file>\n");
+    exit(1);
+}
+
+static const char *symbolOf(const void *ptr)
+{
+    char key[32];
+
+    snprintf(key, sizeof(key), "%p", ptr);
+    return getNameIndex(symbols, key);
+}
+
+static const char *newSymbol(const void *ptr, const char *prefix)
+{
+    char key[32];
+    char name[32];
+    char *keyPtr;
+    char *namePtr;
+
+    snprintf(key, sizeof(key), "%p", ptr);
+    snprintf(name, sizeof(name), "%s%d", prefix, counter++);
+    if (! (keyPtr = strdup(key)) || ! (namePtr = strdup(name))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    addNameIndex(symbols, keyPtr, namePtr);
+    return namePtr;
+}
+
+// Bytes as string literal, octal escapes always take three digits
+static void putBytes(const char *data, int len)
+{
+    unsigned char c;
+    int n;
+
+    if (! data) {
+        fputs("NULL", out);
+        return;
+    }
+    fputc('"', out);
+    for (n = 0; n < len; n++) {
+        c = data[n];
+        if (c == '"' || c == '\\' || c == '?') {
+            fprintf(out, "\\%c", c);
+        } else if (c >= ' ' && c < 0x7f) {
+            fputc(c, out);
+        } else {
+            fprintf(out, "\\%03o", c);
+        }
+    }
+    fputc('"', out);
+}
+
+static void putString(const char *str)
+{
+    putBytes(str, str ? strlen(str) : 0);
+}
+
+static void putFloat(float f)
+{
+    if (isnan(f)) {
+        fputs("NAN", out);
+    } else if (isinf(f)) {
+        fputs(f < 0 ? "-INFINITY" : "INFINITY", out);
+    } else {
+        fprintf(out, "%a", f);
+    }
+}
+
+// Address of a node written before
+static void putRef(const char *type, const void *ptr)
+{
+    const char *sym;
+
+    if (! ptr) {
+        fputs("NULL", out);
+        return;
+    }
+    if (! (sym = symbolOf(ptr))) {
+        logIT(LOG_ERR, "Node %p referenced before it is written", ptr);
+        exit(1);
+    }
+    fprintf(out, "(%s)&%s", type, sym);
+}
+
+static void putField(const char *name)
+{
+    fprintf(out, ",\n    .%s = ", name);
+}
+
+static void genIndex(nameIndexPtr iPtr)
+{
+    const char *slots = NULL;
+    unsigned int n;
+
+    if (! iPtr || symbolOf(iPtr)) {
+        return;
+    }
+    if (iPtr->slots && iPtr->size) {
+        slots = newSymbol(iPtr->slots, "slots");
+        fprintf(out, "static const NameSlot %s[%u] = {\n", slots, iPtr->size);
+        for (n = 0; n < iPtr->size; n++) {
+            if (! iPtr->slots[n].name) {
+                continue;
+            }
+            fprintf(out, "    [%u] = { ", n);
+            putString(iPtr->slots[n].name);
+            fprintf(out, ", %uu, ", iPtr->slots[n].hash);
+            putRef("void *", iPtr->slots[n].ptr);
+            fputs(" },\n", out);
+        }
+        fputs("};\n", out);
+    }
+    fprintf(out, "static const struct nameIndex %s = {\n    .slots = ", newSymbol(iPtr, "index"));
+    if (slots) {
+        fprintf(out, "(NameSlot *)%s", slots);
+    } else {
+        fputs("NULL", out);
+    }
+    putField("size");
+    fprintf(out, "%u", iPtr->size);
+    putField("used");
+    fprintf(out, "%u", iPtr->used);
+    putField("first");
+    putRef("void *", iPtr->first);
+    putField("wildcard");
+    putRef("void *", iPtr->wildcard);
+    fputs("\n};\n", out);
+}
+
+static void genCalc(calcPtr cPtr)
+{
+    const char *ops = NULL;
+    int n;
+
+    if (! cPtr || symbolOf(cPtr)) {
+        return;
+    }
+    if (cPtr->ops && cPtr->len) {
+        ops = newSymbol(cPtr->ops, "ops");
+        fprintf(out, "static const CalcOp %s[%d] = {\n", ops, cPtr->len);
+        for (n = 0; n < cPtr->len; n++) {
+            fprintf(out, "    { %d, %d, ", cPtr->ops[n].op, cPtr->ops[n].arg);
+            putFloat(cPtr->ops[n].f);
+            fprintf(out, ", %d },\n", cPtr->ops[n].i);
+        }
+        fputs("};\n", out);
+    }
+    fprintf(out, "static const struct calc %s = {\n    .integer = %d", newSymbol(cPtr, "calc"),
+            cPtr->integer);
+    putField("shape");
+    fprintf(out, "%d", cPtr->shape);
+    putField("k");
+    putFloat(cPtr->k);
+    putField("len");
+    fprintf(out, "%d", cPtr->len);
+    // Never grows
+    putField("size");
+    fprintf(out, "%d", cPtr->len);
+    putField("ops");
+    if (ops) {
+        fprintf(out, "(CalcOp *)%s", ops);
+    } else {
+        fputs("NULL", out);
+    }
+    fputs("\n};\n", out);
+}
+
+static void genEnum(enumPtr ePtr)
+{
+    if (! ePtr || symbolOf(ePtr)) {
+        return;
+    }
+    genEnum(ePtr->next);
+    fprintf(out, "static const struct enumerate %s = {\n    .bytes = ", newSymbol(ePtr, "enum"));
+    putBytes(ePtr->bytes, ePtr->len);
+    putField("len");
+    fprintf(out, "%d", ePtr->len);
+    putField("text");
+    putString(ePtr->text);
+    putField("next");
+    putRef("enumPtr", ePtr->next);
+    fputs("\n};\n", out);
+}
+
+static void genEnumTable(enumTablePtr tPtr)
+{
+    const char *keys = NULL;
+    int n;
+
+    if (! tPtr || symbolOf(tPtr)) {
+        return;
+    }
+    genIndex(tPtr->byText);
+    if (tPtr->keys && tPtr->count) {
+        keys = newSymbol(tPtr->keys, "keys");
+        fprintf(out, "static const EnumKey %s[%d] = {\n", keys, tPtr->count);
+        for (n = 0; n < tPtr->count; n++) {
+            fputs("    { ", out);
+            putRef("enumPtr", tPtr->keys[n].ePtr);
+            fprintf(out, ", %d },\n", tPtr->keys[n].order);
+        }
+        fputs("};\n", out);
+    }
+    fprintf(out, "static const struct enumTable %s = {\n    .byByte = {\n", newSymbol(tPtr, "enumTab"));
+    for (n = 0; n < 256; n++) {
+        if (tPtr->byByte[n]) {
+            fprintf(out, "        [%d] = ", n);
+            putRef("enumPtr", tPtr->byByte[n]);
+            fputs(",\n", out);
+        }
+    }
+    fputs("    }", out);
+    putField("keys");
+    if (keys) {
+        fprintf(out, "(EnumKey *)%s", keys);
+    } else {
+        fputs("NULL", out);
+    }
+    putField("count");
+    fprintf(out, "%d", tPtr->count);
+    putField("maxLen");
+    fprintf(out, "%d", tPtr->maxLen);
+    putField("dflt");
+    putRef("enumPtr", tPtr->dflt);
+    putField("byText");
+    putRef("nameIndexPtr", tPtr->byText);
+    fputs("\n};\n", out);
+}
+
+static void genUnit(unitPtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genUnit(ptr->next);
+    genCalc(ptr->gProg);
+    genCalc(ptr->sProg);
+    genCalc(ptr->gIProg);
+    genCalc(ptr->sIProg);
+    genEnum(ptr->ePtr);
+    genEnumTable(ptr->eTab);
+    fprintf(out, "static const struct unit %s = {\n    .name = ", newSymbol(ptr, "unit"));
+    putString(ptr->name);
+    putField("abbrev");
+    putString(ptr->abbrev);
+    putField("gCalc");
+    putString(ptr->gCalc);
+    putField("sCalc");
+    putString(ptr->sCalc);
+    putField("gICalc");
+    putString(ptr->gICalc);
+    putField("sICalc");
+    putString(ptr->sICalc);
+    putField("entity");
+    putString(ptr->entity);
+    putField("type");
+    putString(ptr->type);
+    putField("typeCode");
+    fprintf(out, "%d", ptr->typeCode);
+    putField("ttl");
+    fprintf(out, "%d", ptr->ttl);
+    putField("compiled");
+    fprintf(out, "%d", ptr->compiled);
+    putField("gProg");
+    putRef("calcPtr", ptr->gProg);
+    putField("sProg");
+    putRef("calcPtr", ptr->sProg);
+    putField("gIProg");
+    putRef("calcPtr", ptr->gIProg);
+    putField("sIProg");
+    putRef("calcPtr", ptr->sIProg);
+    putField("ePtr");
+    putRef("enumPtr", ptr->ePtr);
+    putField("eTab");
+    putRef("enumTablePtr", ptr->eTab);
+    putField("next");
+    putRef("unitPtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+static void genMacro(macroPtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genMacro(ptr->next);
+    fprintf(out, "static const struct macro %s = {\n    .name = ", newSymbol(ptr, "macro"));
+    putString(ptr->name);
+    putField("command");
+    putString(ptr->command);
+    putField("next");
+    putRef("macroPtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+static void genIcmd(icmdPtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genIcmd(ptr->next);
+    fprintf(out, "static const struct icmd %s = {\n    .name = ", newSymbol(ptr, "icmd"));
+    putString(ptr->name);
+    putField("send");
+    putString(ptr->send);
+    putField("retry");
+    fprintf(out, "%d", ptr->retry);
+    putField("recvTimeout");
+    fprintf(out, "%d", ptr->recvTimeout);
+    putField("next");
+    putRef("icmdPtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+static void genProtocol(protocolPtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genProtocol(ptr->next);
+    genMacro(ptr->mPtr);
+    genIcmd(ptr->icPtr);
+    genIndex(ptr->macroIndex);
+    genIndex(ptr->icmdIndex);
+    fprintf(out, "static const struct protocol %s = {\n    .name = ", newSymbol(ptr, "proto"));
+    putString(ptr->name);
+    putField("id");
+    fprintf(out, "%d", ptr->id);
+    putField("mPtr");
+    putRef("macroPtr", ptr->mPtr);
+    putField("icPtr");
+    putRef("icmdPtr", ptr->icPtr);
+    putField("macroIndex");
+    putRef("nameIndexPtr", ptr->macroIndex);
+    putField("icmdIndex");
+    putRef("nameIndexPtr", ptr->icmdIndex);
+    putField("next");
+    putRef("protocolPtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+static void genCompile(compilePtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genCompile(ptr->next);
+    genUnit(ptr->uPtr);
+    fprintf(out, "static const struct compile %s = {\n    .token = %d", newSymbol(ptr, "code"),
+            ptr->token);
+    putField("send");
+    putBytes(ptr->send, ptr->len);
+    putField("len");
+    fprintf(out, "%d", ptr->len);
+    putField("uPtr");
+    putRef("unitPtr", ptr->uPtr);
+    putField("errStr");
+    putString(ptr->errStr);
+    putField("next");
+    putRef("compilePtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+static void genCommand(commandPtr ptr)
+{
+    commandPtr node = ptr;
+
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genCommand(ptr->next);
+    // The compiled copy is written in place of the command
+    if (compileDev && ! (ptr = compiledCommand(compileDev, node))) {
+        fprintf(stderr, "Command %s does not compile\n", node->name);
+        exit(1);
+    }
+    genCompile(ptr->cmpPtr);
+    fprintf(out, "static const struct command %s = {\n    .name = ", newSymbol(node, "cmd"));
+    putString(ptr->name);
+    putField("pcmd");
+    putString(ptr->pcmd);
+    putField("send");
+    putString(ptr->send);
+    putField("addr");
+    putString(ptr->addr);
+    putField("unit");
+    putString(ptr->unit);
+    putField("errStr");
+    putString(ptr->errStr);
+    putField("precmd");
+    putString(ptr->precmd);
+    putField("len");
+    fprintf(out, "%d", ptr->len);
+    putField("retry");
+    fprintf(out, "%d", ptr->retry);
+    putField("recvTimeout");
+    fprintf(out, "%d", ptr->recvTimeout);
+    putField("bit");
+    fprintf(out, "%d", ptr->bit);
+    putField("ttl");
+    fprintf(out, "%d", ptr->ttl);
+    putField("nodeType");
+    fprintf(out, "%d", ptr->nodeType);
+    putField("cmpPtr");
+    putRef("compilePtr", ptr->cmpPtr);
+    putField("description");
+    putString(ptr->description);
+    putField("seq");
+    fprintf(out, "%d", ptr->seq);
+    putField("next");
+    putRef("commandPtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+static void genDevice(devicePtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genDevice(ptr->next);
+    compileDev = (ptr == cfgPtr->devPtr) ? ptr : NULL;
+    genCommand(ptr->cmdPtr);
+    compileDev = NULL;
+    genIndex(ptr->cmdIndex);
+    genProtocol(ptr->protoPtr);
+    fprintf(out, "static const struct device %s = {\n    .name = ", newSymbol(ptr, "dev"));
+    putString(ptr->name);
+    putField("id");
+    putString(ptr->id);
+    putField("cmdPtr");
+    putRef("commandPtr", ptr->cmdPtr);
+    putField("cmdIndex");
+    putRef("nameIndexPtr", ptr->cmdIndex);
+    putField("protoPtr");
+    putRef("protocolPtr", ptr->protoPtr);
+    putField("next");
+    putRef("devicePtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+// Polls keep their schedule in the nodes, they are not const
+static void genPoll(pollPtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genPoll(ptr->next);
+    fprintf(out, "static struct poll %s = {\n    .name = ", newSymbol(ptr, "poll"));
+    putString(ptr->name);
+    putField("interval");
+    fprintf(out, "%d", ptr->interval);
+    putField("jitter");
+    fprintf(out, "%d", ptr->jitter);
+    putField("min");
+    fprintf(out, "%d", ptr->min);
+    putField("max");
+    fprintf(out, "%d", ptr->max);
+    putField("current");
+    fprintf(out, "%d", ptr->current);
+    putField("next");
+    putRef("pollPtr", ptr->next);
+    fputs("\n};\n", out);
+}
+
+static void genConfig(configPtr ptr)
+{
+    if (! ptr || symbolOf(ptr)) {
+        return;
+    }
+    genDevice(ptr->devPtr);
+    genPoll(ptr->pollsPtr);
+    genIndex(ptr->pollIndex);
+    fprintf(out, "static const struct config %s = {\n    .tty = ", newSymbol(ptr, "cfg"));
+    putString(ptr->tty);
+    putField("baud");
+    fprintf(out, "%d", ptr->baud);
+    putField("parity");
+    fprintf(out, "%d", ptr->parity);
+    putField("stopBits");
+    fprintf(out, "%d", ptr->stopBits);
+    putField("lowLatency");
+    fprintf(out, "%d", ptr->lowLatency);
+    putField("frameMode");
+    fprintf(out, "%d", ptr->frameMode);
+    putField("port");
+    fprintf(out, "%d", ptr->port);
+    putField("binPort");
+    fprintf(out, "%d", ptr->binPort);
+    putField("metricsPort");
+    fprintf(out, "%d", ptr->metricsPort);
+    putField("logfile");
+    putString(ptr->logfile);
+    putField("pidfile");
+    putString(ptr->pidfile);
+    putField("username");
+    putString(ptr->username);
+    putField("groupname");
+    putString(ptr->groupname);
+    putField("devID");
+    putString(ptr->devID);
+    putField("devPtr");
+    putRef("devicePtr", ptr->devPtr);
+    putField("syslog");
+    fprintf(out, "%d", ptr->syslog);
+    putField("debug");
+    fprintf(out, "%d", ptr->debug);
+    putField("slowLog");
+    fprintf(out, "%d", ptr->slowLog);
+    putField("persistent");
+    fprintf(out, "%d", ptr->persistent);
+    putField("idle");
+    fprintf(out, "%d", ptr->idle);
+    putField("keepalive");
+    fprintf(out, "%d", ptr->keepalive);
+    putField("timeoutFactor");
+    putFloat(ptr->timeoutFactor);
+    putField("timeoutMin");
+    fprintf(out, "%d", ptr->timeoutMin);
+    putField("timeoutMax");
+    fprintf(out, "%d", ptr->timeoutMax);
+    putField("batchGap");
+    fprintf(out, "%d", ptr->batchGap);
+    putField("batchMax");
+    fprintf(out, "%d", ptr->batchMax);
+    putField("historyMem");
+    fprintf(out, "%d", ptr->historyMem);
+    putField("pollsPtr");
+    putRef("pollPtr", ptr->pollsPtr);
+    putField("pollIndex");
+    putRef("nameIndexPtr", ptr->pollIndex);
+    fputs("\n};\n", out);
+}
+
+static void genImage(imagePtr iPtr, const char *xmlfile)
+{
+    fprintf(out, "/* Generated by vgen from %s, do not edit */\n\n", xmlfile);
+    fputs("#include <stddef.h>\n#include <math.h>\n\n", out);
+    fputs("#include \"xmlconfig.h\"\n#include \"nameindex.h\"\n", out);
+    fputs("#include \"arithmetic.h\"\n#include \"unit.h\"\n\n", out);
+
+    genPoll(iPtr->pollsPtr);
+    genUnit(iPtr->uPtr);
+    genIndex(iPtr->uIndex);
+    genProtocol(iPtr->protoPtr);
+    genCommand(iPtr->cmdPtr);
+    genDevice(iPtr->devPtr);
+    genConfig(iPtr->cfgPtr);
+
+    fputs("\nconst Image builtinTables = {\n    .aPtr = NULL", out);
+    putField("protoPtr");
+    putRef("protocolPtr", iPtr->protoPtr);
+    putField("uPtr");
+    putRef("unitPtr", iPtr->uPtr);
+    putField("uIndex");
+    putRef("nameIndexPtr", iPtr->uIndex);
+    putField("devPtr");
+    putRef("devicePtr", iPtr->devPtr);
+    putField("cmdPtr");
+    putRef("commandPtr", iPtr->cmdPtr);
+    putField("cfgPtr");
+    putRef("configPtr", iPtr->cfgPtr);
+    putField("pollsPtr");
+    putRef("pollPtr", iPtr->pollsPtr);
+    fputs("\n};\n\nconst char builtinSource[] = ", out);
+    putString(xmlfile);
+    fputs(";\n", out);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option longOptions[] = {
+        {"output", required_argument, 0, 'o'},
+        {"help",   no_argument,       0, '?'},
+        {0, 0, 0, 0}
+    };
+    char *output = NULL;
+    imagePtr iPtr;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "o:?", longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+    }
+
+    // Errors go to stderr
+    initLog(0, NULL, 0);
+
+    if (! (iPtr = loadImage(argv[optind]))) {
+        fprintf(stderr, "Error loading %s\n", argv[optind]);
+        exit(1);
+    }
+    // Pinned, so its commands can be compiled
+    publishImage(iPtr);
+    if (! output) {
+        out = stdout;
+    } else if (! (out = fopen(output, "w"))) {
+        fprintf(stderr, "Could not create %s\n", output);
+        exit(1);
+    }
+
+    symbols = newNameIndex(NULL);
+    genImage(iPtr, argv[optind]);
+
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Error writing %s\n", output ? output : "stdout");
+        exit(1);
+    }
+    return 0;
+}
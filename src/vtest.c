@@ -0,0 +1,467 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Unit tests of the modules not needing a device, run by ctest
+ *
+ * vtest <module> runs the tests of one module and exits with 1 if any of
+ * them failed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "xmlconfig.h"
+#include "parser.h"
+#include "arithmetic.h"
+#include "binproto.h"
+#include "cache.h"
+#include "history.h"
+#include "planner.h"
+
+// Referenced by parser.c and socket.c
+FILE *iniFD = NULL;
+int inetversion = 0;
+
+static int failed = 0;
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+static int check(int cond, const char *text, const char *file, int line)
+{
+    if (! cond) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, text);
+        failed++;
+    }
+    return cond;
+}
+
+// arithmetic.c: the compiled calc must give the same as the interpreter
+
+static const char *floatCalcs[] = {
+    "V",
+    "V/10",
+    "V*100",
+    "-V",
+    "(B1 * 100)+B0",
+    "(B0+B1*256)/10",
+    "B1-B0-0x10",
+    "((((B0-48)*10)+(B1-48))*10)+B2-48",
+    "(V+1)*(V-1)/3",
+    NULL
+};
+
+static const char *intCalcs[] = {
+    "(B0 & (0x01<<BP))>> BP",
+    "B0|B1",
+    "B0^0xff",
+    "(B1<<8)+B0",
+    "B2 & 0x0f",
+    NULL
+};
+
+// The calcs always read B0 to B9
+static char calcBytes[][10] = {
+    { 0x00, 0x00, 0x00, 0x00 },
+    { 0x12, 0x34, 0x56, 0x78 },
+    { (char)0xff, (char)0x80, 0x7f, 0x01 },
+    { 0x31, 0x32, 0x33, 0x00 }
+};
+
+static float calcValues[] = { 0, 1.5, -21.25, 3600 };
+
+static void testArithmetic()
+{
+    char expr[256];
+    char err[256];
+    char *ptr;
+    calcPtr cPtr;
+    float want;
+    float got;
+    int iWant;
+    int iGot;
+    int n;
+    int b;
+    int v;
+
+    for (n = 0; floatCalcs[n]; n++) {
+        err[0] = '\0';
+        cPtr = compileExpression(floatCalcs[n], 0, err, NULL);
+        if (! CHECK(cPtr != NULL)) {
+            fprintf(stderr, "  %s: %s\n", floatCalcs[n], err);
+            continue;
+        }
+        for (b = 0; b < (int)(sizeof(calcBytes) / sizeof(calcBytes[0])); b++) {
+            for (v = 0; v < (int)(sizeof(calcValues) / sizeof(calcValues[0])); v++) {
+                strcpy(expr, floatCalcs[n]);
+                ptr = expr;
+                err[0] = '\0';
+                want = execExpression(&ptr, calcBytes[b], calcValues[v], err);
+                CHECK(err[0] == '\0');
+                got = execCalc(cPtr, calcBytes[b], calcValues[v], err);
+                if (! CHECK(err[0] == '\0' && got == want)) {
+                    fprintf(stderr, "  %s: %f instead of %f\n", floatCalcs[n], got, want);
+                }
+            }
+        }
+        removeExpression(cPtr);
+    }
+
+    for (n = 0; intCalcs[n]; n++) {
+        err[0] = '\0';
+        cPtr = compileExpression(intCalcs[n], 1, err, NULL);
+        if (! CHECK(cPtr != NULL)) {
+            fprintf(stderr, "  %s: %s\n", intCalcs[n], err);
+            continue;
+        }
+        for (b = 0; b < (int)(sizeof(calcBytes) / sizeof(calcBytes[0])); b++) {
+            for (v = 0; v < 8; v++) {
+                strcpy(expr, intCalcs[n]);
+                ptr = expr;
+                err[0] = '\0';
+                iWant = execIExpression(&ptr, calcBytes[b], v, NULL, err);
+                CHECK(err[0] == '\0');
+                iGot = execICalc(cPtr, calcBytes[b], v, NULL, err);
+                if (! CHECK(err[0] == '\0' && iGot == iWant)) {
+                    fprintf(stderr, "  %s: %d instead of %d\n", intCalcs[n], iGot, iWant);
+                }
+            }
+        }
+        removeExpression(cPtr);
+    }
+
+    // Errors are found when compiling
+    err[0] = '\0';
+    CHECK(compileExpression("(B0+", 0, err, NULL) == NULL);
+    CHECK(err[0] != '\0');
+}
+
+// binproto.c: byte order and length of the frames
+
+static void testBinproto()
+{
+    static const unsigned char want[] = {
+        0x00, 0x00, 0x00, 0x13,
+        BIN_VERSION, BIN_EXEC,
+        0x12, 0x34,
+        0xde, 0xad, 0xbe, 0xef,
+        0x3f, 0xf8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        'a', 'b', 'c'
+    };
+    char big[1000];
+    BinBuf buf;
+    int n;
+
+    binInit(&buf);
+    CHECK(buf.len == BIN_HEADER);
+    binPut8(&buf, BIN_VERSION);
+    binPut8(&buf, BIN_EXEC);
+    binPut16(&buf, 0x1234);
+    binPut32(&buf, 0xdeadbeef);
+    binPutDouble(&buf, 1.5);
+    binPutBytes(&buf, "abc", 3);
+    binFinish(&buf);
+    CHECK(buf.len == sizeof(want));
+    CHECK(memcmp(buf.data, want, sizeof(want)) == 0);
+    CHECK(binGet16((char *)buf.data + 6) == 0x1234);
+    binFree(&buf);
+    CHECK(buf.data == NULL && buf.len == 0);
+
+    // Growing past the first allocation keeps what was written
+    binInit(&buf);
+    binPut64(&buf, 0x0102030405060708ULL);
+    for (n = 0; n < (int)sizeof(big); n++) {
+        big[n] = n;
+    }
+    binPutBytes(&buf, big, sizeof(big));
+    binFinish(&buf);
+    CHECK(buf.len == BIN_HEADER + 8 + sizeof(big));
+    CHECK(buf.data[2] == ((8 + sizeof(big)) >> 8) && buf.data[3] == ((8 + sizeof(big)) & 0xff));
+    CHECK(buf.data[4] == 0x01 && buf.data[11] == 0x08);
+    CHECK(memcmp(buf.data + 12, big, sizeof(big)) == 0);
+    binFree(&buf);
+}
+
+// cache.c: fresh, expired, failed and invalidated entries
+
+static void testCache()
+{
+    char key[256];
+    char other[256];
+    cacheEntryPtr ePtr;
+
+    cacheKey(key, sizeof(key), "getTempA", "", 0);
+    cacheKey(other, sizeof(other), "getTempA", "", 1);
+    CHECK(strcmp(key, other) != 0);
+
+    CHECK(cacheLookup(key, &ePtr) == CACHE_MISS);
+    cacheStore(key, 60, 0x0800, 2, "21.5");
+    CHECK(cacheLookup(key, &ePtr) == CACHE_FRESH);
+    CHECK(strcmp(ePtr->value, "21.5") == 0);
+    CHECK(cacheLookup(other, &ePtr) == CACHE_MISS);
+
+    // A failed refresh keeps the value, but it is no longer fresh
+    cacheFailed(key);
+    CHECK(cacheLookup(key, &ePtr) == CACHE_EXPIRED);
+    CHECK(strcmp(ePtr->value, "21.5") == 0);
+    cacheStore(key, 60, 0x0800, 2, "22.0");
+    CHECK(cacheLookup(key, &ePtr) == CACHE_FRESH);
+    CHECK(strcmp(ePtr->value, "22.0") == 0);
+
+    cacheStore(other, 0, 0x0802, 1, "3");
+    CHECK(cacheLookup(other, &ePtr) == CACHE_EXPIRED);
+
+    // Only overlapping ranges are dropped
+    cacheInvalidate(0x0802, 4);
+    CHECK(cacheLookup(key, &ePtr) == CACHE_FRESH);
+    CHECK(cacheLookup(other, &ePtr) == CACHE_MISS);
+    cacheInvalidate(0x0801, 1);
+    CHECK(cacheLookup(key, &ePtr) == CACHE_MISS);
+
+    cacheStore(key, 60, 0x0800, 2, "22.0");
+    cacheClear();
+    CHECK(cacheLookup(key, &ePtr) == CACHE_MISS);
+}
+
+// history.c: the compression must give back every point exactly
+
+#define HIST_POINTS 2000
+
+struct histResult {
+    int count;
+    time_t t[HIST_POINTS];
+    double value[HIST_POINTS];
+};
+
+static void collect(time_t t, double value, void *data)
+{
+    struct histResult *rPtr = data;
+
+    if (rPtr->count < HIST_POINTS) {
+        rPtr->t[rPtr->count] = t;
+        rPtr->value[rPtr->count] = value;
+    }
+    rPtr->count++;
+}
+
+static void testHistory()
+{
+    static struct histResult res;
+    time_t t[HIST_POINTS];
+    double value[HIST_POINTS];
+    int n;
+    int first;
+
+    CHECK(historyMode("avg") == HIST_AVG);
+    CHECK(historyMode("max") == HIST_MAX);
+    CHECK(historyMode("sum") == -1);
+
+    historyBudget(1024);
+    for (n = 0; n < HIST_POINTS; n++) {
+        // Regular, jittered and far apart timestamps, repeated and changing values
+        t[n] = 1000000 + n * 60 + (n % 7 == 3 ? 5 : 0) + (n >= 1500 ? 100000 : 0);
+        value[n] = (n % 5 == 0) ? 20.0 + n / 10 * 0.1 : (n % 11) * -1.25 + (n > 1000 ? 1e6 : 0);
+        historyAdd("temp", t[n], value[n]);
+    }
+    // Points going back in time are ignored
+    historyAdd("temp", t[10], 99.0);
+
+    CHECK(historyQuery("unknown", 0, t[HIST_POINTS - 1], 0, HIST_AVG, collect, &res) == -1);
+
+    memset(&res, 0, sizeof(res));
+    CHECK(historyQuery("temp", 0, t[HIST_POINTS - 1], 0, HIST_AVG, collect, &res) == HIST_POINTS);
+    if (CHECK(res.count == HIST_POINTS)) {
+        for (n = 0; n < HIST_POINTS; n++) {
+            if (! CHECK(res.t[n] == t[n] && res.value[n] == value[n])) {
+                fprintf(stderr, "  point %d: %ld %f instead of %ld %f\n", n,
+                        (long)res.t[n], res.value[n], (long)t[n], value[n]);
+                break;
+            }
+        }
+    }
+
+    // A range in the middle of a block
+    memset(&res, 0, sizeof(res));
+    CHECK(historyQuery("temp", t[100], t[199], 0, HIST_AVG, collect, &res) == 100);
+    CHECK(res.t[0] == t[100] && res.value[99] == value[199]);
+
+    // Aggregated into buckets of 10 points
+    memset(&res, 0, sizeof(res));
+    historyQuery("temp", t[0], t[19], 600, HIST_MAX, collect, &res);
+    CHECK(res.count == 2);
+    CHECK(res.t[0] == t[0] && res.value[0] == 20.0);
+    memset(&res, 0, sizeof(res));
+    historyQuery("temp", t[0], t[9], 600, HIST_AVG, collect, &res);
+    CHECK(res.count == 1);
+
+    // A smaller budget drops the oldest blocks, the newest points stay
+    historyBudget(1);
+    memset(&res, 0, sizeof(res));
+    historyQuery("temp", 0, t[HIST_POINTS - 1], 0, HIST_AVG, collect, &res);
+    CHECK(res.count > 0 && res.count < HIST_POINTS);
+    if (res.count > 0 && res.count < HIST_POINTS) {
+        first = HIST_POINTS - res.count;
+        CHECK(res.t[0] == t[first] && res.value[0] == value[first]);
+        CHECK(res.t[res.count - 1] == t[HIST_POINTS - 1]);
+    }
+
+    historyBudget(0);
+    historyAdd("temp", t[HIST_POINTS - 1] + 60, 1.0);
+    memset(&res, 0, sizeof(res));
+    historyQuery("temp", 0, t[HIST_POINTS - 1] + 60, 0, HIST_AVG, collect, &res);
+    CHECK(res.count == 0);
+}
+
+// planner.c: merged frames and the slices handed to the commands
+
+struct planCmd {
+    struct command cmd;
+    struct compile send;
+    struct compile recv;
+    char sendBuf[5];
+    PlanItem item;
+};
+
+static void planCommand(struct planCmd *pPtr, char *name, int addr, int len, int seq)
+{
+    memset(pPtr, 0, sizeof(*pPtr));
+    pPtr->sendBuf[0] = 0x00;
+    pPtr->sendBuf[1] = 0x01;
+    pPtr->sendBuf[2] = addr >> 8;
+    pPtr->sendBuf[3] = addr & 0xff;
+    pPtr->sendBuf[4] = len;
+    pPtr->send.token = SEND;
+    pPtr->send.send = pPtr->sendBuf;
+    pPtr->send.len = sizeof(pPtr->sendBuf);
+    pPtr->send.next = &pPtr->recv;
+    pPtr->recv.token = RECV;
+    pPtr->recv.len = len;
+    pPtr->cmd.name = name;
+    pPtr->cmd.cmpPtr = &pPtr->send;
+    pPtr->cmd.seq = seq;
+    pPtr->item.cPtr = &pPtr->cmd;
+    pPtr->item.noUnit = 1;
+}
+
+static void testPlanner()
+{
+    static struct planCmd cmds[4];
+    planItemPtr items[4];
+    char answer[PLAN_MAXLEN];
+    char frame[16];
+    int fds[2];
+    int n;
+
+    planCommand(&cmds[0], "getB", 0x0802, 2, 0);
+    planCommand(&cmds[1], "getFar", 0x2000, 4, 1);
+    planCommand(&cmds[2], "getA", 0x0800, 2, 2);
+    planCommand(&cmds[3], "getC", 0x0806, 1, 3);
+    for (n = 0; n < 4; n++) {
+        items[n] = &cmds[n].item;
+        CHECK(planMergeable(&cmds[n].cmd, 0x41));
+    }
+    CHECK(! planMergeable(&cmds[0].cmd, 0x4b));
+    cmds[0].cmd.precmd = "getDevType";
+    CHECK(! planMergeable(&cmds[0].cmd, 0x41));
+    cmds[0].cmd.precmd = NULL;
+    cmds[0].recv.len = 3;
+    CHECK(! planMergeable(&cmds[0].cmd, 0x41));
+    cmds[0].recv.len = 2;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        perror("socketpair");
+        exit(1);
+    }
+
+    // 0800-0806 in one frame, the gap of 2 is read along, 2000 stays single
+    for (n = 0; n < 7; n++) {
+        answer[n] = 0x10 + n;
+    }
+    CHECK(write(fds[1], answer, 7) == 7);
+    CHECK(execPlan(items, 4, fds[0], 2, PLAN_MAXLEN) == 3);
+    CHECK(read(fds[1], frame, sizeof(frame)) == 5);
+    CHECK(memcmp(frame, "\x00\x01\x08\x00\x07", 5) == 0);
+    CHECK(cmds[2].item.done && cmds[2].item.count == 2);
+    CHECK(memcmp(cmds[2].item.recvBuf, "\x10\x11", 2) == 0);
+    CHECK(cmds[0].item.done && cmds[0].item.count == 2);
+    CHECK(memcmp(cmds[0].item.recvBuf, "\x12\x13", 2) == 0);
+    CHECK(cmds[3].item.done && cmds[3].item.count == 1);
+    CHECK(cmds[3].item.recvBuf[0] == 0x16);
+    CHECK(! cmds[1].item.done);
+
+    // The gap and the length limit split the range
+    for (n = 0; n < 4; n++) {
+        items[n] = &cmds[n].item;
+    }
+    CHECK(write(fds[1], answer, 4) == 4);
+    CHECK(execPlan(items, 4, fds[0], 1, PLAN_MAXLEN) == 2);
+    CHECK(read(fds[1], frame, sizeof(frame)) == 5);
+    CHECK(memcmp(frame, "\x00\x01\x08\x00\x04", 5) == 0);
+    CHECK(! cmds[3].item.done);
+
+    CHECK(write(fds[1], answer, 4) == 4);
+    CHECK(execPlan(items, 4, fds[0], 2, 5) == 2);
+    CHECK(read(fds[1], frame, sizeof(frame)) == 5);
+    CHECK(memcmp(frame, "\x00\x01\x08\x00\x04", 5) == 0);
+    CHECK(cmds[0].item.done && cmds[2].item.done && ! cmds[3].item.done);
+
+    // A failed frame is reported, the commands are left to be run singly
+    close(fds[1]);
+    CHECK(execPlan(items, 4, fds[0], 2, PLAN_MAXLEN) == -1);
+    close(fds[0]);
+}
+
+static struct {
+    const char *name;
+    void (*fn)();
+} tests[] = {
+    { "arithmetic", testArithmetic },
+    { "binproto", testBinproto },
+    { "cache", testCache },
+    { "history", testHistory },
+    { "planner", testPlanner },
+    { NULL, NULL }
+};
+
+int main(int argc, char *argv[])
+{
+    int n;
+
+    // The planner tests write to a closed socket
+    signal(SIGPIPE, SIG_IGN);
+
+    for (n = 0; tests[n].name; n++) {
+        if (argc < 2 || strcmp(argv[1], tests[n].name) == 0) {
+            tests[n].fn();
+            if (argc >= 2) {
+                break;
+            }
+        }
+    }
+    if (argc >= 2 && ! tests[n].name) {
+        fprintf(stderr, "usage: vtest [arithmetic|binproto|cache|history|planner]\n");
+        exit(2);
+    }
+    if (failed) {
+        fprintf(stderr, "%d checks failed\n", failed);
+        exit(1);
+    }
+    return 0;
+}
@@ -0,0 +1,578 @@
+/*  Copyright 2007-2017 the original vcontrold development team
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Decoder of the flight recorder dumped by "trace dump", see trace.h
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+
+#include "socket.h"
+#include "vclient.h"
+#include "trace.h"
+#include "version.h"
+
+#define DEFAULT_PORT 3002
+
+// Histogram buckets: below 1 ms, then doubling up to 1024 ms and above
+#define BUCKETS 12
+#define BAR_WIDTH 40
+
+int inetversion = 0;
+
+typedef struct cmdStat {
+    int runs;
+    int failed;
+    uint64_t min;
+    uint64_t max;
+    uint64_t sum;
+    int buckets[BUCKETS];
+} CmdStat;
+
+// An open command per process, to match its end
+typedef struct openCmd {
+    uint32_t pid;
+    uint16_t cmd;
+    uint64_t ns;
+} OpenCmd;
+
+static char **names = NULL;
+static int nameCount = 0;
+
+void logIT (int class, char *string, ...)
+{
+    va_list arguments;
+
+    if (class > LOG_NOTICE) {
+        return;
+    }
+    va_start(arguments, string);
+    vfprintf(stderr, string, arguments);
+    va_end(arguments);
+    fputc('\n', stderr);
+}
+
+static void usage()
+{
+    printf("usage:\n");
+    printf("    vtrace [-h <ip:port>] [-p <port>] [-o <dump file>] [-s] [-4|-6] [<dump file>]\n\n");
+    printf("    -h|--host         <IPv4>:<Port> or <IPv6> of vcontrold, the dump is fetched\n");
+    printf("                      from there instead of read from <dump file> or STDIN\n");
+    printf("    -p|--port         <port> of vcontrold when using IPv6\n");
+    printf("    -o|--output       Also save the fetched dump to the given file\n");
+    printf("    -s|--stats        Print only the timing histograms of the commands\n");
+    printf("    -V|--Version      Print version and exit\n");
+    printf("    -4|--inet4        IPv4 is preferred\n");
+    printf("    -6|--inet6        IPv6 is preferred\n");
+    printf("    --help            Display this help message\n\n");
+    exit(1);
+}
+
+static uint16_t get16(const unsigned char *ptr)
+{
+    uint16_t value;
+
+    memcpy(&value, ptr, 2);
+    return ntohs(value);
+}
+
+static uint32_t get32(const unsigned char *ptr)
+{
+    uint32_t value;
+
+    memcpy(&value, ptr, 4);
+    return ntohl(value);
+}
+
+static uint64_t get64(const unsigned char *ptr)
+{
+    return ((uint64_t)get32(ptr) << 32) | get32(ptr + 4);
+}
+
+/* Looks for a complete dump in buf, there may be text like the prompt of
+ * vcontrold before it. Returns its length and sets *start, 0 if it is
+ * not complete yet.
+ */
+static size_t findDump(const unsigned char *buf, size_t len, size_t *start)
+{
+    const unsigned char *ptr = NULL;
+    size_t pos;
+    size_t need;
+    uint32_t entries;
+    int count;
+
+    for (pos = 0; pos + 4 <= len; pos++) {
+        if (memcmp(buf + pos, TRACE_MAGIC, 4) == 0) {
+            ptr = buf + pos;
+            break;
+        }
+    }
+    if (! ptr || len - pos < TRACE_HEADER_LEN) {
+        return 0;
+    }
+    *start = pos;
+    count = get16(ptr + 6);
+    entries = get32(ptr + 8);
+    need = TRACE_HEADER_LEN;
+    while (count--) {
+        if (need >= len - pos) {
+            return 0;
+        }
+        need += 1 + ptr[need];
+    }
+    while (entries--) {
+        if (need + TRACE_ENTRY_LEN > len - pos) {
+            return 0;
+        }
+        need += TRACE_ENTRY_LEN + ptr[need + 25];
+    }
+    return (need <= len - pos) ? need : 0;
+}
+
+// Reads from fd until a complete dump is in *buf, returns its length
+static size_t readDump(int fd, unsigned char **buf, size_t *start)
+{
+    size_t size = 65536;
+    size_t len = 0;
+    size_t dumpLen;
+    ssize_t n;
+
+    if (! (*buf = malloc(size))) {
+        logIT(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    while (1) {
+        if (len == size) {
+            size *= 2;
+            if (! (*buf = realloc(*buf, size))) {
+                logIT(LOG_ERR, "malloc failed");
+                exit(1);
+            }
+        }
+        n = read(fd, *buf + len, size - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n > 0) {
+            len += n;
+        }
+        if ((dumpLen = findDump(*buf, len, start))) {
+            return dumpLen;
+        }
+        if (n <= 0) {
+            return 0;
+        }
+    }
+}
+
+static const char *cmdName(uint16_t cmd)
+{
+    static char string[16];
+
+    if (cmd == TRACE_NOCMD) {
+        return "-";
+    }
+    if (cmd < nameCount && *names[cmd]) {
+        return names[cmd];
+    }
+    snprintf(string, sizeof(string), "#%u", cmd);
+    return string;
+}
+
+// Describes the frames of the P300 and KW protocols
+static void annotate(char *text, size_t len, int kind, const unsigned char *data,
+                     int dataLen, int size)
+{
+    static const char *types[] = { "request", "response", "?", "error" };
+    const char *fct;
+
+    *text = '\0';
+    if (dataLen < 1) {
+        return;
+    }
+    if (size == 1) {
+        switch (data[0]) {
+        case 0x04:
+            snprintf(text, len, "reset");
+            break;
+        case 0x05:
+            if (kind == TRACE_RECV) {
+                snprintf(text, len, "sync");
+            }
+            break;
+        case 0x06:
+            snprintf(text, len, "ack");
+            break;
+        case 0x15:
+            snprintf(text, len, "nak");
+            break;
+        }
+    } else if (kind == TRACE_SEND && size == 3 && data[0] == 0x16 && data[1] == 0 && data[2] == 0) {
+        snprintf(text, len, "P300 start");
+    } else if (data[0] == 0x41 && dataLen >= 7) {
+        switch (data[3]) {
+        case 0x01:
+            fct = "read";
+            break;
+        case 0x02:
+            fct = "write";
+            break;
+        case 0x07:
+            fct = "call";
+            break;
+        default:
+            fct = "function ?";
+        }
+        snprintf(text, len, "P300 %s %s 0x%02X%02X %d bytes", (data[2] < 4) ? types[data[2]] : "?",
+                 fct, data[4], data[5], data[6]);
+    } else if (kind == TRACE_SEND && data[0] == 0x01 && dataLen >= 5 && (data[1] == 0xF7 || data[1] == 0xF4)) {
+        snprintf(text, len, "KW %s 0x%02X%02X %d bytes", (data[1] == 0xF7) ? "read" : "write",
+                 data[2], data[3], data[4]);
+    }
+}
+
+static int bucket(uint64_t ns)
+{
+    uint64_t ms = ns / 1000000;
+    int n = 0;
+
+    if (ms < 1) {
+        return 0;
+    }
+    while (ms && n < BUCKETS - 1) {
+        ms >>= 1;
+        n++;
+    }
+    return n;
+}
+
+static void printStats(CmdStat *stats, int count)
+{
+    int n;
+    int b;
+    int max;
+    int width;
+    CmdStat *sPtr;
+    char range[32];
+
+    for (n = 0; n < count; n++) {
+        sPtr = &stats[n];
+        if (! sPtr->runs) {
+            continue;
+        }
+        printf("\n%s: %d runs, %d failed, min %.1f ms, avg %.1f ms, max %.1f ms\n",
+               cmdName(n), sPtr->runs, sPtr->failed, sPtr->min / 1e6,
+               sPtr->sum / 1e6 / sPtr->runs, sPtr->max / 1e6);
+        max = 0;
+        for (b = 0; b < BUCKETS; b++) {
+            max = (sPtr->buckets[b] > max) ? sPtr->buckets[b] : max;
+        }
+        for (b = 0; b < BUCKETS; b++) {
+            if (! sPtr->buckets[b]) {
+                continue;
+            }
+            if (b == 0) {
+                snprintf(range, sizeof(range), "< 1 ms");
+            } else if (b == BUCKETS - 1) {
+                snprintf(range, sizeof(range), ">= %d ms", 1 << (b - 1));
+            } else {
+                snprintf(range, sizeof(range), "%d - %d ms", 1 << (b - 1), 1 << b);
+            }
+            width = (sPtr->buckets[b] * BAR_WIDTH + max - 1) / max;
+            printf("  %14s %6d %.*s\n", range, sPtr->buckets[b], width,
+                   "########################################");
+        }
+    }
+}
+
+static int decode(const unsigned char *dump, size_t len, int statsOnly)
+{
+    const unsigned char *ptr = dump;
+    const unsigned char *end = dump + len;
+    uint64_t now;
+    uint64_t wall;
+    uint64_t at;
+    uint64_t prev = 0;
+    uint64_t lastSeq = 0;
+    uint32_t entries;
+    CmdStat *stats;
+    OpenCmd *opens = NULL;
+    int openCount = 0;
+    int n;
+    int i;
+
+    if (len < TRACE_HEADER_LEN) {
+        logIT(LOG_ERR, "Dump truncated");
+        return 0;
+    }
+    if (ptr[4] != TRACE_VERSION) {
+        logIT(LOG_ERR, "Dump version %d is not supported", ptr[4]);
+        return 0;
+    }
+    nameCount = get16(ptr + 6);
+    entries = get32(ptr + 8);
+    now = get64(ptr + 12);
+    wall = get64(ptr + 20);
+    ptr += TRACE_HEADER_LEN;
+
+    if (! (names = calloc(nameCount + 1, sizeof(*names)))
+        || ! (stats = calloc(nameCount + 1, sizeof(*stats)))) {
+        logIT(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    for (n = 0; n < nameCount; n++) {
+        if (ptr >= end || ptr + 1 + *ptr > end) {
+            logIT(LOG_ERR, "Dump truncated in the command names");
+            return 0;
+        }
+        if (! (names[n] = calloc(1, *ptr + 1))) {
+            logIT(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        memcpy(names[n], ptr + 1, *ptr);
+        ptr += 1 + *ptr;
+    }
+
+    // An entry is only read if it is there as a whole
+    for (; entries && ptr + TRACE_ENTRY_LEN <= end && ptr + TRACE_ENTRY_LEN + ptr[25] <= end; entries--) {
+        uint64_t seq = get64(ptr);
+        uint64_t ns = get64(ptr + 8);
+        uint32_t pid = get32(ptr + 16);
+        uint16_t cmd = get16(ptr + 20);
+        int16_t result = (int16_t)get16(ptr + 22);
+        int kind = ptr[24];
+        int dataLen = ptr[25];
+        int size = get16(ptr + 26);
+        const unsigned char *data = ptr + TRACE_ENTRY_LEN;
+        char text[128];
+        char hex[3 * TRACE_DATA + 8];
+        struct tm tm;
+        time_t secs;
+
+        uint64_t took = 0;
+
+        ptr += TRACE_ENTRY_LEN + dataLen;
+
+        // Matches the end of a command to its begin in the same process
+        for (i = 0; i < openCount && opens[i].pid != pid; i++) { }
+        if (kind == TRACE_BEGIN) {
+            if (i == openCount) {
+                if (! (opens = realloc(opens, (openCount + 1) * sizeof(*opens)))) {
+                    logIT(LOG_ERR, "malloc failed");
+                    exit(1);
+                }
+                openCount++;
+            }
+            opens[i].pid = pid;
+            opens[i].cmd = cmd;
+            opens[i].ns = ns;
+        } else if (kind == TRACE_END && i < openCount && opens[i].cmd == cmd && cmd < nameCount) {
+            CmdStat *sPtr = &stats[cmd];
+
+            took = ns - opens[i].ns;
+            if (! sPtr->runs || took < sPtr->min) {
+                sPtr->min = took;
+            }
+            sPtr->max = (took > sPtr->max) ? took : sPtr->max;
+            sPtr->sum += took;
+            sPtr->runs++;
+            sPtr->failed += (result < 0);
+            sPtr->buckets[bucket(took)]++;
+            opens[i].cmd = TRACE_NOCMD;
+        }
+
+        if (statsOnly) {
+            continue;
+        }
+        if (lastSeq && seq != lastSeq + 1) {
+            printf("-- %llu entries lost --\n", (unsigned long long)(seq - lastSeq - 1));
+        }
+        lastSeq = seq;
+
+        at = wall - (now - ns);
+        secs = at / 1000000000;
+        localtime_r(&secs, &tm);
+        strftime(text, sizeof(text), "%H:%M:%S", &tm);
+        printf("%s.%06lu %+9.3f ms [%u] %-20s ", text, (unsigned long)(at % 1000000000 / 1000),
+               prev ? (ns - prev) / 1e6 : 0.0, pid, cmdName(cmd));
+        prev = ns;
+
+        switch (kind) {
+        case TRACE_BEGIN:
+            printf("BEGIN\n");
+            break;
+        case TRACE_END:
+            printf("END    %s", (result < 0) ? "failed" : "ok");
+            if (took) {
+                printf(" after %.3f ms", took / 1e6);
+            }
+            printf("\n");
+            break;
+        case TRACE_SEND:
+        case TRACE_RECV:
+            for (n = 0, i = 0, *hex = '\0'; n < dataLen; n++) {
+                i += sprintf(hex + i, n ? " %02X" : "%02X", data[n]);
+            }
+            if (size > dataLen) {
+                strcat(hex, " ...");
+            }
+            annotate(text, sizeof(text), kind, data, dataLen, size);
+            printf("%s %3d  %s", (kind == TRACE_SEND) ? "SEND" : "RECV", size, hex);
+            if (result == TRACE_TIMEOUT) {
+                printf(" timeout");
+            } else if (result == TRACE_ERROR || (kind == TRACE_SEND && result != size)) {
+                printf(" error");
+            }
+            printf("%s%s\n", *text ? "  " : "", text);
+            break;
+        default:
+            printf("kind %d ?\n", kind);
+        }
+    }
+    if (entries) {
+        printf("-- dump truncated, %u entries missing --\n", entries);
+    }
+
+    printStats(stats, nameCount);
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    char *host = NULL;
+    int port = 0;
+    const char *outfile = NULL;
+    const char *infile = NULL;
+    static int statsOnly = 0;
+    unsigned char *buf;
+    size_t start = 0;
+    size_t len;
+    int fd;
+    int opt;
+
+    while (1) {
+        static struct option long_options[] = {
+            {"host",    required_argument, 0,            'h'},
+            {"port",    required_argument, 0,            'p'},
+            {"output",  required_argument, 0,            'o'},
+            {"stats",   no_argument,       &statsOnly,   1  },
+            {"Version", no_argument,       0,            'V'},
+            {"inet4",   no_argument,       &inetversion, 4  },
+            {"inet6",   no_argument,       &inetversion, 6  },
+            {"help",    no_argument,       0,            0  },
+            {0,         0,                 0,            0  }
+        };
+        int option_index = 0;
+        opt = getopt_long(argc, argv, "h:p:o:sV46", long_options, &option_index);
+
+        if (opt == -1) {
+            break;
+        }
+
+        switch (opt) {
+        case 0:
+            if (strcmp("help", long_options[option_index].name) == 0) {
+                usage();
+            }
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            if (port == 0) {
+                fprintf(stderr, "Invalid value for option --port: %s\n", optarg);
+                usage();
+            }
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 's':
+            statsOnly = 1;
+            break;
+        case 'V':
+            printf("vtrace version %s\n", VERSION);
+            exit(1);
+            break;
+        case '4':
+            inetversion = 4;
+            break;
+        case '6':
+            inetversion = 6;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc) {
+        infile = argv[optind];
+    }
+
+    if (host) {
+        // Like vclient, the last :<port> of the host is the port
+        char *last_colon = strrchr(host, ':');
+
+        if (port == 0 && last_colon) {
+            port = atoi(last_colon + 1);
+            *last_colon = '\0';
+        }
+        if ((fd = openCliSocket(host, port ? port : DEFAULT_PORT, 0)) < 0) {
+            logIT(LOG_ERR, "No connection to host %s on port %d", host, port ? port : DEFAULT_PORT);
+            exit(1);
+        }
+        if (writen(fd, "trace dump\n", 11) != 11) {
+            logIT(LOG_ERR, "Error writing to socket");
+            exit(1);
+        }
+        len = readDump(fd, &buf, &start);
+        writen(fd, "quit\n", 5);
+        close(fd);
+    } else {
+        if (! infile || strcmp(infile, "-") == 0) {
+            fd = STDIN_FILENO;
+        } else if ((fd = open(infile, O_RDONLY)) < 0) {
+            logIT(LOG_ERR, "Could not open %s: %s", infile, strerror(errno));
+            exit(1);
+        }
+        len = readDump(fd, &buf, &start);
+        close(fd);
+    }
+    if (! len) {
+        logIT(LOG_ERR, "No complete flight recorder dump found");
+        exit(1);
+    }
+
+    if (outfile) {
+        FILE *filePtr = fopen(outfile, "w");
+
+        if (! filePtr || fwrite(buf + start, 1, len, filePtr) != len || fclose(filePtr) != 0) {
+            logIT(LOG_ERR, "Could not write %s: %s", outfile, strerror(errno));
+            exit(1);
+        }
+    }
+
+    return decode(buf + start, len, statsOnly) ? 0 : 1;
+}
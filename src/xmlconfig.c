@@ -18,15 +18,21 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <ctype.h>
 #include <string.h>
 #include <syslog.h>
 #include <libxml/parser.h>
-#include <libxml/xinclude.h>
+#include <libxml/xmlreader.h>
+#include <libxml/uri.h>
 #include <arpa/inet.h>
+#include <pthread.h>
 
 #include "xmlconfig.h"
 #include "common.h"
+#include "io.h"
 #include "parser.h"
+#include "arithmetic.h"
+#include "unit.h"
 
 #if defined(__FreeBSD__)
 #include <netinet/in.h>
@@ -36,21 +42,44 @@
 protocolPtr newProtocolNode(protocolPtr ptr);
 char *getPropertyNode(xmlAttrPtr cur, xmlChar *name);
 enumPtr newEnumNode(enumPtr ptr);
-void removeProtocolList(protocolPtr ptr);
-void removeUnitList(unitPtr ptr);
-void removeMacroList(macroPtr ptr);
-void removeCommandList(commandPtr ptr);
-void removeDeviceList(devicePtr ptr);
-void removeIcmdList(icmdPtr ptr);
-void removeEnumList(enumPtr ptr);
-void freeAllLists();
-
-// Globale variables
-protocolPtr protoPtr = NULL;
-unitPtr uPtr = NULL;
-devicePtr devPtr = NULL;
-configPtr cfgPtr = NULL;
-commandPtr cmdPtr = NULL;
+void removePollList(pollPtr ptr);
+
+/* Configuration images
+ *
+ * Everything read from the XML file and compiled from it is allocated
+ * from one arena, see arena.c, which is sealed read only once it is
+ * complete. A reload builds a new image next to the one in use and swaps
+ * it in as a whole; nothing of an image changes after it is published.
+ *
+ * Each thread works on the image it has pinned, the global pointers below
+ * are its view of it. Pins and the current image hold a reference, the
+ * last one gone frees the image. So a reload never waits for a request
+ * in the broker thread, which finishes on the image it started with, and
+ * the next pinImage() moves it over to the new one.
+ *
+ * Only the commands of the active device are ever executed, and most
+ * clients use a handful of them. So they are compiled on first use, see
+ * compiledCommand(), into an arena of their own next to the image.
+ */
+
+// Global variables, the configuration pinned by this thread
+__thread protocolPtr protoPtr = NULL;
+__thread unitPtr uPtr = NULL;
+__thread devicePtr devPtr = NULL;
+__thread configPtr cfgPtr = NULL;
+__thread commandPtr cmdPtr = NULL;
+__thread nameIndexPtr uIndex = NULL;
+static __thread imagePtr pinned = NULL;
+
+static imagePtr current = NULL;
+static unsigned long lastGeneration = 0;
+static pthread_mutex_t imageLock = PTHREAD_MUTEX_INITIALIZER;
+// The image being loaded, parse...() allocate from its arena
+static imagePtr loading = NULL;
+static arenaPtr loadArena = NULL;
+// Serializes compiling, and marks commands which failed to compile
+static pthread_mutex_t codeLock = PTHREAD_MUTEX_INITIALIZER;
+static struct command failedCommand;
 
 protocolPtr newProtocolNode(protocolPtr ptr)
 {
@@ -59,11 +88,7 @@ protocolPtr newProtocolNode(protocolPtr ptr)
         return newProtocolNode(ptr->next);
     }
 
-    nptr = calloc(1, sizeof(Protocol));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(loadArena, sizeof(Protocol));
 
     if (ptr) {
         ptr->next = nptr;
@@ -88,19 +113,6 @@ protocolPtr getProtocolNode(protocolPtr ptr, const char *name)
     return ptr;
 }
 
-void removeProtocolList(protocolPtr ptr)
-{
-    if (ptr && ptr->next) {
-        removeProtocolList(ptr->next);
-    }
-    if (ptr) {
-        removeMacroList(ptr->mPtr);
-        removeIcmdList(ptr->icPtr);
-        free(ptr->name);
-        free(ptr);
-    }
-}
-
 unitPtr newUnitNode(unitPtr ptr)
 {
     unitPtr nptr;
@@ -108,17 +120,14 @@ unitPtr newUnitNode(unitPtr ptr)
         return newUnitNode(ptr->next);
     }
 
-    nptr = calloc(1, sizeof(Unit));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(loadArena, sizeof(Unit));
 
     if (ptr) {
         ptr->next = nptr;
     }
 
     nptr->next = NULL;
+    nptr->ttl = -1;
     return nptr;
 }
 
@@ -135,26 +144,6 @@ unitPtr getUnitNode(unitPtr ptr, const char *name)
     return ptr;
 }
 
-void removeUnitList(unitPtr ptr)
-{
-    if (ptr && ptr->next) {
-        removeUnitList(ptr->next);
-    }
-
-    if (ptr) {
-        removeEnumList(ptr->ePtr);
-        free(ptr->name);
-        free(ptr->abbrev);
-        free(ptr->gCalc);
-        free(ptr->sCalc);
-        free(ptr->gICalc);
-        free(ptr->sICalc);
-        free(ptr->entity);
-        free(ptr->type);
-        free(ptr);
-    }
-}
-
 macroPtr newMacroNode(macroPtr ptr)
 {
     macroPtr nptr;
@@ -162,11 +151,7 @@ macroPtr newMacroNode(macroPtr ptr)
         return newMacroNode(ptr->next);
     }
 
-    nptr = calloc(1, sizeof(Macro));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(loadArena, sizeof(Macro));
 
     if (ptr) {
         ptr->next = nptr;
@@ -190,19 +175,6 @@ macroPtr getMacroNode(macroPtr ptr, const char *name)
     return ptr;
 }
 
-void removeMacroList(macroPtr ptr)
-{
-    if (ptr && ptr->next) {
-        removeMacroList(ptr->next);
-    }
-
-    if (ptr) {
-        free(ptr->name);
-        free(ptr->command);
-        free(ptr);
-    }
-}
-
 commandPtr newCommandNode(commandPtr ptr)
 {
     commandPtr nptr;
@@ -210,11 +182,7 @@ commandPtr newCommandNode(commandPtr ptr)
         return newCommandNode(ptr->next);
     }
 
-    nptr = calloc(1, sizeof(Command));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(loadArena, sizeof(Command));
 
     if (ptr) {
         ptr->next = nptr;
@@ -223,6 +191,7 @@ commandPtr newCommandNode(commandPtr ptr)
     nptr->next = NULL;
     nptr->cmpPtr = NULL;
     nptr->bit = -1;
+    nptr->ttl = -1;
 
     return nptr;
 }
@@ -251,46 +220,6 @@ commandPtr getCommandNode(commandPtr ptr, const char *name)
     return ptr;
 }
 
-void removeCommandList(commandPtr ptr)
-{
-    if (ptr && ptr->next) {
-        removeCommandList(ptr->next);
-    }
-
-    if (ptr) {
-        removeCompileList(ptr->cmpPtr);
-        free(ptr->send);
-        if (ptr->nodeType > 0) {
-            // Has been read from the XML file
-            if (ptr->addr) {
-                free(ptr->addr);
-            }
-            if (ptr->precmd) {
-                free(ptr->precmd);
-            }
-            if (ptr->unit) {
-                free(ptr->unit);
-            }
-            if (ptr->pcmd) {
-                free(ptr->pcmd);
-            }
-            if (ptr->errStr) {
-                free(ptr->errStr);
-            }
-            if (ptr->nodeType == 1) {
-                // Originalknoten
-                if (ptr->name) {
-                    free(ptr->name);
-                }
-                if (ptr->description) {
-                    free(ptr->description);
-                }
-            }
-        }
-        free(ptr);
-    }
-}
-
 devicePtr newDeviceNode(devicePtr ptr)
 {
     devicePtr nptr;
@@ -298,11 +227,7 @@ devicePtr newDeviceNode(devicePtr ptr)
         return newDeviceNode(ptr->next);
     }
 
-    nptr = calloc(1, sizeof(Device));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(loadArena, sizeof(Device));
 
     if (ptr) {
         ptr->next = nptr;
@@ -325,19 +250,6 @@ devicePtr getDeviceNode(devicePtr ptr, char *id)
     return ptr;
 }
 
-void removeDeviceList(devicePtr ptr)
-{
-    if (ptr && ptr->next) {
-        removeDeviceList(ptr->next);
-    }
-    if (ptr) {
-        removeCommandList(ptr->cmdPtr);
-        free(ptr->name);
-        free(ptr->id);
-        free(ptr);
-    }
-}
-
 icmdPtr newIcmdNode(icmdPtr ptr)
 {
     icmdPtr nptr;
@@ -345,11 +257,7 @@ icmdPtr newIcmdNode(icmdPtr ptr)
         return newIcmdNode(ptr->next);
     }
 
-    nptr = calloc(1, sizeof(iCmd));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(loadArena, sizeof(iCmd));
 
     if (ptr) {
         ptr->next = nptr;
@@ -372,18 +280,6 @@ icmdPtr getIcmdNode(icmdPtr ptr, const char *name)
     return ptr;
 }
 
-void removeIcmdList(icmdPtr ptr)
-{
-    if (ptr && ptr->next) {
-        removeIcmdList(ptr->next);
-    }
-    if (ptr) {
-        free(ptr->name);
-        free(ptr->send);
-        free(ptr);
-    }
-}
-
 enumPtr newEnumNode(enumPtr ptr)
 {
     enumPtr nptr;
@@ -391,11 +287,7 @@ enumPtr newEnumNode(enumPtr ptr)
         return newEnumNode(ptr->next);
     }
 
-    nptr = calloc(1, sizeof(Enumerate));
-    if (! nptr) {
-        fprintf(stderr, "malloc failed\n");
-        exit(1);
-    }
+    nptr = arenaAlloc(loadArena, sizeof(Enumerate));
 
     if (ptr) {
         ptr->next = nptr;
@@ -424,15 +316,49 @@ enumPtr getEnumNode(enumPtr ptr, char *search, int len)
     }
 }
 
-void removeEnumList(enumPtr ptr)
+pollPtr newPollNode(pollPtr ptr)
 {
+    pollPtr nptr;
     if (ptr && ptr->next) {
-        removeEnumList(ptr->next);
+        return newPollNode(ptr->next);
+    }
+
+    // The schedule changes, so the polls are not part of the arena
+    nptr = calloc(1, sizeof(Poll));
+    if (! nptr) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
     }
 
     if (ptr) {
-        free(ptr->text);
-        free(ptr->bytes);
+        ptr->next = nptr;
+    }
+
+    nptr->next = NULL;
+    return nptr;
+}
+
+pollPtr getPollNode(pollPtr ptr, const char *name)
+{
+    if (! ptr) {
+        return NULL;
+    }
+
+    if (ptr->name && name && (strcmp(ptr->name, name) != 0)) {
+        return getPollNode(ptr->next, name);
+    }
+
+    return ptr;
+}
+
+void removePollList(pollPtr ptr)
+{
+    if (ptr && ptr->next) {
+        removePollList(ptr->next);
+    }
+
+    if (ptr) {
+        free(ptr->last);
         free(ptr);
     }
 }
@@ -496,8 +422,7 @@ char *getPropertyNode(xmlAttrPtr cur, xmlChar *name)
 
 void nullIT(char **ptr)
 {
-    *ptr = calloc(1, sizeof(char));
-    **ptr = '\0';
+    *ptr = arenaAlloc(loadArena, 1);
 }
 
 configPtr parseConfig(xmlNodePtr cur)
@@ -505,16 +430,26 @@ configPtr parseConfig(xmlNodePtr cur)
     int serialFound = 0;
     int netFound = 0;
     int logFound = 0;
+    int linkFound = 0;
+    int batchFound = 0;
+    int historyFound = 0;
     configPtr cfgPtr;
     char *chrPtr;
     xmlNodePtr prevPtr;
     //char string[256];
     char ip[16];
 
-    cfgPtr = calloc(1, sizeof(Config));
+    cfgPtr = arenaAlloc(loadArena, sizeof(Config));
+    cfgPtr->baud = 4800;
+    cfgPtr->parity = 'E';
+    cfgPtr->stopBits = 2;
     cfgPtr->port = 0;
     cfgPtr->syslog = 0;
     cfgPtr->debug = 0;
+    cfgPtr->timeoutMin = 100;
+    cfgPtr->timeoutMax = TIMEOUT * 1000;
+    cfgPtr->batchGap = 4;
+    cfgPtr->batchMax = 32;
 
     while (cur) {
         logIT(LOG_INFO, "CONFIG:(%d) Node::Name=%s Type:%d Content=%s",
@@ -531,13 +466,24 @@ configPtr parseConfig(xmlNodePtr cur)
             logFound = 1;
             prevPtr = cur;
             cur = cur->children;
+        } else if (strstr((char *)cur->name, "link"))  {
+            linkFound = 1;
+            prevPtr = cur;
+            cur = cur->children;
+        } else if (strstr((char *)cur->name, "batch"))  {
+            batchFound = 1;
+            prevPtr = cur;
+            cur = cur->children;
+        } else if (strstr((char *)cur->name, "history"))  {
+            historyFound = 1;
+            prevPtr = cur;
+            cur = cur->children;
         } else if (strstr((char *)cur->name, "pidfile")) {
             chrPtr = getTextNode(cur);
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cfgPtr->pidfile = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cfgPtr->pidfile, chrPtr);
+                cfgPtr->pidfile = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cfgPtr->pidfile);
             }
@@ -549,8 +495,7 @@ configPtr parseConfig(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cfgPtr->username= calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cfgPtr->username, chrPtr);
+                cfgPtr->username = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cfgPtr->username);
             }
@@ -562,8 +507,7 @@ configPtr parseConfig(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cfgPtr->groupname= calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cfgPtr->groupname, chrPtr);
+                cfgPtr->groupname = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cfgPtr->groupname);
             }
@@ -574,8 +518,7 @@ configPtr parseConfig(xmlNodePtr cur)
             chrPtr = getPropertyNode(cur->properties, (xmlChar *)"ID");
             logIT(LOG_INFO, "     Device ID=%s", chrPtr);
             if (chrPtr) {
-                cfgPtr->devID = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cfgPtr->devID, chrPtr);
+                cfgPtr->devID = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cfgPtr->devID);
             }
@@ -585,12 +528,75 @@ configPtr parseConfig(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cfgPtr->tty = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cfgPtr->tty, chrPtr);
+                cfgPtr->tty = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cfgPtr->tty);
             }
 
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (serialFound && strstr((char *)cur->name, "baud")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->baud = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (serialFound && strstr((char *)cur->name, "parity")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            // none, even or odd
+            if (chrPtr && strchr("NEO", toupper(*chrPtr))) {
+                cfgPtr->parity = toupper(*chrPtr);
+            } else {
+                logIT(LOG_WARNING, "Unknown parity %s, using even", chrPtr ? chrPtr : "");
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (serialFound && strstr((char *)cur->name, "stopbits")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->stopBits = (atoi(chrPtr) == 1) ? 1 : 2;
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (serialFound && strstr((char *)cur->name, "lowlatency")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            (chrPtr && ((*chrPtr == 'y') || (*chrPtr == '1')))
+                ? (cfgPtr->lowLatency = 1) : (cfgPtr->lowLatency = 0);
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (serialFound && strstr((char *)cur->name, "framemode")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            (chrPtr && ((*chrPtr == 'y') || (*chrPtr == '1')))
+                ? (cfgPtr->frameMode = 1) : (cfgPtr->frameMode = 0);
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (netFound && strstr((char *)cur->name, "binport"))  {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->binPort = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (netFound && strstr((char *)cur->name, "metricsport"))  {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->metricsPort = atoi(chrPtr);
+            }
             (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
                 ? (cur = cur->next) : (cur = prevPtr->next);
         } else if (netFound && strstr((char *)cur->name, "port"))  {
@@ -607,8 +613,7 @@ configPtr parseConfig(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cfgPtr->logfile = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cfgPtr->logfile, chrPtr);
+                cfgPtr->logfile = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cfgPtr->logfile);
             }
@@ -622,11 +627,100 @@ configPtr parseConfig(xmlNodePtr cur)
             (cur->next &&
             (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
                 ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (logFound && strstr((char *)cur->name, "slowlog")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->slowLog = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
         } else if (logFound && strstr((char *)cur->name, "debug")) {
             chrPtr = getTextNode(cur);
             ((*chrPtr == 'y') || (*chrPtr == '1')) ? (cfgPtr->debug = 1) : (cfgPtr->debug = 0);
             (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
                 ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (linkFound && strstr((char *)cur->name, "persistent")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            (chrPtr && ((*chrPtr == 'y') || (*chrPtr == '1')))
+                ? (cfgPtr->persistent = 1) : (cfgPtr->persistent = 0);
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (linkFound && strstr((char *)cur->name, "idle")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->idle = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (linkFound && strstr((char *)cur->name, "keepalive")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->keepalive = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (linkFound && strstr((char *)cur->name, "timeoutfactor")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->timeoutFactor = atof(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (linkFound && strstr((char *)cur->name, "timeoutmin")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->timeoutMin = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (linkFound && strstr((char *)cur->name, "timeoutmax")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->timeoutMax = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (batchFound && strstr((char *)cur->name, "gap")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->batchGap = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (batchFound && strstr((char *)cur->name, "maxlen")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->batchMax = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
+        } else if (historyFound && strstr((char *)cur->name, "memory")) {
+            chrPtr = getTextNode(cur);
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cfgPtr->historyMem = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
         } else {
             (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
                 ? (cur = cur->next) : (cur = prevPtr->next);
@@ -665,8 +759,7 @@ unitPtr parseUnit(xmlNodePtr cur)
                 if (! uStartPtr) {
                     uStartPtr = uPtr;
                 }
-                uPtr->name = calloc(strlen(unit) + 1, sizeof(char));
-                strcpy(uPtr->name, unit);
+                uPtr->name = arenaStrdup(loadArena, unit);
                 unitFound = 1;
                 prevPtr = cur;
                 cur = cur->children;
@@ -681,16 +774,14 @@ unitPtr parseUnit(xmlNodePtr cur)
                 if (! uPtr->ePtr) {
                     uPtr->ePtr = ePtr;
                 }
-                ePtr->text = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strncpy(ePtr->text, chrPtr, strlen(chrPtr));
+                ePtr->text = arenaStrdup(loadArena, chrPtr);
                 chrPtr = getPropertyNode(cur->properties, (xmlChar *)"bytes");
                 if (chrPtr) {
                     logIT(LOG_INFO, "          (%d) Node::Name=%s Type:%d Content=%s (bytes)",
                           cur->line, cur->name, cur->type, chrPtr);
                     memset(string, 0, sizeof(string));
                     ePtr->len = string2chr(chrPtr, string, sizeof(string));
-                    ePtr->bytes = calloc(ePtr->len, sizeof(char));
-                    memcpy(ePtr->bytes, string, ePtr->len);
+                    ePtr->bytes = arenaMemdup(loadArena, string, ePtr->len);
                 }
             } else {
                 logIT(LOG_ERR, "Property node without text=");
@@ -700,13 +791,21 @@ unitPtr parseUnit(xmlNodePtr cur)
             (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
                 ? (cur = cur->next) : (cur = prevPtr->next);
 
+        } else if (unitFound && (strcmp((char *)cur->name, "cache") == 0)) {
+            chrPtr = getPropertyNode(cur->properties, (xmlChar *)"ttl");
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s (ttl)",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                uPtr->ttl = atoi(chrPtr);
+            }
+            (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
+                ? (cur = cur->next) : (cur = prevPtr->next);
         } else if (unitFound && strstr((char *)cur->name, "abbrev")) {
             chrPtr = getTextNode(cur);
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                uPtr->abbrev = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(uPtr->abbrev, chrPtr);
+                uPtr->abbrev = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&uPtr->abbrev);
             }
@@ -717,8 +816,7 @@ unitPtr parseUnit(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s (get)",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                uPtr->gCalc = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(uPtr->gCalc, chrPtr);
+                uPtr->gCalc = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&uPtr->gCalc);
             }
@@ -726,8 +824,7 @@ unitPtr parseUnit(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s (set)",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                uPtr->sCalc = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(uPtr->sCalc, chrPtr);
+                uPtr->sCalc = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&uPtr->sCalc);
             }
@@ -738,8 +835,7 @@ unitPtr parseUnit(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s (get)",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                uPtr->gICalc = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(uPtr->gICalc, chrPtr);
+                uPtr->gICalc = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&uPtr->gICalc);
             }
@@ -747,8 +843,7 @@ unitPtr parseUnit(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s (set)",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                uPtr->sICalc = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(uPtr->sICalc, chrPtr);
+                uPtr->sICalc = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&uPtr->sICalc);
             }
@@ -759,10 +854,13 @@ unitPtr parseUnit(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                uPtr->type = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(uPtr->type, chrPtr);
+                uPtr->type = arenaStrdup(loadArena, chrPtr);
+                if ((uPtr->typeCode = getUnitType(chrPtr)) == UNIT_UNKNOWN) {
+                    logIT(LOG_ERR, "Unknown type %s in unit %s", chrPtr, uPtr->name);
+                }
             } else {
                 nullIT(&uPtr->type);
+                uPtr->typeCode = UNIT_NONE;
             }
             (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next))
                 ? (cur = cur->next) : (cur = prevPtr->next);
@@ -771,8 +869,7 @@ unitPtr parseUnit(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                uPtr->entity = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(uPtr->entity, chrPtr);
+                uPtr->entity = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&uPtr->entity);
             }
@@ -815,8 +912,7 @@ macroPtr parseMacro(xmlNodePtr cur)
                 if (! mStartPtr) {
                     mStartPtr = mPtr;
                 }
-                mPtr->name = calloc(strlen(macro) + 1, sizeof(char));
-                strcpy(mPtr->name, macro);
+                mPtr->name = arenaStrdup(loadArena, macro);
                 macroFound = 1;
                 prevPtr = cur;
                 cur = cur->children;
@@ -827,8 +923,7 @@ macroPtr parseMacro(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                mPtr->command = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(mPtr->command, chrPtr);
+                mPtr->command = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&mPtr->command);
             }
@@ -886,14 +981,12 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
                 }
                 cPtr->nodeType = 1; // No copy, we need this for deleting
                 if (command) {
-                    cPtr->name = calloc(strlen(command) + 1, sizeof(char));
-                    strcpy(cPtr->name, command);
+                    cPtr->name = arenaStrdup(loadArena, command);
                 } else {
                     nullIT(&cPtr->name);
                 }
                 if (protocmd) {
-                    cPtr->pcmd = calloc(strlen(protocmd) + 1, sizeof(char));
-                    strcpy(cPtr->pcmd, protocmd);
+                    cPtr->pcmd = arenaStrdup(loadArena, protocmd);
                 } else {
                     nullIT(&cPtr->pcmd);
                 }
@@ -928,16 +1021,17 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
                 ncPtr->name = cPtr->name;
                 // If no unit has been given, we copy it
                 if (! ncPtr->unit && cPtr->unit) {
-                    ncPtr->unit = calloc(strlen(cPtr->unit) + 1, sizeof(char));
-                    strcpy(ncPtr->unit, cPtr->unit);
+                    ncPtr->unit = arenaStrdup(loadArena, cPtr->unit);
+                }
+                // And for the cache lifetime
+                if (ncPtr->ttl < 0) {
+                    ncPtr->ttl = cPtr->ttl;
                 }
                 // Same for the protocol command
                 if (protocmd) {
-                    ncPtr->pcmd = calloc(strlen(protocmd) + 1, sizeof(char));
-                    strcpy(ncPtr->pcmd, protocmd);
+                    ncPtr->pcmd = arenaStrdup(loadArena, protocmd);
                 } else {
-                    ncPtr->pcmd = calloc(strlen(cPtr->pcmd) + 1, sizeof(char));
-                    strcpy(ncPtr->pcmd, cPtr->pcmd);
+                    ncPtr->pcmd = arenaStrdup(loadArena, cPtr->pcmd);
                 }
                 ncPtr->nodeType = 2; // 2 == decription, name has been copied
                 if (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next)) {
@@ -953,8 +1047,7 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cPtr->addr = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cPtr->addr, chrPtr);
+                cPtr->addr = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cPtr->addr);
             }
@@ -972,8 +1065,7 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
             if (chrPtr) {
                 memset(string, 0, sizeof(string));
                 if ((count = string2chr(chrPtr, string, sizeof(string)))) {
-                    cPtr->errStr = calloc(count, sizeof(char));
-                    memcpy(cPtr->errStr, string, count);
+                    cPtr->errStr = arenaMemdup(loadArena, string, count);
                 }
             } else {
                 nullIT(&cPtr->errStr);
@@ -990,8 +1082,7 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cPtr->unit = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cPtr->unit, chrPtr);
+                cPtr->unit = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cPtr->unit);
             }
@@ -1007,8 +1098,7 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cPtr->precmd = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cPtr->precmd, chrPtr);
+                cPtr->precmd = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cPtr->precmd);
             }
@@ -1024,8 +1114,7 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                cPtr->description = calloc(strlen(chrPtr) + 1, sizeof(char));
-                strcpy(cPtr->description, chrPtr);
+                cPtr->description = arenaStrdup(loadArena, chrPtr);
             } else {
                 nullIT(&cPtr->description);
             }
@@ -1036,6 +1125,20 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
             } else {
                 cur = NULL;
             }
+        } else if (commandFound && (strcmp((char *)cur->name, "cache") == 0)) {
+            chrPtr = getPropertyNode(cur->properties, (xmlChar *)"ttl");
+            logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s (ttl)",
+                  cur->line, cur->name, cur->type, chrPtr);
+            if (chrPtr) {
+                cPtr->ttl = atoi(chrPtr);
+            }
+            if (cur->next && (! (cur->next->type == XML_TEXT_NODE) || cur->next->next)) {
+                cur = cur->next;
+            } else if (prevPtr) {
+                cur = prevPtr->next;
+            } else {
+                cur = NULL;
+            }
         } else if (commandFound && strstr((char *)cur->name, "len")) {
             chrPtr = getTextNode(cur);
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
@@ -1073,6 +1176,64 @@ commandPtr parseCommand(xmlNodePtr cur, commandPtr cPtr, devicePtr dePtr)
     return cStartPtr;
 }
 
+pollPtr parsePoll(xmlNodePtr cur)
+{
+    pollPtr pPtr;
+    pollPtr pStartPtr = NULL;
+    char *command;
+    char *chrPtr;
+
+    while (cur) {
+        logIT(LOG_INFO, "POLL: (%d) Node::Name=%s Type:%d Content=%s",
+              cur->line, cur->name, cur->type, cur->content);
+
+        if (xmlIsBlankNode(cur)) {
+            cur = cur->next;
+            continue;
+        }
+
+        if (strcmp((char *)cur->name, "command") != 0 ||
+                ! (command = getPropertyNode(cur->properties, (xmlChar *)"name"))) {
+            logIT(LOG_ERR, "Error parsing poll (%d)", cur->line);
+            return NULL;
+        }
+        logIT(LOG_INFO, "New poll: %s", command);
+        pPtr = newPollNode(pStartPtr);
+        if (! pStartPtr) {
+            pStartPtr = pPtr;
+        }
+        pPtr->name = arenaStrdup(loadArena, command);
+        if ((chrPtr = getPropertyNode(cur->properties, (xmlChar *)"interval"))) {
+            pPtr->interval = atoi(chrPtr);
+        }
+        if (pPtr->interval <= 0) {
+            logIT(LOG_ERR, "Poll %s without interval (%d)", command, cur->line);
+            return NULL;
+        }
+        if ((chrPtr = getPropertyNode(cur->properties, (xmlChar *)"jitter"))) {
+            pPtr->jitter = atoi(chrPtr);
+        }
+        // Bounds of the adaptive interval
+        pPtr->min = pPtr->interval;
+        if ((chrPtr = getPropertyNode(cur->properties, (xmlChar *)"min"))) {
+            pPtr->min = atoi(chrPtr);
+        }
+        pPtr->max = pPtr->interval * 8;
+        if ((chrPtr = getPropertyNode(cur->properties, (xmlChar *)"max"))) {
+            pPtr->max = atoi(chrPtr);
+        }
+        if (pPtr->min < 1) {
+            pPtr->min = 1;
+        }
+        if (pPtr->max < pPtr->interval) {
+            pPtr->max = pPtr->interval;
+        }
+        cur = cur->next;
+    }
+
+    return pStartPtr;
+}
+
 icmdPtr parseICmd(xmlNodePtr cur)
 {
     icmdPtr icPtr;
@@ -1099,8 +1260,7 @@ icmdPtr parseICmd(xmlNodePtr cur)
                 if (! icStartPtr) {
                     icStartPtr = icPtr;
                 }
-                icPtr->name = calloc(strlen(command) + 1, sizeof(char));
-                strcpy(icPtr->name, command);
+                icPtr->name = arenaStrdup(loadArena, command);
                 commandFound = 1;
                 prevPtr = cur;
                 cur = cur->children;
@@ -1111,7 +1271,7 @@ icmdPtr parseICmd(xmlNodePtr cur)
             logIT(LOG_INFO, "   (%d) Node::Name=%s Type:%d Content=%s",
                   cur->line, cur->name, cur->type, chrPtr);
             if (chrPtr) {
-                icPtr->send = calloc(strlen(chrPtr) + 2, sizeof(char));
+                icPtr->send = arenaAlloc(loadArena, strlen(chrPtr) + 2);
                 strcpy(icPtr->send, chrPtr);
             } else {
                 nullIT(&icPtr->send);
@@ -1175,15 +1335,13 @@ devicePtr parseDevice(xmlNodePtr cur, protocolPtr pPtr)
                     dStartPtr = dPtr;
                 } // Remember anchor
                 if (name) {
-                    dPtr->name = calloc(strlen(name) + 1, sizeof(char));
-                    strcpy(dPtr->name, name);
+                    dPtr->name = arenaStrdup(loadArena, name);
                 } else {
                     nullIT(&dPtr->name);
                 }
 
                 if (id) {
-                    dPtr->id = calloc(strlen(id) + 1, sizeof(char));
-                    strcpy(dPtr->id, id);
+                    dPtr->id = arenaStrdup(loadArena, id);
                 } else {
                     nullIT(&dPtr->id);
                 }
@@ -1239,8 +1397,7 @@ protocolPtr parseProtocol(xmlNodePtr cur)
                     protoStartPtr = protoPtr;
                 } // Remember anchor
                 if (proto) {
-                    protoPtr->name = calloc(strlen(proto) + 1, sizeof(char));
-                    strcpy(protoPtr->name, proto);
+                    protoPtr->name = arenaStrdup(loadArena, proto);
                 } else {
                     nullIT(&protoPtr->name);
                 }
@@ -1281,8 +1438,12 @@ protocolPtr parseProtocol(xmlNodePtr cur)
 
 void removeComments(xmlNodePtr node)
 {
+    xmlNodePtr next;
+
     while (node) {
         //printf("type:%d name=%s\n",node->type, node->name);
+        // The node may be freed below
+        next = node->next;
         if (node->children) {
             // if the node has children, process the children
             removeComments(node->children);
@@ -1290,141 +1451,483 @@ void removeComments(xmlNodePtr node)
         if (node->type == XML_COMMENT_NODE) {
             // if the node is a comment?
             //printf("found comment\n");
-            if (node->next) {
-                removeComments(node->next);
-            }
             xmlUnlinkNode(node); // unlink
             xmlFreeNode(node);   // and free the node
         }
-        node = node->next;
+        node = next;
     }
 }
 
-int parseXMLFile(char *filename)
+static nameIndexPtr indexUnits(unitPtr ptr)
 {
-    xmlDocPtr doc;
-    xmlNodePtr cur, curStart;
-    xmlNodePtr prevPtr;
-    xmlNsPtr ns;
-    //char string[256];
-    devicePtr dPtr;
-    commandPtr cPtr, ncPtr;
-    protocolPtr TprotoPtr = NULL;
-    unitPtr TuPtr = NULL;
-    devicePtr TdevPtr = NULL;
-    commandPtr TcmdPtr = NULL;
-    configPtr TcfgPtr = NULL;
-
-    xmlKeepBlanksDefault(0);
-    doc = xmlParseFile(filename);
-    if (doc == NULL) {
+    nameIndexPtr iPtr = newNameIndex(loadArena);
+
+    for (; ptr; ptr = ptr->next) {
+        addNameIndex(iPtr, ptr->abbrev, ptr);
+    }
+    return iPtr;
+}
+
+// Builds the indexes of a loaded configuration, see nameindex.c
+static void indexLists(protocolPtr pPtr, devicePtr dPtr, configPtr cPtr)
+{
+    macroPtr mPtr;
+    icmdPtr iPtr;
+    commandPtr comPtr;
+    pollPtr plPtr;
+    int seq;
+
+    for (; pPtr; pPtr = pPtr->next) {
+        pPtr->macroIndex = newNameIndex(loadArena);
+        for (mPtr = pPtr->mPtr; mPtr; mPtr = mPtr->next) {
+            addNameIndex(pPtr->macroIndex, mPtr->name, mPtr);
+        }
+        pPtr->icmdIndex = newNameIndex(loadArena);
+        for (iPtr = pPtr->icPtr; iPtr; iPtr = iPtr->next) {
+            addNameIndex(pPtr->icmdIndex, iPtr->name, iPtr);
+        }
+    }
+    for (; dPtr; dPtr = dPtr->next) {
+        dPtr->cmdIndex = newNameIndex(loadArena);
+        seq = 0;
+        for (comPtr = dPtr->cmdPtr; comPtr; comPtr = comPtr->next) {
+            addNameIndex(dPtr->cmdIndex, comPtr->name, comPtr);
+            comPtr->seq = seq++;
+        }
+    }
+    cPtr->pollIndex = newNameIndex(loadArena);
+    for (plPtr = cPtr->pollsPtr; plPtr; plPtr = plPtr->next) {
+        addNameIndex(cPtr->pollIndex, plPtr->name, plPtr);
+    }
+}
+
+// The lookup...() functions use the index if the list has one, they are
+// the same as the get...Node() walks otherwise
+commandPtr lookupCommand(devicePtr dPtr, const char *name)
+{
+    if (dPtr->cmdIndex) {
+        return compiledCommand(dPtr, getNameIndex(dPtr->cmdIndex, name));
+    }
+    return compiledCommand(dPtr, getCommandNode(dPtr->cmdPtr, name));
+}
+
+/* Returns the compiled copy of the command cPtr of the device dPtr, NULL if
+ * it does not compile. The first call compiles it, later ones return the
+ * same copy, which lives as long as the pinned image.
+ *
+ * Commands of other devices, without an address or already compiled, as
+ * the built-in tables are, come back as they are.
+ */
+commandPtr compiledCommand(devicePtr dPtr, commandPtr cPtr)
+{
+    commandPtr *code;
+    commandPtr ncPtr;
+    commandPtr comPtr;
+    int count;
+
+    if (! cPtr || cPtr->cmpPtr || ! cPtr->addr || ! pinned || ! pinned->aPtr
+            || dPtr != pinned->cfgPtr->devPtr) {
+        return cPtr;
+    }
+    // Compiled commands are only ever added, they need no lock to be found
+    if ((code = __atomic_load_n(&pinned->code, __ATOMIC_ACQUIRE))
+            && (ncPtr = __atomic_load_n(&code[cPtr->seq], __ATOMIC_ACQUIRE))) {
+        return (ncPtr == &failedCommand) ? NULL : ncPtr;
+    }
+
+    pthread_mutex_lock(&codeLock);
+    if (! (code = pinned->code)) {
+        for (count = 0, comPtr = dPtr->cmdPtr; comPtr; comPtr = comPtr->next) {
+            count++;
+        }
+        if (! (code = calloc(count, sizeof(commandPtr)))) {
+            logIT1(LOG_ERR, "malloc failed");
+            exit(1);
+        }
+        pinned->codeArena = newArena();
+        __atomic_store_n(&pinned->code, code, __ATOMIC_RELEASE);
+    }
+    if (! (ncPtr = code[cPtr->seq])) {
+        ncPtr = arenaMemdup(pinned->codeArena, cPtr, sizeof(Command));
+        if (! compileCommand(ncPtr, dPtr->protoPtr, pinned->uPtr, pinned->codeArena)) {
+            logIT(LOG_ERR, "Command %s of device %s does not compile", cPtr->name, dPtr->id);
+            ncPtr = &failedCommand;
+        }
+        __atomic_store_n(&code[cPtr->seq], ncPtr, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&codeLock);
+    return (ncPtr == &failedCommand) ? NULL : ncPtr;
+}
+
+unitPtr lookupUnit(unitPtr ptr, const char *name)
+{
+    if (uIndex && ptr == uPtr) {
+        return getNameIndex(uIndex, name);
+    }
+    if (loading && loading->uIndex && ptr == loading->uPtr) {
+        // Compiling an image before it is published
+        return getNameIndex(loading->uIndex, name);
+    }
+    return getUnitNode(ptr, name);
+}
+
+macroPtr lookupMacro(protocolPtr pPtr, const char *name)
+{
+    if (pPtr->macroIndex) {
+        return getNameIndex(pPtr->macroIndex, name);
+    }
+    return getMacroNode(pPtr->mPtr, name);
+}
+
+icmdPtr lookupIcmd(protocolPtr pPtr, const char *name)
+{
+    if (pPtr->icmdIndex) {
+        return getNameIndex(pPtr->icmdIndex, name);
+    }
+    return getIcmdNode(pPtr->icPtr, name);
+}
+
+pollPtr lookupPoll(configPtr cPtr, const char *name)
+{
+    if (cPtr->pollIndex) {
+        return getNameIndex(cPtr->pollIndex, name);
+    }
+    return getPollNode(cPtr->pollsPtr, name);
+}
+
+/* Streaming loader
+ *
+ * The XML files are never read into a document as a whole. An xmlTextReader
+ * walks through them, and only a single item, a protocol, unit, device or
+ * command, is expanded at a time. It is copied out of the reader and handed
+ * to the parse...() functions above, the reader drops its part as it moves
+ * on. So the tree in memory stays as small as the largest item, and the
+ * nodes go straight into the arena of the image.
+ *
+ * libxml2 would load an XInclude as a whole document, vito.xml is streamed
+ * by a reader of its own instead.
+ */
+
+#define XINCLUDE_NS "http://www.w3.org/2003/XInclude"
+#define XINCLUDE_OLD_NS "http://www.w3.org/2001/XInclude"
+#define VCONTROL_NS "http://www.openv.de/vcontrol"
+#define MAX_INCLUDE 8
+
+typedef struct stream *streamPtr;
+typedef int (*streamItem)(xmlTextReaderPtr reader, streamPtr sPtr);
+
+typedef struct stream {
+    protocolPtr protoPtr;
+    unitPtr uPtr;
+    devicePtr devPtr;
+    commandPtr cmdPtr;
+    configPtr cfgPtr;
+    pollPtr pollsPtr;
+    // The next pointers of the list ends, items are appended there
+    protocolPtr *protoLast;
+    unitPtr *uLast;
+    devicePtr *devLast;
+    commandPtr *cmdLast;
+    int unixFound;
+    int protocolsFound;
+    int includes;
+    int depth;
+} Stream;
+
+// Copies the element the reader is on with its subtree, the reader frees its own
+static xmlNodePtr copyElement(xmlTextReaderPtr reader)
+{
+    xmlNodePtr node;
+    xmlNodePtr copy;
+
+    if (! (node = xmlTextReaderExpand(reader)) || ! (copy = xmlCopyNode(node, 1))) {
+        logIT(LOG_ERR, "Error reading XML (%d)", xmlTextReaderGetParserLineNumber(reader));
+        return NULL;
+    }
+    removeComments(copy->children);
+    return copy;
+}
+
+// Calls item for each child element of the element the reader is on
+static int streamLevel(xmlTextReaderPtr reader, streamPtr sPtr, streamItem item)
+{
+    int depth = xmlTextReaderDepth(reader);
+    int ret;
+
+    if (xmlTextReaderIsEmptyElement(reader)) {
+        return 1;
+    }
+    ret = xmlTextReaderRead(reader);
+    while (ret == 1 && xmlTextReaderDepth(reader) > depth) {
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+            ret = xmlTextReaderRead(reader);
+            continue;
+        }
+        if (! item(reader, sPtr)) {
+            return 0;
+        }
+        // Skips what item left of the element
+        ret = xmlTextReaderNext(reader);
+    }
+    return ret != -1;
+}
+
+static int streamProtocol(xmlTextReaderPtr reader, streamPtr sPtr)
+{
+    xmlNodePtr cur;
+    protocolPtr ptr;
+
+    if (! (cur = copyElement(reader))) {
+        return 0;
+    }
+    ptr = parseProtocol(cur);
+    xmlFreeNode(cur);
+    if (! ptr) {
         return 0;
     }
-    curStart = xmlDocGetRootElement(doc);
-    cur = curStart;
-    if (cur == NULL) {
-        logIT(LOG_ERR, "empty document\n");
-        xmlFreeDoc(doc);
+    for (*sPtr->protoLast = ptr; *sPtr->protoLast; sPtr->protoLast = &(*sPtr->protoLast)->next) {
+        ;
+    }
+    return 1;
+}
+
+static int streamUnit(xmlTextReaderPtr reader, streamPtr sPtr)
+{
+    xmlNodePtr cur;
+    unitPtr ptr;
+
+    if (! (cur = copyElement(reader))) {
         return 0;
     }
-    ns = xmlSearchNsByHref(doc, cur, (const xmlChar *) "http://www.openv.de/vcontrol");
-    if (ns == NULL) {
-        logIT(LOG_ERR, "document of the wrong type, vcontrol Namespace not found");
-        xmlFreeDoc(doc);
+    ptr = parseUnit(cur);
+    xmlFreeNode(cur);
+    if (! ptr) {
         return 0;
     }
-    if (xmlStrcmp(cur->name, (const xmlChar *) "V-Control")) {
-        logIT(LOG_ERR, "document of the wrong type, root node != V-Control");
-        xmlFreeDoc(doc);
+    for (*sPtr->uLast = ptr; *sPtr->uLast; sPtr->uLast = &(*sPtr->uLast)->next) {
+        ;
+    }
+    return 1;
+}
+
+static int streamDevice(xmlTextReaderPtr reader, streamPtr sPtr)
+{
+    xmlNodePtr cur;
+    devicePtr ptr;
+
+    if (! (cur = copyElement(reader))) {
         return 0;
     }
-    // Run XInclude
-    short xc = 0;
-    if ((xc = xmlXIncludeProcessFlags(doc, XML_PARSE_XINCLUDE | XML_PARSE_NOXINCNODE)) == 0) {
-        logIT(LOG_WARNING, "Didn't perform XInclude");
-    } else if (xc < 0) {
-        logIT(LOG_ERR, "Error during XInclude");
+    ptr = parseDevice(cur, sPtr->protoPtr);
+    xmlFreeNode(cur);
+    if (! ptr) {
         return 0;
-    } else {
-        logIT(LOG_INFO, "%d XInclude performed", xc);
     }
+    for (*sPtr->devLast = ptr; *sPtr->devLast; sPtr->devLast = &(*sPtr->devLast)->next) {
+        ;
+    }
+    return 1;
+}
 
-    removeComments(cur); // now the xml tree is complete --> remove all comments
+// The device specific parts are added to the devices read so far
+static int streamCommand(xmlTextReaderPtr reader, streamPtr sPtr)
+{
+    xmlNodePtr cur;
+    commandPtr ptr;
 
-    int unixFound = 0;
-    int protocolsFound = 0;
-    cur = cur->children;
+    if (! (cur = copyElement(reader))) {
+        return 0;
+    }
+    ptr = parseCommand(cur, NULL, sPtr->devPtr);
+    xmlFreeNode(cur);
+    if (! ptr) {
+        return 0;
+    }
+    for (*sPtr->cmdLast = ptr; *sPtr->cmdLast; sPtr->cmdLast = &(*sPtr->cmdLast)->next) {
+        ;
+    }
+    return 1;
+}
 
-    while (cur) {
-        logIT(LOG_INFO, "XML: (%d) Node::Name=%s Type:%d Content=%s",
-              cur->line, cur->name, cur->type, cur->content);
+static int streamFile(char *filename, streamPtr sPtr);
 
-        if (xmlIsBlankNode(cur)) {
-            cur = cur->next;
-            continue;
+// Streams the file of an <xi:include> in its place
+static int streamInclude(xmlTextReaderPtr reader, streamPtr sPtr)
+{
+    xmlChar *href;
+    xmlChar *parse;
+    xmlChar *uri = NULL;
+    int ok = 0;
+
+    href = xmlTextReaderGetAttribute(reader, (xmlChar *)"href");
+    parse = xmlTextReaderGetAttribute(reader, (xmlChar *)"parse");
+    if (! href || (parse && ! xmlStrEqual(parse, (xmlChar *)"xml"))) {
+        logIT(LOG_ERR, "Unsupported XInclude (%d)", xmlTextReaderGetParserLineNumber(reader));
+    } else if (sPtr->depth >= MAX_INCLUDE) {
+        logIT(LOG_ERR, "XInclude of %s nested too deep", href);
+    } else if (! (uri = xmlBuildURI(href, xmlTextReaderConstBaseUri(reader)))) {
+        logIT(LOG_ERR, "Error during XInclude of %s", href);
+    } else {
+        sPtr->depth++;
+        ok = streamFile((char *)uri, sPtr);
+        sPtr->depth--;
+        sPtr->includes++;
+    }
+    xmlFree(href);
+    xmlFree(parse);
+    xmlFree(uri);
+    return ok;
+}
+
+// The sections, below the root, <unix>, <extern> and the <vito> included there
+static int streamElement(xmlTextReaderPtr reader, streamPtr sPtr)
+{
+    const char *name = (const char *)xmlTextReaderConstLocalName(reader);
+    const xmlChar *ns = xmlTextReaderConstNamespaceUri(reader);
+    xmlNodePtr cur;
+
+    logIT(LOG_INFO, "XML: (%d) Node::Name=%s", xmlTextReaderGetParserLineNumber(reader), name);
+
+    if (ns && (xmlStrEqual(ns, (xmlChar *)XINCLUDE_NS) || xmlStrEqual(ns, (xmlChar *)XINCLUDE_OLD_NS))) {
+        if (strcmp(name, "include") == 0) {
+            return streamInclude(reader, sPtr);
         }
+        return 1;
+    }
 
-        if (strstr((char *)cur->name, "unix"))  {
-            if (unixFound) {
-                // We must not reach here, second pass
-                logIT(LOG_ERR, "Error in XML config");
-                return 0;
-            }
-            prevPtr = cur;
-            unixFound = 1;
-            cur = cur->children; // On Unix, config follows. Thus children.
-            continue;
+    if (strstr(name, "unix")) {
+        if (sPtr->unixFound) {
+            // We must not reach here, second pass
+            logIT(LOG_ERR, "Error in XML config");
+            return 0;
+        }
+        sPtr->unixFound = 1;
+        return streamLevel(reader, sPtr, streamElement);
+    } else if (strstr(name, "extern") || strstr(name, "vito")) {
+        // The XInclude stuff can be found at <extern><vito>
+        return streamLevel(reader, sPtr, streamElement);
+    } else if (strstr(name, "protocols")) {
+        if (sPtr->protocolsFound) {
+            // We must not reach here, second pass
+            logIT(LOG_ERR, "Error in XML config");
+            return 0;
+        }
+        sPtr->protocolsFound = 1;
+        return streamLevel(reader, sPtr, streamProtocol);
+    } else if (strstr(name, "units")) {
+        return streamLevel(reader, sPtr, streamUnit);
+    } else if (strstr(name, "commands")) {
+        return streamLevel(reader, sPtr, streamCommand);
+    } else if (strstr(name, "devices")) {
+        return streamLevel(reader, sPtr, streamDevice);
+    } else if (strstr(name, "config")) {
+        // Small enough to be taken as a whole
+        if (! (cur = copyElement(reader))) {
+            return 0;
         }
+        sPtr->cfgPtr = parseConfig(cur->children);
+        xmlFreeNode(cur);
+        return sPtr->cfgPtr != NULL;
+    } else if (strstr(name, "poll")) {
+        if (! (cur = copyElement(reader))) {
+            return 0;
+        }
+        if (cur->children && ! (sPtr->pollsPtr = parsePoll(cur->children))) {
+            xmlFreeNode(cur);
+            return 0;
+        }
+        xmlFreeNode(cur);
+    }
+    return 1;
+}
 
-        if (strstr((char *)cur->name, "extern")) {
-            cur = cur->children;
-            if (cur && strstr((char *)cur->name, "vito"))  {
-                prevPtr = cur;
-                cur = cur->children; // The xinclude stuff can be found at <extern><vito>
-                continue;
-            } else {
-                cur = prevPtr->next;
-            }
-        } else if (strstr((char *)cur->name, "protocols")) {
-            if (protocolsFound) {
-                // We must not reach here, second pass
-                logIT(LOG_ERR, "Error in XML config");
-                return 0;
-            }
-            protocolsFound = 1;
-            if (! (TprotoPtr = parseProtocol(cur->children))) {
-                return 0;
-            }
-            cur = cur->next; // Same level as Unix, proceed
-            continue;
-        } else if (strstr((char *)cur->name, "units")) {
-            if (! (TuPtr = parseUnit(cur->children))) {
-                return 0;
-            }
-            cur = cur->next; // Same level as Unix, proceed
-            continue;
-        } else if (strstr((char *)cur->name, "commands")) {
-            if (! (TcmdPtr = parseCommand(cur->children, NULL, TdevPtr))) {
-                return 0;
-            }
-            //(cur->next && cur->next->next) ? (cur=cur->next) : (cur=prevPtr->next);
-            (cur->next) ? (cur = cur->next) : (cur = prevPtr->next);
-            continue;
-        } else if (strstr((char *)cur->name, "devices")) {
-            if (! (TdevPtr = parseDevice(cur->children, TprotoPtr))) {
-                return 0;
-            }
-            (cur->next) ? (cur = cur->next) : (cur = prevPtr->next);
-            continue;
-        } else if (strstr((char *)cur->name, "config")) {
-            if (! (TcfgPtr = parseConfig(cur->children))) {
-                return 0;
+static int streamFile(char *filename, streamPtr sPtr)
+{
+    xmlTextReaderPtr reader;
+    int ret;
+    int ok;
+
+    if (! (reader = xmlReaderForFile(filename, NULL, XML_PARSE_NOBLANKS))) {
+        logIT(LOG_ERR, "Could not open %s", filename);
+        return 0;
+    }
+    // Up to the root element
+    while ((ret = xmlTextReaderRead(reader)) == 1
+            && xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+        ;
+    }
+    if (ret != 1) {
+        logIT(LOG_ERR, "empty document %s", filename);
+        xmlFreeTextReader(reader);
+        return 0;
+    }
+    if (sPtr->depth) {
+        // The root of an included file takes the place of the <xi:include>
+        ok = streamElement(reader, sPtr);
+    } else {
+        ok = 0;
+        while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+            if (xmlTextReaderIsNamespaceDecl(reader) == 1
+                    && xmlStrEqual(xmlTextReaderConstValue(reader), (xmlChar *)VCONTROL_NS)) {
+                ok = 1;
             }
-            (cur->next && cur->next->next) ? (cur = cur->next) : (cur = prevPtr->next);
+        }
+        xmlTextReaderMoveToElement(reader);
+        if (! ok) {
+            logIT(LOG_ERR, "document of the wrong type, vcontrol Namespace not found");
+        } else if (! xmlStrEqual(xmlTextReaderConstLocalName(reader), (xmlChar *)"V-Control")) {
+            logIT(LOG_ERR, "document of the wrong type, root node != V-Control");
+            ok = 0;
         } else {
-            cur = cur->next;
+            ok = streamLevel(reader, sPtr, streamElement);
         }
     }
+    // Parse errors further down
+    while (ok && (ret = xmlTextReaderRead(reader)) == 1) {
+        ;
+    }
+    if (ret == -1) {
+        ok = 0;
+    }
+    xmlFreeTextReader(reader);
+    return ok;
+}
+
+// Reads the file into iPtr, returns 0 on errors
+static int parseImage(char *filename, imagePtr iPtr)
+{
+    Stream stream;
+    devicePtr dPtr;
+    commandPtr cPtr, ncPtr;
+    protocolPtr TprotoPtr;
+    unitPtr TuPtr;
+    devicePtr TdevPtr;
+    commandPtr TcmdPtr;
+    configPtr TcfgPtr;
+
+    memset(&stream, 0, sizeof(stream));
+    stream.protoLast = &stream.protoPtr;
+    stream.uLast = &stream.uPtr;
+    stream.devLast = &stream.devPtr;
+    stream.cmdLast = &stream.cmdPtr;
+    if (! streamFile(filename, &stream)) {
+        return 0;
+    }
+    if (stream.includes == 0) {
+        logIT(LOG_WARNING, "Didn't perform XInclude");
+    } else {
+        logIT(LOG_INFO, "%d XInclude performed", stream.includes);
+    }
+    if (! stream.cfgPtr) {
+        logIT(LOG_ERR, "Error in XML config: <config> missing");
+        return 0;
+    }
+    TprotoPtr = stream.protoPtr;
+    TuPtr = stream.uPtr;
+    TdevPtr = stream.devPtr;
+    TcmdPtr = stream.cmdPtr;
+    TcfgPtr = stream.cfgPtr;
+    iPtr->pollsPtr = stream.pollsPtr;
 
     // For all commands that have default definitions,
     // we roam all devices and add the particular commands.
@@ -1448,49 +1951,171 @@ int parseXMLFile(char *filename)
                 ncPtr->precmd = cPtr->precmd;
                 ncPtr->description = cPtr->description;
                 ncPtr->len = cPtr->len;
+                ncPtr->ttl = cPtr->ttl;
             }
             dPtr = dPtr->next;
         }
         cPtr = cPtr->next;
     }
 
+    TcfgPtr->pollsPtr = iPtr->pollsPtr;
+
     // We search the default device
     if (! (TcfgPtr->devPtr = getDeviceNode(TdevPtr, TcfgPtr->devID))) {
         logIT(LOG_ERR, "Device %s is not defined\n", TcfgPtr->devID);
         return 0;
     }
 
-    // If we reach here, the loading has been successful.
-    // Now we free the old lists and allocate the new ones.
+    indexLists(TprotoPtr, TdevPtr, TcfgPtr);
+    iPtr->protoPtr = TprotoPtr;
+    iPtr->uPtr = TuPtr;
+    iPtr->uIndex = indexUnits(TuPtr);
+    iPtr->devPtr = TdevPtr;
+    iPtr->cmdPtr = TcmdPtr;
+    iPtr->cfgPtr = TcfgPtr;
+    return 1;
+}
+
+static void freeImage(imagePtr iPtr)
+{
+    // The built-in tables are static, see builtinImage()
+    if (iPtr->aPtr) {
+        removePollList(iPtr->pollsPtr);
+        freeArena(iPtr->aPtr);
+    }
+    free(iPtr->code);
+    freeArena(iPtr->codeArena);
+    free(iPtr);
+}
+
+/* Reads and compiles the XML file into a new image, returns NULL if it
+ * has errors. The image in use is not touched.
+ */
+imagePtr loadImage(char *filename)
+{
+    imagePtr iPtr;
+    int ok;
+
+    if (! (iPtr = calloc(1, sizeof(Image)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    iPtr->aPtr = newArena();
+    loading = iPtr;
+    loadArena = iPtr->aPtr;
+
+    ok = parseImage(filename, iPtr);
+    if (ok) {
+        // The commands follow on first use, see compiledCommand()
+        compileUnits(iPtr->uPtr, iPtr->aPtr);
+        arenaSeal(iPtr->aPtr);
+    }
 
-    // If we're called repetitive (SIGHUP), everything should be freed.
-    freeAllLists();
+    loading = NULL;
+    loadArena = NULL;
+    if (! ok) {
+        freeImage(iPtr);
+        return NULL;
+    }
+    logIT(LOG_INFO, "Configuration image: %lu kB", (unsigned long)arenaSize(iPtr->aPtr) / 1024);
+    return iPtr;
+}
 
-    protoPtr = TprotoPtr;
-    uPtr = TuPtr;
-    devPtr = TdevPtr;
-    cmdPtr = TcmdPtr;
-    cfgPtr = TcfgPtr;
+#ifdef BUILTIN_CONFIG
+// Generated by vgen at build time
+extern const Image builtinTables;
+extern const char builtinSource[];
+#endif
 
-    xmlFreeDoc(doc);
-    return 1;
+/* Returns an image of the tables compiled into the binary, NULL if there
+ * are none. Like a sealed arena they are read only, there is nothing to
+ * parse or compile.
+ */
+imagePtr builtinImage()
+{
+#ifdef BUILTIN_CONFIG
+    imagePtr iPtr;
+
+    if (! (iPtr = calloc(1, sizeof(Image)))) {
+        logIT1(LOG_ERR, "malloc failed");
+        exit(1);
+    }
+    *iPtr = builtinTables;
+    logIT(LOG_INFO, "Configuration image: built in from %s", builtinSource);
+    return iPtr;
+#else
+    return NULL;
+#endif
+}
+
+static void releaseImage(imagePtr iPtr)
+{
+    int refs;
+
+    if (! iPtr) {
+        return;
+    }
+    pthread_mutex_lock(&imageLock);
+    refs = --iPtr->refs;
+    pthread_mutex_unlock(&imageLock);
+    if (refs == 0) {
+        logIT(LOG_INFO, "Configuration image %lu released", iPtr->generation);
+        freeImage(iPtr);
+    }
+}
+
+// Makes iPtr the current image and pins it for the calling thread
+void publishImage(imagePtr iPtr)
+{
+    imagePtr old;
+
+    pthread_mutex_lock(&imageLock);
+    old = current;
+    iPtr->refs = 1;
+    iPtr->generation = lastGeneration++;
+    current = iPtr;
+    pthread_mutex_unlock(&imageLock);
+
+    pinImage();
+    releaseImage(old);
 }
 
-void freeAllLists()
+// Moves the view of the calling thread to the current image
+void pinImage()
 {
-    removeProtocolList(protoPtr);
-    removeUnitList(uPtr);
-    removeDeviceList(devPtr);
-    removeCommandList(cmdPtr);
-    protoPtr = NULL;
-    uPtr = NULL;
-    devPtr = NULL;
-    cmdPtr = NULL;
-    if (cfgPtr) {
-        free(cfgPtr->tty);
-        free(cfgPtr->logfile);
-        free(cfgPtr->devID);
-        free(cfgPtr);
-        cfgPtr = NULL;
+    imagePtr old = pinned;
+
+    pthread_mutex_lock(&imageLock);
+    if (pinned == current) {
+        pthread_mutex_unlock(&imageLock);
+        return;
     }
+    pinned = current;
+    pinned->refs++;
+    pthread_mutex_unlock(&imageLock);
+
+    protoPtr = pinned->protoPtr;
+    uPtr = pinned->uPtr;
+    uIndex = pinned->uIndex;
+    devPtr = pinned->devPtr;
+    cmdPtr = pinned->cmdPtr;
+    cfgPtr = pinned->cfgPtr;
+    releaseImage(old);
+}
+
+// Generation of the image pinned by the calling thread, counted from 0
+unsigned long imageGeneration()
+{
+    return pinned ? pinned->generation : 0;
+}
+
+int parseXMLFile(char *filename)
+{
+    imagePtr iPtr;
+
+    if (! (iPtr = loadImage(filename))) {
+        return 0;
+    }
+    publishImage(iPtr);
+    return 1;
 }
@@ -18,6 +18,10 @@
 #define XMLCONFIG_H
 
 #include <arpa/inet.h>
+#include <time.h>
+
+#include "nameindex.h"
+#include "arena.h"
 
 typedef struct config *configPtr;
 typedef struct protocol *protocolPtr;
@@ -29,13 +33,48 @@ typedef struct device *devicePtr;
 typedef struct icmd *icmdPtr;
 typedef struct allow *allowPtr;
 typedef struct enumerate *enumPtr;
+typedef struct poll *pollPtr;
+typedef struct calc *calcPtr;
+typedef struct enumTable *enumTablePtr;
+typedef struct image *imagePtr;
 
 int parseXMLFile(char *filename);
+imagePtr loadImage(char *filename);
+imagePtr builtinImage();
+void publishImage(imagePtr iPtr);
+void pinImage();
+unsigned long imageGeneration();
 macroPtr getMacroNode(macroPtr ptr, const char *name);
 unitPtr getUnitNode(unitPtr ptr, const char *name);
 commandPtr getCommandNode(commandPtr ptr, const char *name);
 enumPtr getEnumNode(enumPtr prt, char *search, int len);
 icmdPtr getIcmdNode(icmdPtr ptr, const char *name);
+pollPtr getPollNode(pollPtr ptr, const char *name);
+commandPtr lookupCommand(devicePtr dPtr, const char *name);
+commandPtr compiledCommand(devicePtr dPtr, commandPtr cPtr);
+unitPtr lookupUnit(unitPtr ptr, const char *name);
+macroPtr lookupMacro(protocolPtr pPtr, const char *name);
+icmdPtr lookupIcmd(protocolPtr pPtr, const char *name);
+pollPtr lookupPoll(configPtr cPtr, const char *name);
+
+// A loaded configuration, see xmlconfig.c
+typedef struct image {
+    arenaPtr aPtr;
+    protocolPtr protoPtr;
+    unitPtr uPtr;
+    nameIndexPtr uIndex;
+    devicePtr devPtr;
+    commandPtr cmdPtr;
+    configPtr cfgPtr;
+    // Allocated from the heap, the schedule changes while polling
+    pollPtr pollsPtr;
+    // The compiled commands of the active device by seq, filled on first
+    // use from codeArena, which is never sealed
+    commandPtr *code;
+    arenaPtr codeArena;
+    unsigned long generation;
+    int refs;
+} Image;
 
 struct compile {
     int token;
@@ -48,7 +87,14 @@ struct compile {
 
 struct config {
     char *tty;
+    int baud;
+    char parity;
+    int stopBits;
+    int lowLatency;
+    int frameMode;
     int port;
+    int binPort;
+    int metricsPort;
     char *logfile;
     char *pidfile;
     char *username;
@@ -57,6 +103,18 @@ struct config {
     devicePtr devPtr;
     int syslog;
     int debug;
+    int slowLog;
+    int persistent;
+    int idle;
+    int keepalive;
+    float timeoutFactor;
+    int timeoutMin;
+    int timeoutMax;
+    int batchGap;
+    int batchMax;
+    int historyMem;
+    pollPtr pollsPtr;
+    nameIndexPtr pollIndex;
 } Config;
 
 struct protocol {
@@ -64,6 +122,8 @@ struct protocol {
     char id;
     macroPtr mPtr;
     icmdPtr icPtr;
+    nameIndexPtr macroIndex;
+    nameIndexPtr icmdIndex;
     protocolPtr next;
 } Protocol;
 
@@ -71,6 +131,7 @@ struct device {
     char *name;
     char *id;
     commandPtr cmdPtr;
+    nameIndexPtr cmdIndex;
     protocolPtr protoPtr;
     devicePtr next;
 } Device;
@@ -84,7 +145,19 @@ struct unit {
     char *sICalc;
     char *entity;
     char *type;
+    // UNIT_* code of type
+    short typeCode;
+    int ttl;
+    // The calcs compiled by compileUnits(), NULL if there is none or
+    // it has a syntax error
+    short compiled;
+    calcPtr gProg;
+    calcPtr sProg;
+    calcPtr gIProg;
+    calcPtr sIProg;
     enumPtr ePtr;
+    // ePtr compiled by compileEnums()
+    enumTablePtr eTab;
     unitPtr next;
 } Unit;
 
@@ -106,12 +179,16 @@ struct command {
     int retry;
     unsigned short recvTimeout;
     char bit;
+    int ttl;
     char nodeType;
     // 0: everything copied
     // 1: everything orig
     // 2: only address, unit len orig
+    // Compiled on first use, see compiledCommand()
     compilePtr cmpPtr;
     char *description;
+    // Position in the command list of the device
+    int seq;
     commandPtr next;
 } Command;
 
@@ -130,4 +207,18 @@ struct enumerate {
     enumPtr next;
 } Enumerate;
 
+struct poll {
+    char *name;
+    int interval;
+    int jitter;
+    int min;
+    int max;
+    // Schedule, see poll.c
+    int current;
+    time_t due;
+    int stable;
+    char *last;
+    pollPtr next;
+} Poll;
+
 #endif // XMLCONFIG_H